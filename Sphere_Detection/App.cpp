@@ -61,7 +61,8 @@ bool App::InitCl()
 			throw cl::Error(CL_INVALID_CONTEXT, "Failed to create CL/GL shared context");
 
 		cl::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
-		commandQueue = cl::CommandQueue(context, devices[0]);
+		// profiling for the stage times of the fit results
+		commandQueue = cl::CommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE);
 
 		return pointCloud->InitCl(context, devices);
 	}
@@ -110,6 +111,58 @@ void App::KeyboardUp(SDL_KeyboardEvent& key)
 	{
 		pointCloud->ChangeMode();
 	}
+	else if (key.keysym.sym == SDLK_v)
+	{
+		pointCloud->ChangeVerifyMode();
+	}
+	else if (key.keysym.sym == SDLK_m)
+	{
+		pointCloud->ChangeScoreMode();
+	}
+	else if (key.keysym.sym == SDLK_l)
+	{
+		pointCloud->ToggleLocalOptimization();
+	}
+	else if (key.keysym.sym == SDLK_g)
+	{
+		pointCloud->ToggleGeometricRefinement();
+	}
+	else if (key.keysym.sym == SDLK_t)
+	{
+		pointCloud->ToggleTracking();
+	}
+	else if (key.keysym.sym == SDLK_k)
+	{
+		pointCloud->ChangeSphereCount();
+	}
+	else if (key.keysym.sym == SDLK_n)
+	{
+		pointCloud->ChangeSampleMode();
+	}
+	else if (key.keysym.sym == SDLK_o)
+	{
+		pointCloud->ToggleNormalEstimation();
+	}
+	else if (key.keysym.sym == SDLK_x)
+	{
+		pointCloud->ToggleFreeAxis();
+	}
+	else if (key.keysym.sym == SDLK_c)
+	{
+		pointCloud->ToggleExtraction();
+	}
+	else if (key.keysym.sym == SDLK_p)
+	{
+		pointCloud->ToggleGroundPatches();
+	}
+	else if (key.keysym.sym == SDLK_h)
+	{
+		pointCloud->ToggleHoughVoting();
+	}
+	else if (key.keysym.sym == SDLK_r)
+	{
+		pointCloud->ToggleKnownRadius();
+	}
 }
 
 void App::MouseMove(SDL_MouseMotionEvent& mouse)
@@ -0,0 +1,55 @@
+#include "BufferPool.h"
+
+#include <algorithm>
+
+void BufferPool::Init(cl::Context& context, const cl::Device& device)
+{
+	this->context = context;
+	// the alignment is given in bits
+	alignment = std::max<size_t>(device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8, 1);
+}
+
+const std::vector<cl::Buffer>& BufferPool::Allocate(const std::vector<size_t>& sizes)
+{
+	if (sizes == lastSizes && !buffers.empty())
+	{
+		return buffers;
+	}
+
+	std::vector<size_t> offsets;
+	size_t total = 0;
+	for (size_t size : sizes)
+	{
+		offsets.push_back(total);
+		total += (std::max<size_t>(size, 1) + alignment - 1) / alignment * alignment;
+	}
+
+	try
+	{
+		// the old arena lives on until its sub-buffers are released
+		if (total > capacity)
+		{
+			capacity = std::max(std::max(total, MIN_CAPACITY), (size_t)(GROWTH * capacity));
+			arena = cl::Buffer(context, CL_MEM_READ_WRITE, capacity);
+		}
+
+		buffers.clear();
+		for (size_t i = 0; i < sizes.size(); i++)
+		{
+			cl_buffer_region region = { offsets[i], std::max<size_t>(sizes[i], 1) };
+			buffers.push_back(arena.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region));
+		}
+		lastSizes = sizes;
+	}
+	catch (cl::Error& error)
+	{
+		std::cerr << "BufferPool::Allocate(): " << error.what() << std::endl;
+		throw error;
+	}
+	return buffers;
+}
+
+size_t BufferPool::Capacity() const
+{
+	return capacity;
+}
\ No newline at end of file
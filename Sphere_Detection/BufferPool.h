@@ -0,0 +1,42 @@
+#pragma once
+
+#include "IFitter.h"
+
+// Device memory arena for buffers whose sizes change from call to call:
+// the buffers of a call are aligned sub-buffers of one allocation, which is
+// kept while it is large enough and grows geometrically otherwise.
+class BufferPool
+{
+public:
+	/**
+	 * \brief Stores the context, no memory is allocated until the first request
+	 * \param device device whose base address alignment the sub-buffers respect
+	 */
+	void		Init(cl::Context& context, const cl::Device& device);
+
+	/**
+	 * \brief Gets buffers of the given sizes from the arena
+	 * \param sizes size of each buffer in bytes
+	 * \return the buffers, valid until the next call; the same ones as
+	 * the previous call when the sizes did not change
+	 */
+	const std::vector<cl::Buffer>&	Allocate(const std::vector<size_t>& sizes);
+
+	/**
+	 * \brief Gets the size of the arena
+	 * \return allocated bytes
+	 */
+	size_t		Capacity() const;
+
+private:
+	const float GROWTH = 2.f;
+	const size_t MIN_CAPACITY = 1 << 20;
+
+	cl::Context context;
+	size_t alignment = 1;
+	size_t capacity = 0;
+	cl::Buffer arena;
+
+	std::vector<size_t> lastSizes;
+	std::vector<cl::Buffer> buffers;
+};
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include "ClusterGrid.h"
+
+#include <algorithm>
+
+void ClusterGrid::Init(cl::Context& context, cl::Program& program, int maxCount)
+{
+	countKernel = cl::Kernel(program, "countCells");
+	initKernel = cl::Kernel(program, "initLabels");
+	propagateKernel = cl::Kernel(program, "propagateLabels");
+	resolveKernel = cl::Kernel(program, "resolveLabels");
+	clusterKernel = cl::Kernel(program, "countClusters");
+	pointKernel = cl::Kernel(program, "clusterPoints");
+	scanKernel = cl::Kernel(program, "scanCells");
+	scatterKernel = cl::Kernel(program, "scatterCells");
+
+	int maxCells = MAX_DIM * MAX_DIM;
+	cellBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	cellCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	labelBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	clusterBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	pointClusterBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	clusterCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	clusterStartBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	sortedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	clusterNumBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+	changedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+	zeros.resize(maxCells, 0);
+}
+
+int ClusterGrid::Build(cl::CommandQueue& queue, cl::Buffer& points, int count, const glm::vec3& low, const glm::vec3& high, float cellSize)
+{
+	// square cells with a single layer along y
+	glm::vec3 extent = high - low;
+	float size = std::max(cellSize, std::max(extent.x, extent.z) / MAX_DIM);
+	size = std::max(size, 0.001f);
+	cl_int4 dims = {
+		std::min((int)(extent.x / size) + 1, MAX_DIM),
+		1,
+		std::min((int)(extent.z / size) + 1, MAX_DIM),
+		0
+	};
+	int cellNum = dims.s[0] * dims.s[2];
+
+	queue.enqueueWriteBuffer(cellCountBuffer, CL_FALSE, 0, cellNum * sizeof(int), zeros.data());
+	queue.enqueueWriteBuffer(clusterCountBuffer, CL_FALSE, 0, cellNum * sizeof(int), zeros.data());
+	queue.enqueueWriteBuffer(clusterNumBuffer, CL_FALSE, 0, sizeof(int), zeros.data());
+
+	countKernel.setArg(0, points);
+	countKernel.setArg(1, cellBuffer);
+	countKernel.setArg(2, cellCountBuffer);
+	countKernel.setArg(3, count);
+	countKernel.setArg(4, cl_float4{ low.x, low.y, low.z, size });
+	countKernel.setArg(5, dims);
+
+	queue.enqueueNDRangeKernel(countKernel, cl::NullRange, count, cl::NullRange);
+
+	initKernel.setArg(0, cellCountBuffer);
+	initKernel.setArg(1, labelBuffer);
+
+	queue.enqueueNDRangeKernel(initKernel, cl::NullRange, cellNum, cl::NullRange);
+
+	// the labels spread by at least one cell per step, the flag is only
+	// read back every few steps to save round trips
+	propagateKernel.setArg(0, labelBuffer);
+	propagateKernel.setArg(1, changedBuffer);
+	propagateKernel.setArg(2, dims);
+
+	int changed = 1;
+	for (int step = 0; changed != 0 && step < MAX_STEPS; step += CHECK_STEPS)
+	{
+		queue.enqueueWriteBuffer(changedBuffer, CL_FALSE, 0, sizeof(int), zeros.data());
+		for (int i = 0; i < CHECK_STEPS; i++)
+		{
+			queue.enqueueNDRangeKernel(propagateKernel, cl::NullRange, cellNum, cl::NullRange);
+		}
+		queue.enqueueReadBuffer(changedBuffer, CL_TRUE, 0, sizeof(int), &changed);
+	}
+
+	// a label may still name a cell that is not a root if the steps ran out
+	resolveKernel.setArg(0, labelBuffer);
+
+	queue.enqueueNDRangeKernel(resolveKernel, cl::NullRange, cellNum, cl::NullRange);
+
+	clusterKernel.setArg(0, labelBuffer);
+	clusterKernel.setArg(1, clusterBuffer);
+	clusterKernel.setArg(2, clusterNumBuffer);
+
+	queue.enqueueNDRangeKernel(clusterKernel, cl::NullRange, cellNum, cl::NullRange);
+
+	pointKernel.setArg(0, cellBuffer);
+	pointKernel.setArg(1, labelBuffer);
+	pointKernel.setArg(2, clusterBuffer);
+	pointKernel.setArg(3, pointClusterBuffer);
+	pointKernel.setArg(4, clusterCountBuffer);
+	pointKernel.setArg(5, count);
+
+	queue.enqueueNDRangeKernel(pointKernel, cl::NullRange, count, cl::NullRange);
+
+	// the grid's prefix sum and scatter order the points by cluster instead of cell
+	scanKernel.setArg(0, clusterCountBuffer);
+	scanKernel.setArg(1, clusterStartBuffer);
+	scanKernel.setArg(2, SCAN_SIZE * sizeof(int), nullptr);
+	scanKernel.setArg(3, cellNum);
+
+	queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, SCAN_SIZE, SCAN_SIZE);
+
+	scatterKernel.setArg(0, pointClusterBuffer);
+	scatterKernel.setArg(1, clusterStartBuffer);
+	scatterKernel.setArg(2, clusterCountBuffer);
+	scatterKernel.setArg(3, sortedBuffer);
+	scatterKernel.setArg(4, count);
+
+	queue.enqueueNDRangeKernel(scatterKernel, cl::NullRange, count, cl::NullRange);
+
+	return cellNum;
+}
+
+cl::Buffer& ClusterGrid::ClusterStarts()
+{
+	return clusterStartBuffer;
+}
+
+cl::Buffer& ClusterGrid::ClusterCounts()
+{
+	return clusterCountBuffer;
+}
+
+cl::Buffer& ClusterGrid::Sorted()
+{
+	return sortedBuffer;
+}
+
+cl::Buffer& ClusterGrid::ClusterNum()
+{
+	return clusterNumBuffer;
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "IFitter.h"
+
+// Connected components of the points on a grid over the ground plane, built on
+// the device each frame: points in touching cells belong to the same cluster.
+// The point indices are ordered by cluster, so that each cluster can be fitted
+// on its own points independently of the others.
+class ClusterGrid
+{
+public:
+	/**
+	 * \brief Creates the kernels and buffers
+	 * \param program program containing the grid and clustering kernels
+	 * \param maxCount maximal number of points
+	 */
+	void		Init(cl::Context& context, cl::Program& program, int maxCount);
+
+	/**
+	 * \brief Labels the connected components of the occupied cells and orders the points by them
+	 * \param points points as 4 floats each
+	 * \param count number of points
+	 * \param low, high bounding box of the points, only x and z are gridded
+	 * \param cellSize edge length of the cells, grown if the box would need too many cells
+	 * \return number of cells, the upper bound of the cluster count
+	 */
+	int			Build(cl::CommandQueue& queue, cl::Buffer& points, int count, const glm::vec3& low, const glm::vec3& high, float cellSize);
+
+	// first point of each cluster in the sorted indices
+	cl::Buffer&	ClusterStarts();
+	// number of points in each cluster
+	cl::Buffer&	ClusterCounts();
+	// point indices ordered by cluster
+	cl::Buffer&	Sorted();
+	// number of clusters, one int
+	cl::Buffer&	ClusterNum();
+
+private:
+	const int MAX_DIM = 64;			// cells along an axis
+	const int SCAN_SIZE = 256;		// work-group size of the prefix sum
+	const int CHECK_STEPS = 4;		// propagation steps between reading the changed flag
+	const int MAX_STEPS = 64;		// components still spreading after these are split into several clusters
+
+	cl::Kernel countKernel;
+	cl::Kernel initKernel;
+	cl::Kernel propagateKernel;
+	cl::Kernel resolveKernel;
+	cl::Kernel clusterKernel;
+	cl::Kernel pointKernel;
+	cl::Kernel scanKernel;
+	cl::Kernel scatterKernel;
+
+	cl::Buffer cellBuffer;			// cell of each point
+	cl::Buffer cellCountBuffer;
+	cl::Buffer labelBuffer;			// smallest cell index of each cell's component
+	cl::Buffer clusterBuffer;		// cluster of each root cell
+	cl::Buffer pointClusterBuffer;	// cluster of each point
+	cl::Buffer clusterCountBuffer;
+	cl::Buffer clusterStartBuffer;
+	cl::Buffer sortedBuffer;
+	cl::Buffer clusterNumBuffer;
+	cl::Buffer changedBuffer;
+	std::vector<int> zeros;
+};
\ No newline at end of file
@@ -1,14 +1,28 @@
 #include "CylinderFitter.h"
 
-inline unsigned round_up_div(unsigned a, unsigned b) {
-	return static_cast<int>(ceil((double)a / b));
-}
+#include <algorithm>
 
 CylinderFitter::CylinderFitter() = default;
 
 void CylinderFitter::Init(cl::Context& context, const cl::vector<cl::Device>& devices)
 {
-	this->context = &context;
+	std::ifstream ransacFile("ransac.cl");
+	if (!ransacFile.is_open())
+	{
+		std::cerr << "CylinderFitter::Init(): ransac.cl could not be opened" << std::endl;
+		exit(1);
+	}
+	std::string ransacCode(std::istreambuf_iterator<char>(ransacFile), (std::istreambuf_iterator<char>()));
+	ransacFile.close();
+
+	std::ifstream planeFile("plane_detect.cl");
+	if (!planeFile.is_open())
+	{
+		std::cerr << "CylinderFitter::Init(): plane_detect.cl could not be opened" << std::endl;
+		exit(1);
+	}
+	std::string planeCode(std::istreambuf_iterator<char>(planeFile), (std::istreambuf_iterator<char>()));
+	planeFile.close();
 
 	std::ifstream cylinderFile("cylinder_detect.cl");
 	if (!cylinderFile.is_open())
@@ -19,12 +33,14 @@ void CylinderFitter::Init(cl::Context& context, const cl::vector<cl::Device>& de
 	std::string cylinderCode(std::istreambuf_iterator<char>(cylinderFile), (std::istreambuf_iterator<char>()));
 	cylinderFile.close();
 
+	// the shared kernels come first, the cylinder program instances their template
+	cylinderCode = ransacCode + "\n" + planeCode + "\n" + cylinderCode;
 	cl::Program::Sources cylinderSource(1, std::make_pair(cylinderCode.c_str(), cylinderCode.length() + 1));
 	program = cl::Program(context, cylinderSource);
 
 	try
 	{
-		program.build(devices);
+		program.build(devices, FLOAT3_OPTIONS);
 	}
 	catch (cl::Error& error)
 	{
@@ -33,34 +49,184 @@ void CylinderFitter::Init(cl::Context& context, const cl::vector<cl::Device>& de
 	}
 
 	planeCalcKernel = cl::Kernel(program, "calcPlane");
-	planeFitKernel = cl::Kernel(program, "fitPlane");
-	planeReduceKernel = cl::Kernel(program, "reducePlane");
+	planeCheckKernel = cl::Kernel(program, "checkPlane");
 	planeFillKernel = cl::Kernel(program, "fillPlane");
+	planeSplitKernel = cl::Kernel(program, "splitPlane");
+	planeRefineKernel = cl::Kernel(program, "refinePlane");
 
 	planeIdxBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, ITER_NUM * sizeof(cl_int3));
-	planePointsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * sizeof(cl_float3));
-	planeNormalsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * sizeof(cl_float3));
-	planeInliersBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * sizeof(int));
+	planePointsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * FLOAT3_WIDTH * sizeof(float));
+	planeNormalsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * FLOAT3_WIDTH * sizeof(float));
+	planePointBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, FLOAT3_WIDTH * sizeof(float));
+	planeNormalBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, FLOAT3_WIDTH * sizeof(float));
+	planeRefineBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, 12 * sizeof(float));
 
 	cylinderCalcKernel = cl::Kernel(program, "calcCylinder");
-	cylinderFitKernel = cl::Kernel(program, "fitCylinder");
-	cylinderReduceKernel = cl::Kernel(program, "reduceCylinder");
+	cylinderCheckKernel = cl::Kernel(program, "checkCylinder");
+	cylinderMeasureKernel = cl::Kernel(program, "measureCylinder");
 	cylinderColorKernel = cl::Kernel(program, "fillCylinder");
+	cylinderSortKernel = cl::Kernel(program, "sortQuality");
+	cylinderCalcNormalsKernel = cl::Kernel(program, "calcCylinderNormals");
+	axisCalcKernel = cl::Kernel(program, "calcCylinderAxis");
+	axisCheckKernel = cl::Kernel(program, "checkCylinderAxis");
+	axisMeasureKernel = cl::Kernel(program, "measureCylinderAxis");
+	axisColorKernel = cl::Kernel(program, "fillCylinderAxis");
+
+	cylinderRandBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CYLINDER_ITER_NUM * sizeof(cl_int3));
+	cylinderDataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CYLINDER_ITER_NUM * FLOAT3_WIDTH * sizeof(float));
+	cylinderModelBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, FLOAT3_WIDTH * sizeof(float));
+	cylinderMeasureBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(float));
+	axisDataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, NORMAL_CYLINDER_ITER_NUM * sizeof(cl_float8));
+	axisModelBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float8));
+
+	// each found cylinder has at least MIN_CLUSTER_SIZE points of its own
+	clusterFitKernel = cl::Kernel(program, "fitClusters");
+	clusterColorKernel = cl::Kernel(program, "fillClusters");
+	clusterCylinderBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, (POINT_CLOUD_SIZE / MIN_CLUSTER_SIZE + 1) * sizeof(cl_float4));
+	clusterFoundBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+
+	// the split points, their sorted copy and normals, at most the whole cloud each
+	pool.Init(context, devices[0]);
+	const std::vector<cl::Buffer>& pointBuffers = pool.Allocate({
+		POINT_CLOUD_SIZE * sizeof(cl_float4),
+		POINT_CLOUD_SIZE * sizeof(cl_float4),
+		POINT_CLOUD_SIZE * sizeof(cl_float4),
+		POINT_CLOUD_SIZE * sizeof(cl_float4),
+		POINT_CLOUD_SIZE * sizeof(float),
+		2 * sizeof(int)
+	});
+	cylinderPointsBuffer = pointBuffers[0];
+	cylinderCloseBuffer = pointBuffers[1];
+	cylinderSortedBuffer = pointBuffers[2];
+	cylinderNormalBuffer = pointBuffers[3];
+	cylinderQualityBuffer = pointBuffers[4];
+	cylinderCountBuffer = pointBuffers[5];
+	qualities.resize(POINT_CLOUD_SIZE, 0);
+
+	selectGroups = SelectGroupCount(devices[0], SELECT_GROUPS);
+	planeRansac.Init(context, program, devices[0], ITER_NUM);
+	cylinderRansac.Init(context, program, devices[0], CYLINDER_ITER_NUM);
+	axisRansac.Init(context, program, devices[0], NORMAL_CYLINDER_ITER_NUM);
+	topK.Init(context, program, CYLINDER_ITER_NUM);
+	sampler.Init(context, program, POINT_CLOUD_SIZE);
+	clusterGrid.Init(context, program, POINT_CLOUD_SIZE);
+	ground.Init(context, program, POINT_CLOUD_SIZE);
+	hough.Init(context, program, selectGroups);
+}
+
+void CylinderFitter::SetVerifyMode(VerifyMode mode)
+{
+	verifyMode = mode;
+	planeRansac.SetVerifyMode(mode);
+	cylinderRansac.SetVerifyMode(mode);
+	axisRansac.SetVerifyMode(mode);
+}
+
+void CylinderFitter::SetScoreMode(ScoreMode mode)
+{
+	scoreMode = mode;
+	planeRansac.SetScoreMode(mode);
+	cylinderRansac.SetScoreMode(mode);
+	axisRansac.SetScoreMode(mode);
+}
+
+void CylinderFitter::SetTopK(int count)
+{
+	topCount = std::max(count, 0);
+	topHypotheses.clear();
+}
+
+const std::vector<Hypothesis>& CylinderFitter::GetTopHypotheses() const
+{
+	return topHypotheses;
+}
+
+void CylinderFitter::SetPlaneThreshold(float value)
+{
+	planeThreshold = value;
+}
+
+void CylinderFitter::SetGroundThreshold(float value)
+{
+	groundThreshold = value;
+}
+
+void CylinderFitter::SetCylinderThreshold(float value)
+{
+	cylinderThreshold = value;
+}
+
+void CylinderFitter::SetAxisThreshold(float value)
+{
+	axisThreshold = value;
+}
+
+void CylinderFitter::SetSampleMode(SampleMode mode)
+{
+	sampleMode = mode;
+}
+
+void CylinderFitter::SetPriors(const Priors& value)
+{
+	priors = value;
+}
+
+void CylinderFitter::SetNormalEstimation(bool enabled)
+{
+	normalEstimation = enabled;
+}
 
-	cylinderRandBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, CYLINDER_ITER_NUM * sizeof(cl_int3));
-	cylinderDataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CYLINDER_ITER_NUM * sizeof(cl_float3));
-	cylinderInliersBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CYLINDER_ITER_NUM * sizeof(int));
+void CylinderFitter::SetSampleRadius(float radius)
+{
+	sampleRadius = radius;
+}
+
+void CylinderFitter::SetFreeAxis(bool enabled)
+{
+	freeAxis = enabled;
+}
+
+void CylinderFitter::SetPlaneTracking(bool enabled)
+{
+	planeTracking = enabled;
+	planeTracked = false;
 }
 
-void CylinderFitter::EvalCandidate(const glm::vec4& point, const int idx)
+void CylinderFitter::SetExtraction(bool enabled)
 {
+	extraction = enabled;
+}
+
+void CylinderFitter::SetGroundPatches(bool enabled)
+{
+	groundPatches = enabled;
+}
+
+void CylinderFitter::SetHoughVoting(bool enabled)
+{
+	houghVoting = enabled;
+}
+
+float CylinderFitter::GroundHeight(float x, float z) const
+{
+	return groundPatches ? ground.Height(x, z) : planeY;
+}
+
+const std::vector<FittedCylinder>& CylinderFitter::GetCylinders() const
+{
+	return cylinders;
+}
+
+void CylinderFitter::EvalCandidate(const glm::vec4& point, const int idx, const float quality)
+{
+	qualities[idx] = quality;
 	if (point.y < -1)
 	{
 		candidates.push_back(idx);
 	}
 }
 
-glm::vec4 CylinderFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
+void CylinderFitter::WritePlaneSamples(cl::CommandQueue& queue, cl::Event* event)
 {
 	std::vector<cl_int3> indices;
 	for (int i = 0; i < ITER_NUM; i++)
@@ -77,141 +243,593 @@ glm::vec4 CylinderFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
 		indices.push_back({ candidates[a], candidates[b], candidates[c] });
 	}
 
-	try
+	queue.enqueueWriteBuffer(planeIdxBuffer, CL_TRUE, 0, ITER_NUM * sizeof(cl_int3), indices.data(), nullptr, event);
+	queue.finish();
+}
+
+void CylinderFitter::SearchPlane(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
+{
+	// calculate planes
+	planeCalcKernel.setArg(0, posBuffer);
+	planeCalcKernel.setArg(1, planeIdxBuffer);
+	planeCalcKernel.setArg(2, planePointsBuffer);
+	planeCalcKernel.setArg(3, planeNormalsBuffer);
+
+	queue.enqueueNDRangeKernel(planeCalcKernel, cl::NullRange, ITER_NUM, cl::NullRange);
+
+	// reject tilted and degenerate planes before scoring them against the whole cloud
+	planeCheckKernel.setArg(0, planeNormalsBuffer);
+	planeCheckKernel.setArg(1, priors.minUp);
+
+	queue.enqueueNDRangeKernel(planeCheckKernel, cl::NullRange, ITER_NUM, cl::NullRange);
+
+	// score planes and copy the plane with highest score
+	cl::Buffer planes[2] = { planePointsBuffer, planeNormalsBuffer };
+	cl::Buffer bestPlane[2] = { planePointBuffer, planeNormalBuffer };
+	if (verifyMode == SPRT_VERIFY)
 	{
-		// set inlier buffer to all zeroes
-		std::vector<int> zero(ITER_NUM, 0);
-		queue.enqueueWriteBuffer(planeInliersBuffer, CL_TRUE, 0, ITER_NUM * sizeof(int), zero.data());
-		queue.enqueueWriteBuffer(planeIdxBuffer, CL_TRUE, 0, ITER_NUM * sizeof(cl_int3), indices.data());
-		queue.finish();
+		planeRansac.ResetStats(queue);
+	}
+	planeRansac.Score(queue, posBuffer, planes, POINT_CLOUD_SIZE, ITER_NUM, planeThreshold);
+	planeRansac.Select(queue, planes, bestPlane, ITER_NUM, nullptr);
+}
 
-		// acquire GL position buffer
-		cl::vector<cl::Memory> acq;
-		acq.push_back(posBuffer);
-		queue.enqueueAcquireGLObjects(&acq);
+bool CylinderFitter::RefinePlane(cl::CommandQueue& queue, cl::BufferGL& posBuffer, bool reference)
+{
+	planeRefineKernel.setArg(0, posBuffer);
+	planeRefineKernel.setArg(1, planePointBuffer);
+	planeRefineKernel.setArg(2, planeNormalBuffer);
+	planeRefineKernel.setArg(3, planeRefineBuffer);
+	planeRefineKernel.setArg(4, MEASURE_SIZE * sizeof(float), nullptr);
+	planeRefineKernel.setArg(5, POINT_CLOUD_SIZE);
+	planeRefineKernel.setArg(6, planeThreshold);
+
+	for (int i = 0; i < PLANE_REFINE_STEPS; i++)
+	{
+		queue.enqueueNDRangeKernel(planeRefineKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
+	}
 
-		// calculate planes
-		planeCalcKernel.setArg(0, posBuffer);
-		planeCalcKernel.setArg(1, planeIdxBuffer);
-		planeCalcKernel.setArg(2, planePointsBuffer);
-		planeCalcKernel.setArg(3, planeNormalsBuffer);
+	// support of the plane before the last step
+	float stats[2];
+	cl_float3 normal;
+	queue.enqueueReadBuffer(planeRefineBuffer, CL_FALSE, 0, 2 * sizeof(float), stats);
+	queue.enqueueReadBuffer(planeNormalBuffer, CL_TRUE, 0, FLOAT3_WIDTH * sizeof(float), &normal);
 
-		queue.enqueueNDRangeKernel(planeCalcKernel, cl::NullRange, ITER_NUM, cl::NullRange);
+	float rms = stats[0] > 0 ? sqrtf(stats[1] / stats[0]) : 0;
+	if (reference)
+	{
+		trackedInliers = stats[0];
+	}
+	return stats[0] >= 3
+		&& stats[0] >= TRACK_MIN_INLIERS * trackedInliers
+		&& rms <= TRACK_MAX_RMS * planeThreshold
+		&& fabs(normal.s[1]) >= priors.minUp;
+}
 
-		// evaluate plane inlier ratio
-		planeFitKernel.setArg(0, posBuffer);
-		planeFitKernel.setArg(1, planePointsBuffer);
-		planeFitKernel.setArg(2, planeNormalsBuffer);
-		planeFitKernel.setArg(3, planeInliersBuffer);
+int CylinderFitter::FitPlane(cl::CommandQueue& queue, cl::BufferGL& posBuffer, cl::Event& event)
+{
+	// the plane of the last frame is refined as long as it keeps its support
+	bool tracked = planeTracking && planeTracked;
+	if (!tracked)
+	{
+		WritePlaneSamples(queue, &event);
+	}
+
+	// acquire GL position buffer, released at the end of the cylinder stage
+	cl::vector<cl::Memory> acq;
+	acq.push_back(posBuffer);
+	queue.enqueueAcquireGLObjects(&acq, nullptr, tracked ? &event : nullptr);
+
+	int hypotheses = 0;
+	if (!tracked || !RefinePlane(queue, posBuffer, false))
+	{
+		if (tracked)
+		{
+			std::cout << "CylinderFitter::Fit(): ground plane lost, searching again\n";
+			WritePlaneSamples(queue, nullptr);
+		}
+		SearchPlane(queue, posBuffer);
+		hypotheses = ITER_NUM;
 
-		queue.enqueueNDRangeKernel(planeFitKernel, cl::NullRange, cl::NDRange(ITER_NUM, POINT_CLOUD_SIZE), cl::NullRange);
+		// the refined support of the found plane is the reference of the tracking
+		planeTracked = planeTracking && RefinePlane(queue, posBuffer, true);
+	}
+
+	// mark points that are part of the best plane
+	planeFillKernel.setArg(0, posBuffer);
+	planeFillKernel.setArg(1, planePointBuffer);
+	planeFillKernel.setArg(2, planeNormalBuffer);
+	planeFillKernel.setArg(3, planeThreshold);
+
+	queue.enqueueNDRangeKernel(planeFillKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+	return hypotheses;
+}
+
+FitResult CylinderFitter::FitAxis(cl::CommandQueue& queue, cl::BufferGL& posBuffer, cl::Buffer& samples, int size, int iterNum, cl::Event* events)
+{
+	FitResult result;
 
-		// reduction to get plane with highest inlier count
-		const unsigned GROUP_SIZE = 64;
-		planeReduceKernel.setArg(0, planeInliersBuffer);
-		planeReduceKernel.setArg(1, planePointsBuffer);
-		planeReduceKernel.setArg(2, planeNormalsBuffer);
-		planeReduceKernel.setArg(3, GROUP_SIZE * sizeof(int), nullptr);
-		planeReduceKernel.setArg(4, GROUP_SIZE * sizeof(int), nullptr);
+	axisCalcKernel.setArg(0, samples);
+	axisCalcKernel.setArg(1, cylinderNormalBuffer);
+	axisCalcKernel.setArg(2, cylinderRandBuffer);
+	axisCalcKernel.setArg(3, axisDataBuffer);
+
+	queue.enqueueNDRangeKernel(axisCalcKernel, cl::NullRange, iterNum, cl::NullRange);
+
+	axisCheckKernel.setArg(0, axisDataBuffer);
+	axisCheckKernel.setArg(1, cl_float2{ priors.minRadius, priors.maxRadius });
+	axisCheckKernel.setArg(2, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+	axisCheckKernel.setArg(3, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
+
+	queue.enqueueNDRangeKernel(axisCheckKernel, cl::NullRange, iterNum, cl::NullRange, nullptr, &events[1]);
+
+	if (verifyMode == SPRT_VERIFY)
+	{
+		axisRansac.ResetStats(queue);
+	}
+	axisRansac.Score(queue, cylinderCloseBuffer, &axisDataBuffer, size, iterNum, axisThreshold);
+	axisRansac.Select(queue, &axisDataBuffer, &axisModelBuffer, iterNum, &events[2]);
+
+	// support and extent of the best cylinder, which is moved to the middle of its inliers
+	axisMeasureKernel.setArg(0, cylinderCloseBuffer);
+	axisMeasureKernel.setArg(1, axisModelBuffer);
+	axisMeasureKernel.setArg(2, cylinderMeasureBuffer);
+	axisMeasureKernel.setArg(3, MEASURE_SIZE * sizeof(cl_float4), nullptr);
+	axisMeasureKernel.setArg(4, (cl_int)size);
+	axisMeasureKernel.setArg(5, axisThreshold);
+
+	queue.enqueueNDRangeKernel(axisMeasureKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
+
+	axisColorKernel.setArg(0, posBuffer);
+	axisColorKernel.setArg(1, axisModelBuffer);
+	axisColorKernel.setArg(2, axisThreshold);
+
+	queue.enqueueNDRangeKernel(axisColorKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+	cl_ulong best;
+	if (verifyMode == SPRT_VERIFY)
+	{
+		queue.enqueueReadBuffer(axisRansac.Best(), CL_FALSE, 0, sizeof(cl_ulong), &best);
+		axisRansac.ReadStats(queue);
+	}
 
-		for (unsigned rem_size = ITER_NUM; rem_size > 1; rem_size = round_up_div(rem_size, GROUP_SIZE))
+	float measure[2];
+	queue.enqueueReadBuffer(cylinderMeasureBuffer, CL_FALSE, 0, 2 * sizeof(float), measure);
+
+	cl_float8 model;
+	queue.enqueueReadBuffer(axisModelBuffer, CL_TRUE, 0, sizeof(cl_float8), &model);
+
+	if (verifyMode == SPRT_VERIFY)
+	{
+		axisRansac.UpdateSprt((int)UnpackScore(best), size);
+	}
+
+	result.model = { model.s[0], model.s[1], model.s[2], model.s[3] };
+	result.axis = { model.s[4], model.s[5], model.s[6], model.s[7] };
+	result.inliers = (int)measure[0];
+	result.rms = measure[0] > 0 ? sqrtf(measure[1] / measure[0]) : 0;
+	result.hypotheses = iterNum;
+	if (IsProfiling(queue))
+	{
+		result.generateTime = ElapsedTime(events[0], events[1]);
+		result.scoreTime = ElapsedTime(events[1], events[2]);
+	}
+	return result;
+}
+
+FitResult CylinderFitter::FitClusters(cl::CommandQueue& queue, cl::BufferGL& posBuffer, int size, cl::Event* events)
+{
+	FitResult result;
+
+	// the clusters are searched in the region of the split
+	glm::vec3 low(-MAX_DISTANCE, MIN_HEIGHT, -MAX_DISTANCE);
+	glm::vec3 high(MAX_DISTANCE, MAX_HEIGHT, MAX_DISTANCE);
+	int cellNum = clusterGrid.Build(queue, cylinderCloseBuffer, size, low, high, CLUSTER_CELL);
+
+	queue.enqueueWriteBuffer(clusterFoundBuffer, CL_FALSE, 0, sizeof(int), zeroCounts, nullptr, &events[1]);
+
+	clusterFitKernel.setArg(0, cylinderCloseBuffer);
+	clusterFitKernel.setArg(1, clusterGrid.ClusterStarts());
+	clusterFitKernel.setArg(2, clusterGrid.ClusterCounts());
+	clusterFitKernel.setArg(3, clusterGrid.Sorted());
+	clusterFitKernel.setArg(4, clusterGrid.ClusterNum());
+	clusterFitKernel.setArg(5, clusterCylinderBuffer);
+	clusterFitKernel.setArg(6, clusterFoundBuffer);
+	clusterFitKernel.setArg(7, CLUSTER_SIZE * sizeof(cl_float4), nullptr);
+	clusterFitKernel.setArg(8, (cl_uint)rand());
+	clusterFitKernel.setArg(9, CLUSTER_HYPOTHESES);
+	clusterFitKernel.setArg(10, MIN_CLUSTER_SIZE);
+	clusterFitKernel.setArg(11, cl_float2{ priors.minRadius, priors.maxRadius });
+	clusterFitKernel.setArg(12, cylinderThreshold);
+
+	// one work-group per cell, as there are at most as many clusters
+	queue.enqueueNDRangeKernel(clusterFitKernel, cl::NullRange, cellNum * CLUSTER_SIZE, CLUSTER_SIZE, nullptr, &events[2]);
+
+	clusterColorKernel.setArg(0, posBuffer);
+	clusterColorKernel.setArg(1, clusterCylinderBuffer);
+	clusterColorKernel.setArg(2, clusterFoundBuffer);
+	clusterColorKernel.setArg(3, cylinderThreshold);
+
+	queue.enqueueNDRangeKernel(clusterColorKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+	int clusterNum;
+	int found;
+	queue.enqueueReadBuffer(clusterGrid.ClusterNum(), CL_FALSE, 0, sizeof(int), &clusterNum);
+	if (!groundPatches)
+	{
+		queue.enqueueReadBuffer(planePointBuffer, CL_FALSE, sizeof(float), sizeof(float), &planeY);
+	}
+	queue.enqueueReadBuffer(clusterFoundBuffer, CL_TRUE, 0, sizeof(int), &found);
+
+	std::vector<cl_float4> models(found);
+	if (found > 0)
+	{
+		queue.enqueueReadBuffer(clusterCylinderBuffer, CL_TRUE, 0, found * sizeof(cl_float4), models.data());
+	}
+
+	cylinders.clear();
+	for (const cl_float4& model : models)
+	{
+		float y = GroundHeight(model.s[0], model.s[1]);
+		cylinders.push_back({ glm::vec4(model.s[0], y, model.s[1], model.s[2]), glm::vec4(0, 1, 0, 0), (int)model.s[3] });
+	}
+	std::sort(cylinders.begin(), cylinders.end(), [](const FittedCylinder& a, const FittedCylinder& b) {
+		return a.inliers > b.inliers;
+	});
+
+	if (!cylinders.empty())
+	{
+		result.model = cylinders[0].cylinder;
+		result.inliers = cylinders[0].inliers;
+	}
+	result.hypotheses = clusterNum * CLUSTER_SIZE * CLUSTER_HYPOTHESES;
+	if (IsProfiling(queue))
+	{
+		result.generateTime = ElapsedTime(events[0], events[1]);
+		result.scoreTime = ElapsedTime(events[1], events[2]);
+	}
+	return result;
+}
+
+FitResult CylinderFitter::FitHough(cl::CommandQueue& queue, cl::BufferGL& posBuffer, int size, cl::Event* events)
+{
+	FitResult result;
+
+	// the circles are searched in the region of the split
+	glm::vec3 low(-MAX_DISTANCE, MIN_HEIGHT, -MAX_DISTANCE);
+	glm::vec3 high(MAX_DISTANCE, MAX_HEIGHT, MAX_DISTANCE);
+	hough.Detect(queue, cylinderCloseBuffer, size, low, high, priors.minRadius, priors.maxRadius,
+				 cylinderRansac.Best(), cylinderModelBuffer, &events[1], &events[2]);
+
+	// support of the peak like the best RANSAC cylinder
+	cylinderMeasureKernel.setArg(0, cylinderCloseBuffer);
+	cylinderMeasureKernel.setArg(1, cylinderModelBuffer);
+	cylinderMeasureKernel.setArg(2, cylinderMeasureBuffer);
+	cylinderMeasureKernel.setArg(3, MEASURE_SIZE * sizeof(float), nullptr);
+	cylinderMeasureKernel.setArg(4, (cl_int)size);
+	cylinderMeasureKernel.setArg(5, cylinderThreshold);
+
+	queue.enqueueNDRangeKernel(cylinderMeasureKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
+
+	cylinderColorKernel.setArg(0, posBuffer);
+	cylinderColorKernel.setArg(1, cylinderModelBuffer);
+	cylinderColorKernel.setArg(2, cylinderThreshold);
+
+	queue.enqueueNDRangeKernel(cylinderColorKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+	float measure[2];
+	queue.enqueueReadBuffer(cylinderMeasureBuffer, CL_FALSE, 0, 2 * sizeof(float), measure);
+	if (!groundPatches)
+	{
+		queue.enqueueReadBuffer(planePointBuffer, CL_FALSE, sizeof(float), sizeof(float), &planeY);
+	}
+
+	cl_float3 model;
+	queue.enqueueReadBuffer(cylinderModelBuffer, CL_TRUE, 0, FLOAT3_WIDTH * sizeof(float), &model);
+
+	result.model = { model.s[0], GroundHeight(model.s[0], model.s[1]), model.s[1], model.s[2] };
+	result.inliers = (int)measure[0];
+	result.rms = measure[0] > 0 ? sqrtf(measure[1] / measure[0]) : 0;
+	if (IsProfiling(queue))
+	{
+		result.generateTime = ElapsedTime(events[0], events[1]);
+		result.scoreTime = ElapsedTime(events[1], events[2]);
+	}
+	return result;
+}
+
+FitResult CylinderFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
+{
+	auto start = std::chrono::steady_clock::now();
+	FitResult result;
+
+	if (!freeAxis && !groundPatches && candidates.size() < 3)
+	{
+		std::cout << "CylinderFitter::Fit(): no candidates, skipping cylinder fit\n";
+		candidates.clear();
+		topHypotheses.clear();
+		cylinders.clear();
+		return result;
+	}
+
+	try
+	{
+		cl::Event events[3];
+		cl::vector<cl::Memory> acq;
+		acq.push_back(posBuffer);
+		int planeHypotheses = 0;
+		if (freeAxis)
+		{
+			// acquire GL position buffer, there is no ground plane to fit
+			queue.enqueueAcquireGLObjects(&acq, nullptr, &events[0]);
+		}
+		else if (groundPatches)
+		{
+			// the patch fits replace the ground plane in the generation stage
+			queue.enqueueAcquireGLObjects(&acq, nullptr, &events[0]);
+			ground.Segment(queue, posBuffer, POINT_CLOUD_SIZE, groundThreshold, priors.minUp);
+		}
+		else
+		{
+			// the ground plane fit is part of the generation stage
+			planeHypotheses = FitPlane(queue, posBuffer, events[0]);
+		}
+
+		// split the points around the sensor into plane inliers and the rest on the
+		// device, only their counts are read back to size the cylinder stage
+		queue.enqueueWriteBuffer(cylinderCountBuffer, CL_FALSE, 0, 2 * sizeof(int), zeroCounts);
+		if (sampleMode == PROSAC_SAMPLE)
+		{
+			queue.enqueueWriteBuffer(cylinderQualityBuffer, CL_FALSE, 0, POINT_CLOUD_SIZE * sizeof(float), qualities.data());
+		}
+
+		planeSplitKernel.setArg(0, posBuffer);
+		planeSplitKernel.setArg(1, cylinderQualityBuffer);
+		planeSplitKernel.setArg(2, cylinderPointsBuffer);
+		planeSplitKernel.setArg(3, cylinderCloseBuffer);
+		planeSplitKernel.setArg(4, cylinderCountBuffer);
+		planeSplitKernel.setArg(5, cl_float2{ MIN_DISTANCE, MAX_DISTANCE });
+		planeSplitKernel.setArg(6, MAX_HEIGHT);
+		planeSplitKernel.setArg(7, (cl_int)(sampleMode == PROSAC_SAMPLE));
+		planeSplitKernel.setArg(8, (cl_int)!freeAxis);
+
+		queue.enqueueNDRangeKernel(planeSplitKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+		bool planeSprtUpdate = planeHypotheses > 0 && verifyMode == SPRT_VERIFY;
+		cl_ulong planeBest;
+		if (planeSprtUpdate)
+		{
+			queue.enqueueReadBuffer(planeRansac.Best(), CL_FALSE, 0, sizeof(cl_ulong), &planeBest);
+			planeRansac.ReadStats(queue);
+		}
+		int counts[2];
+		queue.enqueueReadBuffer(cylinderCountBuffer, CL_TRUE, 0, 2 * sizeof(int), counts);
+
+		if (planeSprtUpdate)
 		{
-			int t1 = round_up_div(rem_size, GROUP_SIZE) * GROUP_SIZE;
-			queue.enqueueNDRangeKernel(planeReduceKernel, cl::NullRange, t1, GROUP_SIZE);
+			// estimate plane test parameters for the next frame
+			planeRansac.UpdateSprt((int)UnpackScore(planeBest), POINT_CLOUD_SIZE);
 		}
 
-		// mark points that are part of the best plane
-		planeFillKernel.setArg(0, posBuffer);
-		planeFillKernel.setArg(1, planePointsBuffer);
-		planeFillKernel.setArg(2, planeNormalsBuffer);
+		// with normals the cylinders are fitted to 2 oriented points of the surface
+		// instead of circles through 3 points of the plane
+		bool oriented = normalEstimation || freeAxis;
+		int sampleCount = oriented ? counts[1] : counts[0];
+		cl::Buffer* sampleBuffer = oriented ? &cylinderCloseBuffer : &cylinderPointsBuffer;
+		int sampleSize = oriented ? 2 : 3;
+		int size = counts[1];
 
-		queue.enqueueNDRangeKernel(planeFillKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+		if (sampleCount < sampleSize || size == 0)
+		{
+			std::cout << "CylinderFitter::Fit(): not enough points, skipping cylinder fit\n";
+			queue.enqueueReleaseGLObjects(&acq);
+			candidates.clear();
+			topHypotheses.clear();
+			cylinders.clear();
+			return result;
+		}
 
-		// create new buffer with points that are part of the plane
-		std::vector<glm::vec4> pcl;
-		std::vector<cl_float3> planePoints;
-		std::vector<cl_float3> closePoints;
-		pcl.resize(POINT_CLOUD_SIZE);
-		queue.enqueueReadBuffer(posBuffer, CL_TRUE, 0, POINT_CLOUD_SIZE * sizeof(glm::vec4), pcl.data());
+		if (extraction && !freeAxis)
+		{
+			result = FitClusters(queue, posBuffer, size, events);
+			result.hypotheses += planeHypotheses;
+			queue.enqueueReleaseGLObjects(&acq);
+			candidates.clear();
+			topHypotheses.clear();
+			result.totalTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return result;
+		}
 
-		// select close points from the plane
-		const float close = 7;
-		for (int i = 0; i < POINT_CLOUD_SIZE; i++)
+		if (houghVoting && !freeAxis)
 		{
-			float dist = glm::distance(glm::vec2(0, 0), glm::vec2(pcl[i].x, pcl[i].z));
-			if (dist < close && dist > 3 && pcl[i].y < 1)
+			result = FitHough(queue, posBuffer, size, events);
+			queue.enqueueReleaseGLObjects(&acq);
+			candidates.clear();
+			topHypotheses.clear();
+			cylinders.clear();
+			if (result.inliers > 0)
 			{
-				if (pcl[i].w != 0)
-					planePoints.push_back({ pcl[i].x, pcl[i].y, pcl[i].z });
-				else
-					closePoints.push_back({ pcl[i].x, pcl[i].y, pcl[i].z });
+				cylinders.push_back({ result.model, result.axis, result.inliers });
 			}
+			result.totalTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return result;
+		}
+
+		int iterNum = oriented ? NORMAL_CYLINDER_ITER_NUM : (sampleMode == UNIFORM_SAMPLE ? CYLINDER_ITER_NUM : GUIDED_CYLINDER_ITER_NUM);
+		if (sampleMode == PROSAC_SAMPLE)
+		{
+			// sort the sample points by quality on the device,
+			// the samples index the sorted points
+			cylinderSortKernel.setArg(0, *sampleBuffer);
+			cylinderSortKernel.setArg(1, cylinderSortedBuffer);
+			cylinderSortKernel.setArg(2, sampleCount);
+
+			queue.enqueueNDRangeKernel(cylinderSortKernel, cl::NullRange, sampleCount, cl::NullRange);
+			sampleBuffer = &cylinderSortedBuffer;
+		}
+
+		if (sampleMode == LOCAL_SAMPLE || oriented)
+		{
+			// the grid spans the region of the split, its cells are as large as the expected radius
+			glm::vec3 low(-MAX_DISTANCE, MIN_HEIGHT, -MAX_DISTANCE);
+			glm::vec3 high(MAX_DISTANCE, MAX_HEIGHT, MAX_DISTANCE);
+			sampler.Build(queue, *sampleBuffer, sampleCount, low, high, std::max(sampleRadius, NORMAL_RADIUS));
 		}
-		cylinderPointsBuffer = cl::Buffer(*context, CL_MEM_READ_WRITE, planePoints.size() * sizeof(cl_float3));
-		cl::Buffer closeBuffer(*context, CL_MEM_READ_ONLY, closePoints.size() * sizeof(cl_float3));
 
-		// get random indices for RANSAC (0 .. candidates.size())
-		std::vector<cl_int3> indices;
-		for (int i = 0; i < CYLINDER_ITER_NUM; i++)
+		if (oriented)
 		{
-			int a, b, c;
-			a = rand() % planePoints.size();
-			do {
-				b = rand() % planePoints.size();
-			} while (b == a);
-			do {
-				c = rand() % planePoints.size();
-			} while (c == a || c == b);
-			indices.push_back({ a, b, c });
+			sampler.EstimateNormals(queue, *sampleBuffer, cylinderNormalBuffer, NORMAL_RADIUS);
 		}
 
-		// zeroing out cylinder inlier buffer
-		std::vector<int> zero_c(CYLINDER_ITER_NUM, 0);
-		queue.enqueueWriteBuffer(cylinderInliersBuffer, CL_TRUE, 0, CYLINDER_ITER_NUM * sizeof(int), zero_c.data());
+		if (sampleMode == LOCAL_SAMPLE)
+		{
+			// NAPSAC: the other points of a sample come from the cells around the first
+			sampler.Sample(queue, cylinderRandBuffer, iterNum, sampleSize);
+		}
+		else if (sampleMode == PROSAC_SAMPLE)
+		{
+			std::vector<int> indices = prosac.Sample(sampleCount, iterNum, sampleSize);
+			queue.enqueueWriteBuffer(cylinderRandBuffer, CL_TRUE, 0, iterNum * sizeof(cl_int3), indices.data());
+		}
+		else
+		{
+			// get random indices for RANSAC (0 .. candidates.size())
+			std::vector<cl_int3> indices;
+			for (int i = 0; i < iterNum; i++)
+			{
+				int a, b, c;
+				a = rand() % sampleCount;
+				do {
+					b = rand() % sampleCount;
+				} while (b == a);
+				do {
+					c = rand() % sampleCount;
+				} while (c == a || c == b);
+				indices.push_back({ a, b, c });
+			}
 
-		queue.enqueueWriteBuffer(cylinderRandBuffer, CL_TRUE, 0, CYLINDER_ITER_NUM * sizeof(cl_int3), indices.data());
-		queue.enqueueWriteBuffer(closeBuffer, CL_TRUE, 0, closePoints.size() * sizeof(cl_float3), closePoints.data());
-		queue.enqueueWriteBuffer(cylinderPointsBuffer, CL_TRUE, 0, planePoints.size() * sizeof(glm::vec3), planePoints.data());
+			queue.enqueueWriteBuffer(cylinderRandBuffer, CL_TRUE, 0, iterNum * sizeof(cl_int3), indices.data());
+		}
 		queue.finish();
 
-		cylinderCalcKernel.setArg(0, cylinderRandBuffer);
-		cylinderCalcKernel.setArg(1, cylinderPointsBuffer);
-		cylinderCalcKernel.setArg(2, cylinderDataBuffer);
+		if (freeAxis)
+		{
+			result = FitAxis(queue, posBuffer, *sampleBuffer, size, iterNum, events);
+			queue.enqueueReleaseGLObjects(&acq);
+			candidates.clear();
+			topHypotheses.clear();
+			cylinders.clear();
+			if (result.inliers > 0)
+			{
+				cylinders.push_back({ result.model, result.axis, result.inliers });
+			}
+			result.totalTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return result;
+		}
 
-		queue.enqueueNDRangeKernel(cylinderCalcKernel, cl::NullRange, CYLINDER_ITER_NUM, cl::NullRange);
+		if (normalEstimation)
+		{
+			cylinderCalcNormalsKernel.setArg(0, *sampleBuffer);
+			cylinderCalcNormalsKernel.setArg(1, cylinderNormalBuffer);
+			cylinderCalcNormalsKernel.setArg(2, cylinderRandBuffer);
+			cylinderCalcNormalsKernel.setArg(3, cylinderDataBuffer);
+			cylinderCalcNormalsKernel.setArg(4, MIN_VERTICAL);
 
-		size_t size = closePoints.size();
-		cylinderFitKernel.setArg(0, closeBuffer);
-		cylinderFitKernel.setArg(1, cylinderDataBuffer);
-		cylinderFitKernel.setArg(2, cylinderInliersBuffer);
+			queue.enqueueNDRangeKernel(cylinderCalcNormalsKernel, cl::NullRange, iterNum, cl::NullRange);
+		}
+		else
+		{
+			cylinderCalcKernel.setArg(0, cylinderRandBuffer);
+			cylinderCalcKernel.setArg(1, *sampleBuffer);
+			cylinderCalcKernel.setArg(2, cylinderDataBuffer);
+
+			queue.enqueueNDRangeKernel(cylinderCalcKernel, cl::NullRange, iterNum, cl::NullRange);
+		}
 
-		queue.enqueueNDRangeKernel(cylinderFitKernel, cl::NullRange, cl::NDRange(CYLINDER_ITER_NUM, size), cl::NullRange);
+		// reject implausible cylinders before the scoring
+		cylinderCheckKernel.setArg(0, cylinderDataBuffer);
+		cylinderCheckKernel.setArg(1, cl_float2{ priors.minRadius, priors.maxRadius });
+		cylinderCheckKernel.setArg(2, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+		cylinderCheckKernel.setArg(3, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
 
-		cylinderReduceKernel.setArg(0, cylinderInliersBuffer);
-		cylinderReduceKernel.setArg(1, cylinderDataBuffer);
-		cylinderReduceKernel.setArg(2, GROUP_SIZE * sizeof(int), nullptr);
-		cylinderReduceKernel.setArg(3, GROUP_SIZE * sizeof(int), nullptr);
+		queue.enqueueNDRangeKernel(cylinderCheckKernel, cl::NullRange, iterNum, cl::NullRange, nullptr, &events[1]);
 
-		for (unsigned rem_size = CYLINDER_ITER_NUM; rem_size > 1; rem_size = round_up_div(rem_size, GROUP_SIZE))
+		if (verifyMode == SPRT_VERIFY)
 		{
-			int t1 = round_up_div(rem_size, GROUP_SIZE) * GROUP_SIZE;
-			queue.enqueueNDRangeKernel(cylinderReduceKernel, cl::NullRange, t1, GROUP_SIZE);
+			cylinderRansac.ResetStats(queue);
 		}
+		cylinderRansac.Score(queue, cylinderCloseBuffer, &cylinderDataBuffer, size, iterNum, cylinderThreshold);
+		cylinderRansac.Select(queue, &cylinderDataBuffer, &cylinderModelBuffer, iterNum, &events[2]);
+
+		// support of the best cylinder, read back with the model
+		cylinderMeasureKernel.setArg(0, cylinderCloseBuffer);
+		cylinderMeasureKernel.setArg(1, cylinderModelBuffer);
+		cylinderMeasureKernel.setArg(2, cylinderMeasureBuffer);
+		cylinderMeasureKernel.setArg(3, MEASURE_SIZE * sizeof(float), nullptr);
+		cylinderMeasureKernel.setArg(4, (cl_int)size);
+		cylinderMeasureKernel.setArg(5, cylinderThreshold);
+
+		queue.enqueueNDRangeKernel(cylinderMeasureKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
 
 		cylinderColorKernel.setArg(0, posBuffer);
-		cylinderColorKernel.setArg(1, cylinderDataBuffer);
+		cylinderColorKernel.setArg(1, cylinderModelBuffer);
+		cylinderColorKernel.setArg(2, cylinderThreshold);
 
 		queue.enqueueNDRangeKernel(cylinderColorKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
 
 		queue.enqueueReleaseGLObjects(&acq);
 		candidates.clear();
 
-		cl_float3 result;
-		queue.enqueueReadBuffer(cylinderDataBuffer, CL_TRUE, 0, sizeof(cl_float3), &result);
+		cl_ulong best;
+		if (verifyMode == SPRT_VERIFY)
+		{
+			queue.enqueueReadBuffer(cylinderRansac.Best(), CL_FALSE, 0, sizeof(cl_ulong), &best);
+			cylinderRansac.ReadStats(queue);
+		}
 
-		float y;
-		queue.enqueueReadBuffer(planePointsBuffer, CL_TRUE, sizeof(float), sizeof(float), &y);
-		return { result.s[0], y, result.s[1], result.s[2] };
+		float measure[2];
+		queue.enqueueReadBuffer(cylinderMeasureBuffer, CL_FALSE, 0, 2 * sizeof(float), measure);
+
+		cl_float3 model;
+		queue.enqueueReadBuffer(cylinderModelBuffer, CL_TRUE, 0, FLOAT3_WIDTH * sizeof(float), &model);
+
+		if (!groundPatches)
+		{
+			queue.enqueueReadBuffer(planePointBuffer, CL_TRUE, sizeof(float), sizeof(float), &planeY);
+		}
+
+		if (verifyMode == SPRT_VERIFY)
+		{
+			cylinderRansac.UpdateSprt((int)UnpackScore(best), size);
+		}
+
+		topHypotheses.clear();
+		if (topCount > 0)
+		{
+			topHypotheses = topK.Select(queue, cylinderRansac.Scores(), cylinderDataBuffer, FLOAT3_WIDTH, iterNum, topCount);
+			for (Hypothesis& hypothesis : topHypotheses)
+			{
+				float y = GroundHeight(hypothesis.model.x, hypothesis.model.y);
+				hypothesis.model = { hypothesis.model.x, y, hypothesis.model.y, hypothesis.model.z };
+			}
+		}
+		result.model = { model.s[0], GroundHeight(model.s[0], model.s[1]), model.s[1], model.s[2] };
+		result.inliers = (int)measure[0];
+		result.rms = measure[0] > 0 ? sqrtf(measure[1] / measure[0]) : 0;
+		result.hypotheses = planeHypotheses + iterNum;
+		if (IsProfiling(queue))
+		{
+			result.generateTime = ElapsedTime(events[0], events[1]);
+			result.scoreTime = ElapsedTime(events[1], events[2]);
+		}
+		cylinders.clear();
+		if (result.inliers > 0)
+		{
+			cylinders.push_back({ result.model, result.axis, result.inliers });
+		}
+		result.totalTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return result;
 	}
 	catch (cl::Error& error)
 	{
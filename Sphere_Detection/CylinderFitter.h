@@ -1,6 +1,37 @@
 #pragma once
 
 #include "IFitter.h"
+#include "TopK.h"
+#include "GridSampler.h"
+#include "Prosac.h"
+#include "BufferPool.h"
+#include "ClusterGrid.h"
+#include "GroundSegmenter.h"
+#include "CylinderHough.h"
+#include "RansacEngine.h"
+
+// models of the generic RANSAC kernels: vertical cylinders as (x, z, radius)
+// and free axis cylinders as (axis point, radius, direction, length)
+struct CylinderModel
+{
+	static constexpr const char* NAME = "Cylinder";
+	static const int BUFFERS = 1;
+	static const int WIDTH = FLOAT3_WIDTH;
+};
+
+struct CylinderAxisModel
+{
+	static constexpr const char* NAME = "CylinderAxis";
+	static const int BUFFERS = 1;
+	static const int WIDTH = 8;
+};
+
+struct FittedCylinder
+{
+	glm::vec4 cylinder;	// axis point, radius
+	glm::vec4 axis;		// direction, length
+	int inliers;
+};
 
 class CylinderFitter : public IFitter
 {
@@ -8,35 +39,178 @@ public:
 	CylinderFitter();
 
 	void Init(cl::Context&, const cl::vector<cl::Device>&) override;
-	glm::vec4 Fit(cl::CommandQueue&, cl::BufferGL&) override;
-	void EvalCandidate(const glm::vec4&, const int) override;
+	FitResult Fit(cl::CommandQueue&, cl::BufferGL&) override;
+	void EvalCandidate(const glm::vec4&, const int, const float) override;
+	void SetVerifyMode(VerifyMode) override;
+	void SetScoreMode(ScoreMode) override;
+	void SetSampleMode(SampleMode) override;
+	void SetPriors(const Priors&) override;
+	void SetTopK(int) override;
+	const std::vector<Hypothesis>& GetTopHypotheses() const override;
+
+	// inlier threshold of the point to plane distance
+	void SetPlaneThreshold(float);
+	// inlier threshold of the point to plane distance of the ground patches
+	void SetGroundThreshold(float);
+	// inlier threshold of the squared centerline distance minus squared radius
+	void SetCylinderThreshold(float);
+	// inlier threshold of the distance from the surface of the free axis cylinders
+	void SetAxisThreshold(float);
+
+	// estimate point normals and generate cylinders from 2 oriented points
+	void SetNormalEstimation(bool);
+
+	// expected cylinder radius for the cells of the local sampling grid
+	void SetSampleRadius(float);
+
+	// refine the ground plane of the last frame by weighted least squares, and only
+	// search it again when its inlier count or residual degrades
+	void SetPlaneTracking(bool);
+
+	// fit cylinders of any orientation to oriented points without the ground plane,
+	// the result is the middle of the measured axis with its direction and length
+	void SetFreeAxis(bool);
+
+	// fit a vertical cylinder to each cluster of the points above the ground plane,
+	// the result is the cylinder with the most inliers, without an RMS
+	void SetExtraction(bool);
+
+	// fit a plane to each patch of a polar grid instead of one ground plane, which
+	// follows sloped and stepped ground; the cylinders stand on the patch below them
+	void SetGroundPatches(bool);
+
+	// detect the vertical cylinder by Hough voting over its circle instead of RANSAC,
+	// the result reports no hypotheses
+	void SetHoughVoting(bool);
+
+	// cylinders of the last fit, with the most inliers first
+	const std::vector<FittedCylinder>& GetCylinders() const;
 
 private:
+	// ground plane of the cylinder stage, the upload of its samples or the acquisition of
+	// the tracked plane's points is the first event; returns the number of plane hypotheses
+	int FitPlane(cl::CommandQueue&, cl::BufferGL&, cl::Event&);
+	void WritePlaneSamples(cl::CommandQueue&, cl::Event*);
+	void SearchPlane(cl::CommandQueue&, cl::BufferGL&);
+	// refines the best plane, reference keeps its support for the later frames; returns
+	// whether the plane is still supported by enough inliers with a small residual
+	bool RefinePlane(cl::CommandQueue&, cl::BufferGL&, bool reference);
+	// height of the ground below a point, read with the plane or the patches of the fit
+	float GroundHeight(float x, float z) const;
+	// free axis cylinders of the sampled close points, generation and scoring end with the events 1 and 2
+	FitResult FitAxis(cl::CommandQueue&, cl::BufferGL&, cl::Buffer& samples, int size, int iterNum, cl::Event* events);
+	// cylinders of the clusters of the close points, generation and scoring end with the events 1 and 2
+	FitResult FitClusters(cl::CommandQueue&, cl::BufferGL&, int size, cl::Event* events);
+	// vertical cylinder of the close points by Hough voting, the voting and the peak end with the events 1 and 2
+	FitResult FitHough(cl::CommandQueue&, cl::BufferGL&, int size, cl::Event* events);
+
 	const int ITER_NUM = 2048;
+	const int PLANE_REFINE_STEPS = 2;
+	const float TRACK_MIN_INLIERS = 0.7f;	// of the reference inliers, below it the plane is searched again
+	const float TRACK_MAX_RMS = 0.5f;		// of the plane threshold
 	const int CYLINDER_ITER_NUM = 4096 * 8;
+	const int GUIDED_CYLINDER_ITER_NUM = 4096 * 2; // local and PROSAC samples are far more often all inliers
+	const int NORMAL_CYLINDER_ITER_NUM = 2048;	// 2-point samples of the cylinder surface
+	const float NORMAL_RADIUS = 0.15f;	// neighbourhood of the normal estimation
+	const float MIN_VERTICAL = 0.95f;	// cosine of the largest axis tilt of the 2-point cylinders
+	const int MEASURE_SIZE = 256; // work-group size of the inlier measurement
+	const float CLUSTER_CELL = 0.25f;	// cell size of the clustering grid
+	const int CLUSTER_SIZE = 64;		// work-group size of the cluster fits
+	const int CLUSTER_HYPOTHESES = 4;	// per work item of the cluster fits
+	const int MIN_CLUSTER_SIZE = 20;	// smallest cluster and inlier count of its cylinder
+
+	// region of the cylinder points around the sensor
+	const float MIN_DISTANCE = 3.f;
+	const float MAX_DISTANCE = 7.f;
+	const float MAX_HEIGHT = 1.f;
+	const float MIN_HEIGHT = -3.f;	// of the sampling grid, lower points share its bottom cells
+	const int zeroCounts[2] = { 0, 0 };
 
 	std::vector<int> candidates;
+	std::vector<float> qualities; // of every point in the cloud
+
+	VerifyMode verifyMode = FULL_VERIFY;
+	ScoreMode scoreMode = RANSAC_SCORE;
+	float planeThreshold = 0.12f;
+	float groundThreshold = 0.06f;
+	float cylinderThreshold = 0.06f;
+	float axisThreshold = 0.03f;
+
+	bool planeTracking = false;
+	bool planeTracked = false;
+	float trackedInliers = 0;	// of the plane when it was found
+	Priors priors;
+
+	SampleMode sampleMode = UNIFORM_SAMPLE;
+	bool normalEstimation = false;
+	bool freeAxis = false;
+	bool extraction = false;
+	bool groundPatches = false;
+	float planeY = 0;	// height of the ground plane point
+	GroundSegmenter ground;
+	bool houghVoting = false;
+	CylinderHough hough;
+	std::vector<FittedCylinder> cylinders;
+	ClusterGrid clusterGrid;
+	float sampleRadius = 0.5f;
+	GridSampler sampler;
+	Prosac prosac;
+
+	// the point buffers of the cylinder stage share one allocation
+	BufferPool pool;
+
+	int selectGroups = 1;
+	RansacEngine<PlaneModel> planeRansac;
+	RansacEngine<CylinderModel> cylinderRansac;
+	RansacEngine<CylinderAxisModel> axisRansac;
+
+	// best cylinder hypotheses as (x, plane y, z, radius)
+	TopK topK;
+	int topCount = 0;
+	std::vector<Hypothesis> topHypotheses;
 
 	cl::Program program;
-	cl::Context* context;
 
 	cl::Kernel planeCalcKernel;
-	cl::Kernel planeFitKernel;
-	cl::Kernel planeReduceKernel;
+	cl::Kernel planeCheckKernel;
 	cl::Kernel planeFillKernel;
+	cl::Kernel planeSplitKernel;
+	cl::Kernel planeRefineKernel;
 
 	cl::Buffer planeIdxBuffer;
 	cl::Buffer planePointsBuffer;
 	cl::Buffer planeNormalsBuffer;
-	cl::Buffer planeInliersBuffer;
+	cl::Buffer planePointBuffer;	// point and normal of the best plane
+	cl::Buffer planeNormalBuffer;
+	cl::Buffer planeRefineBuffer;	// support and weighted moments of the refined plane
 
 	cl::Kernel cylinderCalcKernel;
-	cl::Kernel cylinderFitKernel;
-	cl::Kernel cylinderReduceKernel;
+	cl::Kernel cylinderCheckKernel;
+	cl::Kernel cylinderMeasureKernel;
 	cl::Kernel cylinderColorKernel;
+	cl::Kernel cylinderSortKernel;
+	cl::Kernel cylinderCalcNormalsKernel;
+	cl::Kernel axisCalcKernel;
+	cl::Kernel axisCheckKernel;
+	cl::Kernel axisMeasureKernel;
+	cl::Kernel axisColorKernel;
 
-	cl::Buffer cylinderPointsBuffer;
+	cl::Buffer cylinderPointsBuffer;	// plane inliers around the sensor
+	cl::Buffer cylinderCloseBuffer;		// the other points around the sensor
+	cl::Buffer cylinderCountBuffer;
+	cl::Buffer cylinderQualityBuffer;
+	cl::Buffer cylinderSortedBuffer;
+	cl::Buffer cylinderNormalBuffer;
 	cl::Buffer cylinderRandBuffer;
 	cl::Buffer cylinderDataBuffer;
-	cl::Buffer cylinderInliersBuffer;
+	cl::Buffer cylinderModelBuffer;
+	cl::Buffer cylinderMeasureBuffer;
+	cl::Buffer axisDataBuffer;	// (axis point, radius, direction, length)
+	cl::Buffer axisModelBuffer;
+
+	cl::Kernel clusterFitKernel;
+	cl::Kernel clusterColorKernel;
+
+	cl::Buffer clusterCylinderBuffer;	// (x, z, radius, inliers) of the found cylinders
+	cl::Buffer clusterFoundBuffer;
 };
\ No newline at end of file
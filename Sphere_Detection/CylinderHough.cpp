@@ -0,0 +1,75 @@
+#include "CylinderHough.h"
+
+#include <algorithm>
+
+void CylinderHough::Init(cl::Context& context, cl::Program& program, int selectGroups)
+{
+	this->selectGroups = selectGroups;
+
+	clearKernel = cl::Kernel(program, "clearVotes");
+	voteKernel = cl::Kernel(program, "voteCircles");
+	scoreKernel = cl::Kernel(program, "scoreCircles");
+	selectKernel = cl::Kernel(program, "selectBest");
+	centerKernel = cl::Kernel(program, "circleCenter");
+
+	int cellNum = MAX_DIM * MAX_DIM * MAX_BINS;
+	voteBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+	scoreBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(float));
+}
+
+void CylinderHough::Detect(cl::CommandQueue& queue, cl::Buffer& points, int count, const glm::vec3& low, const glm::vec3& high,
+						   float minRadius, float maxRadius, cl::Buffer& best, cl::Buffer& model, cl::Event* voted, cl::Event* found)
+{
+	// the centers lie within maxRadius of the points
+	float extent = std::max(high.x - low.x, high.z - low.z) + 2 * maxRadius;
+	float cellSize = std::max(CELL_SIZE, extent / MAX_DIM);
+	float binWidth = std::max(cellSize, (maxRadius - minRadius) / MAX_BINS);
+	cl_float4 grid = { low.x - maxRadius, low.z - maxRadius, cellSize, 0 };
+	cl_float2 radius = { minRadius, binWidth };
+	cl_int4 dims = {
+		std::min((int)((high.x - low.x + 2 * maxRadius) / cellSize) + 1, MAX_DIM),
+		std::min((int)((high.z - low.z + 2 * maxRadius) / cellSize) + 1, MAX_DIM),
+		std::min((int)((maxRadius - minRadius) / binWidth) + 1, MAX_BINS),
+		0
+	};
+	int cellNum = dims.s[0] * dims.s[1] * dims.s[2];
+
+	clearKernel.setArg(0, voteBuffer);
+
+	queue.enqueueNDRangeKernel(clearKernel, cl::NullRange, cellNum, cl::NullRange);
+
+	voteKernel.setArg(0, points);
+	voteKernel.setArg(1, voteBuffer);
+	voteKernel.setArg(2, count);
+	voteKernel.setArg(3, grid);
+	voteKernel.setArg(4, radius);
+	voteKernel.setArg(5, dims);
+
+	queue.enqueueNDRangeKernel(voteKernel, cl::NullRange, count, cl::NullRange, nullptr, voted);
+
+	scoreKernel.setArg(0, voteBuffer);
+	scoreKernel.setArg(1, scoreBuffer);
+	scoreKernel.setArg(2, dims);
+
+	queue.enqueueNDRangeKernel(scoreKernel, cl::NullRange, cellNum, cl::NullRange);
+
+	// the peak is selected like the best hypothesis
+	cl_ulong zero = 0;
+	queue.enqueueWriteBuffer(best, CL_TRUE, 0, sizeof(cl_ulong), &zero);
+
+	selectKernel.setArg(0, scoreBuffer);
+	selectKernel.setArg(1, best);
+	selectKernel.setArg(2, SELECT_SIZE * sizeof(cl_ulong), nullptr);
+	selectKernel.setArg(3, cellNum);
+
+	queue.enqueueNDRangeKernel(selectKernel, cl::NullRange, selectGroups * SELECT_SIZE, SELECT_SIZE);
+
+	centerKernel.setArg(0, voteBuffer);
+	centerKernel.setArg(1, best);
+	centerKernel.setArg(2, model);
+	centerKernel.setArg(3, grid);
+	centerKernel.setArg(4, radius);
+	centerKernel.setArg(5, dims);
+
+	queue.enqueueNDRangeKernel(centerKernel, cl::NullRange, 1, cl::NullRange, nullptr, found);
+}
\ No newline at end of file
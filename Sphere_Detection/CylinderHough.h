@@ -0,0 +1,48 @@
+#pragma once
+
+#include "IFitter.h"
+
+// Detection of vertical cylinders by Hough voting over their circles in the
+// horizontal plane. The points vote for the centers of every radius bin in a
+// dense (x, z, radius) accumulator on the device and the cell with most votes
+// in its neighbourhood gives the circle; the cost grows with the point count
+// only, whatever the outlier ratio.
+class CylinderHough
+{
+public:
+	/**
+	 * \brief Creates the kernels and the accumulator
+	 * \param program program containing the circle voting and selectBest kernels
+	 * \param selectGroups number of work-groups of the peak selection
+	 */
+	void		Init(cl::Context& context, cl::Program& program, int selectGroups);
+
+	/**
+	 * \brief Votes for the circles and selects the peak
+	 * \param points points as 4 floats each
+	 * \param count number of points
+	 * \param low, high bounding box of the points, only x and z are used
+	 * \param minRadius, maxRadius radius range of the cylinders
+	 * \param best output, packed votes of the peak neighbourhood and its cell
+	 * \param model output, circle as (x, z, radius) in a float3
+	 * \param voted, found signalled when the votes are counted and when the circle is found
+	 */
+	void		Detect(cl::CommandQueue& queue, cl::Buffer& points, int count, const glm::vec3& low, const glm::vec3& high,
+					   float minRadius, float maxRadius, cl::Buffer& best, cl::Buffer& model, cl::Event* voted, cl::Event* found);
+
+private:
+	const int MAX_DIM = 320;		// cells along x and z
+	const int MAX_BINS = 32;		// radius bins
+	const float CELL_SIZE = 0.05f;	// of the centers and the radii, grown for large regions
+
+	int selectGroups = 1;
+
+	cl::Kernel clearKernel;
+	cl::Kernel voteKernel;
+	cl::Kernel scoreKernel;
+	cl::Kernel selectKernel;
+	cl::Kernel centerKernel;
+
+	cl::Buffer voteBuffer;
+	cl::Buffer scoreBuffer;
+};
\ No newline at end of file
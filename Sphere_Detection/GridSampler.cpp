@@ -0,0 +1,92 @@
+#include "GridSampler.h"
+
+#include <algorithm>
+
+void GridSampler::Init(cl::Context& context, cl::Program& program, int maxCount)
+{
+	countKernel = cl::Kernel(program, "countCells");
+	scanKernel = cl::Kernel(program, "scanCells");
+	scatterKernel = cl::Kernel(program, "scatterCells");
+	sampleKernel = cl::Kernel(program, "sampleLocal");
+	normalKernel = cl::Kernel(program, "estimateNormals");
+
+	int maxCells = MAX_DIM * MAX_DIM * MAX_DIM;
+	cellBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	cellCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	cellStartBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCells * sizeof(int));
+	sortedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	zeros.resize(maxCells, 0);
+}
+
+void GridSampler::Build(cl::CommandQueue& queue, cl::Buffer& points, int count, const glm::vec3& low, const glm::vec3& high, float cellSize)
+{
+	this->count = count;
+
+	// cells are cubes, the longest side of the box limits their count
+	glm::vec3 extent = high - low;
+	float size = std::max(cellSize, std::max(extent.x, std::max(extent.y, extent.z)) / MAX_DIM);
+	size = std::max(size, 0.001f);
+	dims = {
+		std::min((int)(extent.x / size) + 1, MAX_DIM),
+		std::min((int)(extent.y / size) + 1, MAX_DIM),
+		std::min((int)(extent.z / size) + 1, MAX_DIM),
+		0
+	};
+	int cellNum = dims.s[0] * dims.s[1] * dims.s[2];
+
+	queue.enqueueWriteBuffer(cellCountBuffer, CL_TRUE, 0, cellNum * sizeof(int), zeros.data());
+
+	countKernel.setArg(0, points);
+	countKernel.setArg(1, cellBuffer);
+	countKernel.setArg(2, cellCountBuffer);
+	countKernel.setArg(3, count);
+	countKernel.setArg(4, cl_float4{ low.x, low.y, low.z, size });
+	countKernel.setArg(5, dims);
+
+	queue.enqueueNDRangeKernel(countKernel, cl::NullRange, count, cl::NullRange);
+
+	scanKernel.setArg(0, cellCountBuffer);
+	scanKernel.setArg(1, cellStartBuffer);
+	scanKernel.setArg(2, SCAN_SIZE * sizeof(int), nullptr);
+	scanKernel.setArg(3, cellNum);
+
+	queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, SCAN_SIZE, SCAN_SIZE);
+
+	scatterKernel.setArg(0, cellBuffer);
+	scatterKernel.setArg(1, cellStartBuffer);
+	scatterKernel.setArg(2, cellCountBuffer);
+	scatterKernel.setArg(3, sortedBuffer);
+	scatterKernel.setArg(4, count);
+
+	queue.enqueueNDRangeKernel(scatterKernel, cl::NullRange, count, cl::NullRange);
+}
+
+void GridSampler::Sample(cl::CommandQueue& queue, cl::Buffer& indices, int sampleNum, int sampleSize)
+{
+	sampleKernel.setArg(0, cellBuffer);
+	sampleKernel.setArg(1, cellStartBuffer);
+	sampleKernel.setArg(2, cellCountBuffer);
+	sampleKernel.setArg(3, sortedBuffer);
+	sampleKernel.setArg(4, indices);
+	sampleKernel.setArg(5, count);
+	sampleKernel.setArg(6, (cl_uint)rand());
+	sampleKernel.setArg(7, dims);
+	sampleKernel.setArg(8, sampleSize);
+
+	queue.enqueueNDRangeKernel(sampleKernel, cl::NullRange, sampleNum, cl::NullRange);
+}
+
+void GridSampler::EstimateNormals(cl::CommandQueue& queue, cl::Buffer& points, cl::Buffer& normals, float radius)
+{
+	normalKernel.setArg(0, points);
+	normalKernel.setArg(1, cellBuffer);
+	normalKernel.setArg(2, cellStartBuffer);
+	normalKernel.setArg(3, cellCountBuffer);
+	normalKernel.setArg(4, sortedBuffer);
+	normalKernel.setArg(5, normals);
+	normalKernel.setArg(6, count);
+	normalKernel.setArg(7, dims);
+	normalKernel.setArg(8, radius);
+
+	queue.enqueueNDRangeKernel(normalKernel, cl::NullRange, count, cl::NullRange);
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "IFitter.h"
+
+// NAPSAC sampling on a uniform grid built on the device each frame (Nasuto & Craddock:
+// NAPSAC: High Noise, High Dimensional Robust Estimation). Minimal samples are drawn
+// around a random seed point, which raises the chance of an all-inlier sample in clutter.
+class GridSampler
+{
+public:
+	/**
+	 * \brief Creates the kernels and buffers
+	 * \param program program containing the grid and sampling kernels
+	 * \param maxCount maximal number of points
+	 */
+	void		Init(cl::Context& context, cl::Program& program, int maxCount);
+
+	/**
+	 * \brief Buckets the points into grid cells
+	 * \param points points as 4 floats each
+	 * \param count number of points
+	 * \param low, high bounding box of the points
+	 * \param cellSize edge length of the cells, grown if the box would need too many cells
+	 */
+	void		Build(cl::CommandQueue& queue, cl::Buffer& points, int count, const glm::vec3& low, const glm::vec3& high, float cellSize);
+
+	/**
+	 * \brief Draws minimal samples from the neighbourhood of random seed points
+	 * \param indices output, 4 indices per sample
+	 * \param sampleNum number of samples
+	 * \param sampleSize number of points in a sample, at most 4
+	 */
+	void		Sample(cl::CommandQueue& queue, cl::Buffer& indices, int sampleNum, int sampleSize);
+
+	/**
+	 * \brief Estimates the normal of each point from its neighbours in the grid
+	 * \param points points of the last Build
+	 * \param normals output, 4 floats per point, w is 0 for points without a normal
+	 * \param radius neighbourhood radius, at most the cell size
+	 */
+	void		EstimateNormals(cl::CommandQueue& queue, cl::Buffer& points, cl::Buffer& normals, float radius);
+
+private:
+	const int MAX_DIM = 32;		// cells along an axis
+	const int SCAN_SIZE = 256;	// work-group size of the prefix sum
+
+	int count = 0;
+	cl_int4 dims;
+
+	cl::Kernel countKernel;
+	cl::Kernel scanKernel;
+	cl::Kernel scatterKernel;
+	cl::Kernel sampleKernel;
+	cl::Kernel normalKernel;
+
+	cl::Buffer cellBuffer;		// cell of each point
+	cl::Buffer cellCountBuffer;
+	cl::Buffer cellStartBuffer;
+	cl::Buffer sortedBuffer;	// point indices ordered by cell
+	std::vector<int> zeros;
+};
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "GroundSegmenter.h"
+
+#include <algorithm>
+
+void GroundSegmenter::Init(cl::Context& context, cl::Program& program, int maxCount)
+{
+	countKernel = cl::Kernel(program, "countPolarCells");
+	scanKernel = cl::Kernel(program, "scanCells");
+	scatterKernel = cl::Kernel(program, "scatterCells");
+	fitKernel = cl::Kernel(program, "fitPatches");
+	labelKernel = cl::Kernel(program, "labelGround");
+
+	int patchNum = RINGS * SECTORS;
+	cellBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	cellCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, patchNum * sizeof(int));
+	cellStartBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, patchNum * sizeof(int));
+	sortedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxCount * sizeof(int));
+	patchBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, patchNum * sizeof(cl_float4));
+	zeros.resize(patchNum, 0);
+	patches.resize(patchNum, { 0, 0, 0, 0 });
+}
+
+void GroundSegmenter::Segment(cl::CommandQueue& queue, cl::Buffer& points, int count, float threshold, float minUp)
+{
+	int patchNum = RINGS * SECTORS;
+	queue.enqueueWriteBuffer(cellCountBuffer, CL_FALSE, 0, patchNum * sizeof(int), zeros.data());
+
+	countKernel.setArg(0, points);
+	countKernel.setArg(1, cellBuffer);
+	countKernel.setArg(2, cellCountBuffer);
+	countKernel.setArg(3, count);
+	countKernel.setArg(4, RING_WIDTH);
+	countKernel.setArg(5, cl_int2{ RINGS, SECTORS });
+
+	queue.enqueueNDRangeKernel(countKernel, cl::NullRange, count, cl::NullRange);
+
+	scanKernel.setArg(0, cellCountBuffer);
+	scanKernel.setArg(1, cellStartBuffer);
+	scanKernel.setArg(2, SCAN_SIZE * sizeof(int), nullptr);
+	scanKernel.setArg(3, patchNum);
+
+	queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, SCAN_SIZE, SCAN_SIZE);
+
+	scatterKernel.setArg(0, cellBuffer);
+	scatterKernel.setArg(1, cellStartBuffer);
+	scatterKernel.setArg(2, cellCountBuffer);
+	scatterKernel.setArg(3, sortedBuffer);
+	scatterKernel.setArg(4, count);
+
+	queue.enqueueNDRangeKernel(scatterKernel, cl::NullRange, count, cl::NullRange);
+
+	fitKernel.setArg(0, points);
+	fitKernel.setArg(1, cellStartBuffer);
+	fitKernel.setArg(2, cellCountBuffer);
+	fitKernel.setArg(3, sortedBuffer);
+	fitKernel.setArg(4, patchBuffer);
+	fitKernel.setArg(5, PATCH_SIZE * sizeof(float), nullptr);
+	fitKernel.setArg(6, SEED_HEIGHT);
+	fitKernel.setArg(7, minUp);
+
+	// one work-group per patch
+	queue.enqueueNDRangeKernel(fitKernel, cl::NullRange, patchNum * PATCH_SIZE, PATCH_SIZE);
+
+	labelKernel.setArg(0, points);
+	labelKernel.setArg(1, cellBuffer);
+	labelKernel.setArg(2, patchBuffer);
+	labelKernel.setArg(3, threshold);
+
+	queue.enqueueNDRangeKernel(labelKernel, cl::NullRange, count, cl::NullRange);
+
+	// completed by the next blocking call on the queue
+	queue.enqueueReadBuffer(patchBuffer, CL_FALSE, 0, patchNum * sizeof(cl_float4), patches.data());
+}
+
+int GroundSegmenter::Patch(float x, float z) const
+{
+	const float pi = 3.14159265f;
+	int ring = std::min((int)(sqrtf(x * x + z * z) / RING_WIDTH), RINGS - 1);
+	int sector = (int)((atan2f(z, x) + pi) / (2 * pi) * SECTORS);
+	sector = std::min(std::max(sector, 0), SECTORS - 1);
+	return sector * RINGS + ring;
+}
+
+float GroundSegmenter::Height(float x, float z) const
+{
+	// empty patches borrow the plane of the nearest ring of their sector,
+	// a cloud without any ground is at height 0
+	int patch = Patch(x, z);
+	int sectorStart = patch - patch % RINGS;
+	for (int offset = 0; offset < RINGS; offset++)
+	{
+		for (int ring : { patch - offset, patch + offset })
+		{
+			if (ring < sectorStart || ring >= sectorStart + RINGS)
+			{
+				continue;
+			}
+			const cl_float4& plane = patches[ring];
+			if (plane.s[1] != 0)
+			{
+				return -(plane.s[0] * x + plane.s[2] * z + plane.s[3]) / plane.s[1];
+			}
+		}
+	}
+	return 0;
+}
\ No newline at end of file
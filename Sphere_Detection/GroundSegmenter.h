@@ -0,0 +1,58 @@
+#pragma once
+
+#include "IFitter.h"
+
+// Ground segmentation on a polar grid around the sensor (in the spirit of
+// Lim et al.: Patchwork). Each patch of rings and sectors gets its own plane
+// fitted to its lowest points on the device, so sloped and stepped ground is
+// labelled in one pass where a single plane would cut through it.
+class GroundSegmenter
+{
+public:
+	/**
+	 * \brief Creates the kernels and buffers
+	 * \param program program containing the polar grid and patch kernels
+	 * \param maxCount maximal number of points
+	 */
+	void		Init(cl::Context& context, cl::Program& program, int maxCount);
+
+	/**
+	 * \brief Fits a plane to each patch and marks the ground points in their w like fillPlane
+	 * \param points points as 4 floats each
+	 * \param count number of points
+	 * \param threshold inlier distance from the plane of the patch
+	 * \param minUp smallest y of the patch normals, steeper patches are levelled
+	 */
+	void		Segment(cl::CommandQueue& queue, cl::Buffer& points, int count, float threshold, float minUp);
+
+	/**
+	 * \brief Height of the ground below a point, valid once the queue has passed the last Segment
+	 * \param x, z horizontal position
+	 * \return height of its patch, or of the nearest fitted patch of its sector
+	 */
+	float		Height(float x, float z) const;
+
+private:
+	const int RINGS = 10;
+	const int SECTORS = 16;
+	const float RING_WIDTH = 1.f;		// the outer ring reaches to infinity
+	const float SEED_HEIGHT = 0.2f;		// above the lowest point of a patch
+	const int PATCH_SIZE = 64;			// work-group size of the patch fits
+	const int SCAN_SIZE = 256;			// work-group size of the prefix sum
+
+	int		Patch(float x, float z) const;
+
+	cl::Kernel countKernel;
+	cl::Kernel scanKernel;
+	cl::Kernel scatterKernel;
+	cl::Kernel fitKernel;
+	cl::Kernel labelKernel;
+
+	cl::Buffer cellBuffer;		// patch of each point
+	cl::Buffer cellCountBuffer;
+	cl::Buffer cellStartBuffer;
+	cl::Buffer sortedBuffer;	// point indices ordered by patch
+	cl::Buffer patchBuffer;		// (normal, offset) of each patch
+	std::vector<int> zeros;
+	std::vector<cl_float4> patches;
+};
\ No newline at end of file
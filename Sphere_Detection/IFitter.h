@@ -24,12 +24,124 @@
 #include <oclutils.hpp>
 
 #include <vector>
+#include <cstring>
+#include <chrono>
+
+#include "SPRT.h"
+
+// layout of the float3 hypothesis buffers of the cylinder program: 4 floats like
+// cl_float3, or 3 packed floats when the project defines PACKED_FLOAT3, which is
+// passed on to the program build
+#ifdef PACKED_FLOAT3
+const int FLOAT3_WIDTH = 3;
+const char* const FLOAT3_OPTIONS = "-D PACKED_FLOAT3";
+#else
+const int FLOAT3_WIDTH = 4;
+const char* const FLOAT3_OPTIONS = "";
+#endif
+
+// how hypotheses are verified against the points
+enum VerifyMode {FULL_VERIFY, SPRT_VERIFY};
+
+// how points are scored against a hypothesis: inlier count,
+// truncated quadratic loss or inlier / outlier mixture likelihood
+enum ScoreMode {RANSAC_SCORE, MSAC_SCORE, MLESAC_SCORE};
+
+// minimal samples are drawn uniformly, around a seed point (NAPSAC)
+// or from a growing pool of the best quality points (PROSAC)
+enum SampleMode {UNIFORM_SAMPLE, LOCAL_SAMPLE, PROSAC_SAMPLE};
+
+// hypotheses outside these bounds are rejected right after they are computed
+// and skipped by the scoring, which also keeps degenerate models from winning
+struct Priors
+{
+	float minRadius = 0.05f;	// of spheres, cylinders and both radii of tori
+	float maxRadius = 1.5f;
+	glm::vec3 low = glm::vec3(-10.f);	// region of the sphere centers, cylinder axes and primitive points
+	glm::vec3 high = glm::vec3(10.f);
+	float minUp = 0.8f;	// cosine of the largest tilt of the plane normal from the y axis
+};
+
+// the best model of a frame and how well it is supported
+struct FitResult
+{
+	glm::vec4 model = glm::vec4(0);	// sphere (center, radius) or cylinder (axis point, radius), see PrimitiveFitter for the others
+	glm::vec4 axis = glm::vec4(0, 1, 0, 0);	// of cylinders, direction and length, 0 when unbounded
+	int inliers = 0;
+	float rms = 0;		// of the geometric residuals of the inliers
+	int hypotheses = 0;	// generated for the best model, 0 for Hough voting
+
+	// milliseconds on the device clock, the stage times are 0 unless
+	// the queue was created with profiling enabled
+	float generateTime = 0;	// sampling and hypothesis generation
+	float scoreTime = 0;	// scoring and selection
+	float refineTime = 0;	// refinement of the best model
+	float totalTime = 0;	// wall time of Fit on the host
+};
+
+// milliseconds between the ends of two commands of a profiling queue
+inline float ElapsedTime(const cl::Event& from, const cl::Event& to)
+{
+	cl_ulong start = from.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	cl_ulong end = to.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	return (end - start) * 1e-6f;
+}
+
+inline bool IsProfiling(const cl::CommandQueue& queue)
+{
+	return (queue.getInfo<CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) != 0;
+}
+
+// a scored hypothesis, as returned by the top-K selection
+struct Hypothesis
+{
+	glm::vec4 model;
+	float score;
+	int index;
+};
+
+// the best hypothesis is selected on the device as (score bits << 32) | index
+inline float UnpackScore(cl_ulong best)
+{
+	cl_uint bits = (cl_uint)(best >> 32);
+	float score;
+	memcpy(&score, &bits, sizeof(float));
+	return score;
+}
+
+inline int UnpackIndex(cl_ulong best)
+{
+	return (int)(best & 0xffffffff);
+}
+
+// work-group sizes of the scoring and selection kernels of ransac.cl, shared by
+// the fitters' batch and Hough paths, and the selection work-groups with 64 bit atomics
+const int SCORE_SIZE = 64;
+const int SELECT_SIZE = 256;
+const int SELECT_GROUPS = 16;
+
+// number of work-groups for the best hypothesis selection, the groups'
+// maxima can only be merged on devices with 64 bit atomics
+inline int SelectGroupCount(const cl::Device& device, int groups)
+{
+	std::string extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+	return extensions.find("cl_khr_int64_extended_atomics") != std::string::npos ? groups : 1;
+}
 
 class IFitter
 {
 public:
 	virtual ~IFitter() {}
 	virtual void Init(cl::Context&, const cl::vector<cl::Device>&) = 0;
-	virtual glm::vec4 Fit(cl::CommandQueue&, cl::BufferGL&) = 0;
-	virtual void EvalCandidate(const glm::vec4&, const int) = 0;
+	virtual FitResult Fit(cl::CommandQueue&, cl::BufferGL&) = 0;
+	// quality predicts whether the point lies on a target, used for PROSAC sampling
+	virtual void EvalCandidate(const glm::vec4&, const int, const float) = 0;
+	virtual void SetVerifyMode(VerifyMode) = 0;
+	virtual void SetScoreMode(ScoreMode) = 0;
+	virtual void SetSampleMode(SampleMode) = 0;
+	virtual void SetPriors(const Priors&) = 0;
+
+	// number of best hypotheses kept in each frame, 0 to disable
+	virtual void SetTopK(int) = 0;
+	virtual const std::vector<Hypothesis>& GetTopHypotheses() const = 0;
 };
\ No newline at end of file
@@ -21,12 +21,149 @@ void PointCloud::ChangeMode()
 		currentFitter = cylinderFitter;
 		break;
 	case CYLINDER:
+		fitMode = PLANE;
+		primitiveFitter->SetPrimitive(PLANE_PRIMITIVE);
+		currentFitter = primitiveFitter;
+		break;
+	case PLANE:
+		fitMode = CONE;
+		primitiveFitter->SetPrimitive(CONE_PRIMITIVE);
+		break;
+	case CONE:
+		fitMode = TORUS;
+		primitiveFitter->SetPrimitive(TORUS_PRIMITIVE);
+		break;
+	case TORUS:
 		fitMode = SPHERE;
 		currentFitter = sphereFitter;
 		break;
 	}
 }
 
+void PointCloud::ChangeVerifyMode()
+{
+	switch (verifyMode)
+	{
+	case FULL_VERIFY:
+		verifyMode = SPRT_VERIFY;
+		break;
+	case SPRT_VERIFY:
+		verifyMode = FULL_VERIFY;
+		break;
+	}
+	sphereFitter->SetVerifyMode(verifyMode);
+	cylinderFitter->SetVerifyMode(verifyMode);
+	primitiveFitter->SetVerifyMode(verifyMode);
+}
+
+void PointCloud::ChangeScoreMode()
+{
+	switch (scoreMode)
+	{
+	case RANSAC_SCORE:
+		scoreMode = MSAC_SCORE;
+		break;
+	case MSAC_SCORE:
+		scoreMode = MLESAC_SCORE;
+		break;
+	case MLESAC_SCORE:
+		scoreMode = RANSAC_SCORE;
+		break;
+	}
+	sphereFitter->SetScoreMode(scoreMode);
+	cylinderFitter->SetScoreMode(scoreMode);
+	primitiveFitter->SetScoreMode(scoreMode);
+}
+
+void PointCloud::ToggleLocalOptimization()
+{
+	localOptimization = !localOptimization;
+	sphereFitter->SetLocalOptimization(localOptimization);
+}
+
+void PointCloud::ToggleGeometricRefinement()
+{
+	geometricRefinement = !geometricRefinement;
+	sphereFitter->SetGeometricRefinement(geometricRefinement);
+}
+
+void PointCloud::ToggleTracking()
+{
+	tracking = !tracking;
+	sphereFitter->SetTracking(tracking);
+	cylinderFitter->SetPlaneTracking(tracking);
+}
+
+void PointCloud::ChangeSampleMode()
+{
+	switch (sampleMode)
+	{
+	case UNIFORM_SAMPLE:
+		sampleMode = LOCAL_SAMPLE;
+		break;
+	case LOCAL_SAMPLE:
+		sampleMode = PROSAC_SAMPLE;
+		break;
+	case PROSAC_SAMPLE:
+		sampleMode = UNIFORM_SAMPLE;
+		break;
+	}
+	sphereFitter->SetSampleMode(sampleMode);
+	cylinderFitter->SetSampleMode(sampleMode);
+	primitiveFitter->SetSampleMode(sampleMode);
+}
+
+void PointCloud::ToggleNormalEstimation()
+{
+	normalEstimation = !normalEstimation;
+	sphereFitter->SetNormalEstimation(normalEstimation);
+	cylinderFitter->SetNormalEstimation(normalEstimation);
+}
+
+void PointCloud::ToggleFreeAxis()
+{
+	freeAxis = !freeAxis;
+	cylinderFitter->SetFreeAxis(freeAxis);
+}
+
+void PointCloud::ToggleExtraction()
+{
+	extraction = !extraction;
+	cylinderFitter->SetExtraction(extraction);
+}
+
+void PointCloud::ToggleGroundPatches()
+{
+	groundPatches = !groundPatches;
+	cylinderFitter->SetGroundPatches(groundPatches);
+}
+
+void PointCloud::ToggleHoughVoting()
+{
+	houghVoting = !houghVoting;
+	cylinderFitter->SetHoughVoting(houghVoting);
+}
+
+void PointCloud::ToggleKnownRadius()
+{
+	// the radius of the current sphere is kept for the Hough detection
+	if (knownRadius == 0 && !sphereResults.empty())
+	{
+		knownRadius = sphereResults[0].w;
+	}
+	else
+	{
+		knownRadius = 0;
+	}
+	sphereFitter->SetKnownRadius(knownRadius);
+}
+
+void PointCloud::ChangeSphereCount()
+{
+	sphereCount = sphereCount % MAX_SPHERE_COUNT + 1;
+	sphereFitter->SetMaxSpheres(sphereCount);
+}
+
 bool PointCloud::Init(const MemoryNames& memNames)
 {
 	mapMem = new SHMManager(memNames.first, memNames.second, sizeof(int), POINT_CLOUD_SIZE * CHANNELS * sizeof(int));
@@ -419,6 +556,9 @@ bool PointCloud::InitCl(cl::Context& context, const cl::vector<cl::Device>& devi
 		cylinderFitter = new CylinderFitter();
 		cylinderFitter->Init(context, devices);
 
+		primitiveFitter = new PrimitiveFitter();
+		primitiveFitter->Init(context, devices);
+
 		currentFitter = sphereFitter;
 	}
 	catch (cl::Error& error)
@@ -447,8 +587,13 @@ void PointCloud::Update()
 			glm::vec4 point = glm::vec4(rawData[i], rawData[i + 2], -rawData[i + 1], 0);
 			pointsPos[i / CHANNELS] = point;
 
+			// range compensated intensity, the returns of the retro-reflective
+			// targets stay bright while the return power falls with squared range
+			float range = glm::length(glm::vec3(point));
+			float quality = rawData[i + 3] * range * range;
+
 			// storing indices of candidate points
-			currentFitter->EvalCandidate(point, i / CHANNELS);
+			currentFitter->EvalCandidate(point, i / CHANNELS, quality);
 		}
 
 		glBindBuffer(GL_ARRAY_BUFFER, posVBO);
@@ -481,10 +626,19 @@ void PointCloud::Render(const glm::mat4& viewProj) const
 		switch (fitMode)
 		{
 		case SPHERE:
-			RenderSphere(viewProj);
+			for (const glm::vec4& sphere : sphereResults)
+			{
+				RenderSphere(viewProj, sphere);
+			}
 			break;
 		case CYLINDER:
-			RenderCylinder(viewProj);
+			for (const FittedCylinder& cylinder : cylinderResults)
+			{
+				RenderCylinder(viewProj, cylinder);
+			}
+			break;
+		default:
+			RenderPrimitive(viewProj, fitResult);
 			break;
 		}
 	}
@@ -502,7 +656,19 @@ void PointCloud::Fit(cl::CommandQueue& queue)
 	try
 	{
 		fitResult = currentFitter->Fit(queue, posBuffer);
-		foundFit = true;
+		if (fitMode == SPHERE)
+		{
+			sphereResults.clear();
+			for (const FittedSphere& sphere : sphereFitter->GetSpheres())
+			{
+				sphereResults.push_back(sphere.sphere);
+			}
+		}
+		else if (fitMode == CYLINDER)
+		{
+			cylinderResults = cylinderFitter->GetCylinders();
+		}
+		foundFit = fitResult.inliers >= MIN_FIT_INLIERS;
 	}
 	catch (cl::Error&)
 	{
@@ -510,12 +676,12 @@ void PointCloud::Fit(cl::CommandQueue& queue)
 	}
 }
 
-void PointCloud::RenderSphere(const glm::mat4& viewProj) const
+void PointCloud::RenderSphere(const glm::mat4& viewProj, const glm::vec4& sphere) const
 {
-	float x0 = fitResult.x;
-	float y0 = fitResult.y;
-	float z0 = fitResult.z;
-	float r  = fitResult.w;
+	float x0 = sphere.x;
+	float y0 = sphere.y;
+	float z0 = sphere.z;
+	float r  = sphere.w;
 	constexpr float pi = glm::pi<float>();
 
 	std::vector<glm::vec4> vertices;
@@ -576,33 +742,35 @@ void PointCloud::RenderSphere(const glm::mat4& viewProj) const
 	glUseProgram(0);
 }
 
-void PointCloud::RenderCylinder(const glm::mat4& viewProj) const
+void PointCloud::RenderCylinder(const glm::mat4& viewProj, const FittedCylinder& cylinder) const
 {
-	float x0 = fitResult.x;
-	float y0 = fitResult.y;
-	float z0 = fitResult.z;
-	float r  = fitResult.w;
+	float r = cylinder.cylinder.w;
+	glm::vec3 axis(cylinder.axis);
+
+	// measured cylinders are centered on their axis point,
+	// the others start at the ground plane
+	float height = cylinder.axis.w > 0 ? cylinder.axis.w : cHeight;
+	glm::vec3 bottom(cylinder.cylinder);
+	if (cylinder.axis.w > 0)
+	{
+		bottom -= 0.5f * height * axis;
+	}
+
+	// base vectors of the circles, x and z for vertical axes
+	glm::vec3 u = fabs(axis.y) < 0.99f ? glm::normalize(glm::cross(axis, glm::vec3(0, 1, 0))) : glm::vec3(1, 0, 0);
+	glm::vec3 v = glm::cross(u, axis);
 
 	std::vector<glm::vec4> vertices;
 	for (int i = 0; i <= cCount; i++)
 	{
 		float phi = 2 * glm::pi<float>() * i / (float)cCount;
+		glm::vec3 p = bottom + r * (cosf(phi) * u + sinf(phi) * v);
 
 		// botton point
-		vertices.push_back({
-			x0 + r * cosf(phi),
-			y0,
-			z0 + r * sinf(phi),
-			1
-		});
+		vertices.push_back(glm::vec4(p, 1));
 
 		// top point
-		vertices.push_back({
-			x0 + r * cosf(phi),
-			y0 + 5,
-			z0 + r * sinf(phi),
-			1
-		});
+		vertices.push_back(glm::vec4(p + height * axis, 1));
 	}
 
 	std::vector<unsigned int> indices;
@@ -634,6 +802,109 @@ void PointCloud::RenderCylinder(const glm::mat4& viewProj) const
 
 	glDrawElements(GL_TRIANGLES, 3 * 2 * (cCount + 1), GL_UNSIGNED_INT, 0);
 
+	glBindVertexArray(0);
+	glUseProgram(0);
+}
+
+void PointCloud::RenderPrimitive(const glm::mat4& viewProj, const FitResult& primitive) const
+{
+	glm::vec3 origin(primitive.model);
+	glm::vec3 axis(primitive.axis);
+	constexpr float pi = glm::pi<float>();
+
+	// base vectors orthogonal to the axis or normal, x and z for vertical ones
+	glm::vec3 u = fabs(axis.y) < 0.99f ? glm::normalize(glm::cross(axis, glm::vec3(0, 1, 0))) : glm::vec3(1, 0, 0);
+	glm::vec3 v = glm::cross(u, axis);
+
+	// the surfaces are grids of rows * cols vertices
+	std::vector<glm::vec4> vertices;
+	int rows;
+	int cols;
+	switch (fitMode)
+	{
+	case PLANE:
+		// square around the centroid of the inliers
+		for (int i = 0; i < 2; i++)
+		{
+			for (int j = 0; j < 2; j++)
+			{
+				vertices.push_back(glm::vec4(origin + pSize * ((i - 0.5f) * u + (j - 0.5f) * v), 1));
+			}
+		}
+		rows = 2;
+		cols = 2;
+		break;
+	case CONE:
+	{
+		// from the apex to the height of the inliers
+		float height = primitive.axis.w;
+		float r = height * tanf(primitive.model.w);
+		for (int i = 0; i <= cCount; i++)
+		{
+			float phi = 2 * pi * i / (float)cCount;
+			vertices.push_back(glm::vec4(origin, 1));
+			vertices.push_back(glm::vec4(origin + height * axis + r * (cosf(phi) * u + sinf(phi) * v), 1));
+		}
+		rows = cCount + 1;
+		cols = 2;
+		break;
+	}
+	case TORUS:
+	{
+		float R = primitive.model.w;
+		float r = primitive.axis.w;
+		for (int i = 0; i <= cCount; i++)
+		{
+			float phi = 2 * pi * i / (float)cCount;
+			glm::vec3 dir = cosf(phi) * u + sinf(phi) * v;
+			for (int j = 0; j <= cCount; j++)
+			{
+				float theta = 2 * pi * j / (float)cCount;
+				vertices.push_back(glm::vec4(origin + (R + r * cosf(theta)) * dir + r * sinf(theta) * axis, 1));
+			}
+		}
+		rows = cCount + 1;
+		cols = cCount + 1;
+		break;
+	}
+	default:
+		return;
+	}
+
+	// two triangles per cell of the grid
+	std::vector<unsigned int> indices;
+	for (int i = 0; i < rows - 1; i++)
+	{
+		for (int j = 0; j < cols - 1; j++)
+		{
+			unsigned int k = i * cols + j;
+			indices.push_back(k);
+			indices.push_back(k + 1);
+			indices.push_back(k + cols);
+
+			indices.push_back(k + 1);
+			indices.push_back(k + cols + 1);
+			indices.push_back(k + cols);
+		}
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, cylVBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, cylIds);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec4), vertices.data(), GL_DYNAMIC_DRAW);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glUseProgram(cylProgram);
+	glBindVertexArray(cylVAO);
+
+	glm::mat4 world(1.0f);
+	glm::mat4 mvp = viewProj * world;
+	GLuint matrix = glGetUniformLocation(cylProgram, "mvp");
+	glUniformMatrix4fv(matrix, 1, GL_FALSE, glm::value_ptr(mvp));
+
+	glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, 0);
+
 	glBindVertexArray(0);
 	glUseProgram(0);
 }
\ No newline at end of file
@@ -2,9 +2,10 @@
 
 #include "SphereFitter.h"
 #include "CylinderFitter.h"
+#include "PrimitiveFitter.h"
 #include "SHMManager.h"
 
-enum FitMode {SPHERE, CYLINDER};
+enum FitMode {SPHERE, CYLINDER, PLANE, CONE, TORUS};
 
 class PointCloud
 {
@@ -20,23 +21,54 @@ public:
 	void Fit(cl::CommandQueue& queue);
 
 	void ChangeMode();
+	void ChangeVerifyMode();
+	void ChangeScoreMode();
+	void ToggleLocalOptimization();
+	void ToggleGeometricRefinement();
+	void ToggleTracking();
+	void ChangeSampleMode();
+	void ToggleNormalEstimation();
+	void ToggleFreeAxis();
+	void ToggleExtraction();
+	void ToggleGroundPatches();
+	void ToggleHoughVoting();
+	void ToggleKnownRadius();
+	void ChangeSphereCount();
 
 private:
 	bool InitSphere();
 	bool InitCylinder();
 
-	void RenderSphere(const glm::mat4& viewProj) const;
-	void RenderCylinder(const glm::mat4& viewProj) const;
+	void RenderSphere(const glm::mat4& viewProj, const glm::vec4& sphere) const;
+	void RenderCylinder(const glm::mat4& viewProj, const FittedCylinder& cylinder) const;
+	// plane, cone or torus of the fit result, with the cylinder program
+	void RenderPrimitive(const glm::mat4& viewProj, const FitResult& primitive) const;
 
 	const int CHANNELS = 4;
 	const float pointRenderSize = 5.f;
+	const int MIN_FIT_INLIERS = 20; // weaker fits are not rendered
 
 	SHMManager *mapMem;
 
 	FitMode fitMode = SPHERE;
+	VerifyMode verifyMode = FULL_VERIFY;
+	ScoreMode scoreMode = RANSAC_SCORE;
+	bool localOptimization = false;
+	bool geometricRefinement = false;
+	bool tracking = false;
+	SampleMode sampleMode = UNIFORM_SAMPLE;
+	bool normalEstimation = false;
+	bool freeAxis = false;
+	bool extraction = false;
+	bool groundPatches = false;
+	bool houghVoting = false;
+	float knownRadius = 0;
+	int sphereCount = 1;
 	bool fit = false;
 	bool foundFit = false;
-	glm::vec4 fitResult;
+	FitResult fitResult;
+	std::vector<glm::vec4> sphereResults;
+	std::vector<FittedCylinder> cylinderResults;
 
 	// GL
 	GLuint program;
@@ -44,6 +76,7 @@ private:
 	GLuint posVBO;
 
 	// sphere rendering
+	const int MAX_SPHERE_COUNT = 4;
 	const int hCount = 36; // horizontal point count
 	const int vCount = 18; // vertical point count
 	GLuint sphProgram;
@@ -53,15 +86,20 @@ private:
 
 	// cylinder rendering
 	const int cCount = 36; // cylinder segment count
+	const float cHeight = 5.f; // of the cylinders without a measured length
 	GLuint cylProgram;
 	GLuint cylVAO;
 	GLuint cylVBO;
 	GLuint cylIds;
 
+	// primitive rendering
+	const float pSize = 2.f; // edge of the plane squares
+
 	// CL
 	cl::BufferGL posBuffer;
 
 	SphereFitter *sphereFitter;
 	CylinderFitter *cylinderFitter;
+	PrimitiveFitter *primitiveFitter;
 	IFitter *currentFitter;
 };
\ No newline at end of file
@@ -0,0 +1,396 @@
+#include "PrimitiveFitter.h"
+
+#include <algorithm>
+
+PrimitiveFitter::PrimitiveFitter() = default;
+
+void PrimitiveFitter::Init(cl::Context& context, const cl::vector<cl::Device>& devices)
+{
+	std::ifstream ransacFile("ransac.cl");
+	if (!ransacFile.is_open())
+	{
+		std::cerr << "PrimitiveFitter::Init(): ransac.cl could not be opened" << std::endl;
+		exit(1);
+	}
+	std::string ransacCode(std::istreambuf_iterator<char>(ransacFile), (std::istreambuf_iterator<char>()));
+	ransacFile.close();
+
+	std::ifstream planeFile("plane_detect.cl");
+	if (!planeFile.is_open())
+	{
+		std::cerr << "PrimitiveFitter::Init(): plane_detect.cl could not be opened" << std::endl;
+		exit(1);
+	}
+	std::string planeCode(std::istreambuf_iterator<char>(planeFile), (std::istreambuf_iterator<char>()));
+	planeFile.close();
+
+	std::ifstream primitiveFile("primitive_detect.cl");
+	if (!primitiveFile.is_open())
+	{
+		std::cerr << "PrimitiveFitter::Init(): primitive_detect.cl could not be opened" << std::endl;
+		exit(1);
+	}
+	std::string primitiveCode(std::istreambuf_iterator<char>(primitiveFile), (std::istreambuf_iterator<char>()));
+	primitiveFile.close();
+
+	// the shared kernels come first, the primitive program instances their template
+	primitiveCode = ransacCode + "\n" + planeCode + "\n" + primitiveCode;
+	cl::Program::Sources primitiveSource(1, std::make_pair(primitiveCode.c_str(), primitiveCode.length() + 1));
+	program = cl::Program(context, primitiveSource);
+
+	try
+	{
+		program.build(devices, FLOAT3_OPTIONS);
+	}
+	catch (cl::Error& error)
+	{
+		std::cerr << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
+		throw error;
+	}
+
+	cropKernel = cl::Kernel(program, "cropPoints");
+
+	int maxIterNum = std::max(PLANE_ITER_NUM, std::max(CONE_ITER_NUM, TORUS_ITER_NUM));
+	pointBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, POINT_CLOUD_SIZE * sizeof(cl_float4));
+	countBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(int));
+	normalBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, POINT_CLOUD_SIZE * sizeof(cl_float4));
+	randBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxIterNum * sizeof(cl_int4));
+	measureBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, 12 * sizeof(float));
+
+	planeCalcKernel = cl::Kernel(program, "calcPlane");
+	planeRefineKernel = cl::Kernel(program, "refinePlane");
+	planeColorKernel = cl::Kernel(program, "fillPlane");
+
+	planePointsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, PLANE_ITER_NUM * FLOAT3_WIDTH * sizeof(float));
+	planeNormalsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, PLANE_ITER_NUM * FLOAT3_WIDTH * sizeof(float));
+	planePointBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, FLOAT3_WIDTH * sizeof(float));
+	planeNormalBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, FLOAT3_WIDTH * sizeof(float));
+
+	coneCalcKernel = cl::Kernel(program, "calcCone");
+	coneCheckKernel = cl::Kernel(program, "checkCone");
+	coneMeasureKernel = cl::Kernel(program, "measureCone");
+	coneColorKernel = cl::Kernel(program, "fillCone");
+
+	coneDataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CONE_ITER_NUM * sizeof(cl_float8));
+	coneModelBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float8));
+
+	torusCalcKernel = cl::Kernel(program, "calcTorus");
+	torusCheckKernel = cl::Kernel(program, "checkTorus");
+	torusMeasureKernel = cl::Kernel(program, "measureTorus");
+	torusColorKernel = cl::Kernel(program, "fillTorus");
+
+	torusDataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, TORUS_ITER_NUM * sizeof(cl_float8));
+	torusModelBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float8));
+
+	planeRansac.Init(context, program, devices[0], PLANE_ITER_NUM);
+	coneRansac.Init(context, program, devices[0], CONE_ITER_NUM);
+	torusRansac.Init(context, program, devices[0], TORUS_ITER_NUM);
+	sampler.Init(context, program, POINT_CLOUD_SIZE);
+}
+
+void PrimitiveFitter::SetVerifyMode(VerifyMode mode)
+{
+	verifyMode = mode;
+	planeRansac.SetVerifyMode(mode);
+	coneRansac.SetVerifyMode(mode);
+	torusRansac.SetVerifyMode(mode);
+}
+
+void PrimitiveFitter::SetScoreMode(ScoreMode mode)
+{
+	planeRansac.SetScoreMode(mode);
+	coneRansac.SetScoreMode(mode);
+	torusRansac.SetScoreMode(mode);
+}
+
+void PrimitiveFitter::SetSampleMode(SampleMode mode)
+{
+	sampleMode = mode;
+}
+
+void PrimitiveFitter::SetPriors(const Priors& value)
+{
+	priors = value;
+}
+
+void PrimitiveFitter::SetTopK(int)
+{
+}
+
+const std::vector<Hypothesis>& PrimitiveFitter::GetTopHypotheses() const
+{
+	return topHypotheses;
+}
+
+void PrimitiveFitter::SetPrimitive(PrimitiveType value)
+{
+	primitive = value;
+}
+
+void PrimitiveFitter::SetPlaneThreshold(float value)
+{
+	planeThreshold = value;
+}
+
+void PrimitiveFitter::SetSurfaceThreshold(float value)
+{
+	surfaceThreshold = value;
+}
+
+void PrimitiveFitter::EvalCandidate(const glm::vec4&, const int, const float)
+{
+	// the primitives are searched among all the points of the prior box
+}
+
+FitResult PrimitiveFitter::FitPlane(cl::CommandQueue& queue, cl::BufferGL& posBuffer, int size, cl::Event* events)
+{
+	FitResult result;
+
+	// collinear samples get null normals, planes of any tilt are kept
+	planeCalcKernel.setArg(0, pointBuffer);
+	planeCalcKernel.setArg(1, randBuffer);
+	planeCalcKernel.setArg(2, planePointsBuffer);
+	planeCalcKernel.setArg(3, planeNormalsBuffer);
+
+	queue.enqueueNDRangeKernel(planeCalcKernel, cl::NullRange, PLANE_ITER_NUM, cl::NullRange, nullptr, &events[1]);
+
+	cl::Buffer planes[2] = { planePointsBuffer, planeNormalsBuffer };
+	cl::Buffer bestPlane[2] = { planePointBuffer, planeNormalBuffer };
+	if (verifyMode == SPRT_VERIFY)
+	{
+		planeRansac.ResetStats(queue);
+	}
+	planeRansac.Score(queue, pointBuffer, planes, size, PLANE_ITER_NUM, planeThreshold);
+	planeRansac.Select(queue, planes, bestPlane, PLANE_ITER_NUM, &events[2]);
+
+	// the support is measured by the last refinement step
+	planeRefineKernel.setArg(0, pointBuffer);
+	planeRefineKernel.setArg(1, planePointBuffer);
+	planeRefineKernel.setArg(2, planeNormalBuffer);
+	planeRefineKernel.setArg(3, measureBuffer);
+	planeRefineKernel.setArg(4, MEASURE_SIZE * sizeof(float), nullptr);
+	planeRefineKernel.setArg(5, size);
+	planeRefineKernel.setArg(6, planeThreshold);
+
+	for (int i = 0; i < PLANE_REFINE_STEPS; i++)
+	{
+		queue.enqueueNDRangeKernel(planeRefineKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
+	}
+
+	planeColorKernel.setArg(0, posBuffer);
+	planeColorKernel.setArg(1, planePointBuffer);
+	planeColorKernel.setArg(2, planeNormalBuffer);
+	planeColorKernel.setArg(3, planeThreshold);
+
+	queue.enqueueNDRangeKernel(planeColorKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+	cl_ulong best;
+	if (verifyMode == SPRT_VERIFY)
+	{
+		queue.enqueueReadBuffer(planeRansac.Best(), CL_FALSE, 0, sizeof(cl_ulong), &best);
+		planeRansac.ReadStats(queue);
+	}
+
+	float measure[2];
+	cl_float3 point;
+	cl_float3 normal;
+	queue.enqueueReadBuffer(measureBuffer, CL_FALSE, 0, 2 * sizeof(float), measure);
+	queue.enqueueReadBuffer(planePointBuffer, CL_FALSE, 0, FLOAT3_WIDTH * sizeof(float), &point);
+	queue.enqueueReadBuffer(planeNormalBuffer, CL_TRUE, 0, FLOAT3_WIDTH * sizeof(float), &normal);
+
+	if (verifyMode == SPRT_VERIFY)
+	{
+		planeRansac.UpdateSprt((int)UnpackScore(best), size);
+	}
+
+	result.model = { point.s[0], point.s[1], point.s[2], 0 };
+	result.axis = { normal.s[0], normal.s[1], normal.s[2], 0 };
+	result.inliers = (int)measure[0];
+	result.rms = measure[0] > 0 ? sqrtf(measure[1] / measure[0]) : 0;
+	result.hypotheses = PLANE_ITER_NUM;
+	if (IsProfiling(queue))
+	{
+		result.generateTime = ElapsedTime(events[0], events[1]);
+		result.scoreTime = ElapsedTime(events[1], events[2]);
+	}
+	return result;
+}
+
+template <class Model>
+FitResult PrimitiveFitter::FitOriented(cl::CommandQueue& queue, cl::BufferGL& posBuffer, RansacEngine<Model>& ransac, cl::Kernel& calcKernel, cl::Kernel& checkKernel,
+									   cl::Kernel& measureKernel, cl::Kernel& colorKernel, cl::Buffer& models, cl::Buffer& model,
+									   int size, int iterNum, cl::Event* events)
+{
+	FitResult result;
+
+	calcKernel.setArg(0, pointBuffer);
+	calcKernel.setArg(1, normalBuffer);
+	calcKernel.setArg(2, randBuffer);
+	calcKernel.setArg(3, models);
+
+	queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, iterNum, cl::NullRange);
+
+	// reject implausible models before the scoring
+	checkKernel.setArg(0, models);
+
+	queue.enqueueNDRangeKernel(checkKernel, cl::NullRange, iterNum, cl::NullRange, nullptr, &events[1]);
+
+	if (verifyMode == SPRT_VERIFY)
+	{
+		ransac.ResetStats(queue);
+	}
+	ransac.Score(queue, pointBuffer, &models, size, iterNum, surfaceThreshold);
+	ransac.Select(queue, &models, &model, iterNum, &events[2]);
+
+	// support of the best model, the cones also get the height of their inliers
+	measureKernel.setArg(0, pointBuffer);
+	measureKernel.setArg(1, model);
+	measureKernel.setArg(2, measureBuffer);
+	measureKernel.setArg(3, MEASURE_SIZE * sizeof(cl_float4), nullptr);
+	measureKernel.setArg(4, (cl_int)size);
+	measureKernel.setArg(5, surfaceThreshold);
+
+	queue.enqueueNDRangeKernel(measureKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
+
+	colorKernel.setArg(0, posBuffer);
+	colorKernel.setArg(1, model);
+	colorKernel.setArg(2, surfaceThreshold);
+
+	queue.enqueueNDRangeKernel(colorKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+	cl_ulong best;
+	if (verifyMode == SPRT_VERIFY)
+	{
+		queue.enqueueReadBuffer(ransac.Best(), CL_FALSE, 0, sizeof(cl_ulong), &best);
+		ransac.ReadStats(queue);
+	}
+
+	float measure[2];
+	queue.enqueueReadBuffer(measureBuffer, CL_FALSE, 0, 2 * sizeof(float), measure);
+
+	cl_float8 values;
+	queue.enqueueReadBuffer(model, CL_TRUE, 0, sizeof(cl_float8), &values);
+
+	if (verifyMode == SPRT_VERIFY)
+	{
+		ransac.UpdateSprt((int)UnpackScore(best), size);
+	}
+
+	result.model = { values.s[0], values.s[1], values.s[2], values.s[3] };
+	result.axis = { values.s[4], values.s[5], values.s[6], values.s[7] };
+	result.inliers = (int)measure[0];
+	result.rms = measure[0] > 0 ? sqrtf(measure[1] / measure[0]) : 0;
+	result.hypotheses = iterNum;
+	if (IsProfiling(queue))
+	{
+		result.generateTime = ElapsedTime(events[0], events[1]);
+		result.scoreTime = ElapsedTime(events[1], events[2]);
+	}
+	return result;
+}
+
+FitResult PrimitiveFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
+{
+	auto start = std::chrono::steady_clock::now();
+	FitResult result;
+
+	try
+	{
+		// acquire GL position buffer
+		cl::Event events[3];
+		cl::vector<cl::Memory> acq;
+		acq.push_back(posBuffer);
+		queue.enqueueAcquireGLObjects(&acq, nullptr, &events[0]);
+
+		// compact the points of the prior box on the device, only their count is read back
+		queue.enqueueWriteBuffer(countBuffer, CL_FALSE, 0, sizeof(int), &zeroCount);
+
+		cropKernel.setArg(0, posBuffer);
+		cropKernel.setArg(1, pointBuffer);
+		cropKernel.setArg(2, countBuffer);
+		cropKernel.setArg(3, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+		cropKernel.setArg(4, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
+		cropKernel.setArg(5, MIN_RANGE);
+
+		queue.enqueueNDRangeKernel(cropKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
+
+		int size;
+		queue.enqueueReadBuffer(countBuffer, CL_TRUE, 0, sizeof(int), &size);
+
+		bool oriented = primitive != PLANE_PRIMITIVE;
+		int sampleSize = primitive == TORUS_PRIMITIVE ? 4 : 3;
+		int iterNum = primitive == PLANE_PRIMITIVE ? PLANE_ITER_NUM : (primitive == CONE_PRIMITIVE ? CONE_ITER_NUM : TORUS_ITER_NUM);
+		if (size < sampleSize)
+		{
+			std::cout << "PrimitiveFitter::Fit(): not enough points, skipping primitive fit\n";
+			queue.enqueueReleaseGLObjects(&acq);
+			return result;
+		}
+
+		if (sampleMode == LOCAL_SAMPLE || oriented)
+		{
+			sampler.Build(queue, pointBuffer, size, priors.low, priors.high, std::max(SAMPLE_CELL, NORMAL_RADIUS));
+		}
+
+		if (oriented)
+		{
+			sampler.EstimateNormals(queue, pointBuffer, normalBuffer, NORMAL_RADIUS);
+		}
+
+		if (sampleMode == LOCAL_SAMPLE)
+		{
+			// NAPSAC: the other points of a sample come from the cells around the first
+			sampler.Sample(queue, randBuffer, iterNum, sampleSize);
+		}
+		else
+		{
+			// samples of distinct random points, the unused indices stay 0
+			std::vector<cl_int4> indices(iterNum, cl_int4{ 0, 0, 0, 0 });
+			for (cl_int4& sample : indices)
+			{
+				for (int k = 0; k < sampleSize; k++)
+				{
+					do {
+						sample.s[k] = rand() % size;
+					} while (std::find(sample.s, sample.s + k, sample.s[k]) != sample.s + k);
+				}
+			}
+
+			queue.enqueueWriteBuffer(randBuffer, CL_TRUE, 0, iterNum * sizeof(cl_int4), indices.data());
+		}
+		queue.finish();
+
+		switch (primitive)
+		{
+		case PLANE_PRIMITIVE:
+			result = FitPlane(queue, posBuffer, size, events);
+			break;
+		case CONE_PRIMITIVE:
+			coneCheckKernel.setArg(1, cl_float2{ MIN_CONE_ANGLE, MAX_CONE_ANGLE });
+			coneCheckKernel.setArg(2, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+			coneCheckKernel.setArg(3, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
+
+			result = FitOriented(queue, posBuffer, coneRansac, coneCalcKernel, coneCheckKernel, coneMeasureKernel, coneColorKernel,
+								 coneDataBuffer, coneModelBuffer, size, iterNum, events);
+			break;
+		case TORUS_PRIMITIVE:
+			torusCalcKernel.setArg(4, cl_float2{ priors.minRadius, priors.maxRadius });
+			torusCheckKernel.setArg(1, cl_float2{ priors.minRadius, priors.maxRadius });
+			torusCheckKernel.setArg(2, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+			torusCheckKernel.setArg(3, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
+
+			result = FitOriented(queue, posBuffer, torusRansac, torusCalcKernel, torusCheckKernel, torusMeasureKernel, torusColorKernel,
+								 torusDataBuffer, torusModelBuffer, size, iterNum, events);
+			break;
+		}
+
+		queue.enqueueReleaseGLObjects(&acq);
+		result.totalTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return result;
+	}
+	catch (cl::Error& error)
+	{
+		std::cerr << "PrimitiveFitter::Fit(): " << error.what() << std::endl;
+		throw error;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "IFitter.h"
+#include "GridSampler.h"
+#include "RansacEngine.h"
+
+enum PrimitiveType {PLANE_PRIMITIVE, CONE_PRIMITIVE, TORUS_PRIMITIVE};
+
+// models of the generic RANSAC kernels: cones as (apex, half angle, axis, height)
+// and tori as (center, ring radius, axis, tube radius)
+struct ConeModel
+{
+	static constexpr const char* NAME = "Cone";
+	static const int BUFFERS = 1;
+	static const int WIDTH = 8;
+};
+
+struct TorusModel
+{
+	static constexpr const char* NAME = "Torus";
+	static const int BUFFERS = 1;
+	static const int WIDTH = 8;
+};
+
+// Planes, cones and tori of any orientation, fitted to the points of the prior
+// box on the device like the spheres and cylinders. Planes are generated from
+// 3 points, cones from 3 and tori from 4 oriented points, whose normals are
+// estimated on the sampling grid. The result holds the model and its axis:
+//   plane	(centroid of the inliers, 0) and (normal, 0)
+//   cone	(apex, half angle) and (axis into the cone, height of the inliers)
+//   torus	(center, ring radius) and (axis, tube radius)
+class PrimitiveFitter : public IFitter
+{
+public:
+	PrimitiveFitter();
+
+	void Init(cl::Context&, const cl::vector<cl::Device>&) override;
+	FitResult Fit(cl::CommandQueue&, cl::BufferGL&) override;
+	void EvalCandidate(const glm::vec4&, const int, const float) override;
+	void SetVerifyMode(VerifyMode) override;
+	void SetScoreMode(ScoreMode) override;
+	// PROSAC samples uniformly, the candidate qualities predict the targets, not the primitives
+	void SetSampleMode(SampleMode) override;
+	void SetPriors(const Priors&) override;
+	// no top hypotheses are kept, the cones and tori do not fit their 4 floats
+	void SetTopK(int) override;
+	const std::vector<Hypothesis>& GetTopHypotheses() const override;
+
+	// primitive searched by Fit, each one keeps its own SPRT estimates
+	void SetPrimitive(PrimitiveType);
+	// inlier threshold of the point to plane distance
+	void SetPlaneThreshold(float);
+	// inlier threshold of the distance from the cone and torus surfaces
+	void SetSurfaceThreshold(float);
+
+private:
+	// best plane of the cropped points, refined by weighted least squares;
+	// generation and scoring end with the events 1 and 2
+	FitResult FitPlane(cl::CommandQueue&, cl::BufferGL&, int size, cl::Event* events);
+	// best cone or torus of the cropped points with the kernels of the model, the
+	// parameters of the calc and check kernels after the buffers are set by the caller;
+	// generation and scoring end with the events 1 and 2
+	template <class Model>
+	FitResult FitOriented(cl::CommandQueue&, cl::BufferGL&, RansacEngine<Model>& ransac, cl::Kernel& calcKernel, cl::Kernel& checkKernel,
+						  cl::Kernel& measureKernel, cl::Kernel& colorKernel, cl::Buffer& models, cl::Buffer& model,
+						  int size, int iterNum, cl::Event* events);
+
+	const int PLANE_ITER_NUM = 2048;
+	const int CONE_ITER_NUM = 4096;
+	const int TORUS_ITER_NUM = 4096;
+	const int PLANE_REFINE_STEPS = 2;
+	const float MIN_CONE_ANGLE = 0.05f;		// half angles of the cones in radians
+	const float MAX_CONE_ANGLE = 1.2f;
+	const float MIN_RANGE = 0.5f;	// of the cropped points from the sensor
+	const float SAMPLE_CELL = 0.5f;	// cell size of the sampling grid
+	const float NORMAL_RADIUS = 0.15f;	// neighbourhood of the normal estimation
+	const int MEASURE_SIZE = 256; // work-group size of the inlier measurement
+	const int zeroCount = 0;
+
+	PrimitiveType primitive = PLANE_PRIMITIVE;
+	float planeThreshold = 0.05f;
+	float surfaceThreshold = 0.03f;
+	VerifyMode verifyMode = FULL_VERIFY;
+	SampleMode sampleMode = UNIFORM_SAMPLE;
+	Priors priors;
+	std::vector<Hypothesis> topHypotheses;	// always empty
+
+	GridSampler sampler;
+	RansacEngine<PlaneModel> planeRansac;
+	RansacEngine<ConeModel> coneRansac;
+	RansacEngine<TorusModel> torusRansac;
+
+	cl::Program program;
+
+	cl::Kernel cropKernel;
+
+	cl::Buffer pointBuffer;		// the points inside the prior box
+	cl::Buffer countBuffer;
+	cl::Buffer normalBuffer;
+	cl::Buffer randBuffer;		// 4 indices per sample
+	cl::Buffer measureBuffer;	// support of the best model, and the weighted moments of the refined plane
+
+	cl::Kernel planeCalcKernel;
+	cl::Kernel planeRefineKernel;
+	cl::Kernel planeColorKernel;
+
+	cl::Buffer planePointsBuffer;
+	cl::Buffer planeNormalsBuffer;
+	cl::Buffer planePointBuffer;	// point and normal of the best plane
+	cl::Buffer planeNormalBuffer;
+
+	cl::Kernel coneCalcKernel;
+	cl::Kernel coneCheckKernel;
+	cl::Kernel coneMeasureKernel;
+	cl::Kernel coneColorKernel;
+
+	cl::Buffer coneDataBuffer;
+	cl::Buffer coneModelBuffer;
+
+	cl::Kernel torusCalcKernel;
+	cl::Kernel torusCheckKernel;
+	cl::Kernel torusMeasureKernel;
+	cl::Kernel torusColorKernel;
+
+	cl::Buffer torusDataBuffer;
+	cl::Buffer torusModelBuffer;
+};
\ No newline at end of file
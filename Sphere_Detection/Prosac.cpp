@@ -0,0 +1,55 @@
+#include "Prosac.h"
+
+#include <cmath>
+#include <cstdlib>
+
+std::vector<int> Prosac::Sample(int count, int sampleNum, int sampleSize) const
+{
+	// expected number of samples drawn from the n best points among sampleNum
+	// uniform ones: T_n = sampleNum * C(n, m) / C(count, m)
+	double T = sampleNum;
+	for (int i = 0; i < sampleSize; i++)
+	{
+		T *= (double)(sampleSize - i) / (count - i);
+	}
+
+	std::vector<int> indices(sampleNum * 4, 0);
+	int n = sampleSize;
+	int nextGrowth = 1; // T'_n, the sample at which the pool grows
+	for (int t = 1; t <= sampleNum; t++)
+	{
+		while (t > nextGrowth && n < count)
+		{
+			double nextT = T * (n + 1) / (n + 1 - sampleSize);
+			nextGrowth += (int)ceil(nextT - T);
+			T = nextT;
+			n++;
+		}
+
+		// the newest point of the pool is always part of the sample,
+		// unless the pool stopped growing
+		int* sample = &indices[(t - 1) * 4];
+		int first = 0;
+		int pool = n;
+		if (t <= nextGrowth)
+		{
+			sample[0] = n - 1;
+			first = 1;
+			pool = n - 1;
+		}
+
+		for (int i = first; i < sampleSize; i++)
+		{
+			bool unique;
+			do {
+				sample[i] = rand() % pool;
+				unique = true;
+				for (int j = 0; j < i; j++)
+				{
+					unique = unique && sample[i] != sample[j];
+				}
+			} while (!unique);
+		}
+	}
+	return indices;
+}
\ No newline at end of file
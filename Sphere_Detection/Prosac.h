@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+
+// Progressive sample consensus (Chum & Matas: Matching with PROSAC - Progressive Sample
+// Consensus). The points are sorted by a quality score and the samples are drawn from
+// a growing pool of the best ones, after the last sample the pool is the whole set
+// and the sampling becomes uniform.
+class Prosac
+{
+public:
+	/**
+	 * \brief Draws samples from the growing pool of the best points
+	 * \param count number of points, sorted by descending quality
+	 * \param sampleNum number of samples
+	 * \param sampleSize number of points in a sample, at most 4
+	 * \return sampleSize distinct indices per sample, 4 apart
+	 */
+	std::vector<int>	Sample(int count, int sampleNum, int sampleSize) const;
+};
\ No newline at end of file
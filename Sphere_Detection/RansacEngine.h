@@ -0,0 +1,192 @@
+#pragma once
+
+#include "IFitter.h"
+
+#include <string>
+#include <cstdlib>
+
+// Scoring, SPRT verification and selection of the hypotheses of one model type,
+// shared by the fitters. The model descriptor gives the kernel names and layout:
+//   NAME		suffix of the fit<NAME> and fit<NAME>SPRT kernels instanced with
+//				RANSAC_KERNELS in the program, see ransac.cl
+//   BUFFERS	number of hypothesis buffers the kernels take
+//   WIDTH		floats of a hypothesis in each buffer
+// The hypotheses are generated by the fitter into its own buffers, which are
+// passed to Score and Select; the engine keeps the scores and the SPRT state.
+template <class Model>
+class RansacEngine
+{
+public:
+	/**
+	 * \brief Creates the kernels and buffers
+	 * \param program program built with ransac.cl and the model's kernels
+	 * \param device device of the program, for the number of selection work-groups
+	 * \param maxHypotheses maximal number of hypotheses scored at once
+	 */
+	void		Init(cl::Context& context, cl::Program& program, const cl::Device& device, int maxHypotheses)
+	{
+		fitKernel = cl::Kernel(program, ("fit" + std::string(Model::NAME)).c_str());
+		sprtKernel = cl::Kernel(program, ("fit" + std::string(Model::NAME) + "SPRT").c_str());
+		selectKernel = cl::Kernel(program, "selectBest");
+		copyKernel = cl::Kernel(program, "copyBest");
+
+		scoreBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxHypotheses * sizeof(float));
+		statsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, 3 * sizeof(int));
+		bestBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_ulong));
+		selectGroups = SelectGroupCount(device, SELECT_GROUPS);
+	}
+
+	// restarts the SPRT with its initial estimates
+	void		SetVerifyMode(VerifyMode mode)
+	{
+		verifyMode = mode;
+		sprt.Reset();
+	}
+
+	void		SetScoreMode(ScoreMode mode)
+	{
+		scoreMode = mode;
+	}
+
+	/**
+	 * \brief Zeroes the SPRT statistics, which are summed over the scorings until the next reset
+	 */
+	void		ResetStats(cl::CommandQueue& queue)
+	{
+		int zeroStats[3] = { 0, 0, 0 };
+		queue.enqueueWriteBuffer(statsBuffer, CL_TRUE, 0, 3 * sizeof(int), zeroStats);
+	}
+
+	/**
+	 * \brief Scores the hypotheses against the points, with the SPRT in SPRT_VERIFY mode
+	 * \param points the points, 16 bytes each
+	 * \param models the Model::BUFFERS hypothesis buffers
+	 * \param count number of points
+	 * \param hypotheses number of hypotheses
+	 * \param threshold inlier threshold of the model's residual
+	 */
+	void		Score(cl::CommandQueue& queue, cl::Buffer& points, cl::Buffer* models, int count, int hypotheses, float threshold)
+	{
+		if (verifyMode == SPRT_VERIFY)
+		{
+			sprtKernel.setArg(0, points);
+			for (int i = 0; i < Model::BUFFERS; i++)
+			{
+				sprtKernel.setArg(1 + i, models[i]);
+			}
+			sprtKernel.setArg(Model::BUFFERS + 1, scoreBuffer);
+			sprtKernel.setArg(Model::BUFFERS + 2, statsBuffer);
+			sprtKernel.setArg(Model::BUFFERS + 3, (cl_int)count);
+			sprtKernel.setArg(Model::BUFFERS + 4, (cl_uint)rand());
+			sprtKernel.setArg(Model::BUFFERS + 5, sprt.KernelParams());
+			sprtKernel.setArg(Model::BUFFERS + 6, threshold);
+			sprtKernel.setArg(Model::BUFFERS + 7, (cl_int)scoreMode);
+
+			queue.enqueueNDRangeKernel(sprtKernel, cl::NullRange, hypotheses, cl::NullRange);
+		}
+		else
+		{
+			fitKernel.setArg(0, points);
+			for (int i = 0; i < Model::BUFFERS; i++)
+			{
+				fitKernel.setArg(1 + i, models[i]);
+			}
+			fitKernel.setArg(Model::BUFFERS + 1, scoreBuffer);
+			fitKernel.setArg(Model::BUFFERS + 2, SCORE_SIZE * sizeof(float), nullptr);
+			fitKernel.setArg(Model::BUFFERS + 3, (cl_int)count);
+			fitKernel.setArg(Model::BUFFERS + 4, threshold);
+			fitKernel.setArg(Model::BUFFERS + 5, (cl_int)scoreMode);
+
+			// one work-group per hypothesis
+			queue.enqueueNDRangeKernel(fitKernel, cl::NullRange, hypotheses * SCORE_SIZE, SCORE_SIZE);
+		}
+	}
+
+	/**
+	 * \brief Selects the best scored hypothesis and copies it out of each hypothesis buffer
+	 * \param models the Model::BUFFERS hypothesis buffers
+	 * \param out a buffer of Model::WIDTH floats for each hypothesis buffer
+	 * \param hypotheses number of hypotheses
+	 * \param event gets the last copy when given
+	 */
+	void		Select(cl::CommandQueue& queue, cl::Buffer* models, cl::Buffer* out, int hypotheses, cl::Event* event)
+	{
+		cl_ulong zero = 0;
+		queue.enqueueWriteBuffer(bestBuffer, CL_TRUE, 0, sizeof(cl_ulong), &zero);
+
+		selectKernel.setArg(0, scoreBuffer);
+		selectKernel.setArg(1, bestBuffer);
+		selectKernel.setArg(2, SELECT_SIZE * sizeof(cl_ulong), nullptr);
+		selectKernel.setArg(3, hypotheses);
+
+		queue.enqueueNDRangeKernel(selectKernel, cl::NullRange, selectGroups * SELECT_SIZE, SELECT_SIZE);
+
+		copyKernel.setArg(1, bestBuffer);
+		copyKernel.setArg(3, Model::WIDTH);
+		for (int i = 0; i < Model::BUFFERS; i++)
+		{
+			copyKernel.setArg(0, models[i]);
+			copyKernel.setArg(2, out[i]);
+
+			queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, Model::WIDTH, cl::NullRange, nullptr,
+									   i == Model::BUFFERS - 1 ? event : nullptr);
+		}
+	}
+
+	/**
+	 * \brief Reads the SPRT statistics without blocking, they are
+	 *		  valid after the next blocking command of the queue
+	 */
+	void		ReadStats(cl::CommandQueue& queue)
+	{
+		queue.enqueueReadBuffer(statsBuffer, CL_FALSE, 0, 3 * sizeof(int), stats);
+	}
+
+	/**
+	 * \brief Estimates the SPRT parameters for the next frame from the read statistics
+	 * \param bestInliers score of the best hypothesis, the inlier count for RANSAC
+	 *		  scoring and a lower estimate otherwise
+	 * \param pointCount number of points the hypotheses were scored against
+	 */
+	void		UpdateSprt(int bestInliers, int pointCount)
+	{
+		sprt.Update(bestInliers, pointCount, stats[0], stats[1], stats[2]);
+	}
+
+	// score of each hypothesis of the last scoring
+	cl::Buffer&	Scores()
+	{
+		return scoreBuffer;
+	}
+
+	// packed score and index of the last selected hypothesis
+	cl::Buffer&	Best()
+	{
+		return bestBuffer;
+	}
+
+private:
+	VerifyMode verifyMode = FULL_VERIFY;
+	ScoreMode scoreMode = RANSAC_SCORE;
+	SPRT sprt;
+	int stats[3] = { 0, 0, 0 };	// rejected hypotheses, points tested and inliers found by them
+	int selectGroups = 1;
+
+	cl::Kernel fitKernel;
+	cl::Kernel sprtKernel;
+	cl::Kernel selectKernel;
+	cl::Kernel copyKernel;
+
+	cl::Buffer scoreBuffer;
+	cl::Buffer statsBuffer;
+	cl::Buffer bestBuffer;	// packed score and index of the best hypothesis
+};
+
+// planes of plane_detect.cl as a point and a normal buffer, used by
+// the cylinder and primitive programs
+struct PlaneModel
+{
+	static constexpr const char* NAME = "Plane";
+	static const int BUFFERS = 2;
+	static const int WIDTH = FLOAT3_WIDTH;
+};
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include "SPRT.h"
+
+#include <algorithm>
+#include <cmath>
+
+SPRT::SPRT()
+{
+	Reset();
+}
+
+void SPRT::Reset()
+{
+	epsilon = 0.05f;
+	delta = 0.01f;
+	UpdateThreshold();
+}
+
+void SPRT::Update(int bestInliers, int pointCount, int rejected, int rejectedTested, int rejectedInliers)
+{
+	if (pointCount == 0)
+		return;
+
+	// every hypothesis was rejected, the estimates are off
+	if (bestInliers == 0 && rejected > 0)
+	{
+		Reset();
+		return;
+	}
+
+	// delta is the average inlier ratio of the bad models seen so far
+	if (rejectedTested > 0)
+	{
+		float estimate = (float)rejectedInliers / rejectedTested;
+		delta = 0.5f * delta + 0.5f * estimate;
+	}
+	delta = std::min(std::max(delta, 0.0001f), 0.5f);
+
+	// epsilon is the inlier ratio of the best model, slightly lowered
+	// since the target's inlier ratio fluctuates from frame to frame
+	epsilon = 0.8f * bestInliers / pointCount;
+	epsilon = std::min(std::max(epsilon, 1.5f * delta), 0.95f);
+
+	UpdateThreshold();
+}
+
+cl_float4 SPRT::KernelParams() const
+{
+	return {
+		logf(delta / epsilon),
+		logf((1 - delta) / (1 - epsilon)),
+		logf(A),
+		0
+	};
+}
+
+void SPRT::UpdateThreshold()
+{
+	// A* = t_M * C / m_S + 1 + ln(A*), solved by fixed point iteration
+	float C = (1 - delta) * logf((1 - delta) / (1 - epsilon)) + delta * logf(delta / epsilon);
+	float K = MODEL_TIME * C / MODELS_PER_SAMPLE + 1;
+
+	A = K;
+	for (int i = 0; i < 10; i++)
+	{
+		A = K + logf(A);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <CL/cl.h>
+
+// Wald's sequential probability ratio test for randomized hypothesis verification
+// (Matas & Chum: Randomized RANSAC with Sequential Probability Ratio Test).
+// The test parameters are estimated online, each frame is verified with the
+// estimates of the previous one.
+class SPRT
+{
+public:
+	SPRT();
+
+	/**
+	 * \brief Restores the initial (pessimistic) test parameters
+	 */
+	void		Reset();
+
+	/**
+	 * \brief Updates test parameters from the statistics of a verification pass
+	 * \param bestInliers inlier count of the best hypothesis
+	 * \param pointCount number of points the hypotheses were verified against
+	 * \param rejected number of rejected hypotheses
+	 * \param rejectedTested number of points evaluated by rejected hypotheses
+	 * \param rejectedInliers number of inliers found by rejected hypotheses
+	 */
+	void		Update(int bestInliers, int pointCount, int rejected, int rejectedTested, int rejectedInliers);
+
+	/**
+	 * \brief Gets the parameters passed to the verification kernels
+	 * \return log(delta / epsilon), log((1 - delta) / (1 - epsilon)), log(A), 0
+	 */
+	cl_float4	KernelParams() const;
+
+private:
+	void		UpdateThreshold();
+
+	// time of computing a model, measured in single point verifications
+	const float MODEL_TIME = 200.f;
+	// average number of models computed from one sample
+	const float MODELS_PER_SAMPLE = 1.f;
+
+	float epsilon;	// probability of a point being consistent with a good model
+	float delta;	// probability of a point being consistent with a bad model
+	float A;		// decision threshold
+};
\ No newline at end of file
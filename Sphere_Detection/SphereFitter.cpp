@@ -1,13 +1,18 @@
 #include "SphereFitter.h"
 
-inline unsigned round_up_div(unsigned a, unsigned b) {
-	return static_cast<int>(ceil((double)a / b));
-}
-
 SphereFitter::SphereFitter() = default;
 
 void SphereFitter::Init(cl::Context& context, const cl::vector<cl::Device>& devices)
 {
+	std::ifstream ransacFile("ransac.cl");
+	if (!ransacFile.is_open())
+	{
+		std::cerr << "SphereFitter::Init(): ransac.cl could not be opened" << std::endl;
+		exit(1);
+	}
+	std::string ransacCode(std::istreambuf_iterator<char>(ransacFile), (std::istreambuf_iterator<char>()));
+	ransacFile.close();
+
 	std::ifstream sphereFile("sphere_detect.cl");
 	if (!sphereFile.is_open())
 	{
@@ -17,6 +22,8 @@ void SphereFitter::Init(cl::Context& context, const cl::vector<cl::Device>& devi
 	std::string sphereCode(std::istreambuf_iterator<char>(sphereFile), (std::istreambuf_iterator<char>()));
 	sphereFile.close();
 
+	// the shared kernels come first, the sphere program instances their template
+	sphereCode = ransacCode + "\n" + sphereCode;
 	cl::Program::Sources sphereSource(1, std::make_pair(sphereCode.c_str(), sphereCode.length() + 1));
 	program = cl::Program(context, sphereSource);
 
@@ -31,94 +38,467 @@ void SphereFitter::Init(cl::Context& context, const cl::vector<cl::Device>& devi
 	}
 
 	calcKernel	 = cl::Kernel(program, "calcSphere");
-	fitKernel	 = cl::Kernel(program, "fitSphere");
-	reduceKernel = cl::Kernel(program, "reduce");
+	checkKernel  = cl::Kernel(program, "checkSphere");
+	copyKernel   = cl::Kernel(program, "copyBest");
+	accumKernel  = cl::Kernel(program, "accumSphere");
+	solveKernel  = cl::Kernel(program, "solveSphere");
+	accumGNKernel = cl::Kernel(program, "accumSphereGN");
+	solveGNKernel = cl::Kernel(program, "solveSphereGN");
+	measureKernel = cl::Kernel(program, "measureSphere");
+	removeKernel = cl::Kernel(program, "removeSphere");
 	fillKernel   = cl::Kernel(program, "fillSphere");
+	sortKernel   = cl::Kernel(program, "sortQuality");
+	calcNormalsKernel = cl::Kernel(program, "calcSphereNormals");
+	batchSampleKernel = cl::Kernel(program, "sampleBatch");
+	batchFitKernel = cl::Kernel(program, "fitSphereBatch");
+	batchSelectKernel = cl::Kernel(program, "selectBestBatch");
+	batchMeasureKernel = cl::Kernel(program, "measureSphereBatch");
 
-	indexBuffer  = cl::Buffer(context, CL_MEM_WRITE_ONLY, ITER_NUM * FIT_NUM * sizeof(int));
-	sphereBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, ITER_NUM * sizeof(cl_float4));
-	inlierBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * sizeof(int));
+	indexBuffer  = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * FIT_NUM * sizeof(int));
+	sphereBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, ITER_NUM * sizeof(cl_float4));
+	modelBuffer  = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4));
+	selectGroups = SelectGroupCount(devices[0], SELECT_GROUPS);
+	ransac.Init(context, program, devices[0], ITER_NUM);
+	topK.Init(context, program, ITER_NUM);
+	hough.Init(context, program, selectGroups);
+	batchPool.Init(context, devices[0]);
+	sampler.Init(context, program, CAND_SIZE);
 	// allocate some memory for unknown number of candidates
-	candidateBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, CAND_SIZE * sizeof(cl_float4));
+	candidateBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CAND_SIZE * sizeof(cl_float4));
+	normalBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CAND_SIZE * sizeof(cl_float4));
+	// candidates left after removing the inliers of the found spheres
+	remainingBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, CAND_SIZE * sizeof(cl_float4));
+	resultBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, MAX_SPHERES * sizeof(cl_float4));
+	countBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, (1 + MAX_SPHERES) * sizeof(int));
+	partialBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, REFINE_GROUPS * std::max(LO_SUMS, GN_SUMS) * sizeof(float));
+	gnStateBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, GN_STATE * sizeof(float));
+	covarianceBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, 16 * sizeof(float));
+	measureBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, 2 * sizeof(float));
+}
+
+void SphereFitter::SetVerifyMode(VerifyMode mode)
+{
+	verifyMode = mode;
+	ransac.SetVerifyMode(mode);
+}
+
+void SphereFitter::SetScoreMode(ScoreMode mode)
+{
+	scoreMode = mode;
+	ransac.SetScoreMode(mode);
+}
+
+void SphereFitter::SetTopK(int count)
+{
+	topCount = std::max(count, 0);
+	topHypotheses.clear();
+}
+
+const std::vector<Hypothesis>& SphereFitter::GetTopHypotheses() const
+{
+	return topHypotheses;
+}
+
+void SphereFitter::SetThreshold(float value)
+{
+	threshold = value;
+}
+
+void SphereFitter::SetTracking(bool enabled)
+{
+	tracking = enabled;
+	tracker.Reset();
+	trackScore = 0;
+}
+
+void SphereFitter::SetMaxSpheres(int count)
+{
+	maxSpheres = std::min(std::max(count, 1), MAX_SPHERES);
+}
+
+const std::vector<FittedSphere>& SphereFitter::GetSpheres() const
+{
+	return spheres;
+}
+
+void SphereFitter::SetLocalOptimization(bool enabled)
+{
+	localOptimization = enabled;
+}
+
+void SphereFitter::SetGeometricRefinement(bool enabled)
+{
+	geometricRefinement = enabled;
+}
+
+void SphereFitter::SetSampleMode(SampleMode mode)
+{
+	sampleMode = mode;
+}
+
+void SphereFitter::SetPriors(const Priors& value)
+{
+	priors = value;
+}
+
+void SphereFitter::SetKnownRadius(float radius)
+{
+	knownRadius = radius;
+}
+
+void SphereFitter::SetNormalEstimation(bool enabled)
+{
+	normalEstimation = enabled;
+}
+
+void SphereFitter::SetSampleRadius(float radius)
+{
+	sampleRadius = radius;
 }
 
-void SphereFitter::EvalCandidate(const glm::vec4& point, const int idx)
+const glm::mat4& SphereFitter::GetCovariance() const
+{
+	return covariance;
+}
+
+void SphereFitter::EvalCandidate(const glm::vec4& point, const int idx, const float quality)
 {
 	float dist = glm::distance(glm::vec2(0, 0), glm::vec2(point.x, point.z));
 	if (candidates.size() < CAND_SIZE && dist < 3.2 && dist > 1.8 && point.z < 0)
 	{
 		// constructing cl_float4 from glm::vec4 just to make sure
-		candidates.push_back({point.x, point.y, point.z, point.w});
+		candidates.push_back({point.x, point.y, point.z, quality});
+	}
+
+	// points close to the surface of the predicted sphere
+	if (tracking && tracker.IsTracking() && roiCandidates.size() < CAND_SIZE &&
+		fabs(glm::distance(glm::vec3(point), glm::vec3(prediction)) - prediction.w) < ROI_MARGIN)
+	{
+		roiCandidates.push_back({point.x, point.y, point.z, quality});
 	}
 }
 
-glm::vec4 SphereFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
+void SphereFitter::UpdateBounds(const std::vector<cl_float4>& points)
 {
-	if (candidates.empty())
+	low = high = glm::vec3(points[0].s[0], points[0].s[1], points[0].s[2]);
+	for (const cl_float4& point : points)
 	{
-		std::cout << "SphereFitter::Fit(): no candidates, skipping sphere fit\n";
-		return { 0,0,0,0 };
-	}
-
-	std::vector<int> indices;
-	for (int i = 0; i < ITER_NUM; i++)
-	{
-		// choosing 4 random indices from candidate vector
-		int a, b, c, d;
-		a = rand() % candidates.size();
-		do {
-			b = rand() % candidates.size();
-		} while (b == a);
-		do {
-			c = rand() % candidates.size();
-		} while (c == a || c == b);
-		do {
-			d = rand() % candidates.size();
-		} while (d == a || d == b || d == c);
-		indices.push_back(a);
-		indices.push_back(b);
-		indices.push_back(c);
-		indices.push_back(d);
+		glm::vec3 p(point.s[0], point.s[1], point.s[2]);
+		low = glm::min(low, p);
+		high = glm::max(high, p);
 	}
+}
 
-	try
+void SphereFitter::Search(cl::CommandQueue& queue, int count, int iterNum, const glm::vec4* seed, cl::Event* events)
+{
+	// 2 oriented points determine a sphere
+	int sampleSize = normalEstimation ? NORMAL_FIT_NUM : FIT_NUM;
+
+	if (sampleMode == PROSAC_SAMPLE)
 	{
-		// set inlier buffer to all zeroes
-		std::vector<int> zero(ITER_NUM, 0);
-		queue.enqueueWriteBuffer(inlierBuffer, CL_TRUE, 0, ITER_NUM * sizeof(int), zero.data());
+		// sort the candidates by quality on the device,
+		// the samples index the sorted candidates
+		sortKernel.setArg(0, candidateBuffer);
+		sortKernel.setArg(1, remainingBuffer);
+		sortKernel.setArg(2, count);
+
+		queue.enqueueNDRangeKernel(sortKernel, cl::NullRange, count, cl::NullRange);
+		std::swap(candidateBuffer, remainingBuffer);
+	}
+
+	if (sampleMode == LOCAL_SAMPLE || normalEstimation)
+	{
+		// the grid cells are as large as the expected sphere radius
+		float cellSize = std::max(seed ? seed->w : sampleRadius, NORMAL_RADIUS);
+		sampler.Build(queue, candidateBuffer, count, low, high, cellSize);
+	}
+
+	if (normalEstimation)
+	{
+		sampler.EstimateNormals(queue, candidateBuffer, normalBuffer, NORMAL_RADIUS);
+	}
+
+	// the Hough peak is final, a free radius refinement would defeat the known radius
+	if (knownRadius > 0)
+	{
+		hough.Detect(queue, candidateBuffer, normalEstimation ? &normalBuffer : nullptr, count, low, knownRadius, ransac.Best(), modelBuffer);
+		return;
+	}
+
+	if (sampleMode == LOCAL_SAMPLE)
+	{
+		// NAPSAC: the remaining points of a sample come from the cells around the first
+		sampler.Sample(queue, indexBuffer, iterNum, sampleSize);
+	}
+	else if (sampleMode == PROSAC_SAMPLE)
+	{
+		std::vector<int> indices = prosac.Sample(count, iterNum, sampleSize);
+		queue.enqueueWriteBuffer(indexBuffer, CL_TRUE, 0, iterNum * FIT_NUM * sizeof(int), indices.data());
+	}
+	else
+	{
+		std::vector<int> indices;
+		for (int i = 0; i < iterNum; i++)
+		{
+			// choosing 4 random indices from candidate vector
+			int a, b, c, d;
+			a = rand() % count;
+			do {
+				b = rand() % count;
+			} while (b == a);
+			do {
+				c = rand() % count;
+			} while (c == a || c == b);
+			do {
+				d = rand() % count;
+			} while (d == a || d == b || d == c);
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+			indices.push_back(d);
+		}
 
 		// write selected indices to GPU
-		queue.enqueueWriteBuffer(indexBuffer, CL_TRUE, 0, ITER_NUM * FIT_NUM * sizeof(int), indices.data());
+		queue.enqueueWriteBuffer(indexBuffer, CL_TRUE, 0, iterNum * FIT_NUM * sizeof(int), indices.data());
+	}
 
-		// write candidate points to GPU
-		queue.enqueueWriteBuffer(candidateBuffer, CL_TRUE, 0, candidates.size() * sizeof(cl_float4), candidates.data());
-		queue.finish();
+	// calculate spheres
+	if (normalEstimation)
+	{
+		calcNormalsKernel.setArg(0, candidateBuffer);
+		calcNormalsKernel.setArg(1, normalBuffer);
+		calcNormalsKernel.setArg(2, indexBuffer);
+		calcNormalsKernel.setArg(3, sphereBuffer);
 
-		// calculate spheres
+		queue.enqueueNDRangeKernel(calcNormalsKernel, cl::NullRange, iterNum, cl::NullRange);
+	}
+	else
+	{
 		calcKernel.setArg(0, candidateBuffer);
 		calcKernel.setArg(1, indexBuffer);
 		calcKernel.setArg(2, sphereBuffer);
 
-		queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, ITER_NUM, cl::NullRange);
+		queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, iterNum, cl::NullRange);
+	}
+
+	// reject implausible spheres before the expensive scoring
+	checkKernel.setArg(0, sphereBuffer);
+	checkKernel.setArg(1, cl_float2{ priors.minRadius, priors.maxRadius });
+	checkKernel.setArg(2, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+	checkKernel.setArg(3, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
+
+	queue.enqueueNDRangeKernel(checkKernel, cl::NullRange, iterNum, cl::NullRange, nullptr, events);
+
+	// the seed replaces the last hypothesis
+	if (seed)
+	{
+		cl_float4 seedSphere = { seed->x, seed->y, seed->z, seed->w };
+		queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, (iterNum - 1) * sizeof(cl_float4), sizeof(cl_float4), &seedSphere);
+	}
+
+	// score spheres, then select the sphere with highest score and copy it for the refinement
+	ransac.Score(queue, candidateBuffer, &sphereBuffer, count, iterNum, threshold);
+	ransac.Select(queue, &sphereBuffer, &modelBuffer, iterNum, events ? &events[1] : nullptr);
+	if (events)
+	{
+		// no refinement takes no time
+		events[2] = events[1];
+	}
+
+	// LO-RANSAC: re-estimate the best sphere by least squares over its inliers,
+	// the inlier threshold shrinks to its final value over the iterations
+	if (localOptimization)
+	{
+		accumKernel.setArg(0, candidateBuffer);
+		accumKernel.setArg(1, modelBuffer);
+		accumKernel.setArg(2, partialBuffer);
+		accumKernel.setArg(3, REFINE_SIZE * LO_SUMS * sizeof(float), nullptr);
+		accumKernel.setArg(4, (cl_int)count);
+		accumKernel.setArg(5, threshold);
+
+		solveKernel.setArg(0, partialBuffer);
+		solveKernel.setArg(1, modelBuffer);
+		solveKernel.setArg(2, REFINE_GROUPS);
+
+		for (int i = 0; i < LO_ITER; i++)
+		{
+			accumKernel.setArg(6, 1 + 0.5f * (LO_ITER - 1 - i));
+			queue.enqueueNDRangeKernel(accumKernel, cl::NullRange, REFINE_GROUPS * REFINE_SIZE, REFINE_SIZE);
+			queue.enqueueNDRangeKernel(solveKernel, cl::NullRange, 1, cl::NullRange, nullptr, events ? &events[2] : nullptr);
+		}
+	}
 
-		// evaluate sphere inlier ratio
-		fitKernel.setArg(0, candidateBuffer);
-		fitKernel.setArg(1, sphereBuffer);
-		fitKernel.setArg(2, inlierBuffer);
+	// Gauss-Newton / Levenberg-Marquardt refinement of the radial distance,
+	// the last pass only evaluates the final step
+	if (geometricRefinement)
+	{
+		accumGNKernel.setArg(0, candidateBuffer);
+		accumGNKernel.setArg(1, modelBuffer);
+		accumGNKernel.setArg(2, partialBuffer);
+		accumGNKernel.setArg(3, REFINE_SIZE * GN_SUMS * sizeof(float), nullptr);
+		accumGNKernel.setArg(4, (cl_int)count);
+		accumGNKernel.setArg(5, threshold);
 
-		queue.enqueueNDRangeKernel(fitKernel, cl::NullRange, cl::NDRange(ITER_NUM, candidates.size()), cl::NullRange);
+		solveGNKernel.setArg(0, partialBuffer);
+		solveGNKernel.setArg(1, modelBuffer);
+		solveGNKernel.setArg(2, gnStateBuffer);
+		solveGNKernel.setArg(3, covarianceBuffer);
+		solveGNKernel.setArg(4, REFINE_GROUPS);
 
-		// reduction to get sphere with highest inlier ratio
-		const unsigned GROUP_SIZE = 64;
-		reduceKernel.setArg(0, inlierBuffer);
-		reduceKernel.setArg(1, sphereBuffer);
-		reduceKernel.setArg(2, GROUP_SIZE * sizeof(int), nullptr);
-		reduceKernel.setArg(3, GROUP_SIZE * sizeof(int), nullptr);
+		for (int i = 0; i <= GN_ITER; i++)
+		{
+			solveGNKernel.setArg(5, i);
+			solveGNKernel.setArg(6, (cl_int)(i == GN_ITER));
+			queue.enqueueNDRangeKernel(accumGNKernel, cl::NullRange, REFINE_GROUPS * REFINE_SIZE, REFINE_SIZE);
+			queue.enqueueNDRangeKernel(solveGNKernel, cl::NullRange, 1, cl::NullRange, nullptr, events ? &events[2] : nullptr);
+		}
+	}
+}
+
+FitResult SphereFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
+{
+	auto start = std::chrono::steady_clock::now();
+	FitResult result;
 
-		for (unsigned rem_size = ITER_NUM; rem_size > 1; rem_size = round_up_div(rem_size, GROUP_SIZE))
+	// while tracking only the points around the predicted sphere are searched
+	bool tracked = tracking && maxSpheres == 1 && tracker.IsTracking() && roiCandidates.size() >= MIN_ROI_SIZE;
+	const std::vector<cl_float4>* points = tracked ? &roiCandidates : &candidates;
+
+	spheres.clear();
+	covariance = glm::mat4(0.0f);
+	if (points->size() < FIT_NUM)
+	{
+		std::cout << "SphereFitter::Fit(): no candidates, skipping sphere fit\n";
+		tracker.Reset();
+		candidates.clear();
+		roiCandidates.clear();
+		return result;
+	}
+
+	try
+	{
+		// write candidate points to GPU, the stage times are measured from the upload
+		cl::Event events[4];
+		int count = points->size();
+		queue.enqueueWriteBuffer(candidateBuffer, CL_TRUE, 0, count * sizeof(cl_float4), points->data(), nullptr, &events[0]);
+		UpdateBounds(*points);
+
+		std::vector<int> counts(1 + maxSpheres, 0);
+		queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+
+		// no covariance is left over from the last frame if the refinement does not run
+		queue.enqueueWriteBuffer(covarianceBuffer, CL_TRUE, 0, 16 * sizeof(float), glm::value_ptr(covariance));
+
+		if (verifyMode == SPRT_VERIFY)
 		{
-			int t1 = round_up_div(rem_size, GROUP_SIZE) * GROUP_SIZE;
-			queue.enqueueNDRangeKernel(reduceKernel, cl::NullRange, t1, GROUP_SIZE);
+			// statistics of all searches in the frame
+			ransac.ResetStats(queue);
+		}
+
+		int globalIterNum = normalEstimation ? NORMAL_ITER_NUM : (sampleMode == UNIFORM_SAMPLE ? ITER_NUM : GUIDED_ITER_NUM);
+
+		cl_ulong best;
+		float score;
+		int iterNum = 0;
+		if (tracked)
+		{
+			iterNum = TRACK_ITER_NUM;
+			Search(queue, count, iterNum, &prediction, &events[1]);
+			queue.enqueueReadBuffer(ransac.Best(), CL_TRUE, 0, sizeof(cl_ulong), &best);
+			score = UnpackScore(best);
+
+			// the sphere left the ROI or got occluded, search the whole frame
+			if (score < MIN_TRACK_SCORE || score < MIN_TRACK_RATIO * trackScore)
+			{
+				std::cout << "SphereFitter::Fit(): track lost, searching globally\n";
+				tracker.Reset();
+				tracked = false;
+				points = &candidates;
+				count = points->size();
+				if (count < FIT_NUM)
+				{
+					std::cout << "SphereFitter::Fit(): no candidates, skipping sphere fit\n";
+					candidates.clear();
+					roiCandidates.clear();
+					return result;
+				}
+				queue.enqueueWriteBuffer(candidateBuffer, CL_TRUE, 0, count * sizeof(cl_float4), points->data(), nullptr, &events[0]);
+				UpdateBounds(*points);
+			}
+		}
+		if (!tracked)
+		{
+			iterNum = globalIterNum;
+			Search(queue, count, iterNum, nullptr, &events[1]);
+			queue.enqueueReadBuffer(ransac.Best(), CL_FALSE, 0, sizeof(cl_ulong), &best);
+		}
+		int pointCount = count;
+
+		// the hypotheses are left intact by the selection and the refinement
+		topHypotheses.clear();
+		if (topCount > 0 && iterNum > 0 && knownRadius == 0)
+		{
+			topHypotheses = topK.Select(queue, ransac.Scores(), sphereBuffer, 4, iterNum, topCount);
+		}
+
+		// support of the best sphere, read back with the results
+		measureKernel.setArg(0, candidateBuffer);
+		measureKernel.setArg(1, modelBuffer);
+		measureKernel.setArg(2, measureBuffer);
+		measureKernel.setArg(3, 2 * MEASURE_SIZE * sizeof(float), nullptr);
+		measureKernel.setArg(4, count);
+		measureKernel.setArg(5, threshold);
+
+		queue.enqueueNDRangeKernel(measureKernel, cl::NullRange, MEASURE_SIZE, MEASURE_SIZE);
+
+		// further spheres are searched among the points left
+		// after removing the inliers of the previous ones on the device
+		removeKernel.setArg(3, resultBuffer);
+		removeKernel.setArg(4, countBuffer);
+		removeKernel.setArg(7, threshold);
+
+		int found = 0;
+		while (true)
+		{
+			removeKernel.setArg(0, candidateBuffer);
+			removeKernel.setArg(1, modelBuffer);
+			removeKernel.setArg(2, remainingBuffer);
+			removeKernel.setArg(5, count);
+			removeKernel.setArg(6, found);
+
+			queue.enqueueNDRangeKernel(removeKernel, cl::NullRange, count, cl::NullRange);
+			found++;
+
+			if (maxSpheres == 1)
+			{
+				break;
+			}
+
+			// the support of every sphere is checked, the last requested one included
+			queue.enqueueReadBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+			if (counts[found] < MIN_SPHERE_INLIERS)
+			{
+				// the last sphere is not supported by enough points, but the first one is kept
+				found = std::max(found - 1, 1);
+				break;
+			}
+
+			if (found == maxSpheres)
+			{
+				break;
+			}
+
+			count = counts[0];
+			if (count < FIT_NUM)
+			{
+				break;
+			}
+
+			int zero = 0;
+			queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(int), &zero);
+			// the points left stay within the bounds of the sampling grid
+			std::swap(candidateBuffer, remainingBuffer);
+			Search(queue, count, globalIterNum, nullptr, nullptr);
 		}
 
 		// acquire GL position buffer
@@ -126,22 +506,209 @@ glm::vec4 SphereFitter::Fit(cl::CommandQueue& queue, cl::BufferGL& posBuffer)
 		acq.push_back(posBuffer);
 		queue.enqueueAcquireGLObjects(&acq);
 
-		// color points which are on the best sphere
+		// color points which are on the found spheres
 		fillKernel.setArg(0, posBuffer);
-		fillKernel.setArg(1, sphereBuffer);
+		fillKernel.setArg(1, resultBuffer);
+		fillKernel.setArg(2, threshold);
+		fillKernel.setArg(3, found);
 
 		queue.enqueueNDRangeKernel(fillKernel, cl::NullRange, POINT_CLOUD_SIZE, cl::NullRange);
 
 		queue.enqueueReleaseGLObjects(&acq);
+
+		if (verifyMode == SPRT_VERIFY)
+		{
+			ransac.ReadStats(queue);
+		}
 		candidates.clear();
+		roiCandidates.clear();
 		
-		cl_float4 result;
-		queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &result);
-		return { result.s[0], result.s[1], result.s[2], result.s[3] };
+		if (geometricRefinement)
+		{
+			queue.enqueueReadBuffer(covarianceBuffer, CL_FALSE, 0, 16 * sizeof(float), glm::value_ptr(covariance));
+		}
+
+		float measure[2];
+		queue.enqueueReadBuffer(measureBuffer, CL_FALSE, 0, 2 * sizeof(float), measure);
+
+		std::vector<cl_float4> results(found);
+		queue.enqueueReadBuffer(countBuffer, CL_FALSE, 0, counts.size() * sizeof(int), counts.data());
+		queue.enqueueReadBuffer(resultBuffer, CL_TRUE, 0, found * sizeof(cl_float4), results.data());
+		for (int i = 0; i < found; i++)
+		{
+			spheres.push_back({ { results[i].s[0], results[i].s[1], results[i].s[2], results[i].s[3] }, counts[1 + i] });
+		}
+		glm::vec4 sphere = spheres[0].sphere;
+		score = UnpackScore(best);
+
+		if (verifyMode == SPRT_VERIFY && knownRadius == 0)
+		{
+			// estimate test parameters for the next frame, the best score is
+			// the inlier count for RANSAC scoring and a lower estimate otherwise
+			ransac.UpdateSprt((int)score, pointCount);
+		}
+
+		// prediction for the candidate selection of the next frame; the Hough score
+		// is a vote count, its peak is only tracked if there was any vote at all
+		bool trackable = knownRadius > 0 ? score > 0 : score >= MIN_TRACK_SCORE;
+		if (tracking && trackable)
+		{
+			tracker.Update(sphere);
+			prediction = tracker.Predict();
+			trackScore = score;
+		}
+
+		result.model = sphere;
+		result.inliers = (int)measure[0];
+		result.rms = measure[0] > 0 ? sqrtf(measure[1] / measure[0]) : 0;
+		if (knownRadius == 0)
+		{
+			result.hypotheses = iterNum;
+			if (IsProfiling(queue))
+			{
+				result.generateTime = ElapsedTime(events[0], events[1]);
+				result.scoreTime = ElapsedTime(events[1], events[2]);
+				result.refineTime = ElapsedTime(events[2], events[3]);
+			}
+		}
+		result.totalTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return result;
 	}
 	catch (cl::Error& error)
 	{
 		std::cerr << "SphereFitter::Fit(): " << error.what() << std::endl;
 		throw error;
 	}
+}
+
+std::vector<FitResult> SphereFitter::FitBatch(cl::CommandQueue& queue, const std::vector<std::vector<cl_float4>>& frames)
+{
+	auto start = std::chrono::steady_clock::now();
+	int frameCount = frames.size();
+	std::vector<FitResult> results(frameCount);
+
+	// one segmented buffer of all candidates, frames too small to fit are left empty
+	std::vector<cl_int2> segments;
+	std::vector<cl_float4> points;
+	for (const std::vector<cl_float4>& frame : frames)
+	{
+		int count = frame.size() >= FIT_NUM ? frame.size() : 0;
+		segments.push_back({ (int)points.size(), count });
+		points.insert(points.end(), frame.begin(), frame.begin() + count);
+	}
+	if (points.empty())
+	{
+		return results;
+	}
+
+	try
+	{
+		int hypotheses = frameCount * BATCH_ITER_NUM;
+
+		// the batch sizes vary, the buffers are carved from the fitter's arena
+		const std::vector<cl::Buffer>& batchBuffers = batchPool.Allocate({
+			points.size() * sizeof(cl_float4),
+			frameCount * sizeof(cl_int2),
+			hypotheses * FIT_NUM * sizeof(int),
+			hypotheses * sizeof(cl_float4),
+			hypotheses * sizeof(float),
+			frameCount * sizeof(cl_ulong),
+			frameCount * sizeof(cl_float4),
+			2 * frameCount * sizeof(float)
+		});
+		cl::Buffer pointBuffer = batchBuffers[0];
+		cl::Buffer segmentBuffer = batchBuffers[1];
+		cl::Buffer idxBuffer = batchBuffers[2];
+		cl::Buffer spheresBuffer = batchBuffers[3];
+		cl::Buffer scoresBuffer = batchBuffers[4];
+		cl::Buffer frameBestBuffer = batchBuffers[5];
+		cl::Buffer frameModelBuffer = batchBuffers[6];
+		cl::Buffer statsBuffer = batchBuffers[7];
+
+		// the host data outlives the final blocking read, nothing waits before it
+		queue.enqueueWriteBuffer(pointBuffer, CL_FALSE, 0, points.size() * sizeof(cl_float4), points.data());
+		queue.enqueueWriteBuffer(segmentBuffer, CL_FALSE, 0, frameCount * sizeof(cl_int2), segments.data());
+
+		batchSampleKernel.setArg(0, segmentBuffer);
+		batchSampleKernel.setArg(1, idxBuffer);
+		batchSampleKernel.setArg(2, (cl_uint)rand());
+
+		queue.enqueueNDRangeKernel(batchSampleKernel, cl::NullRange, cl::NDRange(BATCH_ITER_NUM, frameCount), cl::NullRange);
+
+		// generation and the priors do not depend on the frame
+		calcKernel.setArg(0, pointBuffer);
+		calcKernel.setArg(1, idxBuffer);
+		calcKernel.setArg(2, spheresBuffer);
+
+		queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, hypotheses, cl::NullRange);
+
+		checkKernel.setArg(0, spheresBuffer);
+		checkKernel.setArg(1, cl_float2{ priors.minRadius, priors.maxRadius });
+		checkKernel.setArg(2, cl_float4{ priors.low.x, priors.low.y, priors.low.z, 0 });
+		checkKernel.setArg(3, cl_float4{ priors.high.x, priors.high.y, priors.high.z, 0 });
+
+		queue.enqueueNDRangeKernel(checkKernel, cl::NullRange, hypotheses, cl::NullRange);
+
+		batchFitKernel.setArg(0, pointBuffer);
+		batchFitKernel.setArg(1, segmentBuffer);
+		batchFitKernel.setArg(2, spheresBuffer);
+		batchFitKernel.setArg(3, scoresBuffer);
+		batchFitKernel.setArg(4, SCORE_SIZE * sizeof(float), nullptr);
+		batchFitKernel.setArg(5, threshold);
+		batchFitKernel.setArg(6, (cl_int)scoreMode);
+
+		queue.enqueueNDRangeKernel(batchFitKernel, cl::NullRange, cl::NDRange(BATCH_ITER_NUM * SCORE_SIZE, frameCount), cl::NDRange(SCORE_SIZE, 1));
+
+		batchSelectKernel.setArg(0, scoresBuffer);
+		batchSelectKernel.setArg(1, frameBestBuffer);
+		batchSelectKernel.setArg(2, SELECT_SIZE * sizeof(cl_ulong), nullptr);
+		batchSelectKernel.setArg(3, BATCH_ITER_NUM);
+
+		queue.enqueueNDRangeKernel(batchSelectKernel, cl::NullRange, cl::NDRange(SELECT_SIZE, frameCount), cl::NDRange(SELECT_SIZE, 1));
+
+		// the packed indices address the whole hypothesis buffer
+		copyKernel.setArg(0, spheresBuffer);
+		copyKernel.setArg(1, frameBestBuffer);
+		copyKernel.setArg(2, frameModelBuffer);
+		copyKernel.setArg(3, 4);
+
+		queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, frameCount * 4, cl::NullRange);
+
+		batchMeasureKernel.setArg(0, pointBuffer);
+		batchMeasureKernel.setArg(1, segmentBuffer);
+		batchMeasureKernel.setArg(2, frameModelBuffer);
+		batchMeasureKernel.setArg(3, statsBuffer);
+		batchMeasureKernel.setArg(4, 2 * MEASURE_SIZE * sizeof(float), nullptr);
+		batchMeasureKernel.setArg(5, threshold);
+
+		queue.enqueueNDRangeKernel(batchMeasureKernel, cl::NullRange, cl::NDRange(MEASURE_SIZE, frameCount), cl::NDRange(MEASURE_SIZE, 1));
+
+		std::vector<cl_float4> models(frameCount);
+		std::vector<float> stats(2 * frameCount);
+		queue.enqueueReadBuffer(frameModelBuffer, CL_FALSE, 0, frameCount * sizeof(cl_float4), models.data());
+		queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * frameCount * sizeof(float), stats.data());
+
+		// the wall time of the batch is shared by its frames
+		float frameTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / frameCount;
+		for (int i = 0; i < frameCount; i++)
+		{
+			FitResult& result = results[i];
+			result.totalTime = frameTime;
+			if (segments[i].s[1] == 0)
+			{
+				continue;
+			}
+
+			result.model = { models[i].s[0], models[i].s[1], models[i].s[2], models[i].s[3] };
+			result.inliers = (int)stats[2 * i];
+			result.rms = stats[2 * i] > 0 ? sqrtf(stats[2 * i + 1] / stats[2 * i]) : 0;
+			result.hypotheses = BATCH_ITER_NUM;
+		}
+		return results;
+	}
+	catch (cl::Error& error)
+	{
+		std::cerr << "SphereFitter::FitBatch(): " << error.what() << std::endl;
+		throw error;
+	}
 }
\ No newline at end of file
@@ -1,6 +1,27 @@
 #pragma once
 
 #include "IFitter.h"
+#include "Tracker.h"
+#include "TopK.h"
+#include "GridSampler.h"
+#include "Prosac.h"
+#include "SphereHough.h"
+#include "BufferPool.h"
+#include "RansacEngine.h"
+
+// spheres (center, radius) of the generic RANSAC kernels
+struct SphereModel
+{
+	static constexpr const char* NAME = "Sphere";
+	static const int BUFFERS = 1;
+	static const int WIDTH = 4;
+};
+
+struct FittedSphere
+{
+	glm::vec4 sphere;	// center, radius
+	int inliers;
+};
 
 class SphereFitter : public IFitter
 {
@@ -8,24 +29,160 @@ public:
 	SphereFitter();
 
 	void Init(cl::Context&, const cl::vector<cl::Device>&) override;
-	glm::vec4 Fit(cl::CommandQueue&, cl::BufferGL&) override;
-	void EvalCandidate(const glm::vec4&, const int) override;
+	FitResult Fit(cl::CommandQueue&, cl::BufferGL&) override;
+	void EvalCandidate(const glm::vec4&, const int, const float) override;
+	void SetVerifyMode(VerifyMode) override;
+	void SetScoreMode(ScoreMode) override;
+	void SetSampleMode(SampleMode) override;
+	void SetPriors(const Priors&) override;
+	void SetTopK(int) override;
+	const std::vector<Hypothesis>& GetTopHypotheses() const override;
+
+	// inlier threshold of the radial distance
+	void SetThreshold(float);
+
+	void SetLocalOptimization(bool);
+	void SetGeometricRefinement(bool);
+
+	// radius of the target spheres, which are then detected by Hough voting
+	// instead of RANSAC; 0 for spheres of any radius
+	void SetKnownRadius(float);
+
+	// estimate point normals and generate hypotheses from 2 oriented points
+	void SetNormalEstimation(bool);
+
+	// expected sphere radius for the cells of the local sampling grid,
+	// the tracked radius is used while tracking
+	void SetSampleRadius(float);
+
+	// seed each frame from the sphere predicted by the previous ones
+	void SetTracking(bool);
+
+	// number of spheres searched for in a frame, at most MAX_SPHERES
+	void SetMaxSpheres(int);
+
+	// spheres found in the last frame, the best one first
+	const std::vector<FittedSphere>& GetSpheres() const;
+
+	// covariance of (center, radius) of the last geometric refinement, zero without
+	// a refinement in the last frame and NaN if the refined sphere had too few inliers
+	const glm::mat4& GetCovariance() const;
+
+	// fits a sphere to the candidates of each of many recorded frames with the
+	// same launches, for offline throughput; samples are uniform and verified
+	// fully, there is no refinement, tracking or multi-sphere search
+	std::vector<FitResult> FitBatch(cl::CommandQueue&, const std::vector<std::vector<cl_float4>>&);
 
 private:
+	// generates, scores and refines hypotheses from the first count points
+	// of the candidate buffer, seed is scored along with them when given;
+	// the last commands of the 3 stages are recorded in events when given
+	void Search(cl::CommandQueue&, int, int, const glm::vec4*, cl::Event*);
+
+	// bounding box of the points for the sampling grid
+	void UpdateBounds(const std::vector<cl_float4>&);
+
 	const int ITER_NUM = 4096;
+	const int GUIDED_ITER_NUM = 1024; // local and PROSAC samples are far more often all inliers
+	const int NORMAL_ITER_NUM = 256;  // 2-point samples are all inliers with the square of the inlier ratio
+	const int NORMAL_FIT_NUM = 2;
+	const float NORMAL_RADIUS = 0.15f; // neighbourhood of the normal estimation
 	const int FIT_NUM = 4;
 	const int CAND_SIZE = 4096;
+
+	// least squares refinement of the best sphere
+	const int REFINE_GROUPS = 16;
+	const int REFINE_SIZE = 64;
+	const int LO_SUMS = 15;
+	const int LO_ITER = 3;
+	const int GN_SUMS = 17;
+	const int GN_STATE = 20;
+	const int GN_ITER = 5;
+
+	// tracking
+	const int TRACK_ITER_NUM = 256;
+	const int MIN_ROI_SIZE = 32;	// fewer points around the prediction fall back to global search
+	const float ROI_MARGIN = 0.25f; // distance of ROI points from the predicted surface
+	const float MIN_TRACK_SCORE = 20.f;
+	const float MIN_TRACK_RATIO = 0.5f; // of the previous frame's score
+
+	// multi-sphere detection
+	const int MAX_SPHERES = 8;
+	const int MIN_SPHERE_INLIERS = 20; // further spheres with fewer inliers are dropped
+
+	// inlier count and squared residual sum of the best sphere
+	const int MEASURE_SIZE = 256;
+
+	// hypotheses per frame of the batched fit
+	const int BATCH_ITER_NUM = 4096;
+	BufferPool batchPool;
+
 	std::vector<cl_float4> candidates;
+	std::vector<cl_float4> roiCandidates;
+
+	VerifyMode verifyMode = FULL_VERIFY;
+	ScoreMode scoreMode = RANSAC_SCORE;
+	float threshold = 0.03f;
+	Priors priors;
+	bool localOptimization = false;
+	bool geometricRefinement = false;
+	glm::mat4 covariance = glm::mat4(0.0f);
+
+	SampleMode sampleMode = UNIFORM_SAMPLE;
+	bool normalEstimation = false;
+	float knownRadius = 0;
+	SphereHough hough;
+	float sampleRadius = 0.5f;
+	GridSampler sampler;
+	Prosac prosac;
+	glm::vec3 low;
+	glm::vec3 high;
+
+	bool tracking = false;
+	Tracker tracker;
+	glm::vec4 prediction;
+	float trackScore = 0;
+
+	int maxSpheres = 1;
+	std::vector<FittedSphere> spheres;
+
+	int selectGroups = 1;
+	RansacEngine<SphereModel> ransac;
+
+	// best hypotheses of the first search, before refinement
+	TopK topK;
+	int topCount = 0;
+	std::vector<Hypothesis> topHypotheses;
 
 	cl::Program  program;
 
 	cl::Kernel calcKernel;
-	cl::Kernel fitKernel;
-	cl::Kernel reduceKernel;
+	cl::Kernel checkKernel;
+	cl::Kernel copyKernel;
+	cl::Kernel accumKernel;
+	cl::Kernel solveKernel;
+	cl::Kernel accumGNKernel;
+	cl::Kernel solveGNKernel;
+	cl::Kernel measureKernel;
+	cl::Kernel removeKernel;
 	cl::Kernel fillKernel;
+	cl::Kernel sortKernel;
+	cl::Kernel calcNormalsKernel;
+	cl::Kernel batchSampleKernel;
+	cl::Kernel batchFitKernel;
+	cl::Kernel batchSelectKernel;
+	cl::Kernel batchMeasureKernel;
 
 	cl::Buffer indexBuffer;
 	cl::Buffer sphereBuffer;
-	cl::Buffer inlierBuffer;
+	cl::Buffer modelBuffer;	// best sphere, refined in place
 	cl::Buffer candidateBuffer;
+	cl::Buffer normalBuffer;
+	cl::Buffer remainingBuffer;
+	cl::Buffer resultBuffer;
+	cl::Buffer countBuffer;
+	cl::Buffer partialBuffer;
+	cl::Buffer gnStateBuffer;
+	cl::Buffer covarianceBuffer;
+	cl::Buffer measureBuffer;
 };
\ No newline at end of file
@@ -0,0 +1,69 @@
+#include "SphereHough.h"
+
+void SphereHough::Init(cl::Context& context, cl::Program& program, int selectGroups)
+{
+	this->selectGroups = selectGroups;
+
+	clearKernel = cl::Kernel(program, "clearHough");
+	voteKernel = cl::Kernel(program, "voteSphere");
+	scoreKernel = cl::Kernel(program, "scoreHough");
+	selectKernel = cl::Kernel(program, "selectBest");
+	centerKernel = cl::Kernel(program, "houghCenter");
+
+	keyBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, TABLE_SIZE * sizeof(cl_uint));
+	voteBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, TABLE_SIZE * sizeof(int));
+	scoreBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, TABLE_SIZE * sizeof(float));
+}
+
+void SphereHough::Detect(cl::CommandQueue& queue, cl::Buffer& points, const cl::Buffer* normals, int count,
+						 const glm::vec3& low, float radius, cl::Buffer& best, cl::Buffer& model)
+{
+	// the centers lie within radius of the points
+	cl_float4 grid = { low.x - radius, low.y - radius, low.z - radius, VOXEL_SIZE };
+
+	clearKernel.setArg(0, keyBuffer);
+	clearKernel.setArg(1, voteBuffer);
+
+	queue.enqueueNDRangeKernel(clearKernel, cl::NullRange, TABLE_SIZE, cl::NullRange);
+
+	voteKernel.setArg(0, points);
+	voteKernel.setArg(1, normals ? *normals : points);
+	voteKernel.setArg(2, keyBuffer);
+	voteKernel.setArg(3, voteBuffer);
+	voteKernel.setArg(4, count);
+	voteKernel.setArg(5, grid);
+	voteKernel.setArg(6, radius);
+	voteKernel.setArg(7, (cl_int)(normals != nullptr));
+	voteKernel.setArg(8, NORMAL_COS);
+	voteKernel.setArg(9, TABLE_SIZE - 1);
+
+	queue.enqueueNDRangeKernel(voteKernel, cl::NullRange, count, cl::NullRange);
+
+	scoreKernel.setArg(0, keyBuffer);
+	scoreKernel.setArg(1, voteBuffer);
+	scoreKernel.setArg(2, scoreBuffer);
+	scoreKernel.setArg(3, TABLE_SIZE - 1);
+
+	queue.enqueueNDRangeKernel(scoreKernel, cl::NullRange, TABLE_SIZE, cl::NullRange);
+
+	// the peak is selected like the best hypothesis
+	cl_ulong zero = 0;
+	queue.enqueueWriteBuffer(best, CL_TRUE, 0, sizeof(cl_ulong), &zero);
+
+	selectKernel.setArg(0, scoreBuffer);
+	selectKernel.setArg(1, best);
+	selectKernel.setArg(2, SELECT_SIZE * sizeof(cl_ulong), nullptr);
+	selectKernel.setArg(3, TABLE_SIZE);
+
+	queue.enqueueNDRangeKernel(selectKernel, cl::NullRange, selectGroups * SELECT_SIZE, SELECT_SIZE);
+
+	centerKernel.setArg(0, keyBuffer);
+	centerKernel.setArg(1, voteBuffer);
+	centerKernel.setArg(2, best);
+	centerKernel.setArg(3, model);
+	centerKernel.setArg(4, grid);
+	centerKernel.setArg(5, radius);
+	centerKernel.setArg(6, TABLE_SIZE - 1);
+
+	queue.enqueueNDRangeKernel(centerKernel, cl::NullRange, 1, cl::NullRange);
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "IFitter.h"
+
+// Detection of spheres with a known radius by Hough voting over the center
+// positions. The votes are counted in a voxel hash table on the device and the
+// voxel with most votes in its neighbourhood gives the center; unlike RANSAC
+// the result is deterministic and needs no iteration count.
+class SphereHough
+{
+public:
+	/**
+	 * \brief Creates the kernels and the hash table
+	 * \param program program containing the Hough and selectBest kernels
+	 * \param selectGroups number of work-groups of the peak selection
+	 */
+	void		Init(cl::Context& context, cl::Program& program, int selectGroups);
+
+	/**
+	 * \brief Votes for the centers and selects the peak
+	 * \param points points as 4 floats each
+	 * \param normals normals of the points to prune the votes with, or nullptr
+	 * \param count number of points
+	 * \param low lower corner of the bounding box of the points
+	 * \param radius radius of the spheres
+	 * \param best output, packed votes of the peak neighbourhood and its slot
+	 * \param model output, center and radius of the sphere
+	 */
+	void		Detect(cl::CommandQueue& queue, cl::Buffer& points, const cl::Buffer* normals, int count,
+					   const glm::vec3& low, float radius, cl::Buffer& best, cl::Buffer& model);
+
+private:
+	const int TABLE_SIZE = 1 << 20;	// power of two
+	const float VOXEL_SIZE = 0.05f;
+	const float NORMAL_COS = 0.9f;	// cone of the votes around the normals
+
+	int selectGroups = 1;
+
+	cl::Kernel clearKernel;
+	cl::Kernel voteKernel;
+	cl::Kernel scoreKernel;
+	cl::Kernel selectKernel;
+	cl::Kernel centerKernel;
+
+	cl::Buffer keyBuffer;
+	cl::Buffer voteBuffer;
+	cl::Buffer scoreBuffer;
+};
\ No newline at end of file
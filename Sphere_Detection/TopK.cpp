@@ -0,0 +1,71 @@
+#include "TopK.h"
+
+#include <algorithm>
+
+void TopK::Init(cl::Context& context, cl::Program& program, int maxCount)
+{
+	scoresKernel = cl::Kernel(program, "topScores");
+	keysKernel = cl::Kernel(program, "topKeys");
+	copyKernel = cl::Kernel(program, "copyBest");
+
+	int groups = (maxCount + GROUP_SIZE - 1) / GROUP_SIZE;
+	keyBuffers[0] = cl::Buffer(context, CL_MEM_READ_WRITE, groups * MAX_K * sizeof(cl_ulong));
+	keyBuffers[1] = cl::Buffer(context, CL_MEM_READ_WRITE, groups * MAX_K * sizeof(cl_ulong));
+	modelBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, MAX_K * sizeof(cl_float4));
+}
+
+std::vector<Hypothesis> TopK::Select(cl::CommandQueue& queue, cl::Buffer& scores, cl::Buffer& models, int width, int count, int k)
+{
+	k = std::min(std::max(k, 1), std::min(MAX_K, count));
+
+	// first pass on the scores
+	int groups = (count + GROUP_SIZE - 1) / GROUP_SIZE;
+	scoresKernel.setArg(0, scores);
+	scoresKernel.setArg(1, keyBuffers[0]);
+	scoresKernel.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+	scoresKernel.setArg(3, count);
+	scoresKernel.setArg(4, k);
+
+	queue.enqueueNDRangeKernel(scoresKernel, cl::NullRange, groups * GROUP_SIZE, GROUP_SIZE);
+
+	// merge the k best of the work-groups
+	int current = 0;
+	keysKernel.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+	keysKernel.setArg(4, k);
+	while (groups > 1)
+	{
+		count = groups * k;
+		groups = (count + GROUP_SIZE - 1) / GROUP_SIZE;
+		keysKernel.setArg(0, keyBuffers[current]);
+		keysKernel.setArg(1, keyBuffers[1 - current]);
+		keysKernel.setArg(3, count);
+
+		queue.enqueueNDRangeKernel(keysKernel, cl::NullRange, groups * GROUP_SIZE, GROUP_SIZE);
+		current = 1 - current;
+	}
+
+	// gather the selected models
+	copyKernel.setArg(0, models);
+	copyKernel.setArg(1, keyBuffers[current]);
+	copyKernel.setArg(2, modelBuffer);
+	copyKernel.setArg(3, width);
+
+	queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, k * width, cl::NullRange);
+
+	std::vector<cl_ulong> keys(k);
+	std::vector<float> selected(k * width);
+	queue.enqueueReadBuffer(keyBuffers[current], CL_FALSE, 0, k * sizeof(cl_ulong), keys.data());
+	queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, k * width * sizeof(float), selected.data());
+
+	std::vector<Hypothesis> result;
+	for (int i = 0; i < k; i++)
+	{
+		glm::vec4 model(0);
+		for (int j = 0; j < width; j++)
+		{
+			model[j] = selected[i * width + j];
+		}
+		result.push_back({ model, UnpackScore(keys[i]), UnpackIndex(keys[i]) });
+	}
+	return result;
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "IFitter.h"
+
+// Device side selection of the K best scored hypotheses: each work-group
+// sorts its part of the packed (score, index) pairs with a bitonic sort
+// and keeps the k best, until a single work-group is left.
+class TopK
+{
+public:
+	/**
+	 * \brief Creates the kernels and buffers
+	 * \param program program containing the topScores, topKeys and copyBest kernels
+	 * \param maxCount maximal number of hypotheses
+	 */
+	void		Init(cl::Context& context, cl::Program& program, int maxCount);
+
+	/**
+	 * \brief Selects the k best hypotheses and reads them back
+	 * \param scores score of each hypothesis
+	 * \param models hypotheses, width floats each
+	 * \param width floats of a hypothesis, at most 4
+	 * \param count number of hypotheses
+	 * \param k number of hypotheses to select, at most MAX_K
+	 * \return the selected hypotheses, the best one first
+	 */
+	std::vector<Hypothesis>	Select(cl::CommandQueue& queue, cl::Buffer& scores, cl::Buffer& models, int width, int count, int k);
+
+private:
+	const int MAX_K = 32;
+	const int GROUP_SIZE = 256; // power of two, at least MAX_K
+
+	cl::Kernel scoresKernel;
+	cl::Kernel keysKernel;
+	cl::Kernel copyKernel;
+
+	// ping-pong buffers of the packed pairs kept between passes
+	cl::Buffer keyBuffers[2];
+	cl::Buffer modelBuffer;
+};
\ No newline at end of file
@@ -0,0 +1,39 @@
+#include "Tracker.h"
+
+Tracker::Tracker()
+{
+	Reset();
+}
+
+void Tracker::Reset()
+{
+	tracking = false;
+	estimate = glm::vec4(0);
+	velocity = glm::vec4(0);
+}
+
+bool Tracker::IsTracking() const
+{
+	return tracking;
+}
+
+glm::vec4 Tracker::Predict() const
+{
+	return estimate + velocity;
+}
+
+void Tracker::Update(const glm::vec4& model)
+{
+	if (!tracking)
+	{
+		tracking = true;
+		estimate = model;
+		velocity = glm::vec4(0);
+		return;
+	}
+
+	glm::vec4 predicted = Predict();
+	glm::vec4 residual = model - predicted;
+	estimate = predicted + ALPHA * residual;
+	velocity = velocity + BETA * residual;
+}
\ No newline at end of file
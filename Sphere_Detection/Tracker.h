@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Constant velocity alpha-beta filter (steady state Kalman filter)
+// of a model tracked from frame to frame.
+class Tracker
+{
+public:
+	Tracker();
+
+	/**
+	 * \brief Drops the track, the next update starts a new one
+	 */
+	void		Reset();
+
+	/**
+	 * \brief Whether a model has been tracked since the last reset
+	 */
+	bool		IsTracking() const;
+
+	/**
+	 * \brief Gets the model expected in the next frame
+	 * \return last estimate moved by the estimated velocity
+	 */
+	glm::vec4	Predict() const;
+
+	/**
+	 * \brief Corrects the estimate with the model measured in the current frame
+	 * \param model measured model
+	 */
+	void		Update(const glm::vec4& model);
+
+private:
+	// gains of the position and velocity correction
+	const float ALPHA = 0.8f;
+	const float BETA = 0.3f;
+
+	bool tracking;
+	glm::vec4 estimate;
+	glm::vec4 velocity;	// per frame
+};
\ No newline at end of file
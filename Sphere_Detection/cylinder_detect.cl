@@ -1,111 +1,200 @@
-#define CLOUD_SIZE 14976
-#define EPSILON 0.12
-#define EPS_2 0.06
-
-__kernel void calcPlane(
+// compacts the points of the ring around the sensor below maxHeight into the
+// plane inliers marked by fillPlane and the rest, with their quality in w;
+// without the plane every point of the ring is a close point
+__kernel void splitPlane(
 	__global float4* data,
-	__global int3*	 idx,
-	__global float3* points,
-	__global float3* normals)
+	__global float*	 qualities,	// of every point
+	__global float4* planePoints,
+	__global float4* closePoints,
+	__global int*	 counts,	// plane and close points, zeroed before the launch
+	float2			 ring,		// smallest and largest horizontal distance
+	float			 maxHeight,
+	int				 useQuality,
+	int				 usePlane)
 {
 	int g_id = get_global_id(0);
-	int3 ids = idx[g_id];
-
-	// get the 3 assigned random points
-	float3 p1 = data[ids.x].xyz;
-	float3 p2 = data[ids.y].xyz;
-	float3 p3 = data[ids.z].xyz;
-
-	// calculate normal of plane defined by the 3 points
-	float3 v1 = p2 - p1;
-	float3 v2 = p3 - p1;
-	float3 norm = normalize(cross(v1, v2));
-
-	// filter out nullvectors
-	if(norm.x == 0 && norm.y == 0 && norm.z == 0)
+	float4 p = data[g_id];
+	float dist = length(p.xz);
+	if (dist <= ring.x || dist >= ring.y || p.y >= maxHeight)
 	{
-		norm = (float3)(0, 1, 0);
-	};
+		return;
+	}
 
-	// store plane data
-	points[g_id] = p1;
-	normals[g_id] = norm;
+	float4 point = (float4)(p.xyz, useQuality ? qualities[g_id] : 0);
+	if (usePlane && p.w != 0)
+	{
+		planePoints[atomic_inc(&counts[0])] = point;
+	}
+	else
+	{
+		closePoints[atomic_inc(&counts[1])] = point;
+	}
 }
 
-__kernel void fitPlane(
-	__global float4* data,
-	__global float3* points,
-	__global float3* normals,
-	__global int*	 inliers)
-{
-	int g_id0 = get_global_id(0);
-	int g_id1 = get_global_id(1);
+// Ground segmentation on a polar grid around the sensor: the points are
+// bucketed into patches of rings and sectors, ordered by patch with scanCells
+// and scatterCells, and each patch gets its own plane, which follows slopes
+// and curbs better than a single plane of the whole cloud.
 
-	float3 p = points[g_id0];
-	float3 n = normals[g_id0];
-	float3 point = data[g_id1].xyz;
+// patch of a point: rings of the horizontal distance, the outer one reaching
+// to infinity, and sectors of the azimuth; dims are the ring and sector counts
+int polarCell(float3 p, float ringWidth, int2 dims)
+{
+	int ring = min((int)(length(p.xz) / ringWidth), dims.x - 1);
+	float azimuth = atan2(p.z, p.x) + M_PI_F;
+	int sector = clamp((int)(azimuth / (2 * M_PI_F) * dims.y), 0, dims.y - 1);
+	return sector * dims.x + ring;
+}
 
-	// point is on plane if |<normal, point - plane_point>| < EPSILON
-	if(fabs(dot(n, point - p)) < EPSILON)
+__kernel void countPolarCells(
+	__global float3* data,
+	__global int*	 cells,		 // patch of each point
+	__global int*	 cellCounts, // zeroed by the host
+	int				 count,
+	float			 ringWidth,
+	int2			 dims)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
 	{
-		atomic_inc(&inliers[g_id0]);
+		return;
 	}
+
+	int cell = polarCell(data[g_id].xyz, ringWidth, dims);
+	cells[g_id] = cell;
+	atomic_inc(&cellCounts[cell]);
 }
 
-__kernel void reducePlane(
-	__global int*    inliers,
-	__global float3* points,
-	__global float3* normals,
-	__local  int*    scratch,   // local for inlier values
-	__local  int*	 idx)	    // local for plane global idx
+// fits a plane to the seed points of each patch with one work-group: the seeds
+// are the points at most seedHeight above the lowest one, and the plane is their
+// centroid with the smallest eigenvector of their covariance. Patches with too
+// few seeds or tilted more than minUp get the horizontal plane through their
+// lowest point, empty ones a zero plane.
+__kernel void fitPatches(
+	__global float3* data,
+	__global int*	 cellStarts,
+	__global int*	 cellCounts,
+	__global int*	 sorted,	// point indices ordered by patch
+	__global float4* patches,	// (normal, offset) of each patch
+	__local  float*	 scratch,	// one value per work item
+	float			 seedHeight,
+	float			 minUp)
 {
+	int cell = get_group_id(0);
 	int l_id = get_local_id(0);
-	int g_id = get_global_id(0);
-	scratch[l_id] = inliers[g_id];
-	idx[l_id]	  = g_id;
+	int n = cellCounts[cell];
+	int start = cellStarts[cell];
 
-	barrier(CLK_LOCAL_MEM_FENCE);
+	// the whole group leaves before the reductions
+	if (n == 0)
+	{
+		if (l_id == 0)
+		{
+			patches[cell] = (float4)(0);
+		}
+		return;
+	}
 
-	// local reduction
-	// swap inlier values along with plane idx
-	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
+	float low = MAXFLOAT;
+	for (int i = l_id; i < n; i += get_local_size(0))
 	{
-		if (l_id < offset && scratch[l_id] < scratch[l_id + offset])
+		low = min(low, data[sorted[start + i]].y);
+	}
+	low = groupMin(low, scratch);
+
+	// moments relative to a point of the patch at the lowest height
+	float3 origin = (float3)(data[sorted[start]].x, low, data[sorted[start]].z);
+	float sums[10];
+	for (int k = 0; k < 10; k++)
+	{
+		sums[k] = 0;
+	}
+	for (int i = l_id; i < n; i += get_local_size(0))
+	{
+		float3 d = data[sorted[start + i]] - origin;
+		if (d.y < seedHeight)
 		{
-			scratch[l_id] = scratch[l_id + offset];
-			idx[l_id] = idx[l_id + offset];
+			sums[0] += 1;
+			sums[1] += d.x;
+			sums[2] += d.y;
+			sums[3] += d.z;
+			sums[4] += d.x * d.x;
+			sums[5] += d.x * d.y;
+			sums[6] += d.x * d.z;
+			sums[7] += d.y * d.y;
+			sums[8] += d.y * d.z;
+			sums[9] += d.z * d.z;
 		}
-		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	for (int k = 0; k < 10; k++)
+	{
+		sums[k] = groupSum(sums[k], scratch);
 	}
 
-	if (l_id == 0)
+	if (l_id != 0)
 	{
-		inliers[get_group_id(0)] = scratch[0];
-		points[get_group_id(0)] = points[idx[0]];
-		normals[get_group_id(0)] = normals[idx[0]];
+		return;
 	}
+
+	float4 patch = (float4)(0, 1, 0, -low);
+	if (sums[0] >= 3)
+	{
+		float w = sums[0];
+		float3 m = (float3)(sums[1], sums[2], sums[3]) / w;
+		float3 normal = smallestEigenvector(
+			sums[4] / w - m.x * m.x, sums[5] / w - m.x * m.y, sums[6] / w - m.x * m.z,
+			sums[7] / w - m.y * m.y, sums[8] / w - m.y * m.z, sums[9] / w - m.z * m.z);
+		if (normal.y < 0)
+		{
+			normal = -normal;
+		}
+		if (normal.y >= minUp)
+		{
+			patch = (float4)(normal, -dot(normal, origin + m));
+		}
+	}
+	patches[cell] = patch;
 }
 
-__kernel void fillPlane(
+// marks the points near the plane of their patch like fillPlane
+__kernel void labelGround(
 	__global float4* data,
-	__global float3* points,
-	__global float3* normals)
+	__global int*	 cells,
+	__global float4* patches,
+	float			 threshold)
 {
 	int g_id = get_global_id(0);
-	float3 point = data[g_id].xyz;
+	float4 patch = patches[cells[g_id]];
 
-	float3 p = points[0];
-	float3 n = normals[0];
-	
-	// point is on plane if |<normal, point - plane_point>| < EPSILON
-	data[g_id].w = fabs(dot(n, point - p)) < EPSILON ? 0.25 : 0;
+	data[g_id].w = fabs(dot(patch.xyz, data[g_id].xyz) + patch.w) < threshold ? 0.25 : 0;
+}
+
+// circle through 3 points as (center, radius)
+float3 circle(float2 p1, float2 p2, float2 p3)
+{
+	// base vectors of the new coord system
+	float2 u = normalize(p2 - p1);
+	float2 v = (float2)(-u.y, u.x);
+
+	// translating into new system
+	float bx = dot(p2 - p1, u) * 0.5;
+	float cx = dot(p3 - p1, u);
+	float cy = dot(p3 - p1, v);
+
+	float h = ((cx - bx) * (cx - bx) + cy * cy - bx * bx) / (2 * cy);
+
+	// centerpoint of circle
+	float2 k = p1 + bx * u + h * v;
+	float  r = distance(k, p1);
+
+	return (float3)(k, r);
 }
 
 // fit cylinder by finding a circle on the ground plane
 __kernel void calcCylinder(
 	__global int3*   rand,
 	__global float3* data,
-	__global float3* cylinders)
+	__global model3* cylinders)
 {
 	int g_id = get_global_id(0);
 
@@ -115,84 +204,607 @@ __kernel void calcCylinder(
 	float2 p2 = data[rand[g_id].y].xz;
 	float2 p3 = data[rand[g_id].z].xz;
 
-	// base vectors of the new coord system
-	float2 u = normalize(p2 - p1);
-	float2 v = (float2)(-u.y, u.x);
+	STORE3(cylinders, g_id, circle(p1, p2, p3));
+}
 
-	// translating into new system
-	float bx = dot(p2 - p1, u) * 0.5;
-	float cx = dot(p3 - p1, u);
-	float cy = dot(p3 - p1, v);
+// cylinder from 2 oriented points: the axis is orthogonal to both normals and
+// the normal lines meet on it in the plane orthogonal to the axis; the center
+// is behind both points since the normals face the sensor.
+// The axis may be arbitrary, but only cylinders within minVertical (cosine of
+// the tilt) of the vertical are kept for the ground plane model, the others get radius 0
+__kernel void calcCylinderNormals(
+	__global float3* data,
+	__global float4* normals,
+	__global int3*   rand,
+	__global model3* cylinders,
+	float			 minVertical)
+{
+	int g_id = get_global_id(0);
+	float3 p1 = data[rand[g_id].x];
+	float3 p2 = data[rand[g_id].y];
+	float4 n1 = normals[rand[g_id].x];
+	float4 n2 = normals[rand[g_id].y];
 
-	float h = ((cx - bx) * (cx - bx) + cy * cy - bx * bx) / (2 * cy);
+	float3 axis = cross(n1.xyz, n2.xyz);
+	if (n1.w == 0 || n2.w == 0 || dot(axis, axis) < 1e-4f)
+	{
+		STORE3(cylinders, g_id, (float3)(0));
+		return;
+	}
+	axis = normalize(axis);
 
-	// centerpoint of circle
-	float2 k = p1 + bx * u + h * v;
-	float  r = distance(k, p1);
+	// project onto the plane orthogonal to the axis through p1
+	float3 q2 = p2 - dot(p2 - p1, axis) * axis;
+	float3 m1 = n1.xyz - dot(n1.xyz, axis) * axis;
+	float3 m2 = n2.xyz - dot(n2.xyz, axis) * axis;
 
-	cylinders[g_id] = (float3)(k, r);
+	float t1, t2;
+	if (!closestPoints(p1, m1, q2, m2, &t1, &t2) || t1 >= 0 || t2 >= 0 || fabs(axis.y) < minVertical)
+	{
+		STORE3(cylinders, g_id, (float3)(0));
+		return;
+	}
+
+	float3 center = 0.5f * (p1 + t1 * m1 + q2 + t2 * m2);
+	float r = 0.5f * (distance(center, p1) + distance(center, q2));
+	STORE3(cylinders, g_id, (float3)(center.x, center.z, r));
+}
+
+// zeroes the cylinders outside the radius range or with the axis outside the box,
+// cylinders are (x, z, radius) and zero ones are skipped by the scoring kernels
+__kernel void checkCylinder(
+	__global model3* cylinders,
+	float2			 radius,	// smallest and largest radius
+	float4			 low,
+	float4			 high)
+{
+	int g_id = get_global_id(0);
+	float3 cylinder = LOAD3(cylinders, g_id);
+	if (cylinder.z < radius.x || cylinder.z > radius.y || any(cylinder.xy < low.xz) || any(cylinder.xy > high.xz))
+	{
+		STORE3(cylinders, g_id, (float3)(0));
+	}
 }
 
-__kernel void fitCylinder(
+// cylinders are (x, z, radius), the ones zeroed by checkCylinder are skipped
+float3 loadCylinder(__global model3* cylinders, int i)
+{
+	return LOAD3(cylinders, i);
+}
+
+bool validCylinder(float3 cylinder)
+{
+	return cylinder.z != 0;
+}
+
+// the residual is the difference of the squared centerline distance and squared radius
+float residualCylinder(float3 p, float3 cylinder)
+{
+	float dist = (cylinder.x - p.x) * (cylinder.x - p.x) + (cylinder.y - p.z) * (cylinder.y - p.z);
+	return dist - cylinder.z * cylinder.z;
+}
+
+RANSAC_KERNELS(Cylinder, float3, (__global model3* cylinders), (cylinders))
+
+// inlier count and sum of the squared geometric residuals of the inliers of
+// the best cylinder, run as a single work-group
+__kernel void measureCylinder(
 	__global float3* data,
-	__global float3* cylinders,
-	__global int*	 inliers)
+	__global model3* cylinders,
+	__global float*	 stats,
+	__local  float*	 scratch,	// one value per work item
+	int				 size,
+	float			 threshold)
 {
-	int g_id0 = get_global_id(0);
-	int g_id1 = get_global_id(1);
-	float3 cylinder = cylinders[g_id0];
-	float3 p = data[g_id1].xyz;
+	float3 cylinder = LOAD3(cylinders, 0);
+
+	float inliers = 0;
+	float squares = 0;
+	for (int i = get_local_id(0); i < size; i += get_local_size(0))
+	{
+		float3 p = data[i];
+		float dist = (cylinder.x - p.x) * (cylinder.x - p.x) + (cylinder.y - p.z) * (cylinder.y - p.z);
+		if (fabs(dist - cylinder.z * cylinder.z) < threshold)
+		{
+			float e = sqrt(dist) - cylinder.z;
+			inliers += 1;
+			squares += e * e;
+		}
+	}
+
+	groupScore(inliers, scratch, stats);
+	groupScore(squares, scratch, stats + 1);
+}
+
+__kernel void fillCylinder(
+	__global float4* data,
+	__global model3* cylinders,
+	float			 threshold)
+{
+	int g_id = get_global_id(0);
+	float3 p = data[g_id].xyz;
+	float3 cylinder = LOAD3(cylinders, 0);
 
 	float dist = (cylinder.x - p.x) * (cylinder.x - p.x) + (cylinder.y - p.z) * (cylinder.y - p.z);
+	
+	data[g_id].w += fabs(dist - cylinder.z * cylinder.z) < threshold ? 0.75 : 0;
+}
+
+// Cylinders of any orientation are fitted directly to the oriented points,
+// without the ground plane. They are stored as float8: a point on the axis
+// with the radius and the unit axis direction with the length of the cylinder,
+// the length stays 0 until the inliers are measured.
+
+// the distance of a point from the axis minus the radius
+float residualCylinderAxis(float3 p, float8 cylinder)
+{
+	float3 d = p - cylinder.lo.xyz;
+	float3 axis = cylinder.hi.xyz;
+	return length(d - dot(d, axis) * axis) - cylinder.lo.w;
+}
+
+// cylinder from 2 oriented points like calcCylinderNormals, but the axis is
+// kept whatever its tilt, pointing upwards; degenerate samples get radius 0
+__kernel void calcCylinderAxis(
+	__global float3* data,
+	__global float4* normals,
+	__global int3*   rand,
+	__global float8* cylinders)
+{
+	int g_id = get_global_id(0);
+	float3 p1 = data[rand[g_id].x];
+	float3 p2 = data[rand[g_id].y];
+	float4 n1 = normals[rand[g_id].x];
+	float4 n2 = normals[rand[g_id].y];
 
-	// check distance of p and cylinder centerline
-	if(fabs(dist - cylinder.z * cylinder.z) < EPS_2)
+	float3 axis = cross(n1.xyz, n2.xyz);
+	if (n1.w == 0 || n2.w == 0 || dot(axis, axis) < 1e-4f)
+	{
+		cylinders[g_id] = (float8)(0);
+		return;
+	}
+	axis = normalize(axis);
+	if (axis.y < 0)
 	{
-		atomic_inc(&inliers[g_id0]);
+		axis = -axis;
 	}
+
+	float3 q2 = p2 - dot(p2 - p1, axis) * axis;
+	float3 m1 = n1.xyz - dot(n1.xyz, axis) * axis;
+	float3 m2 = n2.xyz - dot(n2.xyz, axis) * axis;
+
+	float t1, t2;
+	if (!closestPoints(p1, m1, q2, m2, &t1, &t2) || t1 >= 0 || t2 >= 0)
+	{
+		cylinders[g_id] = (float8)(0);
+		return;
+	}
+
+	float3 center = 0.5f * (p1 + t1 * m1 + q2 + t2 * m2);
+	float r = 0.5f * (distance(center, p1) + distance(center, q2));
+	cylinders[g_id] = (float8)(center, r, axis, 0);
 }
 
-__kernel void reduceCylinder(
-	__global int*    inliers,
-	__global float3* cylinders,
-	__local  int*    scratch,   // local for inlier values
-	__local  int*	 idx)	    // local for plane global idx
+// zeroes the cylinders outside the radius range or with the axis point outside the box
+__kernel void checkCylinderAxis(
+	__global float8* cylinders,
+	float2			 radius,	// smallest and largest radius
+	float4			 low,
+	float4			 high)
 {
-	int l_id = get_local_id(0);
 	int g_id = get_global_id(0);
-	scratch[l_id] = inliers[g_id];
-	idx[l_id]	  = g_id;
+	float4 cylinder = cylinders[g_id].lo;
+	if (cylinder.w < radius.x || cylinder.w > radius.y || any(cylinder.xyz < low.xyz) || any(cylinder.xyz > high.xyz))
+	{
+		cylinders[g_id] = (float8)(0);
+	}
+}
+
+// arbitrary axis cylinders are scored on the geometric residual
+float8 loadCylinderAxis(__global float8* cylinders, int i)
+{
+	return cylinders[i];
+}
+
+bool validCylinderAxis(float8 cylinder)
+{
+	return cylinder.s3 != 0;
+}
+
+RANSAC_KERNELS(CylinderAxis, float8, (__global float8* cylinders), (cylinders))
 
+// inlier count, sum of the squared residuals and extent of the inliers along
+// the axis of the best cylinder, run as a single work-group; the axis point
+// is moved to the middle of the extent and its length is stored with the axis
+__kernel void measureCylinderAxis(
+	__global float3* data,
+	__global float8* cylinders,
+	__global float*	 stats,
+	__local  float4* scratch,	// one value per work item
+	int				 size,
+	float			 threshold)
+{
+	int l_id = get_local_id(0);
+	float8 cylinder = cylinders[0];
+
+	// inliers, squares, lowest and highest position along the axis
+	float4 sums = (float4)(0, 0, MAXFLOAT, -MAXFLOAT);
+	for (int i = l_id; i < size; i += get_local_size(0))
+	{
+		float3 p = data[i];
+		float e = residualCylinderAxis(p, cylinder);
+		if (fabs(e) < threshold)
+		{
+			float t = dot(p - cylinder.lo.xyz, cylinder.hi.xyz);
+			sums += (float4)(1, e * e, 0, 0);
+			sums.z = min(sums.z, t);
+			sums.w = max(sums.w, t);
+		}
+	}
+	scratch[l_id] = sums;
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	// local reduction
-	// swap inlier values along with cylinder idx
 	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
 	{
-		if (l_id < offset && scratch[l_id] < scratch[l_id + offset])
+		if (l_id < offset)
 		{
-			scratch[l_id] = scratch[l_id + offset];
-			idx[l_id] = idx[l_id + offset];
+			float4 a = scratch[l_id];
+			float4 b = scratch[l_id + offset];
+			scratch[l_id] = (float4)(a.x + b.x, a.y + b.y, min(a.z, b.z), max(a.w, b.w));
 		}
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
 	if (l_id == 0)
 	{
-		inliers[get_group_id(0)] = scratch[0];
-		cylinders[get_group_id(0)] = cylinders[idx[0]];
+		sums = scratch[0];
+		stats[0] = sums.x;
+		stats[1] = sums.y;
+		if (sums.x > 0)
+		{
+			float3 center = cylinder.lo.xyz + 0.5f * (sums.z + sums.w) * cylinder.hi.xyz;
+			cylinders[0] = (float8)(center, cylinder.s3, cylinder.hi.xyz, sums.w - sums.z);
+		}
 	}
 }
 
-__kernel void fillCylinder(
+__kernel void fillCylinderAxis(
 	__global float4* data,
-	__global float3* cylinders)
+	__global float8* cylinders,
+	float			 threshold)
 {
 	int g_id = get_global_id(0);
 	float3 p = data[g_id].xyz;
-	float3 cylinder = cylinders[0];
+	float8 cylinder = cylinders[0];
 
-	float dist = (cylinder.x - p.x) * (cylinder.x - p.x) + (cylinder.y - p.z) * (cylinder.y - p.z);
-	
-	data[g_id].w += fabs(dist - cylinder.z * cylinder.z) < EPS_2 ? 0.75 : 0;
+	// only the measured part of the axis is marked
+	float t = dot(p - cylinder.lo.xyz, cylinder.hi.xyz);
+	bool inside = cylinder.s7 == 0 || fabs(t) <= 0.5f * cylinder.s7;
+
+	data[g_id].w += inside && fabs(residualCylinderAxis(p, cylinder)) < threshold ? 0.75 : 0;
+}
+
+// Connected components of the points on a grid over the ground: the points are
+// bucketed by countCells with a single cell along y, and the occupied cells of a
+// component take the smallest cell index among them by repeated propagation.
+// The point indices are then ordered by component with scanCells and scatterCells,
+// so that every cluster is fitted on its own points by one work-group.
+
+// occupied cells start with their own index as label, empty ones with -1
+__kernel void initLabels(
+	__global int* cellCounts,
+	__global int* labels)
+{
+	int g_id = get_global_id(0);
+	labels[g_id] = cellCounts[g_id] > 0 ? g_id : -1;
+}
+
+// one propagation step: each occupied cell takes the smallest label of its 8
+// neighbours, then the label of that cell; labels only decrease, so reading
+// neighbours that change meanwhile only slows the convergence down
+__kernel void propagateLabels(
+	__global int* labels,
+	__global int* changed,	// set if any label changed, zeroed by the host
+	int4		  dims)
+{
+	int g_id = get_global_id(0);
+	int label = labels[g_id];
+	if (label < 0)
+	{
+		return;
+	}
+
+	int x = g_id % dims.x;
+	int z = g_id / dims.x;
+	int smallest = label;
+	for (int nz = max(z - 1, 0); nz <= min(z + 1, dims.z - 1); nz++)
+	{
+		for (int nx = max(x - 1, 0); nx <= min(x + 1, dims.x - 1); nx++)
+		{
+			int neighbour = labels[nz * dims.x + nx];
+			if (neighbour >= 0)
+			{
+				smallest = min(smallest, neighbour);
+			}
+		}
+	}
+	smallest = labels[smallest];
+
+	if (smallest < label)
+	{
+		labels[g_id] = smallest;
+		changed[0] = 1;
+	}
+}
+
+// points the label of each occupied cell to its root, the cell whose label is its
+// own index; labels only decrease, so the chase ends, and the cells relabelled
+// meanwhile still point into the same chain. Needed when the propagation was
+// stopped before it converged and a label names a cell that is not a root.
+__kernel void resolveLabels(
+	__global int* labels)
+{
+	int g_id = get_global_id(0);
+	int label = labels[g_id];
+	if (label < 0)
+	{
+		return;
+	}
+
+	while (labels[label] != label)
+	{
+		label = labels[label];
+	}
+	labels[g_id] = label;
+}
+
+// numbers the components by their root cells, whose label is their own index
+__kernel void countClusters(
+	__global int* labels,
+	__global int* clusters,		// cluster of each root cell
+	__global int* clusterNum)	// zeroed by the host
+{
+	int g_id = get_global_id(0);
+	if (labels[g_id] == g_id)
+	{
+		clusters[g_id] = atomic_inc(clusterNum);
+	}
+}
+
+// cluster of each point, the clusters' points are counted for scanCells
+__kernel void clusterPoints(
+	__global int* cells,
+	__global int* labels,
+	__global int* clusters,
+	__global int* pointClusters,
+	__global int* clusterCounts,	// zeroed by the host
+	int			  count)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	int cluster = clusters[labels[cells[g_id]]];
+	pointClusters[g_id] = cluster;
+	atomic_inc(&clusterCounts[cluster]);
+}
+
+// fits a vertical cylinder to each cluster with one work-group: the work items
+// draw circles through 3 points of the cluster and score them on the cluster's
+// points only, the best one of the group is appended to the output if it has
+// enough inliers. Clusters smaller than minSize are skipped, as are the groups
+// past the cluster count.
+__kernel void fitClusters(
+	__global float3* data,
+	__global int*	 clusterStarts,
+	__global int*	 clusterCounts,
+	__global int*	 sorted,		// point indices ordered by cluster
+	__global int*	 clusterNum,
+	__global float4* cylinders,		// (x, z, radius, inliers) of the found cylinders
+	__global int*	 found,			// zeroed by the host
+	__local  float4* scratch,		// one value per work item
+	uint			 seed,
+	int				 hypotheses,	// per work item
+	int				 minSize,		// of the clusters and the inlier count of their cylinders
+	float2			 radius,		// smallest and largest radius
+	float			 threshold)
+{
+	int group = get_group_id(0);
+	int l_id = get_local_id(0);
+	int n = group < clusterNum[0] ? clusterCounts[group] : 0;
+
+	// the whole group leaves before the reduction
+	if (n < max(minSize, 3))
+	{
+		return;
+	}
+
+	int start = clusterStarts[group];
+	uint state = ((get_global_id(0) ^ seed) * 2654435761u) | 1;
+
+	float4 best = (float4)(0);
+	for (int h = 0; h < hypotheses; h++)
+	{
+		int a = nextRandom(&state) % n;
+		int b, c;
+		do
+		{
+			b = nextRandom(&state) % n;
+		} while (b == a);
+		do
+		{
+			c = nextRandom(&state) % n;
+		} while (c == a || c == b);
+
+		float3 cylinder = circle(data[sorted[start + a]].xz, data[sorted[start + b]].xz, data[sorted[start + c]].xz);
+		if (!(cylinder.z >= radius.x && cylinder.z <= radius.y))
+		{
+			continue;
+		}
+
+		float inliers = 0;
+		for (int i = 0; i < n; i++)
+		{
+			float2 d = cylinder.xy - data[sorted[start + i]].xz;
+			inliers += fabs(dot(d, d) - cylinder.z * cylinder.z) < threshold ? 1 : 0;
+		}
+		if (inliers > best.w)
+		{
+			best = (float4)(cylinder, inliers);
+		}
+	}
+	scratch[l_id] = best;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
+	{
+		if (l_id < offset && scratch[l_id + offset].w > scratch[l_id].w)
+		{
+			scratch[l_id] = scratch[l_id + offset];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (l_id == 0 && scratch[0].w >= minSize)
+	{
+		cylinders[atomic_inc(found)] = scratch[0];
+	}
+}
+
+// marks the inliers of every found cylinder
+__kernel void fillClusters(
+	__global float4* data,
+	__global float4* cylinders,
+	__global int*	 found,
+	float			 threshold)
+{
+	int g_id = get_global_id(0);
+	float2 p = data[g_id].xz;
+
+	for (int i = 0; i < found[0]; i++)
+	{
+		float4 cylinder = cylinders[i];
+		float2 d = cylinder.xy - p;
+		if (fabs(dot(d, d) - cylinder.z * cylinder.z) < threshold)
+		{
+			data[g_id].w += 0.75;
+			return;
+		}
+	}
+}
+
+// Vertical cylinders by Hough voting: the points vote for the circle centers
+// around them in the horizontal plane, for every radius bin, in a dense
+// accumulator of (x, z, radius) cells. The cost is linear in the point count
+// whatever the outlier ratio; the peak's neighbourhood gives the circle.
+
+#define CIRCLE_ANGLES 256	// most vote directions of a point per radius bin
+
+__kernel void clearVotes(
+	__global int* votes)
+{
+	votes[get_global_id(0)] = 0;
+}
+
+// grid is the (x, z) origin with the cell size, radius the smallest radius
+// and the bin width, dims the cell counts along x, z and the radius; only the
+// half circle behind the point as seen from the sensor votes. The directions
+// are about a cell apart, so that a point votes at most once per cell and the
+// small radii are not favoured.
+__kernel void voteCircles(
+	__global float3* data,
+	__global int*	 votes,		// zeroed by clearVotes
+	int				 count,
+	float4			 grid,
+	float2			 radius,
+	int4			 dims)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	float2 p = data[g_id].xz;
+	for (int r = 0; r < dims.z; r++)
+	{
+		float rad = radius.x + (r + 0.5f) * radius.y;
+		int angles = clamp((int)ceil(2 * M_PI_F * rad / grid.z), 8, CIRCLE_ANGLES);
+		for (int a = 0; a < angles; a++)
+		{
+			float angle = (a + 0.5f) * 2 * M_PI_F / angles;
+			float2 dir = (float2)(cos(angle), sin(angle));
+			if (dot(dir, p) <= 0)
+			{
+				continue;
+			}
+
+			int2 v = convert_int2(floor((p + rad * dir - grid.xy) / grid.z));
+			if (any(v < 0) || any(v >= dims.xy))
+			{
+				continue;
+			}
+			atomic_inc(&votes[(r * dims.y + v.y) * dims.x + v.x]);
+		}
+	}
+}
+
+// each cell is scored by the votes of its 3x3x3 neighbourhood like scoreHough
+__kernel void scoreCircles(
+	__global int*	votes,
+	__global float* scores,
+	int4			dims)
+{
+	int g_id = get_global_id(0);
+	int3 v = (int3)(g_id % dims.x, g_id / dims.x % dims.y, g_id / (dims.x * dims.y));
+	if (votes[g_id] == 0)
+	{
+		scores[g_id] = 0;
+		return;
+	}
+
+	int sum = 0;
+	for (int r = max(v.z - 1, 0); r <= min(v.z + 1, dims.z - 1); r++)
+	{
+		for (int z = max(v.y - 1, 0); z <= min(v.y + 1, dims.y - 1); z++)
+		{
+			for (int x = max(v.x - 1, 0); x <= min(v.x + 1, dims.x - 1); x++)
+			{
+				sum += votes[(r * dims.y + z) * dims.x + x];
+			}
+		}
+	}
+	scores[g_id] = sum;
+}
+
+// circle of the selected peak as (x, z, radius), the vote weighted mean of its neighbourhood
+__kernel void circleCenter(
+	__global int*	 votes,
+	__global ulong*	 best,
+	__global model3* out,
+	float4			 grid,
+	float2			 radius,
+	int4			 dims)
+{
+	int peak = (uint)best[0];
+	int3 v = (int3)(peak % dims.x, peak / dims.x % dims.y, peak / (dims.x * dims.y));
+
+	float3 circle = (float3)(0);
+	int sum = 0;
+	for (int r = max(v.z - 1, 0); r <= min(v.z + 1, dims.z - 1); r++)
+	{
+		for (int z = max(v.y - 1, 0); z <= min(v.y + 1, dims.y - 1); z++)
+		{
+			for (int x = max(v.x - 1, 0); x <= min(v.x + 1, dims.x - 1); x++)
+			{
+				int n = votes[(r * dims.y + z) * dims.x + x];
+				circle += n * ((float3)(x, z, r) + 0.5f);
+				sum += n;
+			}
+		}
+	}
+	circle /= max(sum, 1);
+	STORE3(out, 0, (float3)(grid.xy + grid.z * circle.xy, radius.x + radius.y * circle.z));
 }
\ No newline at end of file
@@ -0,0 +1,158 @@
+// Planes from 3 points, shared by the cylinder program for the ground and the
+// primitive program for walls and boards. They are stored as a point and a unit
+// normal in two buffers.
+__kernel void calcPlane(
+	__global float4* data,
+	__global int3*	 idx,
+	__global model3* points,
+	__global model3* normals)
+{
+	int g_id = get_global_id(0);
+	int3 ids = idx[g_id];
+
+	// get the 3 assigned random points
+	float3 p1 = data[ids.x].xyz;
+	float3 p2 = data[ids.y].xyz;
+	float3 p3 = data[ids.z].xyz;
+
+	// calculate normal of plane defined by the 3 points
+	float3 v1 = p2 - p1;
+	float3 v2 = p3 - p1;
+	float3 norm = cross(v1, v2);
+
+	// collinear points leave a null normal, which is rejected by the priors
+	if (dot(norm, norm) > 0)
+	{
+		norm = normalize(norm);
+	}
+
+	// store plane data
+	STORE3(points, g_id, p1);
+	STORE3(normals, g_id, norm);
+}
+
+// zeroes the normals of the planes tilted more than the prior allows,
+// planes with null normals are skipped by the scoring kernels
+__kernel void checkPlane(
+	__global model3* normals,
+	float			 minUp)	// cosine of the largest tilt from the y axis
+{
+	int g_id = get_global_id(0);
+	if (fabs(LOAD3(normals, g_id).y) < minUp)
+	{
+		STORE3(normals, g_id, (float3)(0));
+	}
+}
+
+// planes are scored as (point, 0, normal, 0), the ones with null normals are skipped
+float8 loadPlane(__global model3* points, __global model3* normals, int i)
+{
+	return (float8)(LOAD3(points, i), 0, LOAD3(normals, i), 0);
+}
+
+bool validPlane(float8 plane)
+{
+	return dot(plane.hi.xyz, plane.hi.xyz) > 0;
+}
+
+// the residual is <normal, point - plane_point>
+float residualPlane(float3 p, float8 plane)
+{
+	return dot(plane.hi.xyz, p - plane.lo.xyz);
+}
+
+RANSAC_KERNELS(Plane, float8, (__global model3* points, __global model3* normals), (points, normals))
+
+__kernel void fillPlane(
+	__global float4* data,
+	__global model3* points,
+	__global model3* normals,
+	float			 threshold)
+{
+	int g_id = get_global_id(0);
+	float3 point = data[g_id].xyz;
+
+	float3 p = LOAD3(points, 0);
+	float3 n = LOAD3(normals, 0);
+	
+	// point is on plane if |<normal, point - plane_point>| < threshold
+	data[g_id].w = fabs(dot(n, point - p)) < threshold ? 0.25 : 0;
+}
+
+// weighted least squares refinement of the plane in points[0] and normals[0],
+// run as a single work-group: the inliers are weighted with Tukey's biweight
+// of their distance, and the plane is replaced by their weighted centroid and
+// the smallest eigenvector of their weighted covariance. stats get the inlier
+// count and sum of squared distances from the old plane, then the weighted sums.
+__kernel void refinePlane(
+	__global float4* data,
+	__global model3* points,
+	__global model3* normals,
+	__global float*	 stats,		// 12 values
+	__local  float*	 scratch,	// one value per work item
+	int				 count,
+	float			 threshold)
+{
+	float3 p0 = LOAD3(points, 0);
+	float3 n0 = LOAD3(normals, 0);
+
+	// moments relative to the old plane point, which keeps them small
+	float sums[12];
+	for (int k = 0; k < 12; k++)
+	{
+		sums[k] = 0;
+	}
+	for (int i = get_local_id(0); i < count; i += get_local_size(0))
+	{
+		float3 d = data[i].xyz - p0;
+		float e = dot(n0, d);
+		if (fabs(e) < threshold)
+		{
+			float u = 1 - (e * e) / (threshold * threshold);
+			float w = u * u;
+			sums[0] += 1;
+			sums[1] += e * e;
+			sums[2] += w;
+			sums[3] += w * d.x;
+			sums[4] += w * d.y;
+			sums[5] += w * d.z;
+			sums[6] += w * d.x * d.x;
+			sums[7] += w * d.x * d.y;
+			sums[8] += w * d.x * d.z;
+			sums[9] += w * d.y * d.y;
+			sums[10] += w * d.y * d.z;
+			sums[11] += w * d.z * d.z;
+		}
+	}
+
+	for (int k = 0; k < 12; k++)
+	{
+		sums[k] = groupSum(sums[k], scratch);
+	}
+	if (get_local_id(0) != 0)
+	{
+		return;
+	}
+
+	for (int k = 0; k < 12; k++)
+	{
+		stats[k] = sums[k];
+	}
+	if (sums[2] <= 0 || sums[0] < 3)
+	{
+		return;
+	}
+
+	float w = sums[2];
+	float3 m = (float3)(sums[3], sums[4], sums[5]) / w;
+	float3 normal = smallestEigenvector(
+		sums[6] / w - m.x * m.x, sums[7] / w - m.x * m.y, sums[8] / w - m.x * m.z,
+		sums[9] / w - m.y * m.y, sums[10] / w - m.y * m.z, sums[11] / w - m.z * m.z);
+	if (dot(normal, normal) == 0)
+	{
+		return;
+	}
+
+	STORE3(points, 0, p0 + m);
+	STORE3(normals, 0, dot(normal, n0) < 0 ? -normal : normal);
+}
\ No newline at end of file
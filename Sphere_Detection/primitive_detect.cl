@@ -0,0 +1,382 @@
+// Cones and tori of any orientation, fitted to oriented points next to the
+// planes of plane_detect.cl. Both are stored as float8, degenerate and
+// implausible hypotheses are zeroed and skipped by the scoring kernels.
+
+// compacts the points inside the box that are further than minRange from the
+// sensor, which drops the missing returns at the origin
+__kernel void cropPoints(
+	__global float4* data,
+	__global float4* points,
+	__global int*	 count,	// zeroed before the launch
+	float4			 low,
+	float4			 high,
+	float			 minRange)
+{
+	int g_id = get_global_id(0);
+	float3 p = data[g_id].xyz;
+	if (length(p) <= minRange || any(p < low.xyz) || any(p > high.xyz))
+	{
+		return;
+	}
+
+	points[atomic_inc(count)] = (float4)(p, 0);
+}
+
+// Cones are (apex, half angle, axis, height): the unit axis points from the
+// apex into the cone, the height of the inliers stays 0 until they are measured.
+
+// the distance of a point from the cone surface, positive outside;
+// points behind the apex are as far as the apex itself
+float residualCone(float3 p, float8 cone)
+{
+	float3 d = p - cone.lo.xyz;
+	float h = dot(d, cone.hi.xyz);
+	float r = length(d - h * cone.hi.xyz);
+	float s = sin(cone.s3);
+	float c = cos(cone.s3);
+	return h * c + r * s < 0 ? length(d) : r * c - h * s;
+}
+
+// cone from 3 oriented points (Schnabel et al.: Efficient RANSAC for Point-Cloud
+// Shape Detection): the apex is where the 3 tangent planes meet, the axis is the
+// normal of the plane through the unit directions from the apex to the points,
+// and the half angle is their mean angle from the axis; degenerate samples,
+// like planes and cylinders, get angle 0
+__kernel void calcCone(
+	__global float3* data,
+	__global float4* normals,
+	__global int3*   rand,
+	__global float8* cones)
+{
+	int g_id = get_global_id(0);
+	int3 ids = rand[g_id];
+	float3 p1 = data[ids.x];
+	float3 p2 = data[ids.y];
+	float3 p3 = data[ids.z];
+	float4 n1 = normals[ids.x];
+	float4 n2 = normals[ids.y];
+	float4 n3 = normals[ids.z];
+
+	float3 c23 = cross(n2.xyz, n3.xyz);
+	float det = dot(n1.xyz, c23);
+	if (n1.w == 0 || n2.w == 0 || n3.w == 0 || fabs(det) < 1e-4f)
+	{
+		cones[g_id] = (float8)(0);
+		return;
+	}
+
+	float3 apex = (dot(n1.xyz, p1) * c23
+				 + dot(n2.xyz, p2) * cross(n3.xyz, n1.xyz)
+				 + dot(n3.xyz, p3) * cross(n1.xyz, n2.xyz)) / det;
+
+	float3 d1 = p1 - apex;
+	float3 d2 = p2 - apex;
+	float3 d3 = p3 - apex;
+	if (min(dot(d1, d1), min(dot(d2, d2), dot(d3, d3))) < 1e-6f)
+	{
+		cones[g_id] = (float8)(0);
+		return;
+	}
+
+	float3 u1 = normalize(d1);
+	float3 u2 = normalize(d2);
+	float3 u3 = normalize(d3);
+	float3 axis = cross(u2 - u1, u3 - u1);
+	if (dot(axis, axis) < 1e-8f)
+	{
+		cones[g_id] = (float8)(0);
+		return;
+	}
+	axis = normalize(axis);
+	if (dot(axis, u1 + u2 + u3) < 0)
+	{
+		axis = -axis;
+	}
+
+	float angle = (acos(clamp(dot(u1, axis), -1.0f, 1.0f))
+				 + acos(clamp(dot(u2, axis), -1.0f, 1.0f))
+				 + acos(clamp(dot(u3, axis), -1.0f, 1.0f))) / 3;
+	cones[g_id] = (float8)(apex, angle, axis, 0);
+}
+
+// zeroes the cones outside the half angle range or with the apex outside the box
+__kernel void checkCone(
+	__global float8* cones,
+	float2			 angle,	// smallest and largest half angle
+	float4			 low,
+	float4			 high)
+{
+	int g_id = get_global_id(0);
+	float4 cone = cones[g_id].lo;
+	if (cone.w < angle.x || cone.w > angle.y || any(cone.xyz < low.xyz) || any(cone.xyz > high.xyz))
+	{
+		cones[g_id] = (float8)(0);
+	}
+}
+
+float8 loadCone(__global float8* cones, int i)
+{
+	return cones[i];
+}
+
+bool validCone(float8 cone)
+{
+	return cone.s3 != 0;
+}
+
+RANSAC_KERNELS(Cone, float8, (__global float8* cones), (cones))
+
+// inlier count, sum of the squared residuals and height of the inliers along
+// the axis of the best cone, run as a single work-group; the height is stored
+// with the axis
+__kernel void measureCone(
+	__global float3* data,
+	__global float8* cones,
+	__global float*	 stats,
+	__local  float4* scratch,	// one value per work item
+	int				 size,
+	float			 threshold)
+{
+	int l_id = get_local_id(0);
+	float8 cone = cones[0];
+
+	// inliers, squares and highest position along the axis
+	float4 sums = (float4)(0, 0, 0, 0);
+	for (int i = l_id; i < size; i += get_local_size(0))
+	{
+		float3 p = data[i];
+		float e = residualCone(p, cone);
+		if (fabs(e) < threshold)
+		{
+			sums.x += 1;
+			sums.y += e * e;
+			sums.z = max(sums.z, dot(p - cone.lo.xyz, cone.hi.xyz));
+		}
+	}
+	scratch[l_id] = sums;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
+	{
+		if (l_id < offset)
+		{
+			float4 a = scratch[l_id];
+			float4 b = scratch[l_id + offset];
+			scratch[l_id] = (float4)(a.x + b.x, a.y + b.y, max(a.z, b.z), 0);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (l_id == 0)
+	{
+		sums = scratch[0];
+		stats[0] = sums.x;
+		stats[1] = sums.y;
+		if (sums.x > 0)
+		{
+			cones[0].s7 = sums.z;
+		}
+	}
+}
+
+__kernel void fillCone(
+	__global float4* data,
+	__global float8* cones,
+	float			 threshold)
+{
+	int g_id = get_global_id(0);
+	float3 p = data[g_id].xyz;
+	float8 cone = cones[0];
+
+	// only the measured part of the cone is marked
+	float h = dot(p - cone.lo.xyz, cone.hi.xyz);
+	bool inside = cone.s7 == 0 || (h >= 0 && h <= cone.s7);
+
+	data[g_id].w = inside && fabs(residualCone(p, cone)) < threshold ? 0.75 : 0;
+}
+
+// Tori are (center, ring radius, axis, tube radius): the ring is the circle of
+// the tube centers around the unit axis, which points upwards.
+
+#define TORUS_STEPS 16		// brackets of the tube radius range searched for roots
+#define TORUS_BISECTIONS 10	// steps refining a root
+
+// the distance of a point from the ring minus the tube radius
+float residualTorus(float3 p, float8 torus)
+{
+	float3 d = p - torus.lo.xyz;
+	float h = dot(d, torus.hi.xyz);
+	float r = length(d - h * torus.hi.xyz);
+	return length((float2)(r - torus.s3, h)) - torus.s7;
+}
+
+// 6 times the signed volume of the tetrahedron of the tube centers of 4
+// oriented points for the tube radius r, 0 when the centers are coplanar
+float tubeVolume(float3* p, float3* n, float r)
+{
+	float3 q0 = p[0] - r * n[0];
+	float3 q1 = p[1] - r * n[1];
+	float3 q2 = p[2] - r * n[2];
+	float3 q3 = p[3] - r * n[3];
+	return dot(q1 - q0, cross(q2 - q0, q3 - q0));
+}
+
+// circle through 3 points as (center, radius) with the unit normal of its
+// plane, collinear points get radius 0
+float4 spaceCircle(float3 a, float3 b, float3 c, float3* normal)
+{
+	float3 u = a - c;
+	float3 v = b - c;
+	float3 w = cross(u, v);
+	float ww = dot(w, w);
+	if (ww < 1e-10f)
+	{
+		return (float4)(0);
+	}
+
+	float3 center = c + cross(dot(u, u) * v - dot(v, v) * u, w) / (2 * ww);
+	*normal = w / sqrt(ww);
+	return (float4)(center, distance(center, c));
+}
+
+// torus from 4 oriented points: the tube centers p - r n of the points lie on
+// the ring, so the tube radius is a root of the coplanarity of the 4 centers,
+// which is cubic in r. The roots are bracketed on steps of the tube radius range
+// and bisected, the ring of each root is the circle through the first 3 centers,
+// and the root whose ring passes closest to the 4th center is kept. Samples
+// without a ring within a quarter of the tube radius of the 4th center get
+// tube radius 0.
+__kernel void calcTorus(
+	__global float3* data,
+	__global float4* normals,
+	__global int4*   rand,
+	__global float8* tori,
+	float2			 radius)	// smallest and largest tube radius
+{
+	int g_id = get_global_id(0);
+	int4 ids = rand[g_id];
+	float4 m[4] = { normals[ids.x], normals[ids.y], normals[ids.z], normals[ids.w] };
+	if (m[0].w == 0 || m[1].w == 0 || m[2].w == 0 || m[3].w == 0)
+	{
+		tori[g_id] = (float8)(0);
+		return;
+	}
+	float3 p[4] = { data[ids.x], data[ids.y], data[ids.z], data[ids.w] };
+	float3 n[4] = { m[0].xyz, m[1].xyz, m[2].xyz, m[3].xyz };
+
+	float8 torus = (float8)(0);
+	float best = MAXFLOAT;
+	float step = (radius.y - radius.x) / TORUS_STEPS;
+	float r0 = radius.x;
+	float f0 = tubeVolume(p, n, r0);
+	for (int i = 1; i <= TORUS_STEPS; i++)
+	{
+		float r1 = radius.x + i * step;
+		float f1 = tubeVolume(p, n, r1);
+		if (f0 * f1 <= 0)
+		{
+			float lo = r0;
+			float hi = r1;
+			float flo = f0;
+			for (int k = 0; k < TORUS_BISECTIONS; k++)
+			{
+				float mid = 0.5f * (lo + hi);
+				float fmid = tubeVolume(p, n, mid);
+				if (flo * fmid <= 0)
+				{
+					hi = mid;
+				}
+				else
+				{
+					lo = mid;
+					flo = fmid;
+				}
+			}
+
+			float r = 0.5f * (lo + hi);
+			float3 axis;
+			float4 ring = spaceCircle(p[0] - r * n[0], p[1] - r * n[1], p[2] - r * n[2], &axis);
+			if (ring.w > 0)
+			{
+				float3 d = p[3] - r * n[3] - ring.xyz;
+				float h = dot(d, axis);
+				float e = fabs(length(d - h * axis) - ring.w) + fabs(h);
+				if (e < best)
+				{
+					best = e;
+					torus = (float8)(ring, axis.y < 0 ? -axis : axis, r);
+				}
+			}
+		}
+		r0 = r1;
+		f0 = f1;
+	}
+
+	tori[g_id] = best < 0.25f * torus.s7 ? torus : (float8)(0);
+}
+
+// zeroes the tori with a radius outside the range, a ring not larger than
+// the tube or the center outside the box
+__kernel void checkTorus(
+	__global float8* tori,
+	float2			 radius,	// smallest and largest radius of the ring and the tube
+	float4			 low,
+	float4			 high)
+{
+	int g_id = get_global_id(0);
+	float8 torus = tori[g_id];
+	if (torus.s7 < radius.x || torus.s3 <= torus.s7 || torus.s3 > radius.y
+		|| any(torus.lo.xyz < low.xyz) || any(torus.lo.xyz > high.xyz))
+	{
+		tori[g_id] = (float8)(0);
+	}
+}
+
+float8 loadTorus(__global float8* tori, int i)
+{
+	return tori[i];
+}
+
+bool validTorus(float8 torus)
+{
+	return torus.s7 != 0;
+}
+
+RANSAC_KERNELS(Torus, float8, (__global float8* tori), (tori))
+
+// inlier count and sum of the squared residuals of the inliers of
+// the best torus, run as a single work-group
+__kernel void measureTorus(
+	__global float3* data,
+	__global float8* tori,
+	__global float*	 stats,
+	__local  float*	 scratch,	// one value per work item
+	int				 size,
+	float			 threshold)
+{
+	float8 torus = tori[0];
+
+	float inliers = 0;
+	float squares = 0;
+	for (int i = get_local_id(0); i < size; i += get_local_size(0))
+	{
+		float e = residualTorus(data[i], torus);
+		if (fabs(e) < threshold)
+		{
+			inliers += 1;
+			squares += e * e;
+		}
+	}
+
+	groupScore(inliers, scratch, stats);
+	groupScore(squares, scratch, stats + 1);
+}
+
+__kernel void fillTorus(
+	__global float4* data,
+	__global float8* tori,
+	float			 threshold)
+{
+	int g_id = get_global_id(0);
+	data[g_id].w = fabs(residualTorus(data[g_id].xyz, tori[0])) < threshold ? 0.75 : 0;
+}
\ No newline at end of file
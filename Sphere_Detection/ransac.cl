@@ -0,0 +1,696 @@
+#ifdef cl_khr_int64_extended_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+#endif
+
+// Shared part of the detection programs, prepended to the source of each: the
+// NAPSAC / PROSAC sampling of the points, the scoring and SPRT verification of
+// the hypotheses of any model type, and the selection of the best of them.
+
+// scoring functions, same values as ScoreMode on the host
+#define RANSAC_SCORE 0
+#define MSAC_SCORE 1
+#define MLESAC_SCORE 2
+
+// MLESAC mixture density ratio at zero residual: inlier ratio 0.5,
+// inlier sigma threshold / 1.96, outliers uniform over 10 * threshold
+#define MLESAC_RATIO 7.82f
+
+// layout of the float3 hypothesis buffers: 16 bytes like cl_float3, or packed
+// to 12 bytes and accessed with vload3 / vstore3 when the program is built with
+// PACKED_FLOAT3, which the host defines together with FLOAT3_WIDTH
+#ifdef PACKED_FLOAT3
+typedef float model3;
+#define LOAD3(p, i) vload3((i), (p))
+#define STORE3(p, i, v) vstore3((v), (i), (p))
+#else
+typedef float3 model3;
+#define LOAD3(p, i) ((p)[i])
+#define STORE3(p, i, v) ((p)[i] = (v))
+#endif
+
+// primes larger than the cloud size, used as strides for shuffled point order
+__constant int SPRT_STRIDES[8] = { 14983, 15013, 15017, 15031, 15053, 15061, 15073, 15077 };
+
+// shuffled visiting order for randomized verification:
+// random start and a stride coprime to count
+int2 sprtOrder(int g_id, uint seed, int count)
+{
+	uint h = (g_id ^ seed) * 2654435761u;
+	h ^= h >> 16;
+	return (int2)(h % count, SPRT_STRIDES[(h >> 8) & 7] % count);
+}
+
+// score of a point with residual e, an exact fit scores 1 in every mode
+float pointScore(float e, float threshold, int mode)
+{
+	float e2 = (e * e) / (threshold * threshold);
+	if (mode == MSAC_SCORE)
+	{
+		// truncated quadratic loss
+		return max(1 - e2, 0.0f);
+	}
+	if (mode == MLESAC_SCORE)
+	{
+		// log likelihood of the inlier / outlier mixture relative to a pure outlier
+		return log(1 + MLESAC_RATIO * exp(-0.5f * 1.96f * 1.96f * e2)) / log(1 + MLESAC_RATIO);
+	}
+	return e2 < 1 ? 1 : 0;
+}
+
+// sums a value over the work-group, every work item gets the sum
+float groupSum(float value, __local float* scratch)
+{
+	int l_id = get_local_id(0);
+	scratch[l_id] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
+	{
+		if (l_id < offset)
+		{
+			scratch[l_id] += scratch[l_id + offset];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	float sum = scratch[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return sum;
+}
+
+// minimum of a value over the work-group, every work item gets the minimum
+float groupMin(float value, __local float* scratch)
+{
+	int l_id = get_local_id(0);
+	scratch[l_id] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
+	{
+		if (l_id < offset)
+		{
+			scratch[l_id] = min(scratch[l_id], scratch[l_id + offset]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	float result = scratch[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return result;
+}
+
+// sums the work items' scores over the work-group,
+// the first work item writes the sum to the group's slot
+void groupScore(
+	float			score,
+	__local	 float* scratch,
+	__global float* scores)
+{
+	float sum = groupSum(score, scratch);
+	if (get_local_id(0) == 0)
+	{
+		scores[get_group_id(0)] = sum;
+	}
+}
+
+// NAPSAC sampling: the points are bucketed into a uniform grid on the device,
+// a minimal sample is a random seed point and points from its 3x3x3 cell
+// neighbourhood, so most samples are drawn from a single object
+
+// samples retry neighbours this many times before drawing uniformly
+#define SAMPLE_TRIES 8
+
+// xorshift random numbers for the device side sampling
+uint nextRandom(uint* state)
+{
+	uint x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// grid is the origin and the cell size, dims the number of cells along the axes
+int gridCell(float3 p, float4 grid, int4 dims)
+{
+	int3 c = convert_int3(floor((p - grid.xyz) / grid.w));
+	c = clamp(c, (int3)(0), dims.xyz - 1);
+	return (c.z * dims.y + c.y) * dims.x + c.x;
+}
+
+__kernel void countCells(
+	__global float3* data,
+	__global int*	 cells,		 // cell of each point
+	__global int*	 cellCounts, // zeroed by the host
+	int				 count,
+	float4			 grid,
+	int4			 dims)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	int cell = gridCell(data[g_id].xyz, grid, dims);
+	cells[g_id] = cell;
+	atomic_inc(&cellCounts[cell]);
+}
+
+// exclusive prefix sum of the cell counts in a single work-group, each work item
+// scans a chunk of cells; the counts are zeroed for scatterCells to count again
+__kernel void scanCells(
+	__global int* cellCounts,
+	__global int* cellStarts,
+	__local  int* scratch,	// one value per work item
+	int			  cellNum)
+{
+	int l_id = get_local_id(0);
+	int l_size = get_local_size(0);
+	int chunk = (cellNum + l_size - 1) / l_size;
+	int begin = min(l_id * chunk, cellNum);
+	int end = min(begin + chunk, cellNum);
+
+	int sum = 0;
+	for (int i = begin; i < end; i++)
+	{
+		sum += cellCounts[i];
+	}
+	scratch[l_id] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// inclusive scan of the chunk sums
+	for (int offset = 1; offset < l_size; offset *= 2)
+	{
+		int value = l_id >= offset ? scratch[l_id - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[l_id] += value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	int start = scratch[l_id] - sum;
+	for (int i = begin; i < end; i++)
+	{
+		cellStarts[i] = start;
+		start += cellCounts[i];
+		cellCounts[i] = 0;
+	}
+}
+
+// orders the point indices by cell
+__kernel void scatterCells(
+	__global int* cells,
+	__global int* cellStarts,
+	__global int* cellCounts,
+	__global int* sorted,
+	int			  count)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	int cell = cells[g_id];
+	sorted[cellStarts[cell] + atomic_inc(&cellCounts[cell])] = g_id;
+}
+
+// the r-th point of the cells between lo and hi
+int neighbourPoint(
+	__global int* cellStarts,
+	__global int* cellCounts,
+	__global int* sorted,
+	int3		  lo,
+	int3		  hi,
+	int4		  dims,
+	int			  r)
+{
+	for (int z = lo.z; z <= hi.z; z++)
+	{
+		for (int y = lo.y; y <= hi.y; y++)
+		{
+			for (int x = lo.x; x <= hi.x; x++)
+			{
+				int cell = (z * dims.y + y) * dims.x + x;
+				if (r < cellCounts[cell])
+				{
+					return sorted[cellStarts[cell] + r];
+				}
+				r -= cellCounts[cell];
+			}
+		}
+	}
+	return -1;
+}
+
+// draws size distinct point indices for each hypothesis, 4 indices apart;
+// seeds without enough neighbours fall back to uniform sampling
+__kernel void sampleLocal(
+	__global int* cells,
+	__global int* cellStarts,
+	__global int* cellCounts,
+	__global int* sorted,
+	__global int* idx,
+	int			  count,
+	uint		  seed,
+	int4		  dims,
+	int			  size)
+{
+	int g_id = get_global_id(0);
+	uint state = ((g_id ^ seed) * 2654435761u) | 1;
+
+	int sample[4];
+	sample[0] = nextRandom(&state) % count;
+
+	int cell = cells[sample[0]];
+	int3 c = (int3)(cell % dims.x, (cell / dims.x) % dims.y, cell / (dims.x * dims.y));
+	int3 lo = max(c - 1, (int3)(0));
+	int3 hi = min(c + 1, dims.xyz - 1);
+
+	int total = 0;
+	for (int z = lo.z; z <= hi.z; z++)
+	{
+		for (int y = lo.y; y <= hi.y; y++)
+		{
+			for (int x = lo.x; x <= hi.x; x++)
+			{
+				total += cellCounts[(z * dims.y + y) * dims.x + x];
+			}
+		}
+	}
+
+	for (int i = 1; i < size; i++)
+	{
+		int point;
+		bool unique;
+		int tries = 0;
+		do
+		{
+			if (total >= size && tries < SAMPLE_TRIES)
+			{
+				point = neighbourPoint(cellStarts, cellCounts, sorted, lo, hi, dims, nextRandom(&state) % total);
+			}
+			else
+			{
+				point = nextRandom(&state) % count;
+			}
+			tries++;
+
+			unique = true;
+			for (int j = 0; j < i; j++)
+			{
+				unique = unique && point != sample[j];
+			}
+		} while (!unique);
+		sample[i] = point;
+	}
+
+	for (int i = 0; i < size; i++)
+	{
+		idx[g_id * 4 + i] = sample[i];
+	}
+}
+
+// eigenvector of the smallest eigenvalue of a symmetric 3x3 matrix,
+// the eigenvalue is found in closed form (Smith: Eigenvalues of a symmetric 3x3 matrix)
+float3 smallestEigenvector(float a00, float a01, float a02, float a11, float a12, float a22)
+{
+	float q = (a00 + a11 + a22) / 3;
+	float p1 = a01 * a01 + a02 * a02 + a12 * a12;
+	float p2 = (a00 - q) * (a00 - q) + (a11 - q) * (a11 - q) + (a22 - q) * (a22 - q) + 2 * p1;
+	float p = sqrt(p2 / 6);
+	if (p < 1e-12f)
+	{
+		return (float3)(0);
+	}
+
+	// eigenvalues of B = (A - qI) / p are 2cos(phi + 2k pi / 3)
+	float b00 = (a00 - q) / p, b11 = (a11 - q) / p, b22 = (a22 - q) / p;
+	float b01 = a01 / p, b02 = a02 / p, b12 = a12 / p;
+	float r = 0.5f * (b00 * (b11 * b22 - b12 * b12) - b01 * (b01 * b22 - b12 * b02) + b02 * (b01 * b12 - b11 * b02));
+	float phi = acos(clamp(r, -1.0f, 1.0f)) / 3;
+	float lambda = q + 2 * p * cos(phi + 2.0943951f);
+
+	// the eigenvector is orthogonal to the rows of A - lambda I
+	float3 r0 = (float3)(a00 - lambda, a01, a02);
+	float3 r1 = (float3)(a01, a11 - lambda, a12);
+	float3 r2 = (float3)(a02, a12, a22 - lambda);
+	float3 c0 = cross(r0, r1);
+	float3 c1 = cross(r0, r2);
+	float3 c2 = cross(r1, r2);
+	float d0 = dot(c0, c0), d1 = dot(c1, c1), d2 = dot(c2, c2);
+	float3 v = d0 >= d1 && d0 >= d2 ? c0 : (d1 >= d2 ? c1 : c2);
+	float d = max(d0, max(d1, d2));
+	return d > 0 ? v * rsqrt(d) : (float3)(0);
+}
+
+// normal of each point from the covariance of its neighbours within radius,
+// found in the cells of the sampling grid; the normals face the sensor at the
+// origin, w is 1 for valid normals and 0 with too few neighbours
+__kernel void estimateNormals(
+	__global float3* data,
+	__global int*	 cells,
+	__global int*	 cellStarts,
+	__global int*	 cellCounts,
+	__global int*	 sorted,
+	__global float4* normals,
+	int				 count,
+	int4			 dims,
+	float			 radius)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	float3 p = data[g_id].xyz;
+	int cell = cells[g_id];
+	int3 c = (int3)(cell % dims.x, (cell / dims.x) % dims.y, cell / (dims.x * dims.y));
+	int3 lo = max(c - 1, (int3)(0));
+	int3 hi = min(c + 1, dims.xyz - 1);
+
+	// moments relative to the point itself
+	int n = 0;
+	float3 sum = (float3)(0);
+	float s00 = 0, s01 = 0, s02 = 0, s11 = 0, s12 = 0, s22 = 0;
+	for (int z = lo.z; z <= hi.z; z++)
+	{
+		for (int y = lo.y; y <= hi.y; y++)
+		{
+			for (int x = lo.x; x <= hi.x; x++)
+			{
+				int neighbour = (z * dims.y + y) * dims.x + x;
+				int start = cellStarts[neighbour];
+				for (int i = start; i < start + cellCounts[neighbour]; i++)
+				{
+					float3 q = data[sorted[i]].xyz - p;
+					if (dot(q, q) < radius * radius)
+					{
+						n++;
+						sum += q;
+						s00 += q.x * q.x; s01 += q.x * q.y; s02 += q.x * q.z;
+						s11 += q.y * q.y; s12 += q.y * q.z; s22 += q.z * q.z;
+					}
+				}
+			}
+		}
+	}
+
+	if (n < 3)
+	{
+		normals[g_id] = (float4)(0);
+		return;
+	}
+
+	float3 m = sum / n;
+	float3 normal = smallestEigenvector(
+		s00 / n - m.x * m.x, s01 / n - m.x * m.y, s02 / n - m.x * m.z,
+		s11 / n - m.y * m.y, s12 / n - m.y * m.z, s22 / n - m.z * m.z);
+
+	if (dot(normal, p) > 0)
+	{
+		normal = -normal;
+	}
+	normals[g_id] = (float4)(normal, dot(normal, normal) > 0 ? 1 : 0);
+}
+
+// PROSAC: orders the points by descending quality stored in w, ties by index;
+// each work item counts the points ranked before its own
+__kernel void sortQuality(
+	__global float4* data,
+	__global float4* out,
+	int				 count)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	float quality = data[g_id].w;
+	int rank = 0;
+	for (int i = 0; i < count; i++)
+	{
+		float q = data[i].w;
+		rank += q > quality || (q == quality && i < g_id);
+	}
+	out[rank] = data[g_id];
+}
+
+// closest points of the lines p1 + t1 n1 and p2 + t2 n2, returns false for parallel lines
+bool closestPoints(float3 p1, float3 n1, float3 p2, float3 n2, float* t1, float* t2)
+{
+	float3 w = p1 - p2;
+	float b = dot(n1, n2);
+	float d = dot(n1, w);
+	float e = dot(n2, w);
+	float den = dot(n1, n1) * dot(n2, n2) - b * b;
+	if (den < 1e-4f)
+	{
+		return false;
+	}
+	*t1 = (b * e - d * dot(n2, n2)) / den;
+	*t2 = (dot(n1, n1) * e - b * d) / den;
+	return true;
+}
+
+// packs a score with its hypothesis index, so that the maximum of the packed
+// values is the best score with its index (as_uint keeps the order of
+// non-negative floats), nan and negative scores are packed as 0
+ulong packScore(float score, int idx)
+{
+	score = score > 0 ? score : 0;
+	return ((ulong)as_uint(score) << 32) | (uint)idx;
+}
+
+// sorts n (a power of two) values in local memory descending,
+// one work item per value
+void bitonicSort(__local ulong* data, int n)
+{
+	int l_id = get_local_id(0);
+	for (int size = 2; size <= n; size <<= 1)
+	{
+		for (int stride = size / 2; stride > 0; stride >>= 1)
+		{
+			int j = l_id ^ stride;
+			if (j > l_id)
+			{
+				ulong a = data[l_id];
+				ulong b = data[j];
+				if ((a < b) == ((l_id & size) == 0))
+				{
+					data[l_id] = b;
+					data[j] = a;
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+	}
+}
+
+// single launch selection of the best hypothesis: (score, index) pairs are
+// packed into 64 bits, so their maximum is the best score with its index,
+// the hypotheses are left intact and only the packed winner is written.
+// The work-groups' maxima are merged with atom_max, without 64 bit atomics
+// the kernel has to run as a single work-group.
+__kernel void selectBest(
+	__global float*	scores,
+	__global ulong*	best,		// zeroed before the launch
+	__local  ulong*	scratch,	// one value per work item
+	int				count)
+{
+	int l_id = get_local_id(0);
+
+	ulong packed = 0;
+	for (int i = get_global_id(0); i < count; i += get_global_size(0))
+	{
+		packed = max(packed, packScore(scores[i], i));
+	}
+	scratch[l_id] = packed;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
+	{
+		if (l_id < offset)
+		{
+			scratch[l_id] = max(scratch[l_id], scratch[l_id + offset]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (l_id == 0)
+	{
+#ifdef cl_khr_int64_extended_atomics
+		atom_max(best, scratch[0]);
+#else
+		best[0] = scratch[0];
+#endif
+	}
+}
+
+// top-K selection, first pass: each work-group sorts its part of the scores
+// and keeps the k best packed (score, index) pairs
+__kernel void topScores(
+	__global float*	scores,
+	__global ulong*	out,		// k values per work-group
+	__local  ulong*	scratch,	// one value per work item
+	int				count,
+	int				k)
+{
+	int l_id = get_local_id(0);
+	int g_id = get_global_id(0);
+	scratch[l_id] = g_id < count ? packScore(scores[g_id], g_id) : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	bitonicSort(scratch, get_local_size(0));
+
+	if (l_id < k)
+	{
+		out[get_group_id(0) * k + l_id] = scratch[l_id];
+	}
+}
+
+// top-K selection, further passes merge the k best of the previous
+// work-groups until a single work-group is left
+__kernel void topKeys(
+	__global ulong*	keys,
+	__global ulong*	out,		// k values per work-group
+	__local  ulong*	scratch,	// one value per work item
+	int				count,
+	int				k)
+{
+	int l_id = get_local_id(0);
+	int g_id = get_global_id(0);
+	scratch[l_id] = g_id < count ? keys[g_id] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	bitonicSort(scratch, get_local_size(0));
+
+	if (l_id < k)
+	{
+		out[get_group_id(0) * k + l_id] = scratch[l_id];
+	}
+}
+
+// copies the selected hypotheses of width floats each to out,
+// one work item per float
+__kernel void copyBest(
+	__global float*	models,
+	__global ulong*	best,
+	__global float*	out,
+	int				width)
+{
+	int g_id = get_global_id(0);
+	out[g_id] = models[(uint)best[g_id / width] * width + g_id % width];
+}
+
+// Generic RANSAC verification of a model type. A program defines for the model
+// NAME with hypotheses of type MODEL, before instancing RANSAC_KERNELS:
+//   MODEL load<NAME>(BUFFERS, int i)			hypothesis i from its buffers
+//   bool valid<NAME>(MODEL model)				false for the rejected hypotheses
+//   float residual<NAME>(float3 p, MODEL model)	signed residual of a point
+// BUFFERS and ARGS are the parenthesized parameters and arguments of the
+// hypothesis buffers. The instance gets the scoring kernels
+//   fit<NAME>(data, BUFFERS, scores, scratch, count, threshold, mode)
+//   fit<NAME>SPRT(data, BUFFERS, scores, stats, count, seed, sprt, threshold, mode)
+// which RansacEngine drives on the host, the selection is shared by all models.
+#define RANSAC_UNPACK(...) __VA_ARGS__
+
+// fit<NAME> scores each hypothesis with one work-group, the work items sum the
+// point scores over a strided part of the points; fit<NAME>SPRT is the randomized
+// verification, points are visited in a per-hypothesis shuffled order and the
+// hypothesis is abandoned as soon as the SPRT rejects it, accepted hypotheses
+// are scored like in fit<NAME>
+#define RANSAC_KERNELS(NAME, MODEL, BUFFERS, ARGS)									\
+__kernel void fit##NAME(															\
+	__global float3* data,															\
+	RANSAC_UNPACK BUFFERS,															\
+	__global float*	 scores,														\
+	__local  float*	 scratch,	/* one value per work item */						\
+	int				 count,															\
+	float			 threshold,														\
+	int				 mode)															\
+{																					\
+	MODEL model = load##NAME(RANSAC_UNPACK ARGS, get_group_id(0));					\
+																					\
+	/* rejected hypothesis, the whole group leaves before the reduction */			\
+	if (!valid##NAME(model))														\
+	{																				\
+		if (get_local_id(0) == 0)													\
+		{																			\
+			scores[get_group_id(0)] = 0;											\
+		}																			\
+		return;																		\
+	}																				\
+																					\
+	float score = 0;																\
+	for (int i = get_local_id(0); i < count; i += get_local_size(0))				\
+	{																				\
+		score += pointScore(residual##NAME(data[i], model), threshold, mode);		\
+	}																				\
+																					\
+	groupScore(score, scratch, scores);												\
+}																					\
+																					\
+__kernel void fit##NAME##SPRT(														\
+	__global float3* data,															\
+	RANSAC_UNPACK BUFFERS,															\
+	__global float*	 scores,														\
+	__global int*	 stats,	/* rejected hypotheses, points tested and their inliers */	\
+	int				 count,															\
+	uint			 seed,															\
+	float4			 sprt,	/* log inlier step, log outlier step, log threshold */	\
+	float			 threshold,														\
+	int				 mode)															\
+{																					\
+	int g_id = get_global_id(0);													\
+	MODEL model = load##NAME(RANSAC_UNPACK ARGS, g_id);								\
+																					\
+	/* rejected hypothesis, not counted in the test statistics */					\
+	if (!valid##NAME(model))														\
+	{																				\
+		scores[g_id] = 0;															\
+		return;																		\
+	}																				\
+																					\
+	int2 order = sprtOrder(g_id, seed, count);										\
+	int idx = order.x;																\
+																					\
+	float lambda = 0;																\
+	float score = 0;																\
+	int inliers = 0;																\
+	for (int i = 0; i < count; i++)													\
+	{																				\
+		float e = residual##NAME(data[idx], model);									\
+		score += pointScore(e, threshold, mode);									\
+		if (fabs(e) < threshold)													\
+		{																			\
+			inliers++;																\
+			lambda += sprt.x;														\
+		}																			\
+		else																		\
+		{																			\
+			lambda += sprt.y;														\
+		}																			\
+																					\
+		/* the hypothesis cannot be better than the current best */					\
+		if (lambda > sprt.z)														\
+		{																			\
+			atomic_inc(&stats[0]);													\
+			atomic_add(&stats[1], i + 1);											\
+			atomic_add(&stats[2], inliers);											\
+			scores[g_id] = 0;														\
+			return;																	\
+		}																			\
+																					\
+		idx += order.y;																\
+		if (idx >= count)															\
+		{																			\
+			idx -= count;															\
+		}																			\
+	}																				\
+																					\
+	scores[g_id] = score;															\
+}
\ No newline at end of file
@@ -1,7 +1,45 @@
-#define CLOUD_SIZE 14976
-#define EPSILON 0.03
 #define WIDTH 4
 #define HEIGHT 4
+#define LO_SUMS 15 // upper triangle of ATA, ATf and inlier count
+#define GN_SUMS 17 // upper triangle of JTJ, JTe, truncated cost, inlier SSR and inlier count
+#define GN_STATE 20 // lambda, cost, model, JTJ and JTe of the last accepted step
+
+// sums each work item's values over the work-group,
+// the first work item writes them to out
+void groupSums(
+	__private float* sums,
+	int				 n,
+	__local	  float* scratch,
+	__global  float* out)
+{
+	int l_id = get_local_id(0);
+	int l_size = get_local_size(0);
+	for (int k = 0; k < n; k++)
+	{
+		scratch[k * l_size + l_id] = sums[k];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int offset = l_size / 2; offset != 0; offset /= 2)
+	{
+		if (l_id < offset)
+		{
+			for (int k = 0; k < n; k++)
+			{
+				scratch[k * l_size + l_id] += scratch[k * l_size + l_id + offset];
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (l_id == 0)
+	{
+		for (int k = 0; k < n; k++)
+		{
+			out[get_group_id(0) * n + k] = scratch[k * l_size];
+		}
+	}
+}
 
 __kernel void calcSphere(
 	__global float4* data,
@@ -10,6 +48,13 @@ __kernel void calcSphere(
 {
 	int g_id = get_global_id(0);
 
+	// samples of frames too small to fit are not drawn, their spheres are rejected
+	if (idx[g_id * HEIGHT] < 0)
+	{
+		result[g_id] = (float4)(0);
+		return;
+	}
+
 	__private float4 points[HEIGHT];
 	for(int i = 0; i < HEIGHT; i++)
 	{
@@ -114,61 +159,779 @@ __kernel void calcSphere(
 	);
 }
 
-__kernel void fitSphere(
+// sphere from 2 oriented points: the center is where the normal lines meet,
+// behind both points since the normals face the sensor; invalid samples give radius 0
+__kernel void calcSphereNormals(
 	__global float4* data,
+	__global float4* normals,
+	__global int*    idx,
+	__global float4* result)
+{
+	int g_id = get_global_id(0);
+	int i1 = idx[g_id * HEIGHT];
+	int i2 = idx[g_id * HEIGHT + 1];
+	float3 p1 = data[i1].xyz;
+	float3 p2 = data[i2].xyz;
+	float4 n1 = normals[i1];
+	float4 n2 = normals[i2];
+
+	float t1, t2;
+	if (n1.w == 0 || n2.w == 0 || !closestPoints(p1, n1.xyz, p2, n2.xyz, &t1, &t2) || t1 >= 0 || t2 >= 0)
+	{
+		result[g_id] = (float4)(0);
+		return;
+	}
+
+	float3 center = 0.5f * (p1 + t1 * n1.xyz + p2 + t2 * n2.xyz);
+	float r = 0.5f * (distance(center, p1) + distance(center, p2));
+	result[g_id] = (float4)(center, r);
+}
+
+// zeroes the spheres outside the radius range or with the center outside the box,
+// zero spheres are skipped by the scoring kernels
+__kernel void checkSphere(
 	__global float4* spheres,
-	__global int*  result)
+	float2			 radius,	// smallest and largest radius
+	float4			 low,
+	float4			 high)
 {
-	int g_id0 = get_global_id(0);
-	int g_id1 = get_global_id(1);
-	float4 sphere = spheres[g_id0];
-	float4 point = data[g_id1];
+	int g_id = get_global_id(0);
+	float4 sphere = spheres[g_id];
+	if (sphere.w < radius.x || sphere.w > radius.y || any(sphere.xyz < low.xyz) || any(sphere.xyz > high.xyz))
+	{
+		spheres[g_id] = (float4)(0);
+	}
+}
 
-	float dist = distance(point.xyz, sphere.xyz);
-	if(fabs(sphere.w - dist) < EPSILON)
+// spheres are (center, radius), the ones zeroed by checkSphere are skipped
+float4 loadSphere(__global float4* spheres, int i)
+{
+	return spheres[i];
+}
+
+bool validSphere(float4 sphere)
+{
+	return sphere.w != 0;
+}
+
+float residualSphere(float3 p, float4 sphere)
+{
+	return distance(p, sphere.xyz) - sphere.w;
+}
+
+RANSAC_KERNELS(Sphere, float4, (__global float4* spheres), (spheres))
+
+// solves Ax = b in place with partial pivoting, x is returned in b
+// returns 0 if A is singular
+int solveLinear(float* A, float* b, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		int pivot = i;
+		for (int j = i + 1; j < n; j++)
+		{
+			if (fabs(A[j * n + i]) > fabs(A[pivot * n + i]))
+			{
+				pivot = j;
+			}
+		}
+		if (fabs(A[pivot * n + i]) < 1e-12f)
+		{
+			return 0;
+		}
+
+		for (int k = 0; k < n; k++)
+		{
+			float t = A[i * n + k];
+			A[i * n + k] = A[pivot * n + k];
+			A[pivot * n + k] = t;
+		}
+		float t = b[i];
+		b[i] = b[pivot];
+		b[pivot] = t;
+
+		for (int j = i + 1; j < n; j++)
+		{
+			float div = A[j * n + i] / A[i * n + i];
+			for (int k = i; k < n; k++)
+			{
+				A[j * n + k] -= A[i * n + k] * div;
+			}
+			b[j] -= b[i] * div;
+		}
+	}
+
+	for (int i = n - 1; i >= 0; i--)
 	{
-		atomic_inc(&result[g_id0]);
+		for (int k = i + 1; k < n; k++)
+		{
+			b[i] -= A[i * n + k] * b[k];
+		}
+		b[i] /= A[i * n + i];
 	}
+	return 1;
 }
 
-__kernel void reduce(
-	__global int*  inliers,
+// LO-RANSAC: accumulates the algebraic least squares system
+// over the inliers of the best sphere, per work-group
+// points are taken relative to the sphere center for better conditioning
+__kernel void accumSphere(
+	__global float4* data,
 	__global float4* spheres,
-	__local  int*  scratch, // local for inlier values
-	__local  int*	 idx)	  // local for sphere global idx
+	__global float*  partial,	// LO_SUMS values per work-group
+	__local  float*  scratch,	// LO_SUMS values per work item
+	int				 count,
+	float			 threshold,
+	float			 scale)		// inlier threshold scale
+{
+	float4 sphere = spheres[0];
+
+	float sums[LO_SUMS] = {0};
+	for (int i = get_global_id(0); i < count; i += get_global_size(0))
+	{
+		float3 q = data[i].xyz - sphere.xyz;
+		if (fabs(sphere.w - length(q)) < threshold * scale)
+		{
+			// row of A is (2q, 1), f is |q|^2
+			float a[4] = { 2 * q.x, 2 * q.y, 2 * q.z, 1 };
+			float f = dot(q, q);
+
+			int k = 0;
+			for (int r = 0; r < 4; r++)
+			{
+				for (int c = r; c < 4; c++)
+				{
+					sums[k++] += a[r] * a[c];
+				}
+			}
+			for (int r = 0; r < 4; r++)
+			{
+				sums[10 + r] += a[r] * f;
+			}
+			sums[14] += 1;
+		}
+	}
+
+	groupSums(sums, LO_SUMS, scratch, partial);
+}
+
+// LO-RANSAC: solves the accumulated system and replaces the best sphere
+__kernel void solveSphere(
+	__global float*  partial,
+	__global float4* spheres,
+	int				 groups)
+{
+	float sums[LO_SUMS] = {0};
+	for (int g = 0; g < groups; g++)
+	{
+		for (int k = 0; k < LO_SUMS; k++)
+		{
+			sums[k] += partial[g * LO_SUMS + k];
+		}
+	}
+
+	// not enough inliers for a least squares fit
+	if (sums[14] < 5)
+	{
+		return;
+	}
+
+	float ATA[16];
+	float b[4];
+	int k = 0;
+	for (int r = 0; r < 4; r++)
+	{
+		for (int c = r; c < 4; c++)
+		{
+			ATA[r * 4 + c] = sums[k];
+			ATA[c * 4 + r] = sums[k];
+			k++;
+		}
+		b[r] = sums[10 + r];
+	}
+
+	if (!solveLinear(ATA, b, 4))
+	{
+		return;
+	}
+
+	// |q|^2 = 2 c.q + d, where d = r^2 - |c|^2
+	float3 c = (float3)(b[0], b[1], b[2]);
+	float r = sqrt(b[3] + dot(c, c));
+	if (isinf(r) || isnan(r) || r == 0)
+	{
+		return;
+	}
+
+	float4 sphere = spheres[0];
+	spheres[0] = (float4)(sphere.xyz + c, r);
+}
+
+// Gauss-Newton / Levenberg-Marquardt refinement: accumulates the normal equations
+// of the geometric (radial) distance over the inliers of the current sphere
+__kernel void accumSphereGN(
+	__global float4* data,
+	__global float4* spheres,
+	__global float*  partial,	// GN_SUMS values per work-group
+	__local  float*  scratch,	// GN_SUMS values per work item
+	int				 count,
+	float			 threshold)
+{
+	float4 sphere = spheres[0];
+	float t2 = threshold * threshold;
+
+	float sums[GN_SUMS] = {0};
+	for (int i = get_global_id(0); i < count; i += get_global_size(0))
+	{
+		float3 q = data[i].xyz - sphere.xyz;
+		float d = length(q);
+		float e = d - sphere.w;
+
+		// truncated cost over all points, comparable between iterations
+		sums[14] += min(e * e, t2);
+
+		if (fabs(e) < threshold && d > 0)
+		{
+			// derivative of e by center and radius
+			float J[4] = { -q.x / d, -q.y / d, -q.z / d, -1 };
+
+			int k = 0;
+			for (int r = 0; r < 4; r++)
+			{
+				for (int c = r; c < 4; c++)
+				{
+					sums[k++] += J[r] * J[c];
+				}
+			}
+			for (int r = 0; r < 4; r++)
+			{
+				sums[10 + r] += J[r] * e;
+			}
+			sums[15] += e * e;
+			sums[16] += 1;
+		}
+	}
+
+	groupSums(sums, GN_SUMS, scratch, partial);
+}
+
+// Levenberg-Marquardt step: steps that increase the cost are rolled back
+// and retried with stronger damping, the last iteration only decides
+// and writes the best accepted sphere and its covariance
+__kernel void solveSphereGN(
+	__global float*  partial,
+	__global float4* spheres,
+	__global float*  state,
+	__global float*  covariance, // 4x4, row major
+	int				 groups,
+	int				 iteration,
+	int				 last)
+{
+	float sums[GN_SUMS] = {0};
+	for (int g = 0; g < groups; g++)
+	{
+		for (int k = 0; k < GN_SUMS; k++)
+		{
+			sums[k] += partial[g * GN_SUMS + k];
+		}
+	}
+
+	float4 sphere = spheres[0];
+	if (iteration == 0 || sums[14] <= state[1])
+	{
+		// accept the current sphere
+		state[0] = iteration == 0 ? 0.001f : state[0] * 0.1f;
+		state[1] = sums[14];
+		state[2] = sphere.x;
+		state[3] = sphere.y;
+		state[4] = sphere.z;
+		state[5] = sphere.w;
+		for (int k = 0; k < 14; k++)
+		{
+			state[6 + k] = sums[k];
+		}
+
+		// covariance of the parameters: sigma^2 * inv(JTJ),
+		// NaN if there are too few inliers or JTJ is singular
+		bool valid = sums[16] > 4;
+		if (valid)
+		{
+			float sigma2 = sums[15] / (sums[16] - 4);
+			for (int c = 0; c < 4 && valid; c++)
+			{
+				float JTJ[16];
+				float col[4] = {0};
+				col[c] = 1;
+				int k = 0;
+				for (int r = 0; r < 4; r++)
+				{
+					for (int j = r; j < 4; j++)
+					{
+						JTJ[r * 4 + j] = sums[k];
+						JTJ[j * 4 + r] = sums[k];
+						k++;
+					}
+				}
+				valid = solveLinear(JTJ, col, 4);
+				for (int r = 0; r < 4; r++)
+				{
+					covariance[r * 4 + c] = sigma2 * col[r];
+				}
+			}
+		}
+		if (!valid)
+		{
+			for (int i = 0; i < 16; i++)
+			{
+				covariance[i] = NAN;
+			}
+		}
+	}
+	else
+	{
+		// the step increased the cost, retry from the last accepted sphere
+		state[0] *= 10;
+	}
+
+	float4 accepted = (float4)(state[2], state[3], state[4], state[5]);
+	if (last)
+	{
+		spheres[0] = accepted;
+		return;
+	}
+
+	// (JTJ + lambda * diag(JTJ)) delta = -JTe
+	float A[16];
+	float b[4];
+	int k = 0;
+	for (int r = 0; r < 4; r++)
+	{
+		for (int c = r; c < 4; c++)
+		{
+			A[r * 4 + c] = state[6 + k];
+			A[c * 4 + r] = state[6 + k];
+			k++;
+		}
+		A[r * 4 + r] *= 1 + state[0];
+		b[r] = -state[16 + r];
+	}
+
+	if (!solveLinear(A, b, 4))
+	{
+		spheres[0] = accepted;
+		return;
+	}
+
+	spheres[0] = accepted + (float4)(b[0], b[1], b[2], b[3]);
+}
+
+// known-radius sphere detection by Hough voting: every point votes for the
+// centers on a shell of the given radius around it, the votes are counted in
+// a hash table of voxels with open addressing
+
+#define HOUGH_EMPTY 0xffffffffu
+#define HOUGH_PROBES 32
+#define HOUGH_DIRS 1024 // shell directions, about a voxel apart for small spheres
+#define HOUGH_BITS 10	// voxel coordinate bits of a key
+
+uint houghHash(uint key)
+{
+	key *= 2654435761u;
+	return key ^ (key >> 15);
+}
+
+// slot of key in the table or -1, mask is the table size - 1
+int houghFind(__global uint* keys, uint key, int mask)
+{
+	int slot = houghHash(key) & mask;
+	for (int i = 0; i < HOUGH_PROBES; i++)
+	{
+		uint stored = keys[slot];
+		if (stored == key)
+		{
+			return slot;
+		}
+		if (stored == HOUGH_EMPTY)
+		{
+			return -1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+__kernel void clearHough(
+	__global uint* keys,
+	__global int*  votes)
+{
+	int g_id = get_global_id(0);
+	keys[g_id] = HOUGH_EMPTY;
+	votes[g_id] = 0;
+}
+
+// grid is the origin and the edge length of the voxels; with normals only the
+// directions within the cone of acos(minCos) around the inward normal vote,
+// otherwise the half shell behind the point as seen from the sensor
+__kernel void voteSphere(
+	__global float4* data,
+	__global float4* normals,
+	__global uint*	 keys,
+	__global int*	 votes,
+	int				 count,
+	float4			 grid,
+	float			 radius,
+	int				 useNormals,
+	float			 minCos,
+	int				 mask)
+{
+	int g_id = get_global_id(0);
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	float3 p = data[g_id].xyz;
+	float4 n = useNormals ? normals[g_id] : (float4)(0);
+	for (int d = 0; d < HOUGH_DIRS; d++)
+	{
+		// Fibonacci sphere directions
+		float z = 1 - (2 * d + 1) / (float)HOUGH_DIRS;
+		float phi = d * 2.39996323f;
+		float3 dir = (float3)(sqrt(1 - z * z) * cos(phi), sqrt(1 - z * z) * sin(phi), z);
+
+		if (n.w != 0 ? dot(dir, -n.xyz) < minCos : dot(dir, p) <= 0)
+		{
+			continue;
+		}
+
+		int3 v = convert_int3(floor((p + radius * dir - grid.xyz) / grid.w));
+		if (any(v < 0) || any(v >= (1 << HOUGH_BITS)))
+		{
+			continue;
+		}
+
+		uint key = v.x | (v.y << HOUGH_BITS) | (v.z << 2 * HOUGH_BITS);
+		int slot = houghHash(key) & mask;
+		for (int i = 0; i < HOUGH_PROBES; i++)
+		{
+			uint stored = atomic_cmpxchg(&keys[slot], HOUGH_EMPTY, key);
+			if (stored == HOUGH_EMPTY || stored == key)
+			{
+				atomic_inc(&votes[slot]);
+				break;
+			}
+			slot = (slot + 1) & mask;
+		}
+	}
+}
+
+int3 houghVoxel(uint key)
+{
+	int m = (1 << HOUGH_BITS) - 1;
+	return (int3)(key & m, (key >> HOUGH_BITS) & m, key >> 2 * HOUGH_BITS);
+}
+
+// peak finding: each voxel is scored by the votes of its 3x3x3 neighbourhood,
+// which keeps a peak split between voxels from losing against a sharp one
+__kernel void scoreHough(
+	__global uint*	keys,
+	__global int*	votes,
+	__global float* scores,
+	int				mask)
 {
-	int l_id = get_local_id(0);
 	int g_id = get_global_id(0);
-	scratch[l_id] = inliers[g_id];
-	idx[l_id]	  = g_id;
+	uint key = keys[g_id];
+	if (key == HOUGH_EMPTY)
+	{
+		scores[g_id] = 0;
+		return;
+	}
+
+	int3 v = houghVoxel(key);
+	int sum = 0;
+	for (int z = -1; z <= 1; z++)
+	{
+		for (int y = -1; y <= 1; y++)
+		{
+			for (int x = -1; x <= 1; x++)
+			{
+				int3 w = v + (int3)(x, y, z);
+				if (any(w < 0) || any(w >= (1 << HOUGH_BITS)))
+				{
+					continue;
+				}
+				int slot = houghFind(keys, w.x | (w.y << HOUGH_BITS) | (w.z << 2 * HOUGH_BITS), mask);
+				sum += slot >= 0 ? votes[slot] : 0;
+			}
+		}
+	}
+	scores[g_id] = sum;
+}
+
+// center of the selected peak as the vote weighted mean of its neighbourhood
+__kernel void houghCenter(
+	__global uint*	keys,
+	__global int*	votes,
+	__global ulong* best,
+	__global float4* out,
+	float4			grid,
+	float			radius,
+	int				mask)
+{
+	// without any vote the selected slot may be empty, the sphere is rejected
+	// with radius zero like the ones zeroed by checkSphere
+	if ((best[0] >> 32) == 0)
+	{
+		out[0] = (float4)(0);
+		return;
+	}
+
+	int3 v = houghVoxel(keys[(uint)best[0]]);
+	float3 center = (float3)(0);
+	int sum = 0;
+	for (int z = -1; z <= 1; z++)
+	{
+		for (int y = -1; y <= 1; y++)
+		{
+			for (int x = -1; x <= 1; x++)
+			{
+				int3 w = v + (int3)(x, y, z);
+				if (any(w < 0) || any(w >= (1 << HOUGH_BITS)))
+				{
+					continue;
+				}
+				int slot = houghFind(keys, w.x | (w.y << HOUGH_BITS) | (w.z << 2 * HOUGH_BITS), mask);
+				if (slot >= 0)
+				{
+					center += votes[slot] * (convert_float3(w) + 0.5f);
+					sum += votes[slot];
+				}
+			}
+		}
+	}
+	center = grid.xyz + grid.w * center / max(sum, 1);
+	out[0] = (float4)(center, radius);
+}
+
+// inlier count and sum of the squared radial residuals of the inliers of
+// the best sphere, run as a single work-group; a zero sphere has no inliers
+__kernel void measureSphere(
+	__global float4* data,
+	__global float4* spheres,
+	__global float*  stats,
+	__local  float*  scratch,	// 2 values per work item
+	int				 count,
+	float			 threshold)
+{
+	float4 sphere = spheres[0];
+
+	float sums[2] = {0};
+	for (int i = get_local_id(0); i < count && validSphere(sphere); i += get_local_size(0))
+	{
+		float e = distance(data[i].xyz, sphere.xyz) - sphere.w;
+		if (fabs(e) < threshold)
+		{
+			sums[0] += 1;
+			sums[1] += e * e;
+		}
+	}
+
+	groupSums(sums, 2, scratch, stats);
+}
+
+// batched fitting of recorded frames: the candidates of all frames are concatenated,
+// segments holds the offset and count of each frame's points, the frame is the second
+// dimension of the launches and the iterNum hypotheses of frame f start at f * iterNum
+
+// 4 distinct uniform samples from the frame's points, as indices of the whole buffer;
+// frames too small to fit get -1, their segments may start past the end of the buffer
+__kernel void sampleBatch(
+	__global int2* segments,
+	__global int*  idx,
+	uint		   seed)
+{
+	int frame = get_global_id(1);
+	int h = frame * get_global_size(0) + get_global_id(0);
+	int2 segment = segments[frame];
+	uint state = ((h ^ seed) * 2654435761u) | 1;
+
+	if (segment.y < HEIGHT)
+	{
+		for (int i = 0; i < HEIGHT; i++)
+		{
+			idx[h * HEIGHT + i] = -1;
+		}
+		return;
+	}
+
+	int sample[HEIGHT];
+	for (int i = 0; i < HEIGHT; i++)
+	{
+		int point;
+		bool unique;
+		do
+		{
+			point = nextRandom(&state) % segment.y;
+
+			unique = true;
+			for (int j = 0; j < i; j++)
+			{
+				unique = unique && point != sample[j];
+			}
+		} while (!unique);
+		sample[i] = point;
+	}
+
+	for (int i = 0; i < HEIGHT; i++)
+	{
+		idx[h * HEIGHT + i] = segment.x + sample[i];
+	}
+}
+
+// fitSphere against the points of each hypothesis' frame,
+// one work-group per hypothesis
+__kernel void fitSphereBatch(
+	__global float4* data,
+	__global int2*	 segments,
+	__global float4* spheres,
+	__global float*  scores,
+	__local  float*  scratch,	// one value per work item
+	float			 threshold,
+	int				 mode)
+{
+	int frame = get_group_id(1);
+	int2 segment = segments[frame];
+	__global float* frameScores = scores + frame * get_num_groups(0);
+	float4 sphere = spheres[frame * get_num_groups(0) + get_group_id(0)];
+
+	// rejected hypothesis or a frame too small to fit
+	if (sphere.w == 0 || segment.y < HEIGHT)
+	{
+		if (get_local_id(0) == 0)
+		{
+			frameScores[get_group_id(0)] = 0;
+		}
+		return;
+	}
+
+	float score = 0;
+	for (int i = segment.x + get_local_id(0); i < segment.x + segment.y; i += get_local_size(0))
+	{
+		float dist = distance(data[i].xyz, sphere.xyz);
+		score += pointScore(dist - sphere.w, threshold, mode);
+	}
+
+	groupSums(&score, 1, scratch, frameScores);
+}
+
+// best hypothesis of each frame as packed score and index of the whole buffer,
+// one work-group per frame
+__kernel void selectBestBatch(
+	__global float*	scores,
+	__global ulong*	best,
+	__local  ulong*	scratch,	// one value per work item
+	int				iterNum)
+{
+	int l_id = get_local_id(0);
+	int frame = get_group_id(1);
 
+	ulong packed = 0;
+	for (int i = frame * iterNum + l_id; i < (frame + 1) * iterNum; i += get_local_size(0))
+	{
+		packed = max(packed, packScore(scores[i], i));
+	}
+	scratch[l_id] = packed;
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	// local reduction
-	// swap inlier values along with sphere idx
 	for (int offset = get_local_size(0) / 2; offset != 0; offset /= 2)
 	{
-		if (l_id < offset && scratch[l_id] < scratch[l_id + offset])
+		if (l_id < offset)
 		{
-			scratch[l_id] = scratch[l_id + offset];
-			idx[l_id] = idx[l_id + offset];
+			scratch[l_id] = max(scratch[l_id], scratch[l_id + offset]);
 		}
 		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
 	if (l_id == 0)
 	{
-		inliers[get_group_id(0)] = scratch[0];
-		spheres[get_group_id(0)] = spheres[idx[0]];
+		best[frame] = scratch[0];
+	}
+}
+
+// measureSphere of each frame's best sphere, one work-group per frame
+__kernel void measureSphereBatch(
+	__global float4* data,
+	__global int2*	 segments,
+	__global float4* spheres,
+	__global float*  stats,
+	__local  float*  scratch,	// 2 values per work item
+	float			 threshold)
+{
+	int frame = get_group_id(1);
+	int2 segment = segments[frame];
+	float4 sphere = spheres[frame];
+
+	float sums[2] = {0};
+	for (int i = segment.x + get_local_id(0); i < segment.x + segment.y; i += get_local_size(0))
+	{
+		float e = distance(data[i].xyz, sphere.xyz) - sphere.w;
+		if (fabs(e) < threshold)
+		{
+			sums[0] += 1;
+			sums[1] += e * e;
+		}
+	}
+
+	groupSums(sums, 2, scratch, stats + 2 * frame);
+}
+
+// multi-sphere detection: stores the best sphere as the k-th result,
+// counts its inliers and moves the remaining points to out
+__kernel void removeSphere(
+	__global float4* data,
+	__global float4* spheres,
+	__global float4* out,
+	__global float4* results,
+	__global int*	 counts,	// points moved to out, then the inlier count of each result
+	int				 count,
+	int				 k,
+	float			 threshold)
+{
+	int g_id = get_global_id(0);
+	float4 sphere = spheres[0];
+	if (g_id == 0)
+	{
+		results[k] = sphere;
+	}
+	if (g_id >= count)
+	{
+		return;
+	}
+
+	float4 point = data[g_id];
+	if (validSphere(sphere) && fabs(sphere.w - distance(point.xyz, sphere.xyz)) < threshold)
+	{
+		atomic_inc(&counts[1 + k]);
+	}
+	else
+	{
+		out[atomic_inc(&counts[0])] = point;
 	}
 }
 
 __kernel void fillSphere(
 	__global float4* data,
-	__global float4* spheres)
+	__global float4* spheres,
+	float			 threshold,
+	int				 count)
 {
 	int g_id = get_global_id(0);
-	float dist = distance(data[g_id].xyz, spheres[0].xyz);
 
-	data[g_id].w = fabs(spheres[0].w - dist) < EPSILON;
+	int inlier = 0;
+	for (int i = 0; i < count; i++)
+	{
+		float dist = distance(data[g_id].xyz, spheres[i].xyz);
+		inlier |= validSphere(spheres[i]) && fabs(spheres[i].w - dist) < threshold;
+	}
+	data[g_id].w = inlier;
 }
\ No newline at end of file
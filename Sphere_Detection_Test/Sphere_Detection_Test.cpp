@@ -2,11 +2,14 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <functional>
 
 #include "pch.h"
 #include "CppUnitTest.h"
 
 #include "PointCloud.h"
+#include "BufferPool.h"
+#include "Tracker.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -93,6 +96,24 @@ namespace SphereDetectionTest
 		return static_cast<int>(ceil((double)a / b));
 	}
 
+	// points of the refinement tests: 60 on a sphere at (1, 2, 3) with radius 2, and 2 outliers
+	std::vector<cl_float4> refinePoints()
+	{
+		std::vector<cl_float4> points;
+		for (int i = 0; i < 12; i++)
+		{
+			for (int j = 1; j < 6; j++)
+			{
+				float phi = i * 0.52f;
+				float theta = j * 0.52f;
+				points.push_back({ 1 + 2 * cosf(phi) * sinf(theta), 2 + 2 * sinf(phi) * sinf(theta), 3 + 2 * cosf(theta), 0 });
+			}
+		}
+		points.push_back({ 10, 10, 10, 0 });
+		points.push_back({ 1, 2, 3, 0 });
+		return points;
+	}
+
 	TEST_CLASS(OCLKernelTest)
 	{
 	private:
@@ -101,6 +122,7 @@ namespace SphereDetectionTest
 		cl::CommandQueue queue;
 		cl::Program program;
 		cl::Program program_c;
+		cl::Program program_p;
 
 	public:
 		TEST_METHOD_INITIALIZE(OCLKernelTestInit)
@@ -139,9 +161,19 @@ namespace SphereDetectionTest
 			devices = context.getInfo<CL_CONTEXT_DEVICES>();
 			queue = cl::CommandQueue(context, devices[0]);
 
+			// the shared kernels are prepended to every program, the planes to the cylinder and primitive programs
+			std::ifstream ransacFile("../../../Sphere_Detection/ransac.cl");
+			std::string ransacCode(std::istreambuf_iterator<char>(ransacFile), (std::istreambuf_iterator<char>()));
+			ransacFile.close();
+
+			std::ifstream planeFile("../../../Sphere_Detection/plane_detect.cl");
+			std::string planeCode(std::istreambuf_iterator<char>(planeFile), (std::istreambuf_iterator<char>()));
+			planeFile.close();
+
 			std::ifstream sphereFile("../../../Sphere_Detection/sphere_detect.cl");
 			std::string sphereCode(std::istreambuf_iterator<char>(sphereFile), (std::istreambuf_iterator<char>()));
 			sphereFile.close();
+			sphereCode = ransacCode + "\n" + sphereCode;
 
 			cl::Program::Sources sphereSource(1, std::make_pair(sphereCode.c_str(), sphereCode.length() + 1));
 			program = cl::Program(context, sphereSource);
@@ -159,6 +191,7 @@ namespace SphereDetectionTest
 			std::ifstream cylinderFile("../../../Sphere_Detection/cylinder_detect.cl");
 			std::string cylinderCode(std::istreambuf_iterator<char>(cylinderFile), (std::istreambuf_iterator<char>()));
 			cylinderFile.close();
+			cylinderCode = ransacCode + "\n" + planeCode + "\n" + cylinderCode;
 
 			cl::Program::Sources cylinderSource(1, std::make_pair(cylinderCode.c_str(), cylinderCode.length() + 1));
 			program_c = cl::Program(context, cylinderSource);
@@ -172,6 +205,24 @@ namespace SphereDetectionTest
 				std::cout << program_c.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
 				throw error;
 			}
+
+			std::ifstream primitiveFile("../../../Sphere_Detection/primitive_detect.cl");
+			std::string primitiveCode(std::istreambuf_iterator<char>(primitiveFile), (std::istreambuf_iterator<char>()));
+			primitiveFile.close();
+			primitiveCode = ransacCode + "\n" + planeCode + "\n" + primitiveCode;
+
+			cl::Program::Sources primitiveSource(1, std::make_pair(primitiveCode.c_str(), primitiveCode.length() + 1));
+			program_p = cl::Program(context, primitiveSource);
+
+			try
+			{
+				program_p.build(devices);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << program_p.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]) << std::endl;
+				throw error;
+			}
 		}
 
 		TEST_METHOD(SphereCalcTest)
@@ -241,112 +292,296 @@ namespace SphereDetectionTest
 			}
 		}
 
-		TEST_METHOD(SphereInlierTest)
+		TEST_METHOD(LocalSampleTest)
 		{
-			cl_float4 sphere = { 0, 0, 0, 1 };
+			// two clusters in opposite corners of a 7 x 7 x 2 grid of unit cells
+			const int size = 400;
+			std::vector<cl_float4> points;
+			for (int i = 0; i < size; i++)
+			{
+				float offset = i < size / 2 ? 0.0f : 5.0f;
+				points.push_back({ offset + (rand() % 100) / 100.0f, offset + (rand() % 100) / 100.0f, offset / 5, 0 });
+			}
+			const cl_int4 dims = { 7, 7, 2, 0 };
+			const int cellNum = 7 * 7 * 2;
+			const int sampleNum = 1024;
 
-			// expected: first 8 fits, last 5 doesn't
-			std::vector<cl_float4> points = {
-				{1, 0, 0, 0},
-				{0, 1, 0, 0},
-				{0, 0, 1, 0},
-				{-1, 0, 0, 0},
-				{0, -1, 0, 0},
-				{0, 0, -1, 0},
-				{0.98, 0, 0, 0},
-				{0, 1.02, 0, 0},
-				{2, 1, 0, 0},
-				{10, 10, 10, 0},
-				{-100, 0, 0, 0},
-				{1.05, 0, 0, 0},
-				{0, 0, 0.7, 0}
-			};
+			try
+			{
+				cl::Kernel countCells(program, "countCells");
+				cl::Kernel scanCells(program, "scanCells");
+				cl::Kernel scatterCells(program, "scatterCells");
+				cl::Kernel sample(program, "sampleLocal");
+
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer cellBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer startBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer sortedBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_WRITE, sampleNum * 4 * sizeof(int));
+
+				std::vector<int> zeros(cellNum, 0);
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, cellNum * sizeof(int), zeros.data());
+
+				countCells.setArg(0, pointBuffer);
+				countCells.setArg(1, cellBuffer);
+				countCells.setArg(2, countBuffer);
+				countCells.setArg(3, size);
+				countCells.setArg(4, cl_float4{ 0, 0, 0, 1 });
+				countCells.setArg(5, dims);
+
+				queue.enqueueNDRangeKernel(countCells, cl::NullRange, size, cl::NullRange);
+
+				const unsigned GROUP_SIZE = 256;
+				scanCells.setArg(0, countBuffer);
+				scanCells.setArg(1, startBuffer);
+				scanCells.setArg(2, GROUP_SIZE * sizeof(int), nullptr);
+				scanCells.setArg(3, cellNum);
+
+				queue.enqueueNDRangeKernel(scanCells, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
+
+				scatterCells.setArg(0, cellBuffer);
+				scatterCells.setArg(1, startBuffer);
+				scatterCells.setArg(2, countBuffer);
+				scatterCells.setArg(3, sortedBuffer);
+				scatterCells.setArg(4, size);
+
+				queue.enqueueNDRangeKernel(scatterCells, cl::NullRange, size, cl::NullRange);
+
+				sample.setArg(0, cellBuffer);
+				sample.setArg(1, startBuffer);
+				sample.setArg(2, countBuffer);
+				sample.setArg(3, sortedBuffer);
+				sample.setArg(4, idxBuffer);
+				sample.setArg(5, size);
+				sample.setArg(6, (cl_uint)1234);
+				sample.setArg(7, dims);
+				sample.setArg(8, 4);
+
+				queue.enqueueNDRangeKernel(sample, cl::NullRange, sampleNum, cl::NullRange);
+
+				std::vector<int> cells(size), counts(cellNum), starts(cellNum), sorted(size), idx(sampleNum * 4);
+				queue.enqueueReadBuffer(cellBuffer, CL_TRUE, 0, size * sizeof(int), cells.data());
+				queue.enqueueReadBuffer(countBuffer, CL_TRUE, 0, cellNum * sizeof(int), counts.data());
+				queue.enqueueReadBuffer(startBuffer, CL_TRUE, 0, cellNum * sizeof(int), starts.data());
+				queue.enqueueReadBuffer(sortedBuffer, CL_TRUE, 0, size * sizeof(int), sorted.data());
+				queue.enqueueReadBuffer(idxBuffer, CL_TRUE, 0, sampleNum * 4 * sizeof(int), idx.data());
+
+				// the points are ordered by cell
+				int start = 0;
+				for (int i = 0; i < cellNum; i++)
+				{
+					Assert::AreEqual(start, starts[i]);
+					for (int j = 0; j < counts[i]; j++)
+					{
+						Assert::AreEqual(i, cells[sorted[start + j]]);
+					}
+					start += counts[i];
+				}
+				Assert::AreEqual(size, start);
 
-			// for inlier init
-			int zero = 0;
+				// samples are distinct points of a single cluster
+				for (int i = 0; i < sampleNum; i++)
+				{
+					for (int j = 0; j < 4; j++)
+					{
+						Assert::IsTrue(idx[i * 4 + j] >= 0 && idx[i * 4 + j] < size);
+						Assert::AreEqual(idx[i * 4] < size / 2, idx[i * 4 + j] < size / 2);
+						for (int k = 0; k < j; k++)
+						{
+							Assert::AreNotEqual(idx[i * 4 + k], idx[i * 4 + j]);
+						}
+					}
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
 
-			size_t size = points.size();
+		TEST_METHOD(SortQualityTest)
+		{
+			// the original index in x, quality with ties in w
+			const int size = 300;
+			std::vector<cl_float4> points;
+			for (int i = 0; i < size; i++)
+			{
+				points.push_back({ (float)i, 0, 0, (float)(rand() % 50) });
+			}
 
 			try
 			{
-				cl::Kernel kernel(program, "fitSphere");
+				cl::Kernel sort(program, "sortQuality");
 
-				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
-				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4));
-				cl::Buffer inlierBuffer(context, CL_MEM_WRITE_ONLY, sizeof(int));
-
-				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
-				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
-				queue.enqueueWriteBuffer(inlierBuffer, CL_TRUE, 0, sizeof(int), &zero);
-				queue.finish();
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sortedBuffer(context, CL_MEM_WRITE_ONLY, size * sizeof(cl_float4));
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
 
-				kernel.setArg(0, pointsBuffer);
-				kernel.setArg(1, sphereBuffer);
-				kernel.setArg(2, inlierBuffer);
+				sort.setArg(0, pointBuffer);
+				sort.setArg(1, sortedBuffer);
+				sort.setArg(2, size);
 
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1, size), cl::NullRange);
+				queue.enqueueNDRangeKernel(sort, cl::NullRange, size, cl::NullRange);
 
-				int inlier;
-				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, sizeof(int), &inlier);
+				std::vector<cl_float4> sorted(size);
+				queue.enqueueReadBuffer(sortedBuffer, CL_TRUE, 0, size * sizeof(cl_float4), sorted.data());
 
-				Assert::AreEqual(8, inlier);
+				std::stable_sort(points.begin(), points.end(), [](const cl_float4& a, const cl_float4& b) { return a.s[3] > b.s[3]; });
+				for (int i = 0; i < size; i++)
+				{
+					Assert::AreEqual(points[i].s[0], sorted[i].s[0]);
+					Assert::AreEqual(points[i].s[3], sorted[i].s[3]);
+				}
 			}
 			catch (cl::Error& error)
 			{
 				std::cout << error.what() << "\n"
-					<< "spherecalc\n"
 					<< getErrorString(error.err()) << std::endl;
 				return;
 			}
 		}
 
-		TEST_METHOD(ReduceTest)
+		TEST_METHOD(NormalEstimationTest)
 		{
-			const size_t size = 1 << 12;
-			std::vector<int> inliers;
-			std::vector<cl_float4> spheres;
-			for (int i = 0; i < size; i++)
+			// ground plane below the sensor, 0.1 apart
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 20; i++)
 			{
-				int x = rand();
-				inliers.push_back(x);
-				spheres.push_back({ (float)x, 0, 0, 0 });
+				for (int j = 0; j < 20; j++)
+				{
+					points.push_back({ -1 + i * 0.1f, -1, -6 + j * 0.1f, 0 });
+				}
 			}
+			const int size = points.size();
+			const cl_int4 dims = { 5, 1, 5, 0 };
+			const int cellNum = 5 * 1 * 5;
 
 			try
 			{
-				cl::Kernel kernel(program, "reduce");
+				cl::Kernel countCells(program, "countCells");
+				cl::Kernel scanCells(program, "scanCells");
+				cl::Kernel scatterCells(program, "scatterCells");
+				cl::Kernel normals(program, "estimateNormals");
+
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer cellBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer startBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer sortedBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer normalBuffer(context, CL_MEM_WRITE_ONLY, size * sizeof(cl_float4));
+
+				std::vector<int> zeros(cellNum, 0);
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, cellNum * sizeof(int), zeros.data());
+
+				countCells.setArg(0, pointBuffer);
+				countCells.setArg(1, cellBuffer);
+				countCells.setArg(2, countBuffer);
+				countCells.setArg(3, size);
+				countCells.setArg(4, cl_float4{ -1.05f, -1.5f, -6.05f, 0.4f });
+				countCells.setArg(5, dims);
+
+				queue.enqueueNDRangeKernel(countCells, cl::NullRange, size, cl::NullRange);
+
+				const unsigned GROUP_SIZE = 256;
+				scanCells.setArg(0, countBuffer);
+				scanCells.setArg(1, startBuffer);
+				scanCells.setArg(2, GROUP_SIZE * sizeof(int), nullptr);
+				scanCells.setArg(3, cellNum);
+
+				queue.enqueueNDRangeKernel(scanCells, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
+
+				scatterCells.setArg(0, cellBuffer);
+				scatterCells.setArg(1, startBuffer);
+				scatterCells.setArg(2, countBuffer);
+				scatterCells.setArg(3, sortedBuffer);
+				scatterCells.setArg(4, size);
+
+				queue.enqueueNDRangeKernel(scatterCells, cl::NullRange, size, cl::NullRange);
+
+				normals.setArg(0, pointBuffer);
+				normals.setArg(1, cellBuffer);
+				normals.setArg(2, startBuffer);
+				normals.setArg(3, countBuffer);
+				normals.setArg(4, sortedBuffer);
+				normals.setArg(5, normalBuffer);
+				normals.setArg(6, size);
+				normals.setArg(7, dims);
+				normals.setArg(8, 0.25f);
+
+				queue.enqueueNDRangeKernel(normals, cl::NullRange, size, cl::NullRange);
+
+				std::vector<cl_float4> result(size);
+				queue.enqueueReadBuffer(normalBuffer, CL_TRUE, 0, size * sizeof(cl_float4), result.data());
+
+				// the normals point up, towards the sensor
+				for (int i = 0; i < size; i++)
+				{
+					Assert::AreEqual(1.0f, result[i].s[3]);
+					Assert::AreEqual(0.0f, result[i].s[0], 0.001f);
+					Assert::AreEqual(1.0f, result[i].s[1], 0.001f);
+					Assert::AreEqual(0.0f, result[i].s[2], 0.001f);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
 
-				cl::Buffer inlierBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
-				cl::Buffer sphereBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+		TEST_METHOD(SphereNormalsCalcTest)
+		{
+			// oriented points on a sphere at (1, 2, 3) with radius 2,
+			// and a point with a parallel normal line
+			glm::vec3 d1 = glm::normalize(glm::vec3(1, 1, 1));
+			glm::vec3 d2 = glm::normalize(glm::vec3(-1, 0.5f, 2));
+			std::vector<cl_float4> points = {
+				{ 1 + 2 * d1.x, 2 + 2 * d1.y, 3 + 2 * d1.z, 0 },
+				{ 1 + 2 * d2.x, 2 + 2 * d2.y, 3 + 2 * d2.z, 0 },
+				{ 0, 0, 0, 0 }
+			};
+			std::vector<cl_float4> normals = {
+				{ d1.x, d1.y, d1.z, 1 },
+				{ d2.x, d2.y, d2.z, 1 },
+				{ d1.x, d1.y, d1.z, 1 }
+			};
+			std::vector<int> idx = { 0, 1, 0, 0, 0, 2, 0, 0 };
 
-				queue.enqueueWriteBuffer(inlierBuffer, CL_TRUE, 0, size * sizeof(int), inliers.data());
-				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, size * sizeof(cl_float4), spheres.data());
+			try
+			{
+				cl::Kernel kernel(program, "calcSphereNormals");
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_ONLY, normals.size() * sizeof(cl_float4));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, idx.size() * sizeof(int));
+				cl::Buffer sphereBuffer(context, CL_MEM_WRITE_ONLY, 2 * sizeof(cl_float4));
 
-				const unsigned GROUP_SIZE = 64;
-				kernel.setArg(0, inlierBuffer);
-				kernel.setArg(1, sphereBuffer);
-				kernel.setArg(2, GROUP_SIZE * sizeof(float), nullptr);
-				kernel.setArg(3, GROUP_SIZE * sizeof(int), nullptr);
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float4), normals.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(int), idx.data());
 
-				for (unsigned rem_size = size; rem_size > 1; rem_size = round_up_div(rem_size, GROUP_SIZE))
-				{
-					int t1 = round_up_div(rem_size, GROUP_SIZE) * GROUP_SIZE;
-					queue.enqueueNDRangeKernel(kernel, cl::NullRange, t1, GROUP_SIZE);
-				}
+				kernel.setArg(0, pointBuffer);
+				kernel.setArg(1, normalBuffer);
+				kernel.setArg(2, idxBuffer);
+				kernel.setArg(3, sphereBuffer);
 
-				std::vector<int> inl_res;
-				inl_res.resize(size);
-				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, size * sizeof(int), inl_res.data());
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, 2, cl::NullRange);
 
-				std::vector<cl_float4> sph_res;
-				sph_res.resize(size);
-				queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, size * sizeof(cl_float4), sph_res.data());
+				cl_float4 spheres[2];
+				queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, 2 * sizeof(cl_float4), spheres);
 
-				for (int i = 0; i < size; i++)
-				{
-					Assert::IsTrue(inl_res[0] >= inl_res[i]);
-					Assert::AreEqual((float)(inl_res[i]), sph_res[i].v4.m128_f32[0], 0.1f);
-				}
+				Assert::AreEqual(1.0f, spheres[0].s[0], 0.001f);
+				Assert::AreEqual(2.0f, spheres[0].s[1], 0.001f);
+				Assert::AreEqual(3.0f, spheres[0].s[2], 0.001f);
+				Assert::AreEqual(2.0f, spheres[0].s[3], 0.001f);
+
+				// invalid samples give radius 0
+				Assert::AreEqual(0.0f, spheres[1].s[3]);
 			}
 			catch (cl::Error& error)
 			{
@@ -356,7 +591,7 @@ namespace SphereDetectionTest
 			}
 		}
 
-		TEST_METHOD(SphereFillTest)
+		TEST_METHOD(SphereInlierTest)
 		{
 			cl_float4 sphere = { 0, 0, 0, 1 };
 
@@ -378,13 +613,15 @@ namespace SphereDetectionTest
 			};
 
 			size_t size = points.size();
+			const int GROUP_SIZE = 8;
 
 			try
 			{
-				cl::Kernel kernel(program, "fillSphere");
+				cl::Kernel kernel(program, "fitSphere");
 
-				cl::Buffer pointsBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
 				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4));
+				cl::Buffer scoreBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float));
 
 				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
 				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
@@ -392,81 +629,86 @@ namespace SphereDetectionTest
 
 				kernel.setArg(0, pointsBuffer);
 				kernel.setArg(1, sphereBuffer);
+				kernel.setArg(2, scoreBuffer);
+				kernel.setArg(3, GROUP_SIZE * sizeof(float), nullptr);
+				kernel.setArg(4, (cl_int)size);
+				kernel.setArg(5, 0.03f);
+				kernel.setArg(6, (cl_int)RANSAC_SCORE);
 
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
 
-				queue.enqueueReadBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				float inlier;
+				queue.enqueueReadBuffer(scoreBuffer, CL_TRUE, 0, sizeof(float), &inlier);
 
-				for (int i = 0; i < 8; i++)
-				{
-					Assert::AreEqual(1.0f, points[i].s[3], 0.001f);
-				}
-				for (int i = 8; i < size; i++)
-				{
-					Assert::AreEqual(0.0f, points[i].s[3], 0.001f);
-				}
+				Assert::AreEqual(8.0f, inlier, 0.001f);
 			}
 			catch (cl::Error& error)
 			{
 				std::cout << error.what() << "\n"
+					<< "spherecalc\n"
 					<< getErrorString(error.err()) << std::endl;
 				return;
 			}
 		}
 
-		TEST_METHOD(PlaneCalcTest)
+		TEST_METHOD(SphereScoreTest)
 		{
+			// both spheres have the same inliers, but the first one fits them better
+			std::vector<cl_float4> spheres = { { 0, 0, 0, 1 }, { 0, 0, 0, 1.005f } };
+
 			std::vector<cl_float4> points = {
-				{0,0,0,0}, {1,0,0,0}, {0,0,1,0},
-				{0,1,0,0}, {0,1,1,0}, {1,0,0,0},
-				{10,3,4.5,0}, {0.32,8,1.3,0}, {3,0.17,11,0}
+				{1, 0, 0, 0},
+				{0, 1, 0, 0},
+				{0, 0, 1, 0},
+				{-1, 0, 0, 0},
+				{0, -1, 0, 0},
+				{0, 0, -1, 0},
+				{0.98, 0, 0, 0},
+				{0, 1.02, 0, 0},
+				{2, 1, 0, 0},
+				{10, 10, 10, 0}
 			};
 
-			std::vector<cl_int3> idx;
-			for (int i = 0; i < points.size(); i += 3)
-			{
-				idx.push_back({ i, i + 1, i + 2 });
-			}
+			size_t size = points.size();
+			const int GROUP_SIZE = 8;
 
 			try
 			{
-				cl::Kernel kernel(program_c, "calcPlane");
-				cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
-				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, idx.size() * sizeof(cl_int3));
-				cl::Buffer pointsBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
-				cl::Buffer normalsBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
-
-				queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
-				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(cl_int3), idx.data());
-
-				kernel.setArg(0, inputBuffer);
-				kernel.setArg(1, idxBuffer);
-				kernel.setArg(2, pointsBuffer);
-				kernel.setArg(3, normalsBuffer);
-
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, idx.size(), cl::NullRange);
-
-				std::vector<cl_float3> res_pos, res_norm;
-				res_pos.resize(idx.size());
-				res_norm.resize(idx.size());
-				queue.enqueueReadBuffer(pointsBuffer, CL_TRUE, 0, res_pos.size() * sizeof(cl_float3), res_pos.data());
-				queue.enqueueReadBuffer(normalsBuffer, CL_TRUE, 0, res_norm.size() * sizeof(cl_float3), res_norm.data());
+				cl::Kernel kernel(program, "fitSphere");
 
-				for (int i = 0; i < res_pos.size(); i++)
-					for (int j = 0; j < 3; j++)
-						Assert::AreEqual(res_pos[i].v4.m128_f32[j], points[i * 3].v4.m128_f32[j], 0.001f);
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, spheres.size() * sizeof(cl_float4));
+				cl::Buffer scoreBuffer(context, CL_MEM_WRITE_ONLY, spheres.size() * sizeof(float));
 
-				Assert::AreEqual(res_norm[0].v4.m128_f32[0], 0.0f, 0.01f);
-				Assert::AreEqual(res_norm[0].v4.m128_f32[1], -1.0f, 0.01f);
-				Assert::AreEqual(res_norm[0].v4.m128_f32[2], 0.0f, 0.01f);
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, spheres.size() * sizeof(cl_float4), spheres.data());
+				queue.finish();
 
-				Assert::AreEqual(res_norm[1].v4.m128_f32[0], 0.71f, 0.01f);
-				Assert::AreEqual(res_norm[1].v4.m128_f32[1], 0.71f, 0.01f);
-				Assert::AreEqual(res_norm[1].v4.m128_f32[2], 0.0f, 0.01f);
+				kernel.setArg(0, pointsBuffer);
+				kernel.setArg(1, sphereBuffer);
+				kernel.setArg(2, scoreBuffer);
+				kernel.setArg(3, GROUP_SIZE * sizeof(float), nullptr);
+				kernel.setArg(4, (cl_int)size);
+				kernel.setArg(5, 0.03f);
 
-				Assert::AreEqual(res_norm[2].v4.m128_f32[0], 0.22f, 0.01f);
-				Assert::AreEqual(res_norm[2].v4.m128_f32[1], 0.79f, 0.01f);
-				Assert::AreEqual(res_norm[2].v4.m128_f32[2], 0.58f, 0.01f);
+				std::vector<float> scores(spheres.size());
+				for (int mode = RANSAC_SCORE; mode <= MLESAC_SCORE; mode++)
+				{
+					kernel.setArg(6, (cl_int)mode);
+					queue.enqueueNDRangeKernel(kernel, cl::NullRange, spheres.size() * GROUP_SIZE, GROUP_SIZE);
+					queue.enqueueReadBuffer(scoreBuffer, CL_TRUE, 0, scores.size() * sizeof(float), scores.data());
+
+					// no point scores more than an inlier count
+					Assert::IsTrue(scores[0] <= 8.001f);
+					if (mode == RANSAC_SCORE)
+					{
+						Assert::AreEqual(scores[0], scores[1], 0.001f);
+					}
+					else
+					{
+						Assert::IsTrue(scores[0] > scores[1]);
+					}
+				}
 			}
 			catch (cl::Error& error)
 			{
@@ -476,51 +718,60 @@ namespace SphereDetectionTest
 			}
 		}
 
-		TEST_METHOD(PlaneInlierTest)
+		TEST_METHOD(SpherePriorTest)
 		{
-			cl_float3 point = { 0,0,0 };
-			cl_float3 norm = { 0,1,0 };
-
-			std::vector<cl_float4> points = {
-				{1,0,0,0},
-				{0,0,1,0},
-				{-1,0,0,0},
-				{0,0,-1,0},
-				{1,0,1,0},
-				{-1,0,-1,0},
-				{0,1,0,0},
-				{0,-1,0,0},
-				{10,1,2,0},
-				{5,0.5,0,0}
+			// valid, degenerate, too large, center outside the region, too small
+			std::vector<cl_float4> spheres = {
+				{ 1, 0, -5, 0.5f },
+				{ 0, 0, 0, 0 },
+				{ 1, 0, -5, 3 },
+				{ 20, 0, -5, 0.5f },
+				{ 1, 0, -5, 0.01f }
 			};
-			size_t size = points.size();
+			std::vector<cl_float4> points = { { 1.5f, 0, -5, 0 }, { 0.5f, 0, -5, 0 }, { 9, 9, 9, 0 } };
+			const int GROUP_SIZE = 4;
 
-			int inlier = 0;
 			try
 			{
-				cl::Kernel kernel(program_c, "fitPlane");
+				cl::Kernel check(program, "checkSphere");
+				cl::Kernel fit(program, "fitSphere");
 
-				cl::Buffer dataBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
-				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
-				cl::Buffer normBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
-				cl::Buffer inlierBuffer(context, CL_MEM_WRITE_ONLY, sizeof(int));
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_WRITE, spheres.size() * sizeof(cl_float4));
+				cl::Buffer scoreBuffer(context, CL_MEM_WRITE_ONLY, spheres.size() * sizeof(float));
 
-				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
-				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, sizeof(cl_float3), &point);
-				queue.enqueueWriteBuffer(normBuffer, CL_TRUE, 0, sizeof(cl_float3), &norm);
-				queue.enqueueWriteBuffer(inlierBuffer, CL_TRUE, 0, sizeof(int), &inlier);
-				queue.finish();
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, spheres.size() * sizeof(cl_float4), spheres.data());
 
-				kernel.setArg(0, dataBuffer);
-				kernel.setArg(1, pointBuffer);
-				kernel.setArg(2, normBuffer);
-				kernel.setArg(3, inlierBuffer);
+				check.setArg(0, sphereBuffer);
+				check.setArg(1, cl_float2{ 0.05f, 1.5f });
+				check.setArg(2, cl_float4{ -10, -10, -10, 0 });
+				check.setArg(3, cl_float4{ 10, 10, 10, 0 });
 
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1, size), cl::NullRange);
+				queue.enqueueNDRangeKernel(check, cl::NullRange, spheres.size(), cl::NullRange);
 
-				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, sizeof(int), &inlier);
+				fit.setArg(0, pointsBuffer);
+				fit.setArg(1, sphereBuffer);
+				fit.setArg(2, scoreBuffer);
+				fit.setArg(3, GROUP_SIZE * sizeof(float), nullptr);
+				fit.setArg(4, (cl_int)points.size());
+				fit.setArg(5, 0.03f);
+				fit.setArg(6, (cl_int)RANSAC_SCORE);
 
-				Assert::AreEqual(6, inlier);
+				queue.enqueueNDRangeKernel(fit, cl::NullRange, spheres.size() * GROUP_SIZE, GROUP_SIZE);
+
+				std::vector<cl_float4> checked(spheres.size());
+				std::vector<float> scores(spheres.size());
+				queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, checked.size() * sizeof(cl_float4), checked.data());
+				queue.enqueueReadBuffer(scoreBuffer, CL_TRUE, 0, scores.size() * sizeof(float), scores.data());
+
+				Assert::AreEqual(0.5f, checked[0].s[3]);
+				Assert::AreEqual(2.0f, scores[0], 0.001f);
+				for (int i = 1; i < spheres.size(); i++)
+				{
+					Assert::AreEqual(0.0f, checked[i].s[3]);
+					Assert::AreEqual(0.0f, scores[i]);
+				}
 			}
 			catch (cl::Error& error)
 			{
@@ -530,54 +781,1599 @@ namespace SphereDetectionTest
 			}
 		}
 
-		TEST_METHOD(PlaneFillTest)
+		TEST_METHOD(SphereSPRTTest)
 		{
-			cl_float3 point = { 0,0,0 };
-			cl_float3 norm = { 0,1,0 };
+			// first sphere fits all points, second one fits none
+			std::vector<cl_float4> spheres = { { 0, 0, 0, 1 }, { 20, 20, 20, 1 } };
+
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 64; i++)
+			{
+				float phi = i * 0.7f;
+				float theta = i * 1.3f;
+				points.push_back({ cosf(phi) * sinf(theta), sinf(phi) * sinf(theta), cosf(theta), 0 });
+			}
+
+			// delta = 0.01, epsilon = 0.1, A = 10
+			cl_float4 sprt = { logf(0.01f / 0.1f), logf(0.99f / 0.9f), logf(10.0f), 0 };
+			std::vector<int> stats = { 0, 0, 0 };
 
-			std::vector<cl_float4> points = {
-				{1,0,0,0},
-				{0,0,1,0},
-				{-1,0,0,0},
-				{0,0,-1,0},
-				{1,0,1,0},
-				{-1,0,-1,0},
-				{0,1,0,0},
-				{0,-1,0,0},
-				{10,1,2,0},
-				{5,0.5,0,0}
-			};
 			size_t size = points.size();
 
 			try
 			{
-				cl::Kernel kernel(program_c, "fillPlane");
+				cl::Kernel kernel(program, "fitSphereSPRT");
 
-				cl::Buffer dataBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
-				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
-				cl::Buffer normBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, spheres.size() * sizeof(cl_float4));
+				cl::Buffer inlierBuffer(context, CL_MEM_WRITE_ONLY, spheres.size() * sizeof(float));
+				cl::Buffer statsBuffer(context, CL_MEM_READ_WRITE, stats.size() * sizeof(int));
 
-				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
-				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, sizeof(cl_float3), &point);
-				queue.enqueueWriteBuffer(normBuffer, CL_TRUE, 0, sizeof(cl_float3), &norm);
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, spheres.size() * sizeof(cl_float4), spheres.data());
+				queue.enqueueWriteBuffer(statsBuffer, CL_TRUE, 0, stats.size() * sizeof(int), stats.data());
 				queue.finish();
 
-				kernel.setArg(0, dataBuffer);
-				kernel.setArg(1, pointBuffer);
-				kernel.setArg(2, normBuffer);
-
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
-
-				queue.enqueueReadBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
-
-				for (int i = 0; i < 6; i++)
-				{
-					Assert::AreEqual(0.25f, points[i].s[3], 0.01f);
-				}
+				kernel.setArg(0, pointsBuffer);
+				kernel.setArg(1, sphereBuffer);
+				kernel.setArg(2, inlierBuffer);
+				kernel.setArg(3, statsBuffer);
+				kernel.setArg(4, (cl_int)size);
+				kernel.setArg(5, (cl_uint)1234);
+				kernel.setArg(6, sprt);
+				kernel.setArg(7, 0.03f);
+				kernel.setArg(8, (cl_int)RANSAC_SCORE);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, spheres.size(), cl::NullRange);
+
+				std::vector<float> inliers(spheres.size());
+				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, inliers.size() * sizeof(float), inliers.data());
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, stats.size() * sizeof(int), stats.data());
+
+				Assert::AreEqual((float)size, inliers[0], 0.001f);
+				Assert::AreEqual(0.0f, inliers[1], 0.001f);
+
+				// only the second sphere is rejected, after a few points
+				Assert::AreEqual(1, stats[0]);
+				Assert::IsTrue(stats[1] < (int)size / 2);
+				Assert::AreEqual(0, stats[2]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SelectBestTest)
+		{
+			const size_t size = 1 << 12;
+			std::vector<float> scores;
+			std::vector<cl_float4> spheres;
+			for (int i = 0; i < size; i++)
+			{
+				float x = rand() / 100.0f;
+				scores.push_back(x);
+				spheres.push_back({ x, (float)i, 0, 0 });
+			}
+			// invalid scores never win
+			scores[size / 2] = NAN;
+
+			int expected = 0;
+			for (int i = 0; i < size; i++)
+			{
+				if (scores[i] > scores[expected])
+				{
+					expected = i;
+				}
+			}
+
+			try
+			{
+				cl::Kernel select(program, "selectBest");
+				cl::Kernel copy(program, "copyBest");
+
+				cl::Buffer scoreBuffer(context, CL_MEM_READ_ONLY, size * sizeof(float));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer bestBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_ulong));
+				cl::Buffer modelBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float4));
+
+				cl_ulong best = 0;
+				queue.enqueueWriteBuffer(scoreBuffer, CL_TRUE, 0, size * sizeof(float), scores.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, size * sizeof(cl_float4), spheres.data());
+				queue.enqueueWriteBuffer(bestBuffer, CL_TRUE, 0, sizeof(cl_ulong), &best);
+
+				const unsigned GROUP_SIZE = 256;
+				select.setArg(0, scoreBuffer);
+				select.setArg(1, bestBuffer);
+				select.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+				select.setArg(3, (cl_int)size);
+
+				int groups = SelectGroupCount(devices[0], 16);
+				queue.enqueueNDRangeKernel(select, cl::NullRange, groups * GROUP_SIZE, GROUP_SIZE);
+
+				copy.setArg(0, sphereBuffer);
+				copy.setArg(1, bestBuffer);
+				copy.setArg(2, modelBuffer);
+				copy.setArg(3, 4);
+
+				queue.enqueueNDRangeKernel(copy, cl::NullRange, 4, cl::NullRange);
+
+				cl_float4 model;
+				queue.enqueueReadBuffer(bestBuffer, CL_TRUE, 0, sizeof(cl_ulong), &best);
+				queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, sizeof(cl_float4), &model);
+
+				Assert::AreEqual(expected, UnpackIndex(best));
+				Assert::AreEqual(scores[expected], UnpackScore(best));
+				Assert::AreEqual((float)expected, model.s[1]);
+
+				// the hypotheses are left intact
+				std::vector<cl_float4> sph_res(size);
+				queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, size * sizeof(cl_float4), sph_res.data());
+				for (int i = 0; i < size; i++)
+				{
+					Assert::AreEqual((float)i, sph_res[i].s[1]);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(TopKTest)
+		{
+			const size_t size = 1 << 13;
+			const int K = 8;
+			std::vector<float> scores;
+			std::vector<cl_float4> spheres;
+			for (int i = 0; i < size; i++)
+			{
+				float x = rand() / 100.0f;
+				scores.push_back(x);
+				spheres.push_back({ x, (float)i, 0, 0 });
+			}
+
+			std::vector<float> expected = scores;
+			std::sort(expected.begin(), expected.end(), std::greater<float>());
+
+			try
+			{
+				cl::Kernel top(program, "topScores");
+				cl::Kernel merge(program, "topKeys");
+				cl::Kernel copy(program, "copyBest");
+
+				const unsigned GROUP_SIZE = 256;
+				const int groups = size / GROUP_SIZE;
+				cl::Buffer scoreBuffer(context, CL_MEM_READ_ONLY, size * sizeof(float));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer keyBuffer(context, CL_MEM_READ_WRITE, groups * K * sizeof(cl_ulong));
+				cl::Buffer bestBuffer(context, CL_MEM_READ_WRITE, K * sizeof(cl_ulong));
+				cl::Buffer modelBuffer(context, CL_MEM_WRITE_ONLY, K * sizeof(cl_float4));
+
+				queue.enqueueWriteBuffer(scoreBuffer, CL_TRUE, 0, size * sizeof(float), scores.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, size * sizeof(cl_float4), spheres.data());
+
+				// k best of each work-group
+				top.setArg(0, scoreBuffer);
+				top.setArg(1, keyBuffer);
+				top.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+				top.setArg(3, (cl_int)size);
+				top.setArg(4, K);
+
+				queue.enqueueNDRangeKernel(top, cl::NullRange, size, GROUP_SIZE);
+
+				// 32 * 8 keys are merged by a single work-group
+				merge.setArg(0, keyBuffer);
+				merge.setArg(1, bestBuffer);
+				merge.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+				merge.setArg(3, groups * K);
+				merge.setArg(4, K);
+
+				queue.enqueueNDRangeKernel(merge, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
+
+				copy.setArg(0, sphereBuffer);
+				copy.setArg(1, bestBuffer);
+				copy.setArg(2, modelBuffer);
+				copy.setArg(3, 4);
+
+				queue.enqueueNDRangeKernel(copy, cl::NullRange, K * 4, cl::NullRange);
+
+				std::vector<cl_ulong> best(K);
+				std::vector<cl_float4> models(K);
+				queue.enqueueReadBuffer(bestBuffer, CL_TRUE, 0, K * sizeof(cl_ulong), best.data());
+				queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, K * sizeof(cl_float4), models.data());
+
+				for (int i = 0; i < K; i++)
+				{
+					Assert::AreEqual(expected[i], UnpackScore(best[i]));
+					Assert::AreEqual(scores[UnpackIndex(best[i])], UnpackScore(best[i]));
+					Assert::AreEqual((float)UnpackIndex(best[i]), models[i].s[1]);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereRefineTest)
+		{
+			std::vector<cl_float4> points = refinePoints();
+
+			cl_float4 sphere = { 1.02f, 1.99f, 3.01f, 2.01f };
+
+			const int GROUPS = 4;
+			const int GROUP_SIZE = 64;
+			const int SUMS = 15;
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel accum(program, "accumSphere");
+				cl::Kernel solve(program, "solveSphere");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4));
+				cl::Buffer partialBuffer(context, CL_MEM_READ_WRITE, GROUPS * SUMS * sizeof(float));
+
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+				queue.finish();
+
+				accum.setArg(0, pointsBuffer);
+				accum.setArg(1, sphereBuffer);
+				accum.setArg(2, partialBuffer);
+				accum.setArg(3, GROUP_SIZE * SUMS * sizeof(float), nullptr);
+				accum.setArg(4, (cl_int)size);
+				accum.setArg(5, 0.03f);
+				accum.setArg(6, 2.0f);
+
+				solve.setArg(0, partialBuffer);
+				solve.setArg(1, sphereBuffer);
+				solve.setArg(2, GROUPS);
+
+				queue.enqueueNDRangeKernel(accum, cl::NullRange, GROUPS * GROUP_SIZE, GROUP_SIZE);
+				queue.enqueueNDRangeKernel(solve, cl::NullRange, 1, cl::NullRange);
+
+				queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+
+				Assert::AreEqual(1.0f, sphere.s[0], 0.001f);
+				Assert::AreEqual(2.0f, sphere.s[1], 0.001f);
+				Assert::AreEqual(3.0f, sphere.s[2], 0.001f);
+				Assert::AreEqual(2.0f, sphere.s[3], 0.001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereGNTest)
+		{
+			std::vector<cl_float4> points = refinePoints();
+
+			cl_float4 sphere = { 1.01f, 1.99f, 3.01f, 2.01f };
+
+			const int GROUPS = 4;
+			const int GROUP_SIZE = 64;
+			const int SUMS = 17;
+			const int ITER = 5;
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel accum(program, "accumSphereGN");
+				cl::Kernel solve(program, "solveSphereGN");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4));
+				cl::Buffer partialBuffer(context, CL_MEM_READ_WRITE, GROUPS * SUMS * sizeof(float));
+				cl::Buffer stateBuffer(context, CL_MEM_READ_WRITE, 20 * sizeof(float));
+				cl::Buffer covarianceBuffer(context, CL_MEM_READ_WRITE, 16 * sizeof(float));
+
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+				queue.finish();
+
+				accum.setArg(0, pointsBuffer);
+				accum.setArg(1, sphereBuffer);
+				accum.setArg(2, partialBuffer);
+				accum.setArg(3, GROUP_SIZE * SUMS * sizeof(float), nullptr);
+				accum.setArg(4, (cl_int)size);
+				accum.setArg(5, 0.03f);
+
+				solve.setArg(0, partialBuffer);
+				solve.setArg(1, sphereBuffer);
+				solve.setArg(2, stateBuffer);
+				solve.setArg(3, covarianceBuffer);
+				solve.setArg(4, GROUPS);
+
+				for (int i = 0; i <= ITER; i++)
+				{
+					solve.setArg(5, i);
+					solve.setArg(6, (cl_int)(i == ITER));
+					queue.enqueueNDRangeKernel(accum, cl::NullRange, GROUPS * GROUP_SIZE, GROUP_SIZE);
+					queue.enqueueNDRangeKernel(solve, cl::NullRange, 1, cl::NullRange);
+				}
+
+				std::vector<float> covariance(16);
+				queue.enqueueReadBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+				queue.enqueueReadBuffer(covarianceBuffer, CL_TRUE, 0, 16 * sizeof(float), covariance.data());
+
+				Assert::AreEqual(1.0f, sphere.s[0], 0.001f);
+				Assert::AreEqual(2.0f, sphere.s[1], 0.001f);
+				Assert::AreEqual(3.0f, sphere.s[2], 0.001f);
+				Assert::AreEqual(2.0f, sphere.s[3], 0.001f);
+
+				// noise free points, the variances are close to zero
+				for (int i = 0; i < 4; i++)
+				{
+					Assert::AreEqual(0.0f, covariance[i * 4 + i], 0.0001f);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereGNDegenerateTest)
+		{
+			// only 3 points on the sphere, too few for a covariance of 4 parameters
+			std::vector<cl_float4> points = {
+				{ 3, 2, 3, 0 },
+				{ 1, 4, 3, 0 },
+				{ 1, 2, 5, 0 },
+				{ 10, 10, 10, 0 }
+			};
+			cl_float4 sphere = { 1, 2, 3, 2 };
+
+			const int GROUPS = 4;
+			const int GROUP_SIZE = 64;
+			const int SUMS = 17;
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel accum(program, "accumSphereGN");
+				cl::Kernel solve(program, "solveSphereGN");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float4));
+				cl::Buffer partialBuffer(context, CL_MEM_READ_WRITE, GROUPS * SUMS * sizeof(float));
+				cl::Buffer stateBuffer(context, CL_MEM_READ_WRITE, 20 * sizeof(float));
+				cl::Buffer covarianceBuffer(context, CL_MEM_READ_WRITE, 16 * sizeof(float));
+
+				std::vector<float> covariance(16, 0.0f);
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+				queue.enqueueWriteBuffer(covarianceBuffer, CL_TRUE, 0, 16 * sizeof(float), covariance.data());
+				queue.finish();
+
+				accum.setArg(0, pointsBuffer);
+				accum.setArg(1, sphereBuffer);
+				accum.setArg(2, partialBuffer);
+				accum.setArg(3, GROUP_SIZE * SUMS * sizeof(float), nullptr);
+				accum.setArg(4, (cl_int)size);
+				accum.setArg(5, 0.03f);
+
+				solve.setArg(0, partialBuffer);
+				solve.setArg(1, sphereBuffer);
+				solve.setArg(2, stateBuffer);
+				solve.setArg(3, covarianceBuffer);
+				solve.setArg(4, GROUPS);
+				solve.setArg(5, 0);
+				solve.setArg(6, 1);
+
+				queue.enqueueNDRangeKernel(accum, cl::NullRange, GROUPS * GROUP_SIZE, GROUP_SIZE);
+				queue.enqueueNDRangeKernel(solve, cl::NullRange, 1, cl::NullRange);
+
+				queue.enqueueReadBuffer(covarianceBuffer, CL_TRUE, 0, 16 * sizeof(float), covariance.data());
+
+				// the covariance is marked invalid instead of being left untouched
+				for (int i = 0; i < 16; i++)
+				{
+					Assert::IsTrue(std::isnan(covariance[i]));
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereFillTest)
+		{
+			cl_float4 sphere = { 0, 0, 0, 1 };
+
+			// expected: first 8 fits, last 5 doesn't
+			std::vector<cl_float4> points = {
+				{1, 0, 0, 0},
+				{0, 1, 0, 0},
+				{0, 0, 1, 0},
+				{-1, 0, 0, 0},
+				{0, -1, 0, 0},
+				{0, 0, -1, 0},
+				{0.98, 0, 0, 0},
+				{0, 1.02, 0, 0},
+				{2, 1, 0, 0},
+				{10, 10, 10, 0},
+				{-100, 0, 0, 0},
+				{1.05, 0, 0, 0},
+				{0, 0, 0.7, 0}
+			};
+
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel kernel(program, "fillSphere");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4));
+
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+				queue.finish();
+
+				kernel.setArg(0, pointsBuffer);
+				kernel.setArg(1, sphereBuffer);
+				kernel.setArg(2, 0.03f);
+				kernel.setArg(3, 1);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
+
+				queue.enqueueReadBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+
+				for (int i = 0; i < 8; i++)
+				{
+					Assert::AreEqual(1.0f, points[i].s[3], 0.001f);
+				}
+				for (int i = 8; i < size; i++)
+				{
+					Assert::AreEqual(0.0f, points[i].s[3], 0.001f);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereRemoveTest)
+		{
+			cl_float4 sphere = { 0, 0, 0, 1 };
+
+			// expected: first 3 are removed, last 3 are kept
+			std::vector<cl_float4> points = {
+				{1, 0, 0, 0},
+				{0, 1, 0, 0},
+				{0, 0, 1, 0},
+				{5, 0, 0, 0},
+				{6, 1, 0, 0},
+				{0, 0, 0.7, 0}
+			};
+
+			size_t size = points.size();
+			const int K = 1;
+
+			try
+			{
+				cl::Kernel kernel(program, "removeSphere");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4));
+				cl::Buffer outBuffer(context, CL_MEM_WRITE_ONLY, size * sizeof(cl_float4));
+				cl::Buffer resultBuffer(context, CL_MEM_WRITE_ONLY, (K + 1) * sizeof(cl_float4));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, (K + 2) * sizeof(int));
+
+				std::vector<int> counts(K + 2, 0);
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+				queue.finish();
+
+				kernel.setArg(0, pointsBuffer);
+				kernel.setArg(1, sphereBuffer);
+				kernel.setArg(2, outBuffer);
+				kernel.setArg(3, resultBuffer);
+				kernel.setArg(4, countBuffer);
+				kernel.setArg(5, (cl_int)size);
+				kernel.setArg(6, K);
+				kernel.setArg(7, 0.03f);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
+
+				std::vector<cl_float4> out(size);
+				cl_float4 result;
+				queue.enqueueReadBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+				queue.enqueueReadBuffer(outBuffer, CL_TRUE, 0, size * sizeof(cl_float4), out.data());
+				queue.enqueueReadBuffer(resultBuffer, CL_TRUE, K * sizeof(cl_float4), sizeof(cl_float4), &result);
+
+				Assert::AreEqual(3, counts[0]);
+				Assert::AreEqual(0, counts[1]);
+				Assert::AreEqual(3, counts[1 + K]);
+				Assert::AreEqual(1.0f, result.s[3], 0.001f);
+
+				// kept points in any order
+				float sum = 0;
+				for (int i = 0; i < counts[0]; i++)
+				{
+					sum += out[i].s[0] + out[i].s[2];
+				}
+				Assert::AreEqual(11.7f, sum, 0.001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereRemoveSupportTest)
+		{
+			// the first sphere is well supported, the second and last requested one is not
+			std::vector<cl_float4> spheres = { { 0, 0, 0, 1 }, { 5, 0, 0, 1 } };
+			const int K = 2;
+			const int MIN_INLIERS = 20;
+
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 24; i++)
+			{
+				float phi = i * 0.7f;
+				float theta = i * 1.3f;
+				points.push_back({ cosf(phi) * sinf(theta), sinf(phi) * sinf(theta), cosf(theta), 0 });
+			}
+			points.push_back({ 6, 0, 0, 0 });
+			points.push_back({ 4, 0, 0, 0 });
+			points.push_back({ 5, 1, 0, 0 });
+			points.push_back({ 5, 0, 1, 0 });
+			points.push_back({ 10, 0, 0, 0 });
+			points.push_back({ 0, 10, 0, 0 });
+
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel kernel(program, "removeSphere");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4));
+				cl::Buffer outBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+				cl::Buffer resultBuffer(context, CL_MEM_WRITE_ONLY, K * sizeof(cl_float4));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, (K + 1) * sizeof(int));
+
+				std::vector<int> counts(K + 1, 0);
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+				queue.finish();
+
+				kernel.setArg(3, resultBuffer);
+				kernel.setArg(4, countBuffer);
+				kernel.setArg(7, 0.03f);
+
+				// the spheres are removed one after the other as in SphereFitter::Fit,
+				// the support of each one is read after its removal
+				int count = (int)size;
+				for (int k = 0; k < K; k++)
+				{
+					queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &spheres[k]);
+
+					kernel.setArg(0, pointsBuffer);
+					kernel.setArg(1, sphereBuffer);
+					kernel.setArg(2, outBuffer);
+					kernel.setArg(5, count);
+					kernel.setArg(6, k);
+
+					queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
+					queue.enqueueReadBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+
+					count = counts[0];
+					int zero = 0;
+					queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, sizeof(int), &zero);
+					std::swap(pointsBuffer, outBuffer);
+				}
+
+				Assert::AreEqual(2, count);
+				Assert::AreEqual(24, counts[1]);
+				Assert::AreEqual(4, counts[2]);
+
+				// only the first sphere is kept
+				Assert::IsTrue(counts[1] >= MIN_INLIERS);
+				Assert::IsTrue(counts[K] < MIN_INLIERS);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereMeasureTest)
+		{
+			// circle of the sphere with residuals -0.01, 0 and 0.01, and an outlier
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 999; i++)
+			{
+				float r = 0.5f + (i % 3 - 1) * 0.01f;
+				points.push_back({ r * cosf(i * 0.01f), r * sinf(i * 0.01f), -5, 0 });
+			}
+			points.push_back({ 9, 9, 9, 0 });
+			cl_float4 sphere = { 0, 0, -5, 0.5f };
+			const int GROUP_SIZE = 256;
+
+			try
+			{
+				cl::Kernel kernel(program, "measureSphere");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float4));
+				cl::Buffer statsBuffer(context, CL_MEM_WRITE_ONLY, 2 * sizeof(float));
+
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+
+				kernel.setArg(0, pointsBuffer);
+				kernel.setArg(1, sphereBuffer);
+				kernel.setArg(2, statsBuffer);
+				kernel.setArg(3, 2 * GROUP_SIZE * sizeof(float), nullptr);
+				kernel.setArg(4, (cl_int)points.size());
+				kernel.setArg(5, 0.03f);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
+
+				float stats[2];
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * sizeof(float), stats);
+
+				Assert::AreEqual(999.0f, stats[0]);
+				Assert::AreEqual(0.01f * sqrtf(2.0f / 3), sqrtf(stats[1] / stats[0]), 0.0001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereBatchTest)
+		{
+			// 4 frames: a sphere with clutter, no points, a smaller sphere and no points again,
+			// the segment of the last frame starts past the end of the points
+			std::vector<cl_float4> points;
+			std::vector<cl_int2> segments;
+			auto addCap = [&](float x, float y, float z, float r)
+			{
+				for (int i = -6; i <= 6; i++)
+				{
+					for (int j = -6; j <= 6; j++)
+					{
+						float theta = i * 0.12f;
+						float phi = j * 0.12f;
+						points.push_back({ x + r * sinf(theta) * cosf(phi), y + r * sinf(phi), z + r * cosf(theta) * cosf(phi), 0 });
+					}
+				}
+			};
+			addCap(1, 0, -5, 0.5f);
+			for (int i = 0; i < 100; i++)
+			{
+				points.push_back({ -2 + 4 * (rand() / (float)RAND_MAX), -1 + 2 * (rand() / (float)RAND_MAX), -7 + 4 * (rand() / (float)RAND_MAX), 0 });
+			}
+			segments.push_back({ 0, (int)points.size() });
+			segments.push_back({ (int)points.size(), 0 });
+			addCap(-1, 0.2f, -4, 0.3f);
+			segments.push_back({ segments[1].s[0], (int)points.size() - segments[1].s[0] });
+			segments.push_back({ (int)points.size(), 0 });
+
+			const int FRAMES = 4;
+			const int ITER_NUM = 512;
+			const int GROUP_SIZE = 64;
+			const int hypotheses = FRAMES * ITER_NUM;
+
+			try
+			{
+				cl::Kernel sample(program, "sampleBatch");
+				cl::Kernel calc(program, "calcSphere");
+				cl::Kernel fit(program, "fitSphereBatch");
+				cl::Kernel select(program, "selectBestBatch");
+				cl::Kernel copy(program, "copyBest");
+				cl::Kernel measure(program, "measureSphereBatch");
+
+				cl::Buffer pointsBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer segmentBuffer(context, CL_MEM_READ_ONLY, FRAMES * sizeof(cl_int2));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_WRITE, hypotheses * 4 * sizeof(int));
+				cl::Buffer sphereBuffer(context, CL_MEM_READ_WRITE, hypotheses * sizeof(cl_float4));
+				cl::Buffer scoreBuffer(context, CL_MEM_READ_WRITE, hypotheses * sizeof(float));
+				cl::Buffer bestBuffer(context, CL_MEM_READ_WRITE, FRAMES * sizeof(cl_ulong));
+				cl::Buffer modelBuffer(context, CL_MEM_READ_WRITE, FRAMES * sizeof(cl_float4));
+				cl::Buffer statsBuffer(context, CL_MEM_WRITE_ONLY, 2 * FRAMES * sizeof(float));
+
+				queue.enqueueWriteBuffer(pointsBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(segmentBuffer, CL_TRUE, 0, FRAMES * sizeof(cl_int2), segments.data());
+
+				sample.setArg(0, segmentBuffer);
+				sample.setArg(1, idxBuffer);
+				sample.setArg(2, (cl_uint)1234);
+				queue.enqueueNDRangeKernel(sample, cl::NullRange, cl::NDRange(ITER_NUM, FRAMES), cl::NullRange);
+
+				// no point is drawn for the empty frames
+				std::vector<int> idx(hypotheses * 4);
+				queue.enqueueReadBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(int), idx.data());
+				for (int i = 0; i < hypotheses * 4; i++)
+				{
+					int frame = i / (ITER_NUM * 4);
+					Assert::IsTrue(segments[frame].s[1] > 0 ? idx[i] >= segments[frame].s[0] && idx[i] < segments[frame].s[0] + segments[frame].s[1] : idx[i] == -1);
+				}
+
+				calc.setArg(0, pointsBuffer);
+				calc.setArg(1, idxBuffer);
+				calc.setArg(2, sphereBuffer);
+				queue.enqueueNDRangeKernel(calc, cl::NullRange, hypotheses, cl::NullRange);
+
+				fit.setArg(0, pointsBuffer);
+				fit.setArg(1, segmentBuffer);
+				fit.setArg(2, sphereBuffer);
+				fit.setArg(3, scoreBuffer);
+				fit.setArg(4, GROUP_SIZE * sizeof(float), nullptr);
+				fit.setArg(5, 0.03f);
+				fit.setArg(6, (cl_int)RANSAC_SCORE);
+				queue.enqueueNDRangeKernel(fit, cl::NullRange, cl::NDRange(ITER_NUM * GROUP_SIZE, FRAMES), cl::NDRange(GROUP_SIZE, 1));
+
+				select.setArg(0, scoreBuffer);
+				select.setArg(1, bestBuffer);
+				select.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+				select.setArg(3, ITER_NUM);
+				queue.enqueueNDRangeKernel(select, cl::NullRange, cl::NDRange(GROUP_SIZE, FRAMES), cl::NDRange(GROUP_SIZE, 1));
+
+				copy.setArg(0, sphereBuffer);
+				copy.setArg(1, bestBuffer);
+				copy.setArg(2, modelBuffer);
+				copy.setArg(3, 4);
+				queue.enqueueNDRangeKernel(copy, cl::NullRange, FRAMES * 4, cl::NullRange);
+
+				measure.setArg(0, pointsBuffer);
+				measure.setArg(1, segmentBuffer);
+				measure.setArg(2, modelBuffer);
+				measure.setArg(3, statsBuffer);
+				measure.setArg(4, 2 * GROUP_SIZE * sizeof(float), nullptr);
+				measure.setArg(5, 0.03f);
+				queue.enqueueNDRangeKernel(measure, cl::NullRange, cl::NDRange(GROUP_SIZE, FRAMES), cl::NDRange(GROUP_SIZE, 1));
+
+				std::vector<cl_ulong> best(FRAMES);
+				std::vector<cl_float4> models(FRAMES);
+				std::vector<float> stats(2 * FRAMES);
+				queue.enqueueReadBuffer(bestBuffer, CL_TRUE, 0, FRAMES * sizeof(cl_ulong), best.data());
+				queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, FRAMES * sizeof(cl_float4), models.data());
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * FRAMES * sizeof(float), stats.data());
+
+				// the best hypothesis of each frame is one of its own
+				for (int i = 0; i < FRAMES; i++)
+				{
+					Assert::IsTrue(UnpackIndex(best[i]) / ITER_NUM == i);
+				}
+
+				Assert::AreEqual(1.0f, models[0].s[0], 0.03f);
+				Assert::AreEqual(0.0f, models[0].s[1], 0.03f);
+				Assert::AreEqual(-5.0f, models[0].s[2], 0.03f);
+				Assert::AreEqual(0.5f, models[0].s[3], 0.03f);
+				Assert::IsTrue(stats[0] >= 150);
+
+				Assert::AreEqual(0.0f, UnpackScore(best[1]));
+				Assert::AreEqual(0.0f, stats[2]);
+
+				Assert::AreEqual(-1.0f, models[2].s[0], 0.03f);
+				Assert::AreEqual(0.2f, models[2].s[1], 0.03f);
+				Assert::AreEqual(-4.0f, models[2].s[2], 0.03f);
+				Assert::AreEqual(0.3f, models[2].s[3], 0.03f);
+				Assert::IsTrue(stats[4] >= 150);
+
+				Assert::AreEqual(0.0f, UnpackScore(best[3]));
+				Assert::AreEqual(0.0f, models[3].s[3]);
+				Assert::AreEqual(0.0f, stats[6]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(BufferPoolTest)
+		{
+			try
+			{
+				BufferPool pool;
+				pool.Init(context, devices[0]);
+				size_t alignment = devices[0].getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+
+				// odd sizes, every sub-buffer starts at an aligned offset
+				std::vector<size_t> sizes = { 1000, 3, 4096, 1 };
+				std::vector<cl::Buffer> first = pool.Allocate(sizes);
+				size_t capacity = pool.Capacity();
+				Assert::IsTrue(sizes.size() == first.size());
+				for (size_t i = 0; i < first.size(); i++)
+				{
+					size_t offset = first[i].getInfo<CL_MEM_OFFSET>();
+					Assert::IsTrue(offset % alignment == 0);
+					Assert::IsTrue(sizes[i] == first[i].getInfo<CL_MEM_SIZE>());
+					if (i > 0)
+					{
+						Assert::IsTrue(offset >= first[i - 1].getInfo<CL_MEM_OFFSET>() + sizes[i - 1]);
+					}
+				}
+
+				// unchanged sizes get the same sub-buffers
+				const std::vector<cl::Buffer>& same = pool.Allocate(sizes);
+				for (size_t i = 0; i < first.size(); i++)
+				{
+					Assert::IsTrue(first[i]() == same[i]());
+				}
+				Assert::IsTrue(capacity == pool.Capacity());
+
+				// smaller requests are carved from the same arena
+				pool.Allocate({ 16, 16 });
+				Assert::IsTrue(capacity == pool.Capacity());
+
+				// a request that no longer fits at least doubles the arena
+				std::vector<cl::Buffer> grown = pool.Allocate({ capacity / 2, capacity / 2 + 1 });
+				Assert::IsTrue(pool.Capacity() >= 2 * capacity);
+				Assert::IsTrue(grown[1].getInfo<CL_MEM_OFFSET>() % alignment == 0);
+				Assert::IsTrue(capacity / 2 + 1 == grown[1].getInfo<CL_MEM_SIZE>());
+
+				// the grown arena is usable up to its last sub-buffer
+				std::vector<int> values = { 1, 2, 3, 4 };
+				std::vector<int> read(4);
+				size_t last = capacity / 2 + 1 - values.size() * sizeof(int);
+				queue.enqueueWriteBuffer(grown[1], CL_TRUE, last, values.size() * sizeof(int), values.data());
+				queue.enqueueReadBuffer(grown[1], CL_TRUE, last, read.size() * sizeof(int), read.data());
+				for (size_t i = 0; i < values.size(); i++)
+				{
+					Assert::AreEqual(values[i], read[i]);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(SphereHoughTest)
+		{
+			// visible cap of a sphere at (1, 0, -5) with radius 0.5, and clutter
+			std::vector<cl_float4> points;
+			for (int i = -8; i <= 8; i++)
+			{
+				for (int j = -8; j <= 8; j++)
+				{
+					float theta = i * 0.1f;
+					float phi = j * 0.1f;
+					points.push_back({ 1 + 0.5f * sinf(theta) * cosf(phi), 0.5f * sinf(phi), -5 + 0.5f * cosf(theta) * cosf(phi), 0 });
+				}
+			}
+			for (int i = 0; i < 600; i++)
+			{
+				points.push_back({ -2 + 4 * (rand() / (float)RAND_MAX), -1 + 2 * (rand() / (float)RAND_MAX), -7 + 4 * (rand() / (float)RAND_MAX), 0 });
+			}
+			const int size = points.size();
+			const int TABLE_SIZE = 1 << 20;
+			const cl_float4 grid = { -2.6f, -1.6f, -7.6f, 0.05f };
+
+			try
+			{
+				cl::Kernel clear(program, "clearHough");
+				cl::Kernel vote(program, "voteSphere");
+				cl::Kernel score(program, "scoreHough");
+				cl::Kernel select(program, "selectBest");
+				cl::Kernel center(program, "houghCenter");
+
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer keyBuffer(context, CL_MEM_READ_WRITE, TABLE_SIZE * sizeof(cl_uint));
+				cl::Buffer voteBuffer(context, CL_MEM_READ_WRITE, TABLE_SIZE * sizeof(int));
+				cl::Buffer scoreBuffer(context, CL_MEM_READ_WRITE, TABLE_SIZE * sizeof(float));
+				cl::Buffer bestBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_ulong));
+				cl::Buffer modelBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float4));
+
+				cl_ulong best = 0;
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(bestBuffer, CL_TRUE, 0, sizeof(cl_ulong), &best);
+
+				clear.setArg(0, keyBuffer);
+				clear.setArg(1, voteBuffer);
+
+				queue.enqueueNDRangeKernel(clear, cl::NullRange, TABLE_SIZE, cl::NullRange);
+
+				// no normals, the half shells behind the points vote
+				vote.setArg(0, pointBuffer);
+				vote.setArg(1, pointBuffer);
+				vote.setArg(2, keyBuffer);
+				vote.setArg(3, voteBuffer);
+				vote.setArg(4, size);
+				vote.setArg(5, grid);
+				vote.setArg(6, 0.5f);
+				vote.setArg(7, 0);
+				vote.setArg(8, 0.9f);
+				vote.setArg(9, TABLE_SIZE - 1);
+
+				queue.enqueueNDRangeKernel(vote, cl::NullRange, size, cl::NullRange);
+
+				score.setArg(0, keyBuffer);
+				score.setArg(1, voteBuffer);
+				score.setArg(2, scoreBuffer);
+				score.setArg(3, TABLE_SIZE - 1);
+
+				queue.enqueueNDRangeKernel(score, cl::NullRange, TABLE_SIZE, cl::NullRange);
+
+				const unsigned GROUP_SIZE = 256;
+				select.setArg(0, scoreBuffer);
+				select.setArg(1, bestBuffer);
+				select.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+				select.setArg(3, TABLE_SIZE);
+
+				int groups = SelectGroupCount(devices[0], 16);
+				queue.enqueueNDRangeKernel(select, cl::NullRange, groups * GROUP_SIZE, GROUP_SIZE);
+
+				center.setArg(0, keyBuffer);
+				center.setArg(1, voteBuffer);
+				center.setArg(2, bestBuffer);
+				center.setArg(3, modelBuffer);
+				center.setArg(4, grid);
+				center.setArg(5, 0.5f);
+				center.setArg(6, TABLE_SIZE - 1);
+
+				queue.enqueueNDRangeKernel(center, cl::NullRange, 1, cl::NullRange);
+
+				cl_float4 sphere;
+				queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+
+				Assert::AreEqual(1.0f, sphere.s[0], 0.05f);
+				Assert::AreEqual(0.0f, sphere.s[1], 0.05f);
+				Assert::AreEqual(-5.0f, sphere.s[2], 0.05f);
+				Assert::AreEqual(0.5f, sphere.s[3]);
+
+				// without any vote the empty first slot is selected, the sphere is rejected
+				best = 0;
+				queue.enqueueNDRangeKernel(clear, cl::NullRange, TABLE_SIZE, cl::NullRange);
+				queue.enqueueWriteBuffer(bestBuffer, CL_TRUE, 0, sizeof(cl_ulong), &best);
+				queue.enqueueNDRangeKernel(center, cl::NullRange, 1, cl::NullRange);
+				queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, sizeof(cl_float4), &sphere);
+
+				Assert::AreEqual(0.0f, sphere.s[3]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PlaneCalcTest)
+		{
+			std::vector<cl_float4> points = {
+				{0,0,0,0}, {1,0,0,0}, {0,0,1,0},
+				{0,1,0,0}, {0,1,1,0}, {1,0,0,0},
+				{10,3,4.5,0}, {0.32,8,1.3,0}, {3,0.17,11,0}
+			};
+
+			std::vector<cl_int3> idx;
+			for (int i = 0; i < points.size(); i += 3)
+			{
+				idx.push_back({ i, i + 1, i + 2 });
+			}
+
+			try
+			{
+				cl::Kernel kernel(program_c, "calcPlane");
+				cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, idx.size() * sizeof(cl_int3));
+				cl::Buffer pointsBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
+				cl::Buffer normalsBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
+
+				queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(cl_int3), idx.data());
+
+				kernel.setArg(0, inputBuffer);
+				kernel.setArg(1, idxBuffer);
+				kernel.setArg(2, pointsBuffer);
+				kernel.setArg(3, normalsBuffer);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, idx.size(), cl::NullRange);
+
+				std::vector<cl_float3> res_pos, res_norm;
+				res_pos.resize(idx.size());
+				res_norm.resize(idx.size());
+				queue.enqueueReadBuffer(pointsBuffer, CL_TRUE, 0, res_pos.size() * sizeof(cl_float3), res_pos.data());
+				queue.enqueueReadBuffer(normalsBuffer, CL_TRUE, 0, res_norm.size() * sizeof(cl_float3), res_norm.data());
+
+				for (int i = 0; i < res_pos.size(); i++)
+					for (int j = 0; j < 3; j++)
+						Assert::AreEqual(res_pos[i].v4.m128_f32[j], points[i * 3].v4.m128_f32[j], 0.001f);
+
+				Assert::AreEqual(res_norm[0].v4.m128_f32[0], 0.0f, 0.01f);
+				Assert::AreEqual(res_norm[0].v4.m128_f32[1], -1.0f, 0.01f);
+				Assert::AreEqual(res_norm[0].v4.m128_f32[2], 0.0f, 0.01f);
+
+				Assert::AreEqual(res_norm[1].v4.m128_f32[0], 0.71f, 0.01f);
+				Assert::AreEqual(res_norm[1].v4.m128_f32[1], 0.71f, 0.01f);
+				Assert::AreEqual(res_norm[1].v4.m128_f32[2], 0.0f, 0.01f);
+
+				Assert::AreEqual(res_norm[2].v4.m128_f32[0], 0.22f, 0.01f);
+				Assert::AreEqual(res_norm[2].v4.m128_f32[1], 0.79f, 0.01f);
+				Assert::AreEqual(res_norm[2].v4.m128_f32[2], 0.58f, 0.01f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PlaneInlierTest)
+		{
+			cl_float3 point = { 0,0,0 };
+			cl_float3 norm = { 0,1,0 };
+
+			std::vector<cl_float4> points = {
+				{1,0,0,0},
+				{0,0,1,0},
+				{-1,0,0,0},
+				{0,0,-1,0},
+				{1,0,1,0},
+				{-1,0,-1,0},
+				{0,1,0,0},
+				{0,-1,0,0},
+				{10,1,2,0},
+				{5,0.5,0,0}
+			};
+			size_t size = points.size();
+			const int GROUP_SIZE = 8;
+
+			float inlier = 0;
+			try
+			{
+				cl::Kernel kernel(program_c, "fitPlane");
+
+				cl::Buffer dataBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+				cl::Buffer normBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+				cl::Buffer inlierBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float));
+
+				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, sizeof(cl_float3), &point);
+				queue.enqueueWriteBuffer(normBuffer, CL_TRUE, 0, sizeof(cl_float3), &norm);
+				queue.finish();
+
+				kernel.setArg(0, dataBuffer);
+				kernel.setArg(1, pointBuffer);
+				kernel.setArg(2, normBuffer);
+				kernel.setArg(3, inlierBuffer);
+				kernel.setArg(4, GROUP_SIZE * sizeof(float), nullptr);
+				kernel.setArg(5, (cl_int)size);
+				kernel.setArg(6, 0.12f);
+				kernel.setArg(7, (cl_int)RANSAC_SCORE);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
+
+				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, sizeof(float), &inlier);
+
+				Assert::AreEqual(6.0f, inlier, 0.001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PlaneSPRTTest)
+		{
+			// the first plane fits all points, the second one none and the third one was rejected
+			std::vector<cl_float3> planePoints = { { 0, 0, 0 }, { 0, 5, 0 }, { 0, 0, 0 } };
+			std::vector<cl_float3> normals = { { 0, 1, 0 }, { 0, 1, 0 }, { 0, 0, 0 } };
+
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 64; i++)
+			{
+				points.push_back({ (float)(i % 8), 0.01f * (i % 3), (float)(i / 8), 0 });
+			}
+
+			// delta = 0.01, epsilon = 0.1, A = 10
+			cl_float4 sprt = { logf(0.01f / 0.1f), logf(0.99f / 0.9f), logf(10.0f), 0 };
+			std::vector<int> stats = { 0, 0, 0 };
+
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel kernel(program_c, "fitPlaneSPRT");
+
+				cl::Buffer dataBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, planePoints.size() * sizeof(cl_float3));
+				cl::Buffer normBuffer(context, CL_MEM_READ_ONLY, normals.size() * sizeof(cl_float3));
+				cl::Buffer scoreBuffer(context, CL_MEM_WRITE_ONLY, normals.size() * sizeof(float));
+				cl::Buffer statsBuffer(context, CL_MEM_READ_WRITE, stats.size() * sizeof(int));
+
+				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, planePoints.size() * sizeof(cl_float3), planePoints.data());
+				queue.enqueueWriteBuffer(normBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float3), normals.data());
+				queue.enqueueWriteBuffer(statsBuffer, CL_TRUE, 0, stats.size() * sizeof(int), stats.data());
+				queue.finish();
+
+				kernel.setArg(0, dataBuffer);
+				kernel.setArg(1, pointBuffer);
+				kernel.setArg(2, normBuffer);
+				kernel.setArg(3, scoreBuffer);
+				kernel.setArg(4, statsBuffer);
+				kernel.setArg(5, (cl_int)size);
+				kernel.setArg(6, (cl_uint)1234);
+				kernel.setArg(7, sprt);
+				kernel.setArg(8, 0.12f);
+				kernel.setArg(9, (cl_int)RANSAC_SCORE);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, normals.size(), cl::NullRange);
+
+				std::vector<float> scores(normals.size());
+				queue.enqueueReadBuffer(scoreBuffer, CL_TRUE, 0, scores.size() * sizeof(float), scores.data());
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, stats.size() * sizeof(int), stats.data());
+
+				Assert::AreEqual((float)size, scores[0], 0.001f);
+				Assert::AreEqual(0.0f, scores[1], 0.001f);
+				Assert::AreEqual(0.0f, scores[2], 0.001f);
+
+				// only the second plane is tested and rejected, after a few points
+				Assert::AreEqual(1, stats[0]);
+				Assert::IsTrue(stats[1] < (int)size / 2);
+				Assert::AreEqual(0, stats[2]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PlaneFillTest)
+		{
+			cl_float3 point = { 0,0,0 };
+			cl_float3 norm = { 0,1,0 };
+
+			std::vector<cl_float4> points = {
+				{1,0,0,0},
+				{0,0,1,0},
+				{-1,0,0,0},
+				{0,0,-1,0},
+				{1,0,1,0},
+				{-1,0,-1,0},
+				{0,1,0,0},
+				{0,-1,0,0},
+				{10,1,2,0},
+				{5,0.5,0,0}
+			};
+			size_t size = points.size();
+
+			try
+			{
+				cl::Kernel kernel(program_c, "fillPlane");
+
+				cl::Buffer dataBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+				cl::Buffer normBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
+
+				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, sizeof(cl_float3), &point);
+				queue.enqueueWriteBuffer(normBuffer, CL_TRUE, 0, sizeof(cl_float3), &norm);
+				queue.finish();
+
+				kernel.setArg(0, dataBuffer);
+				kernel.setArg(1, pointBuffer);
+				kernel.setArg(2, normBuffer);
+				kernel.setArg(3, 0.12f);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
+
+				queue.enqueueReadBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+
+				for (int i = 0; i < 6; i++)
+				{
+					Assert::AreEqual(0.25f, points[i].s[3], 0.01f);
+				}
 				for (int i = 6; i < size; i++)
 				{
-					Assert::AreEqual(0.0f, points[i].s[3], 0.01f);
+					Assert::AreEqual(0.0f, points[i].s[3], 0.01f);
+				}
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PlaneSplitTest)
+		{
+			// plane inlier, close point, too near, too far, too high, plane inlier
+			std::vector<cl_float4> points = {
+				{ 4, 0, 0, 0.25f }, { 0, -1, -5, 0 }, { 1, 0, 1, 0.25f },
+				{ 8, 0, 0, 0 }, { 0, 2, 5, 0 }, { -5, -2, 0, 0.25f }
+			};
+			std::vector<float> qualities = { 1, 2, 3, 4, 5, 6 };
+			int counts[2] = { 0, 0 };
+
+			try
+			{
+				cl::Kernel kernel(program_c, "splitPlane");
+
+				cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer qualityBuffer(context, CL_MEM_READ_ONLY, qualities.size() * sizeof(float));
+				cl::Buffer planeBuffer(context, CL_MEM_WRITE_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer closeBuffer(context, CL_MEM_WRITE_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, 2 * sizeof(int));
+
+				queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(qualityBuffer, CL_TRUE, 0, qualities.size() * sizeof(float), qualities.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, 2 * sizeof(int), counts);
+
+				kernel.setArg(0, inputBuffer);
+				kernel.setArg(1, qualityBuffer);
+				kernel.setArg(2, planeBuffer);
+				kernel.setArg(3, closeBuffer);
+				kernel.setArg(4, countBuffer);
+				kernel.setArg(5, cl_float2{ 3, 7 });
+				kernel.setArg(6, 1.0f);
+				kernel.setArg(7, 1);
+				kernel.setArg(8, 1);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, points.size(), cl::NullRange);
+
+				std::vector<cl_float4> plane(points.size());
+				std::vector<cl_float4> close(points.size());
+				queue.enqueueReadBuffer(countBuffer, CL_TRUE, 0, 2 * sizeof(int), counts);
+				queue.enqueueReadBuffer(planeBuffer, CL_TRUE, 0, plane.size() * sizeof(cl_float4), plane.data());
+				queue.enqueueReadBuffer(closeBuffer, CL_TRUE, 0, close.size() * sizeof(cl_float4), close.data());
+
+				Assert::AreEqual(2, counts[0]);
+				Assert::AreEqual(1, counts[1]);
+
+				// the order of the compacted points is arbitrary
+				float qualitySum = plane[0].s[3] + plane[1].s[3];
+				Assert::AreEqual(7.0f, qualitySum);
+				Assert::AreEqual(-1.0f, close[0].s[1]);
+				Assert::AreEqual(2.0f, close[0].s[3]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PlaneRefineTest)
+		{
+			// ground y = -1.5 + 0.02 x with 1 cm noise and points above it,
+			// refined from a plane 5 cm too high
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 2000; i++)
+			{
+				float x = (i % 50) * 0.2f - 5;
+				float z = (i / 50) * 0.25f - 5;
+				float noise = ((i * 37) % 21 - 10) * 0.001f;
+				points.push_back({ x, -1.5f + 0.02f * x + noise, z, 0 });
+			}
+			for (int i = 0; i < 500; i++)
+			{
+				points.push_back({ (i % 25) * 0.4f - 5, -1 + (i % 7) * 0.3f, (i / 25) * 0.5f - 5, 0 });
+			}
+			const int size = (int)points.size();
+			cl_float3 point = { 0, -1.45f, 0 };
+			cl_float3 normal = { 0, 1, 0 };
+
+			try
+			{
+				cl::Kernel kernel(program_c, "refinePlane");
+
+				cl::Buffer dataBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer pointBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float3));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float3));
+				cl::Buffer statsBuffer(context, CL_MEM_READ_WRITE, 12 * sizeof(float));
+
+				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, sizeof(cl_float3), &point);
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, sizeof(cl_float3), &normal);
+
+				kernel.setArg(0, dataBuffer);
+				kernel.setArg(1, pointBuffer);
+				kernel.setArg(2, normalBuffer);
+				kernel.setArg(3, statsBuffer);
+				kernel.setArg(4, 256 * sizeof(float), nullptr);
+				kernel.setArg(5, size);
+				kernel.setArg(6, 0.12f);
+
+				// single work-group, twice
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, 256, 256);
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, 256, 256);
+
+				float stats[2];
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * sizeof(float), stats);
+				queue.enqueueReadBuffer(pointBuffer, CL_TRUE, 0, sizeof(cl_float3), &point);
+				queue.enqueueReadBuffer(normalBuffer, CL_TRUE, 0, sizeof(cl_float3), &normal);
+
+				// support of the plane after the first step
+				Assert::AreEqual(2000.0f, stats[0]);
+				Assert::IsTrue(sqrtf(stats[1] / stats[0]) < 0.01f);
+
+				glm::vec3 n = glm::normalize(glm::vec3(-0.02f, 1, 0));
+				Assert::AreEqual(n.x, normal.s[0], 0.001f);
+				Assert::AreEqual(n.y, normal.s[1], 0.001f);
+				Assert::AreEqual(n.z, normal.s[2], 0.001f);
+				Assert::AreEqual(-1.5f + 0.02f * point.s[0], point.s[1], 0.002f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(GroundPatchTest)
+		{
+			// ground flat at y = -1.5 up to x = 2 and rising 0.3 per meter beyond,
+			// with a pole of radius 0.2 standing on the slope at (4, 0.5)
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 4000; i++)
+			{
+				float x = (i % 80) * 0.2f - 8;
+				float z = (i / 80) * 0.3f - 7.5f;
+				float noise = ((i * 37) % 11 - 5) * 0.002f;
+				points.push_back({ x, (x < 2 ? -1.5f : -1.5f + 0.3f * (x - 2)) + noise, z, 0 });
+			}
+			for (int i = 0; i < 100; i++)
+			{
+				float a = i * 0.0628f;
+				points.push_back({ 4 + 0.2f * cosf(a), -0.8f + (i % 10) * 0.1f, 0.5f + 0.2f * sinf(a), 0 });
+			}
+			const int size = (int)points.size();
+			const int rings = 10;
+			const int sectors = 16;
+			const int patchNum = rings * sectors;
+			std::vector<int> zeros(patchNum, 0);
+
+			try
+			{
+				cl::Kernel countKernel(program_c, "countPolarCells");
+				cl::Kernel scanKernel(program_c, "scanCells");
+				cl::Kernel scatterKernel(program_c, "scatterCells");
+				cl::Kernel fitKernel(program_c, "fitPatches");
+				cl::Kernel labelKernel(program_c, "labelGround");
+
+				cl::Buffer dataBuffer(context, CL_MEM_READ_WRITE, size * sizeof(cl_float4));
+				cl::Buffer cellBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, patchNum * sizeof(int));
+				cl::Buffer startBuffer(context, CL_MEM_READ_WRITE, patchNum * sizeof(int));
+				cl::Buffer sortedBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer patchBuffer(context, CL_MEM_READ_WRITE, patchNum * sizeof(cl_float4));
+
+				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, patchNum * sizeof(int), zeros.data());
+
+				countKernel.setArg(0, dataBuffer);
+				countKernel.setArg(1, cellBuffer);
+				countKernel.setArg(2, countBuffer);
+				countKernel.setArg(3, size);
+				countKernel.setArg(4, 1.f);
+				countKernel.setArg(5, cl_int2{ rings, sectors });
+				queue.enqueueNDRangeKernel(countKernel, cl::NullRange, size, cl::NullRange);
+
+				scanKernel.setArg(0, countBuffer);
+				scanKernel.setArg(1, startBuffer);
+				scanKernel.setArg(2, 256 * sizeof(int), nullptr);
+				scanKernel.setArg(3, patchNum);
+				queue.enqueueNDRangeKernel(scanKernel, cl::NullRange, 256, 256);
+
+				scatterKernel.setArg(0, cellBuffer);
+				scatterKernel.setArg(1, startBuffer);
+				scatterKernel.setArg(2, countBuffer);
+				scatterKernel.setArg(3, sortedBuffer);
+				scatterKernel.setArg(4, size);
+				queue.enqueueNDRangeKernel(scatterKernel, cl::NullRange, size, cl::NullRange);
+
+				fitKernel.setArg(0, dataBuffer);
+				fitKernel.setArg(1, startBuffer);
+				fitKernel.setArg(2, countBuffer);
+				fitKernel.setArg(3, sortedBuffer);
+				fitKernel.setArg(4, patchBuffer);
+				fitKernel.setArg(5, 64 * sizeof(float), nullptr);
+				fitKernel.setArg(6, 0.2f);
+				fitKernel.setArg(7, 0.8f);
+				// one work-group per patch
+				queue.enqueueNDRangeKernel(fitKernel, cl::NullRange, patchNum * 64, 64);
+
+				labelKernel.setArg(0, dataBuffer);
+				labelKernel.setArg(1, cellBuffer);
+				labelKernel.setArg(2, patchBuffer);
+				labelKernel.setArg(3, 0.06f);
+				queue.enqueueNDRangeKernel(labelKernel, cl::NullRange, size, cl::NullRange);
+
+				std::vector<cl_float4> patches(patchNum);
+				queue.enqueueReadBuffer(patchBuffer, CL_TRUE, 0, patchNum * sizeof(cl_float4), patches.data());
+				queue.enqueueReadBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+
+				int ground = 0;
+				int pole = 0;
+				for (int i = 0; i < size; i++)
+				{
+					(i < 4000 ? ground : pole) += points[i].s[3] != 0;
+				}
+				Assert::IsTrue(ground >= 3900);
+				Assert::IsTrue(pole <= 10);
+
+				// the patch of ring 5 around +x follows the slope
+				const cl_float4& patch = patches[(sectors / 2) * rings + 5];
+				Assert::IsTrue(patch.s[1] > 0.9f);
+				Assert::AreEqual(-0.45f, -(patch.s[0] * 5.5f + patch.s[3]) / patch.s[1], 0.02f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(CylinderCalcTest)
+		{
+			std::vector<cl_float3> points = {
+				{-1,0,0}, {1,0,0}, {0,0,1},
+				{10,0,3}, {0.32,0,8}, {3,0,0.17},
+				{5.63527261068398, -0.692904204691849, -1.52133834711262},
+				{5.4029353024265, -1.70681461715848, -1.51823251857139},
+				{10.7040668630443, -2.23217858522227, 0.190859516798132}
+			};
+
+			std::vector<cl_int3> idx;
+			for (int i = 0; i < points.size(); i += 3)
+			{
+				idx.push_back({ i, i + 1, i + 2 });
+			}
+
+			try
+			{
+				cl::Kernel kernel(program_c, "calcCylinder");
+				cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float3));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, idx.size() * sizeof(cl_int3));
+				cl::Buffer pointsBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
+
+				queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(cl_int3), idx.data());
+
+				kernel.setArg(0, idxBuffer);
+				kernel.setArg(1, inputBuffer);
+				kernel.setArg(2, pointsBuffer);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, idx.size(), cl::NullRange);
+
+				std::vector<cl_float3> cylinders;
+				cylinders.resize(idx.size());
+				queue.enqueueReadBuffer(pointsBuffer, CL_TRUE, 0, cylinders.size() * sizeof(cl_float3), cylinders.data());
+
+				Assert::AreEqual(cylinders[0].v4.m128_f32[0], 0.0f, 0.01f);
+				Assert::AreEqual(cylinders[0].v4.m128_f32[1], 0.0f, 0.01f);
+				Assert::AreEqual(cylinders[0].v4.m128_f32[2], 1.0f, 0.01f);
+
+				Assert::AreEqual(cylinders[1].v4.m128_f32[0], 5.02f, 0.01f);
+				Assert::AreEqual(cylinders[1].v4.m128_f32[1], 5.24f, 0.01f);
+				Assert::AreEqual(cylinders[1].v4.m128_f32[2], 5.45f, 0.01f);
+
+				Assert::AreEqual(cylinders[2].v4.m128_f32[0], 5.63f, 0.01f);
+				Assert::AreEqual(cylinders[2].v4.m128_f32[1], 6.85f, 0.01f);
+				Assert::AreEqual(cylinders[2].v4.m128_f32[2], 8.37f, 0.01f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(PackedLayoutTest)
+		{
+			// the circles of CylinderCalcTest, computed and checked with the float3
+			// hypotheses packed to 3 floats and padded to 4, must be the same
+			std::vector<cl_float4> points = {
+				{-1,0,0,0}, {1,0,0,0}, {0,0,1,0},
+				{10,0,3,0}, {0.32f,0,8,0}, {3,0,0.17f,0},
+				{0,0,0,0}, {1,0,0,0}, {2,0,0,0}
+			};
+			std::vector<cl_int3> idx = { {0,1,2}, {3,4,5}, {6,7,8} };
+			const int n = (int)idx.size();
+
+			try
+			{
+				std::ifstream cylinderFile("../../../Sphere_Detection/cylinder_detect.cl");
+				std::string cylinderCode(std::istreambuf_iterator<char>(cylinderFile), (std::istreambuf_iterator<char>()));
+				cylinderFile.close();
+
+				std::ifstream ransacFile("../../../Sphere_Detection/ransac.cl");
+				std::string ransacCode(std::istreambuf_iterator<char>(ransacFile), (std::istreambuf_iterator<char>()));
+				ransacFile.close();
+
+				std::ifstream planeFile("../../../Sphere_Detection/plane_detect.cl");
+				std::string planeCode(std::istreambuf_iterator<char>(planeFile), (std::istreambuf_iterator<char>()));
+				planeFile.close();
+				cylinderCode = ransacCode + "\n" + planeCode + "\n" + cylinderCode;
+
+				cl::Program::Sources cylinderSource(1, std::make_pair(cylinderCode.c_str(), cylinderCode.length() + 1));
+				cl::Program packed(context, cylinderSource);
+				packed.build(devices, "-D PACKED_FLOAT3");
+
+				cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float4));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_int3));
+				queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, n * sizeof(cl_int3), idx.data());
+
+				std::vector<float> results[2];
+				for (int width = 3; width <= 4; width++)
+				{
+					cl::Program& program = width == 3 ? packed : program_c;
+					cl::Kernel calc(program, "calcCylinder");
+					cl::Kernel check(program, "checkCylinder");
+					cl::Buffer cylinderBuffer(context, CL_MEM_READ_WRITE, n * width * sizeof(float));
+
+					calc.setArg(0, idxBuffer);
+					calc.setArg(1, inputBuffer);
+					calc.setArg(2, cylinderBuffer);
+					queue.enqueueNDRangeKernel(calc, cl::NullRange, n, cl::NullRange);
+
+					check.setArg(0, cylinderBuffer);
+					check.setArg(1, cl_float2{ 0.05f, 5.0f });
+					check.setArg(2, cl_float4{ -10, -10, -10, 0 });
+					check.setArg(3, cl_float4{ 10, 10, 10, 0 });
+					queue.enqueueNDRangeKernel(check, cl::NullRange, n, cl::NullRange);
+
+					std::vector<float> cylinders(n * width);
+					queue.enqueueReadBuffer(cylinderBuffer, CL_TRUE, 0, n * width * sizeof(float), cylinders.data());
+					for (int i = 0; i < n; i++)
+					{
+						results[width - 3].insert(results[width - 3].end(), &cylinders[i * width], &cylinders[i * width + 3]);
+					}
 				}
+
+				// the collinear sample and the too large circle are zeroed in both
+				for (int i = 0; i < 3 * n; i++)
+				{
+					Assert::AreEqual(results[1][i], results[0][i]);
+				}
+				Assert::AreEqual(1.0f, results[0][2], 0.01f);
+				Assert::AreEqual(0.0f, results[0][5]);
+				Assert::AreEqual(0.0f, results[0][8]);
+
+				// the host's layout is the one its build options select
+				Assert::AreEqual(FLOAT3_WIDTH == 3, std::string(FLOAT3_OPTIONS) == "-D PACKED_FLOAT3");
 			}
 			catch (cl::Error& error)
 			{
@@ -587,53 +2383,189 @@ namespace SphereDetectionTest
 			}
 		}
 
-		TEST_METHOD(CylinderCalcTest)
+		TEST_METHOD(CylinderNormalsCalcTest)
 		{
+			// oriented points at different heights of a vertical cylinder at x = 1, z = -4
+			// with radius 0.5, and a pair giving an axis tilted by 45 degrees
 			std::vector<cl_float3> points = {
-				{-1,0,0}, {1,0,0}, {0,0,1},
-				{10,0,3}, {0.32,0,8}, {3,0,0.17},
-				{5.63527261068398, -0.692904204691849, -1.52133834711262},
-				{5.4029353024265, -1.70681461715848, -1.51823251857139},
-				{10.7040668630443, -2.23217858522227, 0.190859516798132}
+				{ 1 + 0.5f * sinf(0.3f), -1, -4 + 0.5f * cosf(0.3f) },
+				{ 1 + 0.5f * sinf(-0.8f), 0.5f, -4 + 0.5f * cosf(-0.8f) },
+				{ 0, 0, -1 },
+				{ 1, 0, -2 }
 			};
+			std::vector<cl_float4> normals = {
+				{ sinf(0.3f), 0, cosf(0.3f), 1 },
+				{ sinf(-0.8f), 0, cosf(-0.8f), 1 },
+				{ 0, 0.7071f, 0.7071f, 1 },
+				{ 1, 0, 0, 1 }
+			};
+			std::vector<cl_int3> idx = { { 0, 1, 0 }, { 2, 3, 0 } };
 
-			std::vector<cl_int3> idx;
-			for (int i = 0; i < points.size(); i += 3)
+			try
 			{
-				idx.push_back({ i, i + 1, i + 2 });
+				cl::Kernel kernel(program_c, "calcCylinderNormals");
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float3));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_ONLY, normals.size() * sizeof(cl_float4));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, idx.size() * sizeof(cl_int3));
+				cl::Buffer cylinderBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
+
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float4), normals.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(cl_int3), idx.data());
+
+				kernel.setArg(0, pointBuffer);
+				kernel.setArg(1, normalBuffer);
+				kernel.setArg(2, idxBuffer);
+				kernel.setArg(3, cylinderBuffer);
+				kernel.setArg(4, 0.95f);
+
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, idx.size(), cl::NullRange);
+
+				std::vector<cl_float3> cylinders(idx.size());
+				queue.enqueueReadBuffer(cylinderBuffer, CL_TRUE, 0, cylinders.size() * sizeof(cl_float3), cylinders.data());
+
+				Assert::AreEqual(1.0f, cylinders[0].s[0], 0.001f);
+				Assert::AreEqual(-4.0f, cylinders[0].s[1], 0.001f);
+				Assert::AreEqual(0.5f, cylinders[0].s[2], 0.001f);
+
+				// too tilted for the ground plane model
+				Assert::AreEqual(0.0f, cylinders[1].s[2]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(CylinderAxisTest)
+		{
+			// half of a cylinder with radius 0.3 around the axis (1, 1, 0) through (0, 0, -5),
+			// 40 points along 2 m of the axis on each of 10 lines, and an outlier
+			glm::vec3 axis = glm::normalize(glm::vec3(1, 1, 0));
+			glm::vec3 u(0, 0, 1);
+			glm::vec3 v = glm::cross(axis, u);
+			std::vector<cl_float3> points;
+			std::vector<cl_float4> normals;
+			for (int i = 0; i < 400; i++)
+			{
+				float t = -1 + 2 * (i % 40) / 39.0f;
+				float phi = glm::pi<float>() * (i / 40) / 10;
+				glm::vec3 n = cosf(phi) * u + sinf(phi) * v;
+				glm::vec3 p = glm::vec3(0, 0, -5) + t * axis + 0.3f * n;
+				points.push_back({ p.x, p.y, p.z });
+				normals.push_back({ n.x, n.y, n.z, 1 });
 			}
+			points.push_back({ 9, 9, 9 });
+			normals.push_back({ 0, 0, 0, 0 });
+
+			// points of different lines, then of the same line with parallel normals
+			std::vector<cl_int3> idx = { { 3, 157, 0 }, { 10, 11, 0 } };
 
 			try
 			{
-				cl::Kernel kernel(program_c, "calcCylinder");
-				cl::Buffer inputBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float3));
+				cl::Kernel calcKernel(program_c, "calcCylinderAxis");
+				cl::Kernel measureKernel(program_c, "measureCylinderAxis");
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float3));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_ONLY, normals.size() * sizeof(cl_float4));
 				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, idx.size() * sizeof(cl_int3));
-				cl::Buffer pointsBuffer(context, CL_MEM_WRITE_ONLY, idx.size() * sizeof(cl_float3));
+				cl::Buffer cylinderBuffer(context, CL_MEM_READ_WRITE, idx.size() * sizeof(cl_float8));
+				cl::Buffer statsBuffer(context, CL_MEM_WRITE_ONLY, 2 * sizeof(float));
 
-				queue.enqueueWriteBuffer(inputBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float4), normals.data());
 				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, idx.size() * sizeof(cl_int3), idx.data());
 
-				kernel.setArg(0, idxBuffer);
-				kernel.setArg(1, inputBuffer);
-				kernel.setArg(2, pointsBuffer);
+				calcKernel.setArg(0, pointBuffer);
+				calcKernel.setArg(1, normalBuffer);
+				calcKernel.setArg(2, idxBuffer);
+				calcKernel.setArg(3, cylinderBuffer);
 
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, idx.size(), cl::NullRange);
+				queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, idx.size(), cl::NullRange);
 
-				std::vector<cl_float3> cylinders;
-				cylinders.resize(idx.size());
-				queue.enqueueReadBuffer(pointsBuffer, CL_TRUE, 0, cylinders.size() * sizeof(cl_float3), cylinders.data());
+				std::vector<cl_float8> cylinders(idx.size());
+				queue.enqueueReadBuffer(cylinderBuffer, CL_TRUE, 0, cylinders.size() * sizeof(cl_float8), cylinders.data());
 
-				Assert::AreEqual(cylinders[0].v4.m128_f32[0], 0.0f, 0.01f);
-				Assert::AreEqual(cylinders[0].v4.m128_f32[1], 0.0f, 0.01f);
-				Assert::AreEqual(cylinders[0].v4.m128_f32[2], 1.0f, 0.01f);
+				Assert::AreEqual(0.3f, cylinders[0].s[3], 0.001f);
+				Assert::AreEqual(0.7071f, cylinders[0].s[4], 0.001f);
+				Assert::AreEqual(0.7071f, cylinders[0].s[5], 0.001f);
+				Assert::AreEqual(0.0f, cylinders[0].s[6], 0.001f);
+				Assert::AreEqual(0.0f, cylinders[1].s[3]);
 
-				Assert::AreEqual(cylinders[1].v4.m128_f32[0], 5.02f, 0.01f);
-				Assert::AreEqual(cylinders[1].v4.m128_f32[1], 5.24f, 0.01f);
-				Assert::AreEqual(cylinders[1].v4.m128_f32[2], 5.45f, 0.01f);
+				// the first cylinder is measured in place
+				measureKernel.setArg(0, pointBuffer);
+				measureKernel.setArg(1, cylinderBuffer);
+				measureKernel.setArg(2, statsBuffer);
+				measureKernel.setArg(3, 256 * sizeof(cl_float4), nullptr);
+				measureKernel.setArg(4, (int)points.size());
+				measureKernel.setArg(5, 0.03f);
 
-				Assert::AreEqual(cylinders[2].v4.m128_f32[0], 5.63f, 0.01f);
-				Assert::AreEqual(cylinders[2].v4.m128_f32[1], 6.85f, 0.01f);
-				Assert::AreEqual(cylinders[2].v4.m128_f32[2], 8.37f, 0.01f);
+				queue.enqueueNDRangeKernel(measureKernel, cl::NullRange, 256, 256);
+
+				float stats[2];
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * sizeof(float), stats);
+				queue.enqueueReadBuffer(cylinderBuffer, CL_TRUE, 0, sizeof(cl_float8), cylinders.data());
+
+				Assert::AreEqual(400.0f, stats[0]);
+				Assert::AreEqual(0.0f, stats[1], 0.001f);
+
+				// centered on the inliers, with the length of the covered axis
+				Assert::AreEqual(0.0f, cylinders[0].s[0], 0.001f);
+				Assert::AreEqual(0.0f, cylinders[0].s[1], 0.001f);
+				Assert::AreEqual(-5.0f, cylinders[0].s[2], 0.001f);
+				Assert::AreEqual(2.0f, cylinders[0].s[7], 0.001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(CylinderPriorTest)
+		{
+			// valid, axis outside the region, too large
+			std::vector<cl_float3> cylinders = { { 1, -5, 0.5f }, { 1, -50, 0.5f }, { 1, -5, 4 } };
+			// horizontal, tilted within the cone, tilted too much, degenerate
+			std::vector<cl_float3> normals = { { 0, 1, 0 }, { 0.6f, 0.8f, 0 }, { 0.8f, 0.6f, 0 }, { 0, 0, 0 } };
+
+			try
+			{
+				cl::Kernel checkCylinder(program_c, "checkCylinder");
+				cl::Kernel checkPlane(program_c, "checkPlane");
+
+				cl::Buffer cylinderBuffer(context, CL_MEM_READ_WRITE, cylinders.size() * sizeof(cl_float3));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_WRITE, normals.size() * sizeof(cl_float3));
+
+				queue.enqueueWriteBuffer(cylinderBuffer, CL_TRUE, 0, cylinders.size() * sizeof(cl_float3), cylinders.data());
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float3), normals.data());
+
+				checkCylinder.setArg(0, cylinderBuffer);
+				checkCylinder.setArg(1, cl_float2{ 0.05f, 1.5f });
+				checkCylinder.setArg(2, cl_float4{ -10, -10, -10, 0 });
+				checkCylinder.setArg(3, cl_float4{ 10, 10, 10, 0 });
+
+				checkPlane.setArg(0, normalBuffer);
+				checkPlane.setArg(1, 0.79f);
+
+				queue.enqueueNDRangeKernel(checkCylinder, cl::NullRange, cylinders.size(), cl::NullRange);
+				queue.enqueueNDRangeKernel(checkPlane, cl::NullRange, normals.size(), cl::NullRange);
+
+				std::vector<cl_float3> res_cyl(cylinders.size());
+				std::vector<cl_float3> res_norm(normals.size());
+				queue.enqueueReadBuffer(cylinderBuffer, CL_TRUE, 0, res_cyl.size() * sizeof(cl_float3), res_cyl.data());
+				queue.enqueueReadBuffer(normalBuffer, CL_TRUE, 0, res_norm.size() * sizeof(cl_float3), res_norm.data());
+
+				Assert::AreEqual(0.5f, res_cyl[0].s[2]);
+				Assert::AreEqual(0.0f, res_cyl[1].s[2]);
+				Assert::AreEqual(0.0f, res_cyl[2].s[2]);
+
+				Assert::AreEqual(1.0f, res_norm[0].s[1]);
+				Assert::AreEqual(0.8f, res_norm[1].s[1]);
+				Assert::AreEqual(0.0f, res_norm[2].s[1]);
+				Assert::AreEqual(0.0f, res_norm[3].s[1]);
 			}
 			catch (cl::Error& error)
 			{
@@ -658,7 +2590,8 @@ namespace SphereDetectionTest
 				{0,0,0,0}
 			};
 			size_t size = points.size();
-			int inlier = 0;
+			const int GROUP_SIZE = 8;
+			float inlier = 0;
 
 			try
 			{
@@ -666,21 +2599,24 @@ namespace SphereDetectionTest
 
 				cl::Buffer dataBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
 				cl::Buffer cylinderBuffer(context, CL_MEM_READ_ONLY, sizeof(cl_float3));
-				cl::Buffer inlierBuffer(context, CL_MEM_WRITE_ONLY, sizeof(int));
+				cl::Buffer inlierBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float));
 
 				queue.enqueueWriteBuffer(dataBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
 				queue.enqueueWriteBuffer(cylinderBuffer, CL_TRUE, 0, sizeof(cl_float3), &cylinder);
-				queue.enqueueWriteBuffer(inlierBuffer, CL_TRUE, 0, sizeof(int), &inlier);
 
 				kernel.setArg(0, dataBuffer);
 				kernel.setArg(1, cylinderBuffer);
 				kernel.setArg(2, inlierBuffer);
+				kernel.setArg(3, GROUP_SIZE * sizeof(float), nullptr);
+				kernel.setArg(4, (cl_int)size);
+				kernel.setArg(5, 0.06f);
+				kernel.setArg(6, (cl_int)RANSAC_SCORE);
 
-				queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(1, size), cl::NullRange);
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, GROUP_SIZE, GROUP_SIZE);
 
-				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, sizeof(int), &inlier);
+				queue.enqueueReadBuffer(inlierBuffer, CL_TRUE, 0, sizeof(float), &inlier);
 
-				Assert::AreEqual(4, inlier);
+				Assert::AreEqual(4.0f, inlier, 0.001f);
 			}
 			catch (cl::Error& error)
 			{
@@ -718,6 +2654,7 @@ namespace SphereDetectionTest
 
 				kernel.setArg(0, dataBuffer);
 				kernel.setArg(1, cylinderBuffer);
+				kernel.setArg(2, 0.06f);
 
 				queue.enqueueNDRangeKernel(kernel, cl::NullRange, size, cl::NullRange);
 
@@ -739,5 +2676,655 @@ namespace SphereDetectionTest
 				return;
 			}
 		}
+
+		TEST_METHOD(CircleHoughTest)
+		{
+			// visible half of a pole at (4, 1) with radius 0.3, and clutter
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 400; i++)
+			{
+				float a = (i % 40) * 3.14159265f / 40 + 3.14159265f / 2 + atan2f(1, 4);
+				points.push_back({ 4 + 0.3f * cosf(a), -1 + (i / 40) * 0.2f, 1 + 0.3f * sinf(a), 0 });
+			}
+			for (int i = 0; i < 400; i++)
+			{
+				points.push_back({ -6 + 12 * (rand() / (float)RAND_MAX), 0, -6 + 12 * (rand() / (float)RAND_MAX), 0 });
+			}
+			const int size = points.size();
+			const cl_float4 grid = { -7.5f, -7.5f, 0.05f, 0 };
+			const cl_float2 radius = { 0.05f, 0.05f };
+			const cl_int4 dims = { 300, 300, 30, 0 };
+			const int cellNum = dims.s[0] * dims.s[1] * dims.s[2];
+
+			try
+			{
+				cl::Kernel clear(program_c, "clearVotes");
+				cl::Kernel vote(program_c, "voteCircles");
+				cl::Kernel score(program_c, "scoreCircles");
+				cl::Kernel select(program_c, "selectBest");
+				cl::Kernel center(program_c, "circleCenter");
+
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer voteBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer scoreBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(float));
+				cl::Buffer bestBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_ulong));
+				cl::Buffer modelBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_float3));
+
+				cl_ulong best = 0;
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(bestBuffer, CL_TRUE, 0, sizeof(cl_ulong), &best);
+
+				clear.setArg(0, voteBuffer);
+
+				queue.enqueueNDRangeKernel(clear, cl::NullRange, cellNum, cl::NullRange);
+
+				vote.setArg(0, pointBuffer);
+				vote.setArg(1, voteBuffer);
+				vote.setArg(2, size);
+				vote.setArg(3, grid);
+				vote.setArg(4, radius);
+				vote.setArg(5, dims);
+
+				queue.enqueueNDRangeKernel(vote, cl::NullRange, size, cl::NullRange);
+
+				score.setArg(0, voteBuffer);
+				score.setArg(1, scoreBuffer);
+				score.setArg(2, dims);
+
+				queue.enqueueNDRangeKernel(score, cl::NullRange, cellNum, cl::NullRange);
+
+				const unsigned GROUP_SIZE = 256;
+				select.setArg(0, scoreBuffer);
+				select.setArg(1, bestBuffer);
+				select.setArg(2, GROUP_SIZE * sizeof(cl_ulong), nullptr);
+				select.setArg(3, cellNum);
+
+				int groups = SelectGroupCount(devices[0], 16);
+				queue.enqueueNDRangeKernel(select, cl::NullRange, groups * GROUP_SIZE, GROUP_SIZE);
+
+				center.setArg(0, voteBuffer);
+				center.setArg(1, bestBuffer);
+				center.setArg(2, modelBuffer);
+				center.setArg(3, grid);
+				center.setArg(4, radius);
+				center.setArg(5, dims);
+
+				queue.enqueueNDRangeKernel(center, cl::NullRange, 1, cl::NullRange);
+
+				cl_float3 circle;
+				queue.enqueueReadBuffer(modelBuffer, CL_TRUE, 0, sizeof(cl_float3), &circle);
+
+				Assert::AreEqual(4.0f, circle.s[0], 0.05f);
+				Assert::AreEqual(1.0f, circle.s[1], 0.05f);
+				Assert::AreEqual(0.3f, circle.s[2], 0.05f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(ClusterLabelTest)
+		{
+			// a ring, an L-shaped wall and a single point on a 16 x 16 grid of 0.25 m cells
+			std::vector<cl_float4> points;
+			for (int i = 0; i < 60; i++)
+			{
+				float phi = 2 * glm::pi<float>() * i / 60;
+				points.push_back({ 1 + 0.3f * cosf(phi), 0, 1 + 0.3f * sinf(phi), 0 });
+			}
+			for (int i = 0; i < 60; i++)
+			{
+				float t = i * 0.1f;
+				points.push_back(t < 1.5f ? cl_float4{ 2 + t, 0, 3, 0 } : cl_float4{ 3.5f, 0, 4.5f - t, 0 });
+			}
+			points.push_back({ 0.2f, 0, 3.8f, 0 });
+			const int size = (int)points.size();
+			const cl_int4 dims = { 16, 1, 16, 0 };
+			const int cellNum = 16 * 16;
+
+			try
+			{
+				cl::Kernel countCells(program_c, "countCells");
+				cl::Kernel initLabels(program_c, "initLabels");
+				cl::Kernel propagateLabels(program_c, "propagateLabels");
+				cl::Kernel countClusters(program_c, "countClusters");
+				cl::Kernel clusterPoints(program_c, "clusterPoints");
+
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float4));
+				cl::Buffer cellBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer countBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer labelBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer clusterBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer pointClusterBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer clusterCountBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer clusterNumBuffer(context, CL_MEM_READ_WRITE, sizeof(int));
+				cl::Buffer changedBuffer(context, CL_MEM_READ_WRITE, sizeof(int));
+
+				std::vector<int> zeros(cellNum, 0);
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float4), points.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, cellNum * sizeof(int), zeros.data());
+				queue.enqueueWriteBuffer(clusterCountBuffer, CL_TRUE, 0, cellNum * sizeof(int), zeros.data());
+				queue.enqueueWriteBuffer(clusterNumBuffer, CL_TRUE, 0, sizeof(int), zeros.data());
+
+				countCells.setArg(0, pointBuffer);
+				countCells.setArg(1, cellBuffer);
+				countCells.setArg(2, countBuffer);
+				countCells.setArg(3, size);
+				countCells.setArg(4, cl_float4{ 0, 0, 0, 0.25f });
+				countCells.setArg(5, dims);
+
+				queue.enqueueNDRangeKernel(countCells, cl::NullRange, size, cl::NullRange);
+
+				initLabels.setArg(0, countBuffer);
+				initLabels.setArg(1, labelBuffer);
+
+				queue.enqueueNDRangeKernel(initLabels, cl::NullRange, cellNum, cl::NullRange);
+
+				propagateLabels.setArg(0, labelBuffer);
+				propagateLabels.setArg(1, changedBuffer);
+				propagateLabels.setArg(2, dims);
+
+				int changed = 1;
+				for (int step = 0; changed != 0; step++)
+				{
+					Assert::IsTrue(step < cellNum);
+					queue.enqueueWriteBuffer(changedBuffer, CL_TRUE, 0, sizeof(int), zeros.data());
+					queue.enqueueNDRangeKernel(propagateLabels, cl::NullRange, cellNum, cl::NullRange);
+					queue.enqueueReadBuffer(changedBuffer, CL_TRUE, 0, sizeof(int), &changed);
+				}
+
+				countClusters.setArg(0, labelBuffer);
+				countClusters.setArg(1, clusterBuffer);
+				countClusters.setArg(2, clusterNumBuffer);
+
+				queue.enqueueNDRangeKernel(countClusters, cl::NullRange, cellNum, cl::NullRange);
+
+				clusterPoints.setArg(0, cellBuffer);
+				clusterPoints.setArg(1, labelBuffer);
+				clusterPoints.setArg(2, clusterBuffer);
+				clusterPoints.setArg(3, pointClusterBuffer);
+				clusterPoints.setArg(4, clusterCountBuffer);
+				clusterPoints.setArg(5, size);
+
+				queue.enqueueNDRangeKernel(clusterPoints, cl::NullRange, size, cl::NullRange);
+
+				int clusterNum;
+				std::vector<int> clusters(size);
+				std::vector<int> clusterCounts(cellNum);
+				queue.enqueueReadBuffer(clusterNumBuffer, CL_TRUE, 0, sizeof(int), &clusterNum);
+				queue.enqueueReadBuffer(pointClusterBuffer, CL_TRUE, 0, size * sizeof(int), clusters.data());
+				queue.enqueueReadBuffer(clusterCountBuffer, CL_TRUE, 0, cellNum * sizeof(int), clusterCounts.data());
+
+				Assert::AreEqual(3, clusterNum);
+				for (int i = 0; i < 60; i++)
+				{
+					Assert::AreEqual(clusters[0], clusters[i]);
+					Assert::AreEqual(clusters[60], clusters[60 + i]);
+				}
+				Assert::AreNotEqual(clusters[0], clusters[60]);
+				Assert::AreNotEqual(clusters[0], clusters[120]);
+				Assert::AreNotEqual(clusters[60], clusters[120]);
+				Assert::AreEqual(60, clusterCounts[clusters[0]]);
+				Assert::AreEqual(1, clusterCounts[clusters[120]]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(ClusterResolveTest)
+		{
+			// labels of a propagation stopped early: cells 2 and 3 name cells that are not roots
+			std::vector<int> labels = { 0, 0, 1, 2, -1, 5, 5 };
+			std::vector<int> cells = { 0, 1, 2, 3, 3, 5, 6 };
+			const int cellNum = (int)labels.size();
+			const int size = (int)cells.size();
+
+			try
+			{
+				cl::Kernel resolveLabels(program_c, "resolveLabels");
+				cl::Kernel countClusters(program_c, "countClusters");
+				cl::Kernel clusterPoints(program_c, "clusterPoints");
+
+				cl::Buffer cellBuffer(context, CL_MEM_READ_ONLY, size * sizeof(int));
+				cl::Buffer labelBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer clusterBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer pointClusterBuffer(context, CL_MEM_READ_WRITE, size * sizeof(int));
+				cl::Buffer clusterCountBuffer(context, CL_MEM_READ_WRITE, cellNum * sizeof(int));
+				cl::Buffer clusterNumBuffer(context, CL_MEM_READ_WRITE, sizeof(int));
+
+				std::vector<int> zeros(cellNum, 0);
+				queue.enqueueWriteBuffer(cellBuffer, CL_TRUE, 0, size * sizeof(int), cells.data());
+				queue.enqueueWriteBuffer(labelBuffer, CL_TRUE, 0, cellNum * sizeof(int), labels.data());
+				queue.enqueueWriteBuffer(clusterCountBuffer, CL_TRUE, 0, cellNum * sizeof(int), zeros.data());
+				queue.enqueueWriteBuffer(clusterNumBuffer, CL_TRUE, 0, sizeof(int), zeros.data());
+
+				resolveLabels.setArg(0, labelBuffer);
+
+				queue.enqueueNDRangeKernel(resolveLabels, cl::NullRange, cellNum, cl::NullRange);
+
+				countClusters.setArg(0, labelBuffer);
+				countClusters.setArg(1, clusterBuffer);
+				countClusters.setArg(2, clusterNumBuffer);
+
+				queue.enqueueNDRangeKernel(countClusters, cl::NullRange, cellNum, cl::NullRange);
+
+				clusterPoints.setArg(0, cellBuffer);
+				clusterPoints.setArg(1, labelBuffer);
+				clusterPoints.setArg(2, clusterBuffer);
+				clusterPoints.setArg(3, pointClusterBuffer);
+				clusterPoints.setArg(4, clusterCountBuffer);
+				clusterPoints.setArg(5, size);
+
+				queue.enqueueNDRangeKernel(clusterPoints, cl::NullRange, size, cl::NullRange);
+
+				int clusterNum;
+				std::vector<int> clusters(size);
+				std::vector<int> clusterCounts(cellNum);
+				queue.enqueueReadBuffer(labelBuffer, CL_TRUE, 0, cellNum * sizeof(int), labels.data());
+				queue.enqueueReadBuffer(clusterNumBuffer, CL_TRUE, 0, sizeof(int), &clusterNum);
+				queue.enqueueReadBuffer(pointClusterBuffer, CL_TRUE, 0, size * sizeof(int), clusters.data());
+				queue.enqueueReadBuffer(clusterCountBuffer, CL_TRUE, 0, cellNum * sizeof(int), clusterCounts.data());
+
+				std::vector<int> expected = { 0, 0, 0, 0, -1, 5, 5 };
+				for (int i = 0; i < cellNum; i++)
+				{
+					Assert::AreEqual(expected[i], labels[i]);
+				}
+
+				Assert::AreEqual(2, clusterNum);
+				for (int i = 0; i < size; i++)
+				{
+					Assert::IsTrue(clusters[i] >= 0 && clusters[i] < clusterNum);
+				}
+				for (int i = 1; i < 5; i++)
+				{
+					Assert::AreEqual(clusters[0], clusters[i]);
+				}
+				Assert::AreEqual(clusters[5], clusters[6]);
+				Assert::AreNotEqual(clusters[0], clusters[5]);
+				Assert::AreEqual(5, clusterCounts[clusters[0]]);
+				Assert::AreEqual(2, clusterCounts[clusters[5]]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(ClusterFitTest)
+		{
+			// a pole with radius 0.3 at x = 2, z = -4, a wall and a cluster too small to fit
+			std::vector<cl_float3> points;
+			for (int i = 0; i < 100; i++)
+			{
+				float phi = 0.03f * i;
+				points.push_back({ 2 + 0.3f * cosf(phi), 0.01f * i, -4 + 0.3f * sinf(phi) });
+			}
+			for (int i = 0; i < 50; i++)
+			{
+				points.push_back({ 5, 0.01f * i, -2 + 0.04f * i });
+			}
+			for (int i = 0; i < 5; i++)
+			{
+				points.push_back({ -3, 0.1f * i, 1 });
+			}
+			const int size = (int)points.size();
+			std::vector<int> starts = { 0, 100, 150 };
+			std::vector<int> counts = { 100, 50, 5 };
+			std::vector<int> sorted(size);
+			for (int i = 0; i < size; i++)
+			{
+				sorted[i] = i;
+			}
+			// one work-group more than clusters
+			const int groups = 4;
+			const int groupSize = 64;
+			int clusterNum = 3;
+			int found = 0;
+
+			try
+			{
+				cl::Kernel kernel(program_c, "fitClusters");
+
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, size * sizeof(cl_float3));
+				cl::Buffer startBuffer(context, CL_MEM_READ_ONLY, groups * sizeof(int));
+				cl::Buffer countBuffer(context, CL_MEM_READ_ONLY, groups * sizeof(int));
+				cl::Buffer sortedBuffer(context, CL_MEM_READ_ONLY, size * sizeof(int));
+				cl::Buffer clusterNumBuffer(context, CL_MEM_READ_ONLY, sizeof(int));
+				cl::Buffer cylinderBuffer(context, CL_MEM_WRITE_ONLY, groups * sizeof(cl_float4));
+				cl::Buffer foundBuffer(context, CL_MEM_READ_WRITE, sizeof(int));
+
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, size * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(startBuffer, CL_TRUE, 0, starts.size() * sizeof(int), starts.data());
+				queue.enqueueWriteBuffer(countBuffer, CL_TRUE, 0, counts.size() * sizeof(int), counts.data());
+				queue.enqueueWriteBuffer(sortedBuffer, CL_TRUE, 0, size * sizeof(int), sorted.data());
+				queue.enqueueWriteBuffer(clusterNumBuffer, CL_TRUE, 0, sizeof(int), &clusterNum);
+				queue.enqueueWriteBuffer(foundBuffer, CL_TRUE, 0, sizeof(int), &found);
+
+				kernel.setArg(0, pointBuffer);
+				kernel.setArg(1, startBuffer);
+				kernel.setArg(2, countBuffer);
+				kernel.setArg(3, sortedBuffer);
+				kernel.setArg(4, clusterNumBuffer);
+				kernel.setArg(5, cylinderBuffer);
+				kernel.setArg(6, foundBuffer);
+				kernel.setArg(7, groupSize * sizeof(cl_float4), nullptr);
+				kernel.setArg(8, 1234u);
+				kernel.setArg(9, 4);
+				kernel.setArg(10, 20);
+				kernel.setArg(11, cl_float2{ 0.05f, 1.5f });
+				kernel.setArg(12, 0.06f);
+
+				// one work-group per cluster
+				queue.enqueueNDRangeKernel(kernel, cl::NullRange, groups * groupSize, groupSize);
+
+				cl_float4 cylinder;
+				queue.enqueueReadBuffer(foundBuffer, CL_TRUE, 0, sizeof(int), &found);
+				queue.enqueueReadBuffer(cylinderBuffer, CL_TRUE, 0, sizeof(cl_float4), &cylinder);
+
+				// the wall has no circle within the radius range
+				Assert::AreEqual(1, found);
+				Assert::AreEqual(2.0f, cylinder.s[0], 0.01f);
+				Assert::AreEqual(-4.0f, cylinder.s[1], 0.01f);
+				Assert::AreEqual(0.3f, cylinder.s[2], 0.01f);
+				Assert::AreEqual(100.0f, cylinder.s[3]);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(ConeTest)
+		{
+			// half of a cone with the apex at (1, 0.7, -4), the axis pointing down and
+			// a half angle of 0.3, 20 points between 0.1 and 0.7 m below the apex on
+			// each of 20 lines, and an outlier
+			glm::vec3 apex(1, 0.7f, -4);
+			glm::vec3 axis(0, -1, 0);
+			const float angle = 0.3f;
+			std::vector<cl_float3> points;
+			std::vector<cl_float4> normals;
+			for (int i = 0; i < 400; i++)
+			{
+				float h = 0.1f + 0.6f * (i % 20) / 19.0f;
+				float phi = glm::pi<float>() * (1 + (i / 20) / 20.0f);
+				glm::vec3 radial(cosf(phi), 0, sinf(phi));
+				glm::vec3 p = apex + h * axis + h * tanf(angle) * radial;
+				glm::vec3 n = cosf(angle) * radial - sinf(angle) * axis;
+				points.push_back({ p.x, p.y, p.z });
+				normals.push_back({ n.x, n.y, n.z, 1 });
+			}
+			points.push_back({ 9, 9, 9 });
+			normals.push_back({ 0, 0, 0, 0 });
+
+			// points of different lines, then of the same line with parallel
+			// normals, then with the outlier without a normal
+			std::vector<cl_int3> idx = { { 3, 157, 260 }, { 0, 1, 2 }, { 5, 6, 400 } };
+			const int n = (int)idx.size();
+
+			try
+			{
+				cl::Kernel calcKernel(program_p, "calcCone");
+				cl::Kernel checkKernel(program_p, "checkCone");
+				cl::Kernel fitKernel(program_p, "fitCone");
+				cl::Kernel measureKernel(program_p, "measureCone");
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float3));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_ONLY, normals.size() * sizeof(cl_float4));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_int3));
+				cl::Buffer coneBuffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_float8));
+				cl::Buffer scoreBuffer(context, CL_MEM_WRITE_ONLY, n * sizeof(float));
+				cl::Buffer statsBuffer(context, CL_MEM_WRITE_ONLY, 2 * sizeof(float));
+
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float4), normals.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, n * sizeof(cl_int3), idx.data());
+
+				calcKernel.setArg(0, pointBuffer);
+				calcKernel.setArg(1, normalBuffer);
+				calcKernel.setArg(2, idxBuffer);
+				calcKernel.setArg(3, coneBuffer);
+
+				queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, n, cl::NullRange);
+
+				checkKernel.setArg(0, coneBuffer);
+				checkKernel.setArg(1, cl_float2{ 0.05f, 1.2f });
+				checkKernel.setArg(2, cl_float4{ -10, -10, -10, 0 });
+				checkKernel.setArg(3, cl_float4{ 10, 10, 10, 0 });
+
+				queue.enqueueNDRangeKernel(checkKernel, cl::NullRange, n, cl::NullRange);
+
+				std::vector<cl_float8> cones(n);
+				queue.enqueueReadBuffer(coneBuffer, CL_TRUE, 0, n * sizeof(cl_float8), cones.data());
+
+				Assert::AreEqual(1.0f, cones[0].s[0], 0.001f);
+				Assert::AreEqual(0.7f, cones[0].s[1], 0.001f);
+				Assert::AreEqual(-4.0f, cones[0].s[2], 0.001f);
+				Assert::AreEqual(0.3f, cones[0].s[3], 0.001f);
+				Assert::AreEqual(-1.0f, cones[0].s[5], 0.001f);
+				Assert::AreEqual(0.0f, cones[1].s[3]);
+				Assert::AreEqual(0.0f, cones[2].s[3]);
+
+				// every point but the outlier supports the first cone, the others are skipped
+				fitKernel.setArg(0, pointBuffer);
+				fitKernel.setArg(1, coneBuffer);
+				fitKernel.setArg(2, scoreBuffer);
+				fitKernel.setArg(3, 64 * sizeof(float), nullptr);
+				fitKernel.setArg(4, (int)points.size());
+				fitKernel.setArg(5, 0.03f);
+				fitKernel.setArg(6, (int)RANSAC_SCORE);
+
+				queue.enqueueNDRangeKernel(fitKernel, cl::NullRange, n * 64, 64);
+
+				std::vector<float> scores(n);
+				queue.enqueueReadBuffer(scoreBuffer, CL_TRUE, 0, n * sizeof(float), scores.data());
+
+				Assert::AreEqual(400.0f, scores[0]);
+				Assert::AreEqual(0.0f, scores[1]);
+				Assert::AreEqual(0.0f, scores[2]);
+
+				// the first cone is measured in place
+				measureKernel.setArg(0, pointBuffer);
+				measureKernel.setArg(1, coneBuffer);
+				measureKernel.setArg(2, statsBuffer);
+				measureKernel.setArg(3, 256 * sizeof(cl_float4), nullptr);
+				measureKernel.setArg(4, (int)points.size());
+				measureKernel.setArg(5, 0.03f);
+
+				queue.enqueueNDRangeKernel(measureKernel, cl::NullRange, 256, 256);
+
+				float stats[2];
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * sizeof(float), stats);
+				queue.enqueueReadBuffer(coneBuffer, CL_TRUE, 0, sizeof(cl_float8), cones.data());
+
+				Assert::AreEqual(400.0f, stats[0]);
+				Assert::AreEqual(0.0f, stats[1], 0.001f);
+				Assert::AreEqual(0.7f, cones[0].s[7], 0.001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+
+		TEST_METHOD(TorusTest)
+		{
+			// the outer half of a torus around the y axis through (0, -1, -5) with
+			// ring radius 0.5 and tube radius 0.1, 12 points of 30 tube circles,
+			// and an outlier
+			glm::vec3 center(0, -1, -5);
+			std::vector<cl_float3> points;
+			std::vector<cl_float4> normals;
+			for (int i = 0; i < 360; i++)
+			{
+				float phi = glm::pi<float>() * (0.05f + 0.9f * (i / 12) / 29.0f);
+				float theta = -1.4f + 2.8f * (i % 12) / 11.0f;
+				glm::vec3 radial(cosf(phi), 0, sinf(phi));
+				glm::vec3 n = cosf(theta) * radial + sinf(theta) * glm::vec3(0, 1, 0);
+				glm::vec3 p = center + 0.5f * radial + 0.1f * n;
+				points.push_back({ p.x, p.y, p.z });
+				normals.push_back({ n.x, n.y, n.z, 1 });
+			}
+			points.push_back({ 1, 1, 1 });
+			normals.push_back({ 0, 0, 1, 1 });
+
+			// points of different circles, then of the same circle, whose
+			// tube centers coincide, then with the outlier
+			std::vector<cl_int4> idx = { { 5, 100, 200, 300 }, { 0, 1, 2, 3 }, { 5, 100, 200, 360 } };
+			const int n = (int)idx.size();
+
+			try
+			{
+				cl::Kernel calcKernel(program_p, "calcTorus");
+				cl::Kernel fitKernel(program_p, "fitTorus");
+				cl::Kernel measureKernel(program_p, "measureTorus");
+				cl::Buffer pointBuffer(context, CL_MEM_READ_ONLY, points.size() * sizeof(cl_float3));
+				cl::Buffer normalBuffer(context, CL_MEM_READ_ONLY, normals.size() * sizeof(cl_float4));
+				cl::Buffer idxBuffer(context, CL_MEM_READ_ONLY, n * sizeof(cl_int4));
+				cl::Buffer torusBuffer(context, CL_MEM_READ_WRITE, n * sizeof(cl_float8));
+				cl::Buffer scoreBuffer(context, CL_MEM_WRITE_ONLY, n * sizeof(float));
+				cl::Buffer statsBuffer(context, CL_MEM_WRITE_ONLY, 2 * sizeof(float));
+
+				queue.enqueueWriteBuffer(pointBuffer, CL_TRUE, 0, points.size() * sizeof(cl_float3), points.data());
+				queue.enqueueWriteBuffer(normalBuffer, CL_TRUE, 0, normals.size() * sizeof(cl_float4), normals.data());
+				queue.enqueueWriteBuffer(idxBuffer, CL_TRUE, 0, n * sizeof(cl_int4), idx.data());
+
+				calcKernel.setArg(0, pointBuffer);
+				calcKernel.setArg(1, normalBuffer);
+				calcKernel.setArg(2, idxBuffer);
+				calcKernel.setArg(3, torusBuffer);
+				calcKernel.setArg(4, cl_float2{ 0.05f, 1.5f });
+
+				queue.enqueueNDRangeKernel(calcKernel, cl::NullRange, n, cl::NullRange);
+
+				std::vector<cl_float8> tori(n);
+				queue.enqueueReadBuffer(torusBuffer, CL_TRUE, 0, n * sizeof(cl_float8), tori.data());
+
+				Assert::AreEqual(0.0f, tori[0].s[0], 0.001f);
+				Assert::AreEqual(-1.0f, tori[0].s[1], 0.001f);
+				Assert::AreEqual(-5.0f, tori[0].s[2], 0.001f);
+				Assert::AreEqual(0.5f, tori[0].s[3], 0.001f);
+				Assert::AreEqual(1.0f, tori[0].s[5], 0.001f);
+				Assert::AreEqual(0.1f, tori[0].s[7], 0.001f);
+				Assert::AreEqual(0.0f, tori[1].s[7]);
+				Assert::AreEqual(0.0f, tori[2].s[7]);
+
+				// every point but the outlier supports the first torus
+				fitKernel.setArg(0, pointBuffer);
+				fitKernel.setArg(1, torusBuffer);
+				fitKernel.setArg(2, scoreBuffer);
+				fitKernel.setArg(3, 64 * sizeof(float), nullptr);
+				fitKernel.setArg(4, (int)points.size());
+				fitKernel.setArg(5, 0.03f);
+				fitKernel.setArg(6, (int)RANSAC_SCORE);
+
+				queue.enqueueNDRangeKernel(fitKernel, cl::NullRange, n * 64, 64);
+
+				std::vector<float> scores(n);
+				queue.enqueueReadBuffer(scoreBuffer, CL_TRUE, 0, n * sizeof(float), scores.data());
+
+				Assert::AreEqual(360.0f, scores[0]);
+				Assert::AreEqual(0.0f, scores[1]);
+				Assert::AreEqual(0.0f, scores[2]);
+
+				measureKernel.setArg(0, pointBuffer);
+				measureKernel.setArg(1, torusBuffer);
+				measureKernel.setArg(2, statsBuffer);
+				measureKernel.setArg(3, 256 * sizeof(float), nullptr);
+				measureKernel.setArg(4, (int)points.size());
+				measureKernel.setArg(5, 0.03f);
+
+				queue.enqueueNDRangeKernel(measureKernel, cl::NullRange, 256, 256);
+
+				float stats[2];
+				queue.enqueueReadBuffer(statsBuffer, CL_TRUE, 0, 2 * sizeof(float), stats);
+
+				Assert::AreEqual(360.0f, stats[0]);
+				Assert::AreEqual(0.0f, stats[1], 0.001f);
+			}
+			catch (cl::Error& error)
+			{
+				std::cout << error.what() << "\n"
+					<< getErrorString(error.err()) << std::endl;
+				return;
+			}
+		}
+	};
+
+	TEST_CLASS(TrackerTest)
+	{
+	public:
+		TEST_METHOD(TrackerUpdateTest)
+		{
+			Tracker tracker;
+			Assert::IsFalse(tracker.IsTracking());
+
+			// the first model starts the track at rest
+			glm::vec4 model(1, 2, 3, 0.5f);
+			tracker.Update(model);
+			Assert::IsTrue(tracker.IsTracking());
+			glm::vec4 prediction = tracker.Predict();
+			for (int i = 0; i < 4; i++)
+			{
+				Assert::AreEqual(model[i], prediction[i], 0.0001f);
+			}
+
+			// the second one is partly corrected: alpha = 0.8, beta = 0.3
+			tracker.Update(model + glm::vec4(0.1f, 0, 0, 0));
+			Assert::AreEqual(1.11f, tracker.Predict().x, 0.0001f);
+		}
+
+		TEST_METHOD(TrackerVelocityTest)
+		{
+			// a sphere moving at constant velocity is predicted one frame ahead
+			glm::vec4 model(1, 2, 3, 0.5f);
+			glm::vec4 velocity(0.1f, -0.05f, 0.02f, 0);
+
+			Tracker tracker;
+			for (int i = 0; i < 30; i++)
+			{
+				tracker.Update(model + (float)i * velocity);
+			}
+
+			glm::vec4 prediction = tracker.Predict();
+			glm::vec4 expected = model + 30.0f * velocity;
+			for (int i = 0; i < 4; i++)
+			{
+				Assert::AreEqual(expected[i], prediction[i], 0.001f);
+			}
+		}
+
+		TEST_METHOD(TrackerResetTest)
+		{
+			Tracker tracker;
+			tracker.Update(glm::vec4(1, 2, 3, 0.5f));
+			tracker.Update(glm::vec4(2, 2, 3, 0.5f));
+
+			tracker.Reset();
+			Assert::IsFalse(tracker.IsTracking());
+
+			// the next model starts a new track without the old velocity
+			glm::vec4 model(-1, 0, 4, 0.3f);
+			tracker.Update(model);
+			Assert::IsTrue(tracker.IsTracking());
+			glm::vec4 prediction = tracker.Predict();
+			for (int i = 0; i < 4; i++)
+			{
+				Assert::AreEqual(model[i], prediction[i], 0.0001f);
+			}
+		}
 	};
 }